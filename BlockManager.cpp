@@ -1,7 +1,14 @@
 #include "Globals.h"
 #include "BlockManager.h"
 #include "Blocks.h"
+#include "Compress.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include "SDL_thread.h"
@@ -40,7 +47,7 @@ void BlockManager::LoadingLoop(const int id)
 	    continue;
 	// our file	
 	// alloc correct block size
-	Block* root = (Block*)malloc(snaps[i].firstLength);
+	Block* root = (Block*)alloc(snaps[i].firstLength);
 	// and read in block
 	read(i, snaps[i].firstFile, snaps[i].firstLocation, snaps[i].firstLength, root);
 	// don't need to set internal ptrs to 0, they're 0 in the file
@@ -77,11 +84,14 @@ void BlockManager::LoadingLoop(const int id)
 	    continue;
 	}
 
+	// what the children will take up in memory (unpacked, if need be)
+	uint64_t length = childBytes(parent.snap, parent.block);
+
 	// check if we have enough memory
 	// and if we don't, should we load anyway?
-	if (parent.block->childLength + totalBytes > g_Opts->sys.maxBytes)
+	if (length + totalBytes > g_Opts->sys.maxBytes)
 	{
-	    uint64_t bytesOver = parent.block->childLength + totalBytes - g_Opts->sys.maxBytes;
+	    uint64_t bytesOver = length + totalBytes - g_Opts->sys.maxBytes;
 	    double freeScore = g_Priority->GetMergeCost(bytesOver, parent.parent);
 	    // if we don't increase our score, don't load
 	    if (parent.score < freeScore)
@@ -100,16 +110,16 @@ void BlockManager::LoadingLoop(const int id)
 	}
 
 	// alright, we are ready to load: first, increment byte count and update queue
-	totalBytes += parent.block->childLength;
+	totalBytes += length;
 	g_Priority->DoSplit(id);
 
 	// and allocate
-	Block* child = (Block*)malloc(parent.block->childLength);
+	Block* child = (Block*)alloc(parent.block->childLength);
 	if (child == NULL)
 	{
 	    // out of memory, so cancel read
 	    printf("Out of memory error!\n");
-	    totalBytes -= parent.block->childLength;
+	    totalBytes -= length;
 	    unlock();
 	    g_Priority->Unlock();
 	    SDL_Delay(100);
@@ -126,8 +136,22 @@ void BlockManager::LoadingLoop(const int id)
 
 	// now actually read the blocks (this is the long step)
 	read(parent.snap, parent.block->childFile, parent.block->childLocation, parent.block->childLength, child);
+	// (and unpack them, if they need it)
+	if (parent.block->childFlags & BLOCK_COMPRESSED_FLAG)
+	{
+	    child = unpack(parent.block, child, length);
+	    if (child == NULL)
+	    {
+		// no use trying again, so let it be a leaf
+		lock();
+		totalBytes -= length;
+		unlock();
+		parent.block->childFlags = 0;
+		continue;
+	    }
+	}
 	// and set pointers of parent block
-	findBlocks(parent.block, child);
+	findBlocks(parent.snap, parent.block, child);
 
 	// then unflag it
 	parent.block->childFlags &= ~BLOCK_LOAD_FLAG;
@@ -160,6 +184,9 @@ void BlockManager::removeBlocks(Block* parent)
 	}
     }
 
+    // (what they took up, while they're still there to count)
+    uint64_t length = loadedLength(parent);
+
     // set all parent pointers to 0
     for (int i=0; i<8; i++)
     {
@@ -176,18 +203,27 @@ void BlockManager::removeBlocks(Block* parent)
 
     // finally, decrement global byte count
     // (this assumes we have a lock!)
-    totalBytes -= parent->childLength;
+    totalBytes -= length;
 
     if (g_Opts->dbg.printBlocks)
 	printf("Block %x added to delete queue.\n", (uint)child);
 }
 
-/* Finds all eight child blocks contained in chunk of memory pointed to by child. */
-void BlockManager::findBlocks(Block* parent, Block* child)
+/* Finds all eight child blocks contained in chunk of memory pointed to by child.
+   With a block directory, their places come from that, else by stepping over
+   each block in turn. Groups that were packed decode back to back, so they
+   always get stepped over (the directory only numbers their blocks). */
+void BlockManager::findBlocks(int snap, Block* parent, Block* child)
 {
     // pointer used for byte-by-byte iteration
     char *cur = (char*)child;
 
+    // the first child's entry, if there's a directory
+    int entry = -1;
+    if ((parent->childFlags & BLOCK_COMPRESSED_FLAG) == 0)
+	entry = findDirEntry(snap, parent->childFile, parent->childLocation);
+    SnapDir& dir = snapDirs[snap];
+
     if (g_Opts->dbg.printBlocks)
 	printf("Scanning parent at %x.\n",(uint)parent);
     
@@ -198,12 +234,18 @@ void BlockManager::findBlocks(Block* parent, Block* child)
 	if ((parent->childFlags & (1<<i)) == 0)
 	    continue;
 	// otherwise, set child pointer
+	if (entry >= 0)
+	{
+	    cur = (char*)child + (dir.entries[entry].location - parent->childLocation);
+	    entry += dir.entries[entry].subtreeSize;
+	}
 	parent->childPtr[i] = (Block*)cur;
 	// and set children to NULL
 	for (int j=0; j<8; j++)
 	    parent->childPtr[i]->childPtr[j] = NULL;
 	// and step cur by the size of the block (header + verts * vertsize)
-	cur += sizeof(Block) + parent->childPtr[i]->count * g_Opts->file.vertexSize;
+	cur += sizeof(Block) + parent->childPtr[i]->count
+	    * BlockVertexSize(parent->childPtr[i], g_Opts->file.vertexSize);
 	nchildren++;
     }
 
@@ -219,6 +261,84 @@ void BlockManager::findBlocks(Block* parent, Block* child)
     }
 }
 
+/* Unpacks a group of children that was compressed on disk, read into
+   child, into memory of its own (and frees child). The load counted
+   length for them already, so only a difference from that (a directory
+   out of step with the files) gets accounted here. */
+Block* BlockManager::unpack(Block* parent, Block* child, uint64_t length)
+{
+    GroupFrame frame;
+    memcpy(&frame, child, sizeof(GroupFrame));
+    Block *blocks = NULL;
+    if (frame.magic == GROUP_FRAME_MAGIC)
+	blocks = (Block*)alloc(frame.rawLength);
+    if (blocks == NULL || !DecompressGroup((char*)child, parent->childLength, (char*)blocks))
+    {
+	printf("Bad compressed children of block %x!\n", (uint)parent);
+	free(blocks);
+	free(child);
+	return NULL;
+    }
+    free(child);
+
+    if (frame.rawLength != length)
+    {
+	lock();
+	totalBytes += frame.rawLength;
+	totalBytes -= length;
+	unlock();
+    }
+
+    if (g_Opts->dbg.printBlocks)
+	printf("Unpacked %llu bytes of children to %u.\n", parent->childLength, frame.rawLength);
+    return blocks;
+}
+
+/* Returns the memory a block's children will take up once loaded: their
+   length on disk, or, for compressed ones, what they unpack to. That's
+   the sum of their lengths in the directory, or without one, what the
+   group's frame says (a small read on this thread's own disk). */
+uint64_t BlockManager::childBytes(int snap, Block* parent)
+{
+    if ((parent->childFlags & BLOCK_COMPRESSED_FLAG) == 0)
+	return parent->childLength;
+
+    int entry = findDirEntry(snap, parent->childFile, parent->childLocation);
+    if (entry >= 0)
+    {
+	SnapDir& dir = snapDirs[snap];
+	uint64_t length = 0;
+	for (int i=0; i<8; i++)
+	{
+	    if ((parent->childFlags & (1<<i)) == 0)
+		continue;
+	    length += dir.entries[entry].length;
+	    entry += dir.entries[entry].subtreeSize;
+	}
+	return length;
+    }
+
+    GroupFrame frame;
+    read(snap, parent->childFile, parent->childLocation, sizeof(GroupFrame), &frame);
+    if (frame.magic != GROUP_FRAME_MAGIC)
+	return parent->childLength;
+    return frame.rawLength;
+}
+
+/* Returns the memory a block's loaded children take up: their length on
+   disk, or, for compressed ones, what they came to unpacked. */
+uint64_t BlockManager::loadedLength(Block* parent)
+{
+    if ((parent->childFlags & BLOCK_COMPRESSED_FLAG) == 0)
+	return parent->childLength;
+    uint64_t length = 0;
+    for (int i=0; i<8; i++)
+	if (parent->childPtr[i] != NULL)
+	    length += sizeof(Block) + parent->childPtr[i]->count
+		* BlockVertexSize(parent->childPtr[i], g_Opts->file.vertexSize);
+    return length;
+}
+
 /* Returns the global coordinates of a given block/snapshot pair. */
 void BlockManager::GetBlockCoords(int snap, Block *block, double* mins, double* scales)
 {
@@ -309,6 +429,7 @@ bool BlockManager::LoadSnapshots()
     // now we can load each snapshot header
     numSnaps = (g_Opts->file.lastSnap-g_Opts->file.firstSnap)/g_Opts->file.interval + 1;
     snaps = new SnapInfo[numSnaps];
+    snapDirs = new SnapDir[numSnaps];
 
     // load snapshot desc. from dir 0
     int snap = g_Opts->file.firstSnap;
@@ -318,6 +439,9 @@ bool BlockManager::LoadSnapshots()
 	if (loadSnapHeader(g_Opts->file.dirs[0] + snapName + "_info", i))
 	{
 	    printf("Snapshot info %s loaded.\n", (snapName+"_info").c_str());
+	    if (loadSnapDir(g_Opts->file.dirs[0] + snapName + "_dir", i))
+		printf("Block directory %s loaded, %d blocks.\n", (snapName+"_dir").c_str(),
+		       (int)snapDirs[i].entries.size());
 	}
 	else
 	{
@@ -335,11 +459,16 @@ bool BlockManager::LoadSnapshots()
 
     // also initialize file array
     snapFile = new LFILE*[numSnaps];
+    snapFd = new int*[numSnaps];
     for (int i=0; i<numSnaps; i++)
     {
 	snapFile[i] = new LFILE[g_Opts->file.ndirs];
+	snapFd[i] = new int[g_Opts->file.ndirs];
 	for (int j=0; j<g_Opts->file.ndirs; j++)
+	{
 	    snapFile[i][j] = NULL;
+	    snapFd[i][j] = -1;
+	}
     }
 
     // and thread array
@@ -389,6 +518,82 @@ bool BlockManager::loadSnapHeader(string filename, int index)
     return true;
 }
 
+// for sorting directory entries by where they are
+struct DirLocationLess
+{
+    const BlockDirEntry *entries;
+    bool operator()(uint32_t a, uint32_t b) const
+    {
+	if (entries[a].file != entries[b].file)
+	    return entries[a].file < entries[b].file;
+	return entries[a].location < entries[b].location;
+    }
+};
+
+/* Loads the block directory of a snapshot, returns false if there's none
+   (or it's not one we can read), in which case blocks are found by
+   stepping through them as they're loaded. */
+bool BlockManager::loadSnapDir(string filename, int index)
+{
+    FILE *file = fopen(filename.c_str(),"rb");
+    if (file == NULL)
+	return false;
+
+    SnapDir& dir = snapDirs[index];
+    BlockDirHeader head;
+    if (fread(&head, sizeof(BlockDirHeader), 1, file) != 1
+	|| head.magic != BLOCK_DIR_MAGIC || head.version != BLOCK_DIR_VERSION)
+    {
+	fprintf(stderr,"Block directory %s is not readable, ignoring it.\n", filename.c_str());
+	fclose(file);
+	return false;
+    }
+    dir.entries.resize(head.count);
+    if (head.count > 0 && fread(&dir.entries[0], sizeof(BlockDirEntry), head.count, file) != head.count)
+    {
+	fprintf(stderr,"Block directory %s is short, ignoring it.\n", filename.c_str());
+	dir.entries.clear();
+	fclose(file);
+	return false;
+    }
+    fclose(file);
+
+    dir.byLocation.resize(head.count);
+    for (uint32_t i=0; i<head.count; i++)
+	dir.byLocation[i] = i;
+    if (head.count > 0)
+    {
+	DirLocationLess less;
+	less.entries = &dir.entries[0];
+	std::sort(dir.byLocation.begin(), dir.byLocation.end(), less);
+    }
+
+    return true;
+}
+
+/* Returns the directory entry of the block at a given file location, or -1
+   if there's no directory or no block there. */
+int BlockManager::findDirEntry(int snap, int file, uint64_t location)
+{
+    SnapDir& dir = snapDirs[snap];
+    int lo = 0, hi = (int)dir.byLocation.size();
+    while (lo < hi)
+    {
+	int mid = (lo + hi) / 2;
+	const BlockDirEntry& e = dir.entries[dir.byLocation[mid]];
+	if (e.file < file || (e.file == file && e.location < location))
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    if (lo == (int)dir.byLocation.size())
+	return -1;
+    int entry = dir.byLocation[lo];
+    if (dir.entries[entry].file != file || dir.entries[entry].location != location)
+	return -1;
+    return entry;
+}
+
 /* Opens a given fileset for reading. OS-dependent, due to large file sizes. */
 bool BlockManager::open(int index, string filename)
 {
@@ -401,6 +606,16 @@ bool BlockManager::open(int index, string filename)
 	    return false;
 	}
 	printf("File %s opened.\n", (g_Opts->file.dirs[i]+filename+"."+toString(i)).c_str());
+
+#ifdef O_DIRECT
+	// a second handle for direct reads, if the file system has them
+	if (g_Opts->sys.directIO)
+	{
+	    snapFd[index][i] = ::open((g_Opts->file.dirs[i]+filename+"."+toString(i)).c_str(), O_RDONLY | O_DIRECT);
+	    if (snapFd[index][i] < 0)
+		printf("No direct I/O for %s, reading it buffered.\n", (g_Opts->file.dirs[i]+filename+"."+toString(i)).c_str());
+	}
+#endif
     }
     return true;
 }
@@ -408,6 +623,29 @@ bool BlockManager::open(int index, string filename)
 /* Reads a certain amount from a file, at a given location (also OS-dependent). */
 void BlockManager::read(int index, int part, uint64_t loc, int length, void* data)
 {
+    // aligned groups can go straight from disk, skipping the page cache
+    int fd = snapFd[index][part];
+    if (fd >= 0 && loc % DIRECT_ALIGN == 0 && length % DIRECT_ALIGN == 0
+	&& (uintptr_t)data % DIRECT_ALIGN == 0)
+    {
+	int done = 0;
+	while (done < length)
+	{
+	    ssize_t n = pread(fd, (char*)data + done, length - done, loc + done);
+	    if (n < 0 && errno == EINTR)
+		continue;
+	    if (n <= 0)
+		break;
+	    done += n;
+	}
+	if (done == length)
+	    return;
+	// no good after all, so don't try again
+	printf("Direct read failed, reading part %d of snapshot %d buffered.\n", part, index);
+	::close(fd);
+	snapFd[index][part] = -1;
+    }
+
     // need to use fseeko so that it uses off_t offset, which
     // is now off64_t
     fseeko(snapFile[index][part], loc, SEEK_SET);
@@ -418,7 +656,22 @@ void BlockManager::read(int index, int part, uint64_t loc, int length, void* dat
 void BlockManager::close(int index)
 {
     for (int i=0; i<g_Opts->file.ndirs; i++)
+    {
 	fclose(snapFile[index][i]);
+	if (snapFd[index][i] >= 0)
+	    ::close(snapFd[index][i]);
+    }
+}
+
+/* Allocates memory for a read, aligned so it can be a direct one. */
+void* BlockManager::alloc(uint64_t length)
+{
+    if (!g_Opts->sys.directIO)
+	return malloc(length);
+    void *mem;
+    if (posix_memalign(&mem, DIRECT_ALIGN, length) != 0)
+	return NULL;
+    return mem;
 }
 
 BlockManager::BlockManager()
@@ -11,6 +11,10 @@
 // the OS-dependent file representation
 typedef FILE* LFILE;
 
+// what direct reads need lined up: file offset, length and memory
+// (block files written with BlockAlign of at least this are)
+#define DIRECT_ALIGN 4096
+
 // snapinfo struct, as stored in snapshot files
 struct __attribute__ ((__packed__)) SnapInfo
 {
@@ -23,6 +27,40 @@ struct __attribute__ ((__packed__)) SnapInfo
     double scale[3]; // size of snapshot in each dim
 };
 
+// the directory of a snapshot's blocks, blocks_N_dir, as stored: a header
+// and then an entry for every block, depth first, so that a block's first
+// child comes right after it and its next sibling subtreeSize entries on
+#define BLOCK_DIR_MAGIC 0x52494442
+#define BLOCK_DIR_VERSION 2
+
+struct __attribute__ ((__packed__)) BlockDirHeader
+{
+    uint32_t magic;
+    int32_t version;
+    uint64_t count; // entries following
+};
+
+struct __attribute__ ((__packed__)) BlockDirEntry
+{
+    uint64_t key; // octree index, 3 bits per level
+    uint16_t depth;
+    int16_t file; // subfile containing the block
+    uint32_t count; // points in it
+    uint64_t location; // file location of the block
+    uint32_t length; // header and points
+    int16_t childFlags; // which children exist
+    uint64_t childLength; // length of all its children
+    uint32_t subtreeSize; // entries in its subtree, itself included
+};
+
+// a loaded directory, with what we need to look things up in it
+struct SnapDir
+{
+    std::vector<BlockDirEntry> entries;
+    // entry indices, by file and then location
+    std::vector<uint32_t> byLocation;
+};
+
 // a flag to let priority know we are loading this block's children
 #define BLOCK_LOAD_FLAG (1<<9)
 // a flag to let a block's children know they are going to be deleted
@@ -39,10 +77,15 @@ class BlockManager
     // (note that this array is a 2D array of arrays
     // and accessed using snapFile[snap][part])
     LFILE ** snapFile;
+    // and O_DIRECT descriptors for the same, with directIO on (else -1)
+    int ** snapFd;
 
 
     Block ** rootNodes; // pointers to the root blocks of each snap
 
+    // block directories of each snap (empty if there was none)
+    SnapDir * snapDirs;
+
 
 
     SDL_Thread **threads; // the loader threads
@@ -64,14 +107,32 @@ class BlockManager
 
     // attempts to load single snapshot header from a file
     bool loadSnapHeader(string filename, int index);
+    // and its block directory, if it has one
+    bool loadSnapDir(string filename, int index);
+    // the directory entry of the block at a file location, or -1
+    int findDirEntry(int snap, int file, uint64_t location);
 
     // following two are OS-dependent
     bool open(int index, string filename); // opens single snap, all parts
     void read(int index, int part, uint64_t loc, int length, void* data); // reads from a given subfile
     void close(int index);
 
+    // allocates memory to read blocks into, aligned for direct reads
+    void* alloc(uint64_t length);
+
+    // unpacks a compressed group of children, read into child, returning
+    // the unpacked blocks (or NULL), and freeing child; length is what
+    // the load counted for them
+    Block* unpack(Block* parent, Block* child, uint64_t length);
+
+    // memory the children of a block will take up, before loading them
+    uint64_t childBytes(int snap, Block* parent);
+
+    // memory the children of a block take up, once loaded
+    uint64_t loadedLength(Block* parent);
+
     // finds child blocks contained in chunk of mem.
-    void findBlocks(Block* parent, Block* child);
+    void findBlocks(int snap, Block* parent, Block* child);
 
     // "removes" child blocks (adds them to deadBlocks also)
     void removeBlocks(Block* parent);
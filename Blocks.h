@@ -8,7 +8,8 @@
 struct __attribute__ ((__packed__)) Block
 {
     uint16_t pos[3]; // position, from 0..65535
-    uint16_t depth; // size is TreeSize/(1<<depth)
+    uint8_t depth; // size is TreeSize/(1<<depth)
+    uint8_t codec; // layout of the vertices (see below)
     uint32_t count; // number of elts in block
     uint64_t childLocation; // location in file of first child
     uint64_t childLength; // length in file of all children (bytes)
@@ -19,6 +20,22 @@ struct __attribute__ ((__packed__)) Block
     Block *childPtr[8]; // pointers to children in memory
 };
 
+// set in childFlags if the children are compressed on disk (see Compress.h)
+#define BLOCK_COMPRESSED_FLAG (1<<8)
+
+// vertex layouts, in codec: the full one (vertexSize bytes, from the
+// config), or the coarse one of blocks near the root, without
+// accelerations or next-step values
+#define BLOCK_FULL_VERTICES 0
+#define BLOCK_COARSE_VERTICES 1
+#define COARSE_VERTEX_SIZE 16
+
+// bytes per vertex of a block, where full ones are fullSize
+inline int BlockVertexSize(const Block* block, int fullSize)
+{
+    return block->codec == BLOCK_COARSE_VERTICES ? COARSE_VERTEX_SIZE : fullSize;
+}
+
 /* This is a block descriptor used by the priority class. */
 struct BlockInfo
 {
@@ -0,0 +1,221 @@
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "Compress.h"
+
+/* Unpacking of compressed child groups, as gentree's CompressBlocks
+   writes them (see gentree/Compress.cpp, which packs them). */
+
+// rANS with 32-bit state, read a byte at a time, and frequencies
+// scaled to add up to 1<<RANS_BITS
+#define RANS_BITS 12
+#define RANS_TOTAL (1<<RANS_BITS)
+#define RANS_LOW (1u<<23)
+
+// how each plane is stored
+#define PLANE_RAW 0
+#define PLANE_CONST 1
+#define PLANE_RANS 2
+
+
+// ***************************************************************
+// Filters
+// ***************************************************************
+
+// field offsets in a full vertex
+#define OV_PID 0
+#define OV_POS 4
+#define OV_HSML 22
+#define OV_NHSML 23
+#define OV_DENSQ 24
+#define OV_VDISP 26
+#define OV_NDENSQ 28
+#define OV_NVDISP 30
+
+static inline uint16_t get16(const char *p)
+{
+    uint16_t v;
+    memcpy(&v, p, 2);
+    return v;
+}
+
+static inline uint32_t get32(const char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline void put16(char *p, uint16_t v)
+{
+    memcpy(p, &v, 2);
+}
+
+static inline void put32(char *p, uint32_t v)
+{
+    memcpy(p, &v, 4);
+}
+
+// and back, from the first
+static void unfilterPoints(char *pts, int n)
+{
+    for (int i=0; i<n; i++)
+    {
+	char *p = pts + i*FULL_VERTEX_SIZE;
+	p[OV_NHSML] = (char)(p[OV_NHSML] + p[OV_HSML]);
+	put16(p + OV_NDENSQ, get16(p + OV_NDENSQ) + get16(p + OV_DENSQ));
+	put16(p + OV_NVDISP, get16(p + OV_NVDISP) + get16(p + OV_VDISP));
+	if (i == 0)
+	    continue;
+	const char *q = p - FULL_VERTEX_SIZE;
+	put32(p + OV_PID, get32(p + OV_PID) + get32(q + OV_PID));
+	for (int j=0; j<3; j++)
+	    put16(p + OV_POS + 2*j, get16(p + OV_POS + 2*j) + get16(q + OV_POS + 2*j));
+    }
+}
+
+
+// ***************************************************************
+// rANS
+// ***************************************************************
+
+// decodes n bytes, stride apart, from a table and stream at in (with
+// avail bytes left), returns bytes used, or 0 if it's bad
+static uint32_t ransDecode(const char *in, uint32_t avail, int n, int stride, unsigned char *out)
+{
+    if (avail < 1)
+	return 0;
+    int nsym = (unsigned char)in[0] + 1;
+    uint32_t used = 1 + 3*nsym + 4;
+    if (avail < used)
+	return 0;
+
+    uint32_t freq[256], start[256];
+    unsigned char slots[RANS_TOTAL];
+    memset(freq, 0, sizeof(freq));
+    const char *t = in + 1;
+    uint32_t cum = 0;
+    for (int i=0; i<nsym; i++)
+    {
+	int s = (unsigned char)t[0];
+	freq[s] = get16(t + 1);
+	t += 3;
+	if (cum + freq[s] > RANS_TOTAL)
+	    return 0;
+	start[s] = cum;
+	memset(slots + cum, s, freq[s]);
+	cum += freq[s];
+    }
+    if (cum != RANS_TOTAL)
+	return 0;
+
+    uint32_t bytes = get32(t);
+    if (bytes < 4 || avail - used < bytes)
+	return 0;
+    const unsigned char *ptr = (const unsigned char*)t + 4;
+    const unsigned char *end = ptr + bytes;
+    uint32_t x = get32((const char*)ptr);
+    ptr += 4;
+    for (int i=0; i<n; i++)
+    {
+	uint32_t slot = x & (RANS_TOTAL - 1);
+	int s = slots[slot];
+	out[(size_t)i*stride] = (unsigned char)s;
+	x = freq[s] * (x >> RANS_BITS) + slot - start[s];
+	while (x < RANS_LOW)
+	{
+	    if (ptr == end)
+		return 0;
+	    x = (x << 8) | *ptr++;
+	}
+    }
+    return used + bytes;
+}
+
+
+// ***************************************************************
+// Groups
+// ***************************************************************
+
+bool DecompressGroup(const char *in, uint32_t length, char *out)
+{
+    if (length < sizeof(GroupFrame))
+	return false;
+    GroupFrame frame;
+    memcpy(&frame, in, sizeof(GroupFrame));
+    if (frame.magic != GROUP_FRAME_MAGIC || frame.packedLength > length || frame.vertexSize == 0
+	|| (uint64_t)frame.numBlocks * sizeof(Block) > frame.packedLength - sizeof(GroupFrame))
+	return false;
+    int vertexSize = frame.vertexSize;
+
+    // put the headers in place, leaving room for the points
+    const char *heads = in + sizeof(GroupFrame);
+    uint64_t pos = 0;
+    uint64_t points = 0;
+    for (int b=0; b<frame.numBlocks; b++)
+    {
+	Block head;
+	memcpy(&head, heads + b*sizeof(Block), sizeof(Block));
+	if (pos + sizeof(Block) + (uint64_t)head.count*vertexSize > frame.rawLength)
+	    return false;
+	memcpy(out + pos, &head, sizeof(Block));
+	pos += sizeof(Block) + (uint64_t)head.count*vertexSize;
+	points += head.count;
+    }
+    if (pos != frame.rawLength)
+	return false;
+
+    // the planes
+    std::vector<char> pts(points*vertexSize + 1);
+    uint32_t used = sizeof(GroupFrame) + frame.numBlocks*sizeof(Block);
+    for (int k=0; k<vertexSize && points > 0; k++)
+    {
+	unsigned char *plane = (unsigned char*)&pts[k];
+	if (used >= frame.packedLength)
+	    return false;
+	int mode = in[used++];
+	if (mode == PLANE_CONST)
+	{
+	    if (used >= frame.packedLength)
+		return false;
+	    for (uint64_t i=0; i<points; i++)
+		plane[i*vertexSize] = (unsigned char)in[used];
+	    used++;
+	}
+	else if (mode == PLANE_RAW)
+	{
+	    if (frame.packedLength - used < points)
+		return false;
+	    for (uint64_t i=0; i<points; i++)
+		plane[i*vertexSize] = (unsigned char)in[used + i];
+	    used += points;
+	}
+	else if (mode == PLANE_RANS)
+	{
+	    uint32_t bytes = ransDecode(in + used, frame.packedLength - used, points, vertexSize, plane);
+	    if (bytes == 0)
+		return false;
+	    used += bytes;
+	}
+	else
+	    return false;
+    }
+
+    if (frame.filter == FILTER_OUTVERTEX && vertexSize == (int)FULL_VERTEX_SIZE)
+	unfilterPoints(&pts[0], points);
+    else if (frame.filter != FILTER_NONE)
+	return false;
+
+    // and the points back after their headers
+    pos = 0;
+    uint64_t p = 0;
+    for (int b=0; b<frame.numBlocks; b++)
+    {
+	const Block *head = (const Block*)(out + pos);
+	uint64_t bytes = (uint64_t)head->count * vertexSize;
+	memcpy(out + pos + sizeof(Block), &pts[p], bytes);
+	p += bytes;
+	pos += sizeof(Block) + bytes;
+    }
+    return true;
+}
@@ -0,0 +1,32 @@
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+#include <stdint.h>
+#include "Blocks.h"
+
+// a compressed child group, as gentree writes it with CompressBlocks:
+// this header, the blocks' headers as they are, and then their points,
+// packed (flagged by BLOCK_COMPRESSED_FLAG in the parent's childFlags,
+// whose childLength is then the frame's length on disk)
+#define GROUP_FRAME_MAGIC 0x50524743
+
+struct __attribute__ ((__packed__)) GroupFrame
+{
+    uint32_t magic;
+    uint32_t rawLength; // the blocks back to back, once unpacked
+    uint32_t packedLength; // this frame, header included
+    uint16_t numBlocks;
+    uint8_t vertexSize; // bytes per point
+    uint8_t filter; // how points were transformed before packing
+};
+
+// the transforms, and the vertex the one that isn't none is for
+#define FILTER_NONE 0
+#define FILTER_OUTVERTEX 1
+#define FULL_VERTEX_SIZE 32
+
+// unpacks a frame of length bytes into out, which has room for its
+// rawLength, returns false if it isn't a good one
+bool DecompressGroup(const char *frame, uint32_t length, char *out);
+
+#endif
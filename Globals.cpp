@@ -27,6 +27,7 @@ void GlobalOpts::defaults()
     sys.maxBytes = 2000000000;
     // try only using 500 megs
 //    sys.maxBytes = 500000000;
+    sys.directIO = false;
 
     dbg.printBlocks = false;
     dbg.printPrior = false;
@@ -94,6 +95,8 @@ bool GlobalOpts::OpenConfig(string filename)
 	    cam.tscale = atof(line+v);
 	else if (strncmp(line+s, "maxBytes", 8) == 0)
 	    sys.maxBytes = atoi(line+v);
+	else if (strncmp(line+s, "directIO", 8) == 0)
+	    sys.directIO = atoi(line+v) != 0;
 	else if (strncmp(line+s, "minBlockPixels", 14) == 0)
 	    view.minBlockPixels = atoi(line+v);
 	else if (strncmp(line+s, "camFactor", 9) == 0)
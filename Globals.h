@@ -44,6 +44,7 @@ struct FileOpts
 struct SystemOpts
 {
     uint32_t maxBytes; // memory usage limit of program
+    bool directIO; // read aligned block groups with O_DIRECT?
 };
 
 /*
@@ -14,7 +14,7 @@ using namespace std;
 #define NPROGS 4
 // # of uniform variables
 #define NUNI 11
-#define NPUNI 15
+#define NPUNI 16
 // # of attr. vars
 #define NATTR 7
 
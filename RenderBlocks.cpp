@@ -187,24 +187,52 @@ int Render::drawBoxesRec(int snap, Block* block)
 
     // set velocity and accel uniforms
     glUniform3fv(ptuniform[1], 1, block->mins); // vmin
-    glUniform3fv(ptuniform[2], 1, block->mins+3); // amin
-
     glUniform3fv(ptuniform[6], 1, block->scales); // vscl
-    glUniform3fv(ptuniform[7], 1, block->scales+3); // ascl
 
+    bool coarse = block->codec == BLOCK_COARSE_VERTICES;
+    if (coarse)
+    {
+	// no accelerations, so scale whatever acc points at to 0
+	float zeros[3] = {0,0,0};
+	glUniform3fv(ptuniform[2], 1, zeros); // amin
+	glUniform3fv(ptuniform[7], 1, zeros); // ascl
+    }
+    else
+    {
+	glUniform3fv(ptuniform[2], 1, block->mins+3); // amin
+	glUniform3fv(ptuniform[7], 1, block->scales+3); // ascl
+    }
+    // and only full ones can be interpolated to the next step
+    glUniform1f(ptuniform[15], coarse ? 0 : 1); // interp
+
+    int stride = BlockVertexSize(block, g_Opts->file.vertexSize);
     uint16_t* ptr = (uint16_t*)(block+1) + 2;
 
     if (viewPoints)
     {
 	glEnableClientState(GL_VERTEX_ARRAY);
 
-	glVertexAttribPointer(attribute[6], 4, GL_UNSIGNED_BYTE, GL_FALSE, g_Opts->file.vertexSize, ptr-2); // pid
-	glVertexAttribPointer(attribute[0], 3, GL_UNSIGNED_SHORT, GL_TRUE, g_Opts->file.vertexSize, ptr); // pos
-	glVertexAttribPointer(attribute[1], 3, GL_UNSIGNED_SHORT, GL_TRUE, g_Opts->file.vertexSize, ptr+3); // vel
-	glVertexAttribPointer(attribute[2], 3, GL_UNSIGNED_SHORT, GL_TRUE, g_Opts->file.vertexSize, ptr+6); // acc
-	glVertexAttribPointer(attribute[3], 2, GL_UNSIGNED_BYTE, GL_TRUE, g_Opts->file.vertexSize, ptr+9); // hsml bytes
-	glVertexAttribPointer(attribute[4], 2, GL_UNSIGNED_SHORT, GL_TRUE, g_Opts->file.vertexSize, ptr+10); // cur color
-	glVertexAttribPointer(attribute[5], 2, GL_UNSIGNED_SHORT, GL_TRUE, g_Opts->file.vertexSize, ptr+12); // next color
+	glVertexAttribPointer(attribute[6], 4, GL_UNSIGNED_BYTE, GL_FALSE, stride, ptr-2); // pid
+	glVertexAttribPointer(attribute[0], 3, GL_UNSIGNED_SHORT, GL_TRUE, stride, ptr); // pos
+
+	if (coarse)
+	{
+	    // pid, pos, then bytes: vel[3], hsml, densq, vdisp
+	    uint8_t* bytes = (uint8_t*)(ptr+3);
+	    glVertexAttribPointer(attribute[1], 3, GL_UNSIGNED_BYTE, GL_TRUE, stride, bytes); // vel
+	    glVertexAttribPointer(attribute[2], 3, GL_UNSIGNED_BYTE, GL_TRUE, stride, bytes); // acc (scaled to 0)
+	    glVertexAttribPointer(attribute[3], 1, GL_UNSIGNED_BYTE, GL_TRUE, stride, bytes+3); // hsml byte
+	    glVertexAttribPointer(attribute[4], 2, GL_UNSIGNED_BYTE, GL_TRUE, stride, bytes+4); // cur color
+	    glVertexAttribPointer(attribute[5], 2, GL_UNSIGNED_BYTE, GL_TRUE, stride, bytes+4); // next (unused)
+	}
+	else
+	{
+	    glVertexAttribPointer(attribute[1], 3, GL_UNSIGNED_SHORT, GL_TRUE, stride, ptr+3); // vel
+	    glVertexAttribPointer(attribute[2], 3, GL_UNSIGNED_SHORT, GL_TRUE, stride, ptr+6); // acc
+	    glVertexAttribPointer(attribute[3], 2, GL_UNSIGNED_BYTE, GL_TRUE, stride, ptr+9); // hsml bytes
+	    glVertexAttribPointer(attribute[4], 2, GL_UNSIGNED_SHORT, GL_TRUE, stride, ptr+10); // cur color
+	    glVertexAttribPointer(attribute[5], 2, GL_UNSIGNED_SHORT, GL_TRUE, stride, ptr+12); // next color
+	}
 
 	glDrawArrays(GL_POINTS, 0, block->count);
     }
@@ -441,6 +441,7 @@ void Render::loadShaders()
     ptuniform[12] = glGetUniformLocation(shaderprog[P_PSPRITE], "nfac");
     ptuniform[13] = glGetUniformLocation(shaderprog[P_PSPRITE], "seltex");
     ptuniform[14] = glGetUniformLocation(shaderprog[P_PSPRITE], "numSel");
+    ptuniform[15] = glGetUniformLocation(shaderprog[P_PSPRITE], "interp");
 
     // set default for this one, important
     glUniform1i(ptuniform[14],0);
@@ -195,6 +195,8 @@ uniform float hscl;				\
 uniform vec2 cscl;				\
 						\
 uniform float dt;				\
+/* 1 if there are next-step values, else 0 */	\
+uniform float interp;				\
 uniform float hsmlscale;			\
 uniform sampler2D seltex;			\
 uniform int numSel;				\
@@ -257,8 +259,9 @@ void main()								\
     nclr = (nclr*cscl) + cmin;					\
     hsml = (hsml*hscl) + hmin;					\
     /* interpolate density, veldisp, hsml correctly */		\
-    clr = clr*(1-dt) + nclr*dt;					\
-    hsml.x = hsml.x*(1-dt) + hsml.y*dt;				\
+    float ndt = dt*interp;					\
+    clr = clr*(1-ndt) + nclr*ndt;				\
+    hsml.x = hsml.x*(1-ndt) + hsml.y*ndt;			\
     /* these two are log-compressed */				\
     gl_FrontColor.r = exp(clr.r);				\
     gl_FrontColor.g = exp(clr.g);				\
@@ -6,30 +6,16 @@
 #include "TreeIndex.h"
 
 
-BlockFile BuildIndex(SnapHeader *curSnap, SnapHeader *nextSnap, string filename)
+/* Joins each point of the current snapshot with the same one in the
+   next (both read in pid order), works out its motion in between, and
+   writes it with its octree coord. Either reader can be of files or of
+   an array; readNext is NULL for the last snapshot. Returns how many
+   points were written. */
+template<typename RC, typename RN, typename W>
+uint64_t indexPoints(SnapHeader *curSnap, SnapHeader *nextSnap, RC& readCur, RN *readNext, W& writer)
 {
-    printf("Building index for snap %d...",curSnap->snap);
-    fflush(stdout);
-
-    // load input streams
-    BufferedReader<VertexA> readCur(string(curSnap->filename));
-    BufferedReader<VertexA> *readNext = NULL;
-    bool hasNext = false;
-    if (nextSnap != NULL)
-    {
-	readNext = new BufferedReader<VertexA>(string(nextSnap->filename));
-	// set next snaps' reader to delete after read,
-	// since we won't be needing that data anymore
-	readNext->SetDelete(true);
-	hasNext = true;
-    }
+    bool hasNext = (readNext != NULL);
 
-    // create writer on output filename
-    BufferedWriter<VertexB> writer(filename);
-    writer.SetSort(true);
-
-    VertexA vcur;
-    VertexA vnext;
     VertexB vout;
 
     double scale[3];
@@ -41,14 +27,14 @@ BlockFile BuildIndex(SnapHeader *curSnap, SnapHeader *nextSnap, string filename)
 	dloga = log(nextSnap->time) - log(curSnap->time);
 
     uint64_t npts = 0;
-    int64_t lastpid = 0;
 
     // time halfway between two snapshots, for interpolatioon
     double tmid = dloga/2;
 
     while (readCur.CanRead())
     {
-	vcur = readCur.Read();
+	// (use in place, these are only valid until the next Next())
+	const VertexA& vcur = readCur.Read();
 
 	// set positions, duh
 	for (int i=0;i<3;i++)
@@ -57,7 +43,7 @@ BlockFile BuildIndex(SnapHeader *curSnap, SnapHeader *nextSnap, string filename)
 	// combine with next vertex, if exists
 	if (hasNext)
 	{
-	    vnext = readNext->Read();
+	    const VertexA& vnext = readNext->Read();
 	    assert(vcur.pid == vnext.pid);
 	    // set accelerations so that point ends up at vnext.pos
 	    // after dloga time, but passes through correct intermediate point
@@ -135,17 +121,61 @@ BlockFile BuildIndex(SnapHeader *curSnap, SnapHeader *nextSnap, string filename)
 
 	if (npts % 1000000 == 0)
 	{
-	    printf("%d million...",npts/1000000);
+	    printf("%d million...",(int)(npts/1000000));
 	    fflush(stdout);
 	}
     }
 
+    return npts;
+}
+
+// and a blockfile object for the snapshot
+BlockFile indexBlockFile(SnapHeader *curSnap)
+{
+    BlockFile bf;
+    for (int i=0;i<3;i++)
+    {
+	bf.pos[i] = curSnap->minpos[i];
+	bf.scale[i] = curSnap->maxpos[i]-curSnap->minpos[i];
+    }
+
+    // use log-time for all of these
+    bf.time = log(curSnap->time);
+    bf.snapnum = curSnap->snap;
+    
+    return bf;
+}
+
+
+BlockFile BuildIndex(SnapHeader *curSnap, SnapHeader *nextSnap, string filename)
+{
+    printf("Building index for snap %d...",curSnap->snap);
+    fflush(stdout);
+
+    // load input streams
+    BufferedReader<VertexA> readCur(string(curSnap->filename));
+    readCur.SetPrefetch(ReadAhead);
+    BufferedReader<VertexA> *readNext = NULL;
+    if (nextSnap != NULL)
+    {
+	readNext = new BufferedReader<VertexA>(string(nextSnap->filename));
+	// (the pipeline deletes it once we're done)
+	readNext->SetPrefetch(ReadAhead);
+    }
+
+    // create writer on output filename
+    BufferedWriter<VertexB> writer(filename);
+    writer.SetSort(true);
+    writer.SetBuffers(WriteBuffers);
+
+    uint64_t npts = indexPoints(curSnap, nextSnap, readCur, readNext, writer);
+
     delete(readNext);
 
     // and clean up
     int numFiles = writer.Close();
 
-    printf("\nIndexed %d points.\n",npts);
+    printf("\nIndexed %d points.\n",(int)npts);
     fflush(stdout);
 
     // save # of files, for mergesort
@@ -153,17 +183,44 @@ BlockFile BuildIndex(SnapHeader *curSnap, SnapHeader *nextSnap, string filename)
     fwrite(&numFiles, sizeof(int), 1, file);
     fclose(file);
 
-    // and return a blockfile object
-    BlockFile bf;
-    for (int i=0;i<3;i++)
+    return indexBlockFile(curSnap);
+}
+
+
+/* Same thing for a snapshot whose pid-sorted points are in memory, into
+   a new array of points sorted by coord. The next snapshot's points can
+   be in memory too, or else are read from its file. */
+BlockFile BuildIndex(SnapHeader *curSnap, const VertexA *curPoints, SnapHeader *nextSnap,
+		     const VertexA *nextPoints, VertexB **points)
+{
+    printf("Building index for snap %d in memory...",curSnap->snap);
+    fflush(stdout);
+
+    ArrayReader<VertexA> readCur(curPoints, 0, curSnap->numTotal);
+
+    ArrayWriter<VertexB> writer(curSnap->numTotal);
+    writer.SetSort(true);
+
+    uint64_t npts;
+    if (nextSnap == NULL)
+	npts = indexPoints(curSnap, nextSnap, readCur, (ArrayReader<VertexA>*)NULL, writer);
+    else if (nextPoints != NULL)
     {
-	bf.pos[i] = curSnap->minpos[i];
-	bf.scale[i] = scale[i];
+	ArrayReader<VertexA> readNext(nextPoints, 0, nextSnap->numTotal);
+	npts = indexPoints(curSnap, nextSnap, readCur, &readNext, writer);
+    }
+    else
+    {
+	BufferedReader<VertexA> readNext(string(nextSnap->filename));
+	readNext.SetPrefetch(ReadAhead);
+	npts = indexPoints(curSnap, nextSnap, readCur, &readNext, writer);
     }
 
-    // use log-time for all of these
-    bf.time = log(curSnap->time);
-    bf.snapnum = curSnap->snap;
-    
-    return bf;
+    writer.Close();
+    *points = writer.Release();
+
+    printf("\nIndexed %d points.\n",(int)npts);
+    fflush(stdout);
+
+    return indexBlockFile(curSnap);
 }
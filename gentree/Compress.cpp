@@ -0,0 +1,424 @@
+#include <stdlib.h>
+#include <string.h>
+#include "Compress.h"
+
+// rANS with 32-bit state, put out a byte at a time, and frequencies
+// scaled to add up to 1<<RANS_BITS
+#define RANS_BITS 12
+#define RANS_TOTAL (1<<RANS_BITS)
+#define RANS_LOW (1u<<23)
+
+// how each plane is stored
+#define PLANE_RAW 0
+#define PLANE_CONST 1
+#define PLANE_RANS 2
+
+
+// ***************************************************************
+// Filters
+// ***************************************************************
+
+// field offsets in OutVertex
+#define OV_PID 0
+#define OV_POS 4
+#define OV_HSML 22
+#define OV_NHSML 23
+#define OV_DENSQ 24
+#define OV_VDISP 26
+#define OV_NDENSQ 28
+#define OV_NVDISP 30
+
+static inline uint16_t get16(const char *p)
+{
+    uint16_t v;
+    memcpy(&v, p, 2);
+    return v;
+}
+
+static inline void put16(char *p, uint16_t v)
+{
+    memcpy(p, &v, 2);
+}
+
+static inline uint32_t get32(const char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline void put32(char *p, uint32_t v)
+{
+    memcpy(p, &v, 4);
+}
+
+// differences, in place, from the last point to the first
+static void filterPoints(char *pts, int n)
+{
+    for (int i=n-1; i>=0; i--)
+    {
+	char *p = pts + i*sizeof(OutVertex);
+	p[OV_NHSML] = (char)(p[OV_NHSML] - p[OV_HSML]);
+	put16(p + OV_NDENSQ, get16(p + OV_NDENSQ) - get16(p + OV_DENSQ));
+	put16(p + OV_NVDISP, get16(p + OV_NVDISP) - get16(p + OV_VDISP));
+	if (i == 0)
+	    continue;
+	const char *q = p - sizeof(OutVertex);
+	put32(p + OV_PID, get32(p + OV_PID) - get32(q + OV_PID));
+	for (int j=0; j<3; j++)
+	    put16(p + OV_POS + 2*j, get16(p + OV_POS + 2*j) - get16(q + OV_POS + 2*j));
+    }
+}
+
+// and back, from the first
+static void unfilterPoints(char *pts, int n)
+{
+    for (int i=0; i<n; i++)
+    {
+	char *p = pts + i*sizeof(OutVertex);
+	p[OV_NHSML] = (char)(p[OV_NHSML] + p[OV_HSML]);
+	put16(p + OV_NDENSQ, get16(p + OV_NDENSQ) + get16(p + OV_DENSQ));
+	put16(p + OV_NVDISP, get16(p + OV_NVDISP) + get16(p + OV_VDISP));
+	if (i == 0)
+	    continue;
+	const char *q = p - sizeof(OutVertex);
+	put32(p + OV_PID, get32(p + OV_PID) + get32(q + OV_PID));
+	for (int j=0; j<3; j++)
+	    put16(p + OV_POS + 2*j, get16(p + OV_POS + 2*j) + get16(q + OV_POS + 2*j));
+    }
+}
+
+
+// ***************************************************************
+// rANS
+// ***************************************************************
+
+// scales counts of n symbols to frequencies adding up to RANS_TOTAL,
+// keeping every symbol that's there
+static void normalize(const uint32_t count[256], uint32_t n, uint32_t freq[256])
+{
+    uint32_t sum = 0;
+    int largest = 0;
+    for (int s=0; s<256; s++)
+    {
+	freq[s] = 0;
+	if (count[s] == 0)
+	    continue;
+	freq[s] = (uint32_t)(((uint64_t)count[s] * RANS_TOTAL) / n);
+	if (freq[s] == 0)
+	    freq[s] = 1;
+	sum += freq[s];
+	if (freq[s] > freq[largest])
+	    largest = s;
+    }
+    if (sum < RANS_TOTAL)
+	freq[largest] += RANS_TOTAL - sum;
+    // rounding rare symbols up can go over, so take it off the big ones
+    while (sum > RANS_TOTAL)
+    {
+	int big = 0;
+	for (int s=1; s<256; s++)
+	    if (freq[s] > freq[big])
+		big = s;
+	freq[big]--;
+	sum--;
+    }
+}
+
+// codes n bytes of a plane, stride apart, into out (the table and then
+// the stream), returns the bytes used, or 0 if it came to more than limit
+static uint32_t ransEncode(const unsigned char *in, int n, int stride, const uint32_t freq[256],
+			   std::vector<unsigned char>& buf, char *out, uint32_t limit)
+{
+    uint32_t start[256];
+    uint32_t cum = 0;
+    int nsym = 0;
+    for (int s=0; s<256; s++)
+    {
+	start[s] = cum;
+	cum += freq[s];
+	nsym += freq[s] > 0;
+    }
+
+    // the table: symbols there, and their frequencies
+    uint32_t used = 1 + 3*nsym + 4;
+    if (used >= limit)
+	return 0;
+    out[0] = (char)(nsym - 1);
+    char *t = out + 1;
+    for (int s=0; s<256; s++)
+	if (freq[s] > 0)
+	{
+	    *t++ = (char)s;
+	    put16(t, (uint16_t)freq[s]);
+	    t += 2;
+	}
+
+    // the stream goes backwards, from the end of buf
+    buf.resize(2*(size_t)n + 16);
+    unsigned char *end = &buf[0] + buf.size();
+    unsigned char *ptr = end;
+    uint32_t x = RANS_LOW;
+    for (int i=n-1; i>=0; i--)
+    {
+	int s = in[(size_t)i*stride];
+	uint32_t xmax = ((RANS_LOW >> RANS_BITS) << 8) * freq[s];
+	while (x >= xmax)
+	{
+	    *--ptr = (unsigned char)(x & 0xff);
+	    x >>= 8;
+	}
+	x = ((x / freq[s]) << RANS_BITS) + (x % freq[s]) + start[s];
+    }
+    ptr -= 4;
+    put32((char*)ptr, x);
+
+    uint32_t bytes = (uint32_t)(end - ptr);
+    if (used + bytes >= limit)
+	return 0;
+    put32(t, bytes);
+    memcpy(t + 4, ptr, bytes);
+    return used + bytes;
+}
+
+// decodes n bytes, stride apart, from a table and stream at in (with
+// avail bytes left), returns bytes used, or 0 if it's bad
+static uint32_t ransDecode(const char *in, uint32_t avail, int n, int stride, unsigned char *out)
+{
+    if (avail < 1)
+	return 0;
+    int nsym = (unsigned char)in[0] + 1;
+    uint32_t used = 1 + 3*nsym + 4;
+    if (avail < used)
+	return 0;
+
+    uint32_t freq[256], start[256];
+    unsigned char slots[RANS_TOTAL];
+    memset(freq, 0, sizeof(freq));
+    const char *t = in + 1;
+    uint32_t cum = 0;
+    for (int i=0; i<nsym; i++)
+    {
+	int s = (unsigned char)t[0];
+	freq[s] = get16(t + 1);
+	t += 3;
+	if (cum + freq[s] > RANS_TOTAL)
+	    return 0;
+	start[s] = cum;
+	memset(slots + cum, s, freq[s]);
+	cum += freq[s];
+    }
+    if (cum != RANS_TOTAL)
+	return 0;
+
+    uint32_t bytes = get32(t);
+    if (bytes < 4 || avail - used < bytes)
+	return 0;
+    const unsigned char *ptr = (const unsigned char*)t + 4;
+    const unsigned char *end = ptr + bytes;
+    uint32_t x = get32((const char*)ptr);
+    ptr += 4;
+    for (int i=0; i<n; i++)
+    {
+	uint32_t slot = x & (RANS_TOTAL - 1);
+	int s = slots[slot];
+	out[(size_t)i*stride] = (unsigned char)s;
+	x = freq[s] * (x >> RANS_BITS) + slot - start[s];
+	while (x < RANS_LOW)
+	{
+	    if (ptr == end)
+		return 0;
+	    x = (x << 8) | *ptr++;
+	}
+    }
+    return used + bytes;
+}
+
+
+// ***************************************************************
+// Groups
+// ***************************************************************
+
+// counts the blocks in a group, and their points, false if they don't
+// fit in length exactly
+static bool countBlocks(const char *group, uint32_t length, int vertexSize, int& blocks, int& points)
+{
+    blocks = 0;
+    points = 0;
+    uint32_t pos = 0;
+    while (pos < length)
+    {
+	if (length - pos < sizeof(OutBlock))
+	    return false;
+	const OutBlock *head = (const OutBlock*)(group + pos);
+	pos += sizeof(OutBlock) + (uint64_t)head->count * vertexSize;
+	points += head->count;
+	blocks++;
+    }
+    return pos == length;
+}
+
+uint32_t CompressGroup(const char *group, uint32_t length, int vertexSize, std::vector<char>& out)
+{
+    int blocks, points;
+    if (!countBlocks(group, length, vertexSize, blocks, points) || blocks > 65535)
+	return 0;
+
+    // the points, all together, transformed
+    std::vector<char> pts((size_t)points*vertexSize + 1);
+    uint32_t pos = 0;
+    size_t p = 0;
+    for (int b=0; b<blocks; b++)
+    {
+	const OutBlock *head = (const OutBlock*)(group + pos);
+	size_t bytes = (size_t)head->count * vertexSize;
+	memcpy(&pts[p], group + pos + sizeof(OutBlock), bytes);
+	p += bytes;
+	pos += sizeof(OutBlock) + bytes;
+    }
+    int filter = vertexSize == (int)sizeof(OutVertex) ? FILTER_OUTVERTEX : FILTER_NONE;
+    if (filter == FILTER_OUTVERTEX)
+	filterPoints(&pts[0], points);
+
+    // header, then the block headers
+    out.resize(length + 64);
+    GroupFrame frame;
+    frame.magic = GROUP_FRAME_MAGIC;
+    frame.rawLength = length;
+    frame.numBlocks = blocks;
+    frame.vertexSize = vertexSize;
+    frame.filter = filter;
+    uint32_t used = sizeof(GroupFrame);
+    pos = 0;
+    for (int b=0; b<blocks; b++)
+    {
+	const OutBlock *head = (const OutBlock*)(group + pos);
+	memcpy(&out[used], head, sizeof(OutBlock));
+	used += sizeof(OutBlock);
+	pos += sizeof(OutBlock) + head->count * vertexSize;
+    }
+
+    // and each plane, the smallest way
+    std::vector<unsigned char> buf;
+    for (int k=0; k<vertexSize && points > 0; k++)
+    {
+	const unsigned char *plane = (const unsigned char*)&pts[k];
+	uint32_t count[256];
+	memset(count, 0, sizeof(count));
+	for (int i=0; i<points; i++)
+	    count[plane[(size_t)i*vertexSize]]++;
+	int nsym = 0;
+	for (int s=0; s<256; s++)
+	    nsym += count[s] > 0;
+
+	if (used + 2 + points >= length)
+	    return 0;
+	if (nsym == 1)
+	{
+	    out[used++] = PLANE_CONST;
+	    out[used++] = (char)plane[0];
+	    continue;
+	}
+	uint32_t freq[256];
+	normalize(count, points, freq);
+	uint32_t bytes = ransEncode(plane, points, vertexSize, freq, buf, &out[used+1], points);
+	if (bytes > 0)
+	{
+	    out[used] = PLANE_RANS;
+	    used += 1 + bytes;
+	    continue;
+	}
+	out[used++] = PLANE_RAW;
+	for (int i=0; i<points; i++)
+	    out[used++] = (char)plane[(size_t)i*vertexSize];
+    }
+
+    if (used >= length)
+	return 0;
+    frame.packedLength = used;
+    memcpy(&out[0], &frame, sizeof(GroupFrame));
+    return used;
+}
+
+bool DecompressGroup(const char *in, uint32_t length, char *out)
+{
+    if (length < sizeof(GroupFrame))
+	return false;
+    GroupFrame frame;
+    memcpy(&frame, in, sizeof(GroupFrame));
+    if (frame.magic != GROUP_FRAME_MAGIC || frame.packedLength > length || frame.vertexSize == 0
+	|| (uint64_t)frame.numBlocks * sizeof(OutBlock) > frame.packedLength - sizeof(GroupFrame))
+	return false;
+    int vertexSize = frame.vertexSize;
+
+    // put the headers in place, leaving room for the points
+    const char *heads = in + sizeof(GroupFrame);
+    uint64_t pos = 0;
+    uint64_t points = 0;
+    for (int b=0; b<frame.numBlocks; b++)
+    {
+	OutBlock head;
+	memcpy(&head, heads + b*sizeof(OutBlock), sizeof(OutBlock));
+	if (pos + sizeof(OutBlock) + (uint64_t)head.count*vertexSize > frame.rawLength)
+	    return false;
+	memcpy(out + pos, &head, sizeof(OutBlock));
+	pos += sizeof(OutBlock) + (uint64_t)head.count*vertexSize;
+	points += head.count;
+    }
+    if (pos != frame.rawLength)
+	return false;
+
+    // the planes
+    std::vector<char> pts(points*vertexSize + 1);
+    uint32_t used = sizeof(GroupFrame) + frame.numBlocks*sizeof(OutBlock);
+    for (int k=0; k<vertexSize && points > 0; k++)
+    {
+	unsigned char *plane = (unsigned char*)&pts[k];
+	if (used >= frame.packedLength)
+	    return false;
+	int mode = in[used++];
+	if (mode == PLANE_CONST)
+	{
+	    if (used >= frame.packedLength)
+		return false;
+	    for (uint64_t i=0; i<points; i++)
+		plane[i*vertexSize] = (unsigned char)in[used];
+	    used++;
+	}
+	else if (mode == PLANE_RAW)
+	{
+	    if (frame.packedLength - used < points)
+		return false;
+	    for (uint64_t i=0; i<points; i++)
+		plane[i*vertexSize] = (unsigned char)in[used + i];
+	    used += points;
+	}
+	else if (mode == PLANE_RANS)
+	{
+	    uint32_t bytes = ransDecode(in + used, frame.packedLength - used, points, vertexSize, plane);
+	    if (bytes == 0)
+		return false;
+	    used += bytes;
+	}
+	else
+	    return false;
+    }
+
+    if (frame.filter == FILTER_OUTVERTEX && vertexSize == (int)sizeof(OutVertex))
+	unfilterPoints(&pts[0], points);
+    else if (frame.filter != FILTER_NONE)
+	return false;
+
+    // and the points back after their headers
+    pos = 0;
+    uint64_t p = 0;
+    for (int b=0; b<frame.numBlocks; b++)
+    {
+	const OutBlock *head = (const OutBlock*)(out + pos);
+	uint64_t bytes = (uint64_t)head->count * vertexSize;
+	memcpy(out + pos + sizeof(OutBlock), &pts[p], bytes);
+	p += bytes;
+	pos += sizeof(OutBlock) + bytes;
+    }
+    return true;
+}
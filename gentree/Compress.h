@@ -0,0 +1,30 @@
+/* Packing of child groups, for CompressBlocks. The headers of the blocks
+   are kept as they are (so they can still be patched in place), and the
+   points go in byte planes: every point's first byte, then every
+   point's second, and so on, each plane coded on its own, by an order-0
+   rANS coder, or as a single repeated byte, or as is if neither helps.
+   Before that, for the full OutVertex, pids and positions become
+   differences from the point before (points in a block are in Morton
+   order, so these are small), and the next-step hsml and densities
+   differences from the current ones. */
+
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+#include <vector>
+#include "Formats.h"
+
+// transforms of the points before packing (GroupFrame::filter)
+#define FILTER_NONE 0
+#define FILTER_OUTVERTEX 1
+
+// packs the blocks in group (headers and points back to back, length
+// bytes, points vertexSize bytes each) into a frame in out, and returns
+// its length, or 0 if that wouldn't be any smaller than the group
+uint32_t CompressGroup(const char *group, uint32_t length, int vertexSize, std::vector<char>& out);
+
+// unpacks a frame of length bytes into out, which has room for its
+// rawLength, returns false if it isn't a good one
+bool DecompressGroup(const char *frame, uint32_t length, char *out);
+
+#endif
@@ -3,75 +3,43 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <algorithm>
 #include "CreateBlocks.h"
 #include "PartFiles.h"
 #include "Formats.h"
+#include "Process.h"
+#include "Threads.h"
 
 
-// ***************************************************************
-// The most important single variable
-// ***************************************************************
-
-int MAX_COUNT;
-
-
-
-
-// ***************************************************************
-// these structs point to processed blocks that we need to use for
-// merging in any sort of depth-first traversal
-// ***************************************************************
-
-// points to previously completed blocks
-VertexB* PendingBlocks[MAX_DEPTH][8];
-
-// and their counts
-int PendingCount[MAX_DEPTH][8];
-
-// and gives the file pointers to the first child (for depth->block)
-uint64_t BlockChildLocation[MAX_DEPTH][8];
-
-// and the length of children, in file
-uint64_t BlockChildLength[MAX_DEPTH][8];
-
-// which children exist
-int16_t BlockChildFlags[MAX_DEPTH][8];
-
-// and which file they're in
-int16_t BlockChildFile[MAX_DEPTH][8];
-
-
-// ***************************************************************
-// Contains current read buffer, sized 
-// ***************************************************************
-
-#define BUFFER_FAC 3
 // CurrentBlock is BUFFER_FAC*MAX_COUNT
-int CurrentCount;
-VertexB* CurrentBlock;
-
-// reader and writer classes
-BufferedReader<VertexB> *reader;
-
-// one writer for each file
-LargeWriter **writers;
-// and the current writer
-LargeWriter *writer;
-// and the index of the current writer
-int curWriterIndex;
-// total number of writers
-int numWriters;
+#define BUFFER_FAC 3
 
-int totalNodes;
-int totalLeaves;
 
+BlockBuilder::BlockBuilder(int maxcnt, BlockFile& bf)
+{
+    MAX_COUNT = maxcnt;
+    curBlockFile = &bf;
+    reader = NULL;
+    writers = NULL;
+    writer = NULL;
+    rngState = 1;
+    recordFixups = false;
+    grouping = false;
+    splitDepth = 0;
+    splitBounds = NULL;
+    subtrees = NULL;
+    subBases = NULL;
+    mergeThreads = MAX(NumThreads, 1);
+}
 
-// also current block info, for merging
-BlockFile *curBlockFile;
+void BlockBuilder::SetMergeThreads(int n)
+{
+    mergeThreads = MAX(n, 1);
+}
 
 
 // Recursively creates all the blocks (...woah)
-void CreateBlocks(uint64_t block, int shift, int depth)
+void BlockBuilder::CreateBlocks(uint64_t block, int shift, int depth)
 {
     int nmatch = GetMatchingCount(block, shift);
     int blocknum = block&7;
@@ -95,10 +63,93 @@ void CreateBlocks(uint64_t block, int shift, int depth)
     for (int i=0; i<8; i++)
 	CreateBlocks((block<<3) + i, shift - 3, depth + 1);
 
-    // and then merge to create the current one
-    MergeBlock(depth, blocknum, shift);
+    // and then merge to create the current one, and write the children
+    FinishNode(block, shift, depth);
+}
+
+
+// Builds a node above the split depth, whose children are either
+// whole subtrees built separately, or more of the same
+void BlockBuilder::CreateTop(uint64_t block, int shift, int depth)
+{
+    int blocknum = block&7;
+
+    // range of input in this block
+    int sh = 3*(splitDepth - depth);
+    uint64_t first = splitBounds[block << sh];
+    uint64_t last = splitBounds[(block+1) << sh];
+    int count = (int)MIN(last - first, (uint64_t)MAX_COUNT+1);
+
+    // small enough to be a leaf, so just load it
+    if (count <= MAX_COUNT)
+    {
+	PendingBlocks[depth][blocknum] = (VertexB*)malloc(count*sizeof(VertexB));
+	PendingCount[depth][blocknum] = count;
+	if (count > 0)
+	{
+	    if (topInput->points != NULL)
+		memcpy(PendingBlocks[depth][blocknum], topInput->points + first, count*sizeof(VertexB));
+	    else
+	    {
+		RangeReader<VertexB> leafReader(topInput->filename, first, last, count*sizeof(VertexB));
+		for (int i=0; i<count; i++)
+		{
+		    PendingBlocks[depth][blocknum][i] = leafReader.Read();
+		    leafReader.Next();
+		}
+	    }
+	    totalLeaves++;
+	}
+	BlockChildLocation[depth][blocknum] = 0;
+	BlockChildLength[depth][blocknum] = 0;
+	BlockChildFlags[depth][blocknum] = 0;
+	BlockChildFile[depth][blocknum] = -1;
+	return;
+    }
+
+    // already built, just need to point it into the final files
+    if (depth == splitDepth)
+    {
+	Subtree *sub = subtrees[block];
+	PendingBlocks[depth][blocknum] = sub->points;
+	PendingCount[depth][blocknum] = sub->count;
+	BlockChildLocation[depth][blocknum] = sub->childLocation;
+	if (sub->childLength > 0)
+	    BlockChildLocation[depth][blocknum] += subBases[block*numWriters + sub->childFile];
+	BlockChildLength[depth][blocknum] = sub->childLength;
+	BlockChildFlags[depth][blocknum] = sub->childFlags;
+	BlockChildFile[depth][blocknum] = sub->childFile;
+	sub->points = NULL;
+	totalNodes += sub->totalNodes;
+	totalLeaves += sub->totalLeaves;
+	MergeGrid->evals += sub->distEvals;
+	bruteEvals += sub->bruteEvals;
+	nextEvals += sub->nextEvals;
+	nextMatches += sub->nextMatches;
+	nextDistSum += sub->nextDistSum;
+	rawBytes += sub->rawBytes;
+	packedBytes += sub->packedBytes;
+	return;
+    }
+
+    for (int i=0; i<8; i++)
+	CreateTop((block<<3) + i, shift - 3, depth + 1);
+
+    FinishNode(block, shift, depth);
+}
+
+
+// Merges the (pending) children of a node, and writes them out
+void BlockBuilder::FinishNode(uint64_t block, int shift, int depth)
+{
+    int blocknum = block&7;
+
+    MergeBlock(block, depth, shift);
 
     uint64_t length = 0;
+
+    // children start on a boundary, with BlockAlign set
+    writer->Pad();
     
     // set first child's pointer
     BlockChildLocation[depth][blocknum] = writer->GetLocation();
@@ -109,6 +160,12 @@ void CreateBlocks(uint64_t block, int shift, int depth)
     // zero flags
     BlockChildFlags[depth][blocknum] = 0;
 
+    // to be packed, they're put together first
+    grouping = CompressBlocks != 0;
+    groupBuf.clear();
+    unsigned int firstFixup = fixups.size();
+    unsigned int firstEntry = dirEntries.size();
+
     // and then write child blocks (also frees pendingblock mem)
     for (int i=0; i<8; i++)
     {
@@ -120,6 +177,13 @@ void CreateBlocks(uint64_t block, int shift, int depth)
 	// and write it
 	length += WritePendingBlock((block<<3) + i, shift - 3, depth + 1);
     }
+    if (grouping)
+    {
+	length = WriteGroup(depth, blocknum, firstFixup, firstEntry);
+	grouping = false;
+    }
+    // and end on one, so the padding counts as theirs
+    length += writer->Pad();
     BlockChildLength[depth][blocknum] = length;
 
     // and now advance to next writer
@@ -137,7 +201,7 @@ void CreateBlocks(uint64_t block, int shift, int depth)
 
 
 // Copies current vertices into a pending block (blocknum is 0-7)
-void CreateLeaf(int depth, int blocknum, int count)
+void BlockBuilder::CreateLeaf(int depth, int blocknum, int count)
 {
     // alloc and copy data
     PendingBlocks[depth][blocknum] = (VertexB*)malloc(count*sizeof(VertexB));
@@ -156,7 +220,7 @@ void CreateLeaf(int depth, int blocknum, int count)
 }
 
 // Returns the number of matching vertices in current
-int GetMatchingCount(uint64_t block, int shift)
+int BlockBuilder::GetMatchingCount(uint64_t block, int shift)
 {
     for (int i=0; i<CurrentCount; i++)
     {
@@ -169,65 +233,75 @@ int GetMatchingCount(uint64_t block, int shift)
 }
 
 // Reads in a block's worth of vertices
-void ReadNextBlock()
+void BlockBuilder::ReadNextBlock()
 {
     int maxn = MAX_COUNT*BUFFER_FAC;
-    // read in as many so as to fill the current block with data
-    VertexB *data = CurrentBlock+CurrentCount;
-    VertexB v;
-    int i=0;
-    for (i=0; i<(maxn-CurrentCount); i++)
+    // read in as many so as to fill the current block with data,
+    // copying whole spans of the read buffer at a time
+    while (CurrentCount < maxn && reader->CanRead())
     {
-	if (reader->CanRead())
-	    *data = reader->Read();
-	else
-	    break;
-
-	data++;
-	reader->Next();	
+	int n;
+	const VertexB *span = reader->GetSpan(n);
+	if (n > maxn-CurrentCount)
+	    n = maxn-CurrentCount;
+	memcpy(CurrentBlock+CurrentCount, span, n*sizeof(VertexB));
+	CurrentCount += n;
+	reader->Advance(n);
     }
-
-    CurrentCount += i;
     // now as full of data as it can get
 }
 
 // Advances writer pointer
-void NextWriter()
+void BlockBuilder::NextWriter()
 {
     curWriterIndex++;
     curWriterIndex %= numWriters;
     writer = writers[curWriterIndex];
 }
 
-// The main function
-void ProcessBlocks(string infile, string outfile, int maxcnt, int numfiles, BlockFile& bf)
+// Seeds the random state from a block's coord and depth
+void BlockBuilder::SeedRandom(uint64_t block, int depth)
 {
-    MAX_COUNT = maxcnt;
+    // splitmix64 finalizer, to spread out neighbouring blocks
+    uint64_t z = (block + 1) * 0x9E3779B97F4A7C15ULL + depth;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+    rngState = z ? z : 1;
+}
+
+// Returns a non-negative random int (xorshift64)
+int BlockBuilder::Random()
+{
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 7;
+    rngState ^= rngState << 17;
+    return (int)(rngState >> 33);
+}
 
+// The main function
+void BlockBuilder::Build(BlockInput& input, string outfile, int numfiles)
+{
     SetupBlocks();
 
     CurrentBlock = (VertexB*)malloc(MAX_COUNT * BUFFER_FAC * sizeof(VertexB));
+    countAlloc((int64_t)MAX_COUNT * BUFFER_FAC * sizeof(VertexB));
 
     CurrentCount = 0;
 
-    curBlockFile = &bf;
-
     totalNodes = 0;
     totalLeaves = 0;
 
     curWriterIndex = 0;
     numWriters = numfiles;
 
-    // open up the input file
-    BufferedReader<VertexB> readFile(infile);
-    // set delete, since we don't need to keep them
-    readFile.SetDelete(true);
-    reader = &readFile;
+    // open up the input
+    reader = input.Open();
 
     // now open up each output file, as outfile.i
     writers = new LargeWriter*[numfiles];
     for (int i=0; i<numfiles; i++)
-	writers[i] = new LargeWriter(outfile + "." + toString<int>(i));
+	writers[i] = new LargeWriter(outfile + "." + toString<int>(i), BlockAlign);
 
     // and set to first writer
     writer = writers[0];
@@ -242,10 +316,14 @@ void ProcessBlocks(string infile, string outfile, int maxcnt, int numfiles, Bloc
     // and make the master block, with 0 blockid, max shift, and 0 depth
     CreateBlocks(0, MAX_DEPTH*3, 0);
 
+    BlockFile& bf = *curBlockFile;
+    writer->Pad();
     bf.firstLocation = writer->GetLocation();
     bf.firstFile = curWriterIndex;
     bf.firstLength = WritePendingBlock(0, MAX_DEPTH*3, 0);
+    bf.firstLength += writer->Pad();
     printf("\nDone, created %d nodes and %d leaves.\n", totalNodes, totalLeaves);
+    PrintMergeStats();
 
     // close all the writers
     for (int i=0; i<numfiles; i++)
@@ -256,9 +334,203 @@ void ProcessBlocks(string infile, string outfile, int maxcnt, int numfiles, Bloc
 
     // since it's an array of pointers, destructors not called
     delete[] writers;
+    writers = NULL;
+    writer = NULL;
+
+    free(CurrentBlock);
+    countFree((int64_t)MAX_COUNT * BUFFER_FAC * sizeof(VertexB));
+
+    CleanupBlocks();
+    delete reader;
+    reader = NULL;
+}
+
+// Builds one subtree, keeping its root pending
+void BlockBuilder::BuildSubtree(BlockInput& input, string outfile, int numfiles, Subtree& sub, int depth)
+{
+    SetupBlocks();
+
+    CurrentBlock = (VertexB*)malloc(MAX_COUNT * BUFFER_FAC * sizeof(VertexB));
+    countAlloc((int64_t)MAX_COUNT * BUFFER_FAC * sizeof(VertexB));
+    CurrentCount = 0;
+
+    totalNodes = 0;
+    totalLeaves = 0;
+
+    curWriterIndex = 0;
+    numWriters = numfiles;
+
+    recordFixups = true;
+    fixups.clear();
+
+    // split the read buffer between the threads
+    int bufsize = READ_BUF_SIZE / MAX(NumThreads, 1);
+    reader = input.Open(sub.first, sub.last, bufsize);
+
+    writers = new LargeWriter*[numfiles];
+    for (int i=0; i<numfiles; i++)
+	writers[i] = new LargeWriter(outfile + "." + toString<int>(i), BlockAlign);
+    writer = writers[0];
+
+    ReadNextBlock();
+
+    int shift = MAX_DEPTH*3 - 3*depth;
+    CreateBlocks(sub.block, shift, depth);
+
+    // hand over the root, for the parent to merge and write
+    int blocknum = sub.block&7;
+    sub.points = PendingBlocks[depth][blocknum];
+    sub.count = PendingCount[depth][blocknum];
+    sub.childLocation = BlockChildLocation[depth][blocknum];
+    sub.childLength = BlockChildLength[depth][blocknum];
+    sub.childFlags = BlockChildFlags[depth][blocknum];
+    sub.childFile = BlockChildFile[depth][blocknum];
+    sub.fixups.swap(fixups);
+    sub.dir.swap(dirEntries);
+    sub.totalNodes = totalNodes;
+    sub.totalLeaves = totalLeaves;
+    sub.distEvals = MergeGrid->evals;
+    sub.bruteEvals = bruteEvals;
+    sub.nextEvals = nextEvals;
+    sub.nextMatches = nextMatches;
+    sub.nextDistSum = nextDistSum;
+    sub.rawBytes = rawBytes;
+    sub.packedBytes = packedBytes;
+
+    sub.fileSize.resize(numfiles);
+    for (int i=0; i<numfiles; i++)
+    {
+	sub.fileSize[i] = writers[i]->GetLocation();
+	writers[i]->Close();
+	delete writers[i];
+    }
+    delete[] writers;
+    writers = NULL;
+    writer = NULL;
 
     free(CurrentBlock);
+    countFree((int64_t)MAX_COUNT * BUFFER_FAC * sizeof(VertexB));
 
     CleanupBlocks();
+    delete reader;
     reader = NULL;
 }
+
+// Builds the top levels over the finished subtrees, and the root
+void BlockBuilder::BuildTop(BlockInput& input, LargeWriter **outwriters, int numfiles, int depth,
+			    uint64_t *bounds, Subtree **subs, uint64_t *bases)
+{
+    SetupBlocks();
+
+    totalNodes = 0;
+    totalLeaves = 0;
+
+    curWriterIndex = 0;
+    numWriters = numfiles;
+    writers = outwriters;
+    writer = writers[0];
+
+    topInput = &input;
+    splitDepth = depth;
+    splitBounds = bounds;
+    subtrees = subs;
+    subBases = bases;
+
+    CreateTop(0, MAX_DEPTH*3, 0);
+
+    BlockFile& bf = *curBlockFile;
+    writer->Pad();
+    bf.firstLocation = writer->GetLocation();
+    bf.firstFile = curWriterIndex;
+    bf.firstLength = WritePendingBlock(0, MAX_DEPTH*3, 0);
+    bf.firstLength += writer->Pad();
+    printf("\nDone, created %d nodes and %d leaves.\n", totalNodes, totalLeaves);
+    PrintMergeStats();
+
+    // writers belong to the caller
+    writers = NULL;
+    writer = NULL;
+
+    CleanupBlocks();
+}
+
+
+/* Builds the blocks for one snapshot, split into subtrees if asked. The
+   subtrees get written twice (once on their own, then stitched), so with
+   one thread it's just the one tree. */
+void ProcessBlocks(BlockInput input, string outfile, int maxcnt, int numfiles, BlockFile& bf)
+{
+    if (SplitDepth > 0 && NumThreads > 1)
+    {
+	ProcessBlocksSplit(input, outfile, maxcnt, numfiles, bf);
+	return;
+    }
+
+    BlockBuilder builder(maxcnt, bf);
+    builder.Build(input, outfile, numfiles);
+    SaveBlockDir(outfile + "_dir", builder.Directory());
+}
+
+
+// for putting the directory in depth-first order: a block's key, shifted
+// down to the bottom level, comes right before all its children's
+static bool dirLess(const BlockDirEntry& a, const BlockDirEntry& b)
+{
+    uint64_t ka = a.key << 3*(MAX_DEPTH - a.depth);
+    uint64_t kb = b.key << 3*(MAX_DEPTH - b.depth);
+    if (ka != kb)
+	return ka < kb;
+    return a.depth < b.depth;
+}
+
+// is a an ancestor of b?
+static bool dirContains(const BlockDirEntry& a, const BlockDirEntry& b)
+{
+    return a.depth < b.depth && (b.key >> 3*(b.depth - a.depth)) == a.key;
+}
+
+/* Puts directory entries in depth-first order, and sets their subtree
+   sizes. */
+void SortBlockDir(vector<BlockDirEntry>& dir)
+{
+    std::sort(dir.begin(), dir.end(), dirLess);
+
+    // a subtree ends at the first entry that isn't in it
+    vector<uint32_t> open;
+    for (uint32_t i=0; i<dir.size(); i++)
+    {
+	while (!open.empty() && !dirContains(dir[open.back()], dir[i]))
+	{
+	    dir[open.back()].subtreeSize = i - open.back();
+	    open.pop_back();
+	}
+	open.push_back(i);
+    }
+    while (!open.empty())
+    {
+	dir[open.back()].subtreeSize = dir.size() - open.back();
+	open.pop_back();
+    }
+}
+
+/* Writes the directory of a snapshot's blocks (see BlockDirEntry), from
+   entries in any order. */
+void SaveBlockDir(string filename, vector<BlockDirEntry>& dir)
+{
+    SortBlockDir(dir);
+
+    FILE *out = fopen(filename.c_str(), "wb");
+    if (out == NULL)
+    {
+	fprintf(stderr,"Couldn't write block directory %s!\n",filename.c_str());
+	return;
+    }
+    BlockDirHeader head;
+    head.magic = BLOCK_DIR_MAGIC;
+    head.version = BLOCK_DIR_VERSION;
+    head.count = dir.size();
+    fwrite(&head, sizeof(BlockDirHeader), 1, out);
+    if (dir.size() > 0)
+	fwrite(&dir[0], sizeof(BlockDirEntry), dir.size(), out);
+    fclose(out);
+}
@@ -1,7 +1,10 @@
 #ifndef _CREATEBLOCKS_H_
 #define _CREATEBLOCKS_H_
 
+#include <vector>
 #include "Formats.h"
+#include "PartFiles.h"
+#include "PointGrid.h"
 
 // Global defines
 #define MAX_DEPTH 20
@@ -13,25 +16,333 @@
 #define MIN(a,b) ((a)<(b)?(a):(b))
 
 
-// ***************************************************************
-// Function prototypes
-// ***************************************************************
-int GetMatchingCount(uint64_t block, int shift);
-void CreateBlocks(uint64_t block, int shift, int depth);
-void CreateLeaf(int depth, int blocknum, int count);
-void ReadNextBlock();
-void NextWriter();
+// a struct to hold rearranged PtsOut, for merging next
+struct NextPt
+{
+    uint64_t coord; // octtree coord in *next* timestep
+    double pos[3];
+    VertexB* orig;
+
+    bool operator< (const NextPt& b) const
+    {
+	return coord < b.coord;
+    }
+};
+
+
+// tree depth at which ProcessBlocks splits the work (0 for no split,
+// and never with one thread)
+extern int SplitDepth;
+
+// how points find their match in the next timestep when merging
+#define NEXT_WINDOW 0	// nearest of a few neighbors in octree order
+#define NEXT_EXACT 1	// nearest of all, from a grid
+#define NEXT_APPROX 2	// nearest in its own grid cell, if any
+extern int NextMatch;
+
+// output points within a step of the exact ones, but faster (see Quantize.h)
+extern int FastQuantize;
+// depth above which blocks get coarse points
+extern int CoarseDepth;
+
+// start (and end) every group of children on a multiple of this many
+// bytes, written with direct I/O (0 packs them back to back)
+extern int BlockAlign;
+
+// write child groups compressed (see Compress.h), when they get smaller
+extern int CompressBlocks;
+
+
+/* Where a builder gets its coord-sorted points from, either a whole
+   file or one range of it. */
+class BlockSource
+{
+public:
+    virtual ~BlockSource()
+    {
+    }
+
+    virtual bool CanRead() = 0;
+    virtual const VertexB* GetSpan(int& count) = 0;
+    virtual bool Advance(int n) = 0;
+};
+
+template<typename R>
+class ReaderSource : public BlockSource
+{
+    R* reader;
+    // delete the reader along with this?
+    bool owned;
+
+public:
+    ReaderSource(R* r, bool own = false)
+    {
+	reader = r;
+	owned = own;
+    }
+
+    ~ReaderSource()
+    {
+	if (owned)
+	    delete reader;
+    }
+
+    bool CanRead()
+    {
+	return reader->CanRead();
+    }
+
+    const VertexB* GetSpan(int& count)
+    {
+	return reader->GetSpan(count);
+    }
+
+    bool Advance(int n)
+    {
+	return reader->Advance(n);
+    }
+};
+
+
+/* The coord-sorted points of a snapshot, either in a set of subfiles,
+   or in an array for a snapshot done in memory (which still belongs to
+   the caller). */
+struct BlockInput
+{
+    string filename;
+    const VertexB *points;
+    uint64_t count;
+
+    BlockInput(string fname)
+    {
+	filename = fname;
+	points = NULL;
+	count = 0;
+    }
+
+    BlockInput(const VertexB *p, uint64_t n)
+    {
+	points = p;
+	count = n;
+    }
+
+    // how many points there are
+    uint64_t Total();
+    // first index in [first, last) whose coord isn't below key's
+    uint64_t LowerBound(uint64_t first, uint64_t last, const VertexB& key);
+
+    // new sources of all the points, or of [first, last) with a
+    // buffer of bufsize bytes if read from files
+    BlockSource* Open();
+    BlockSource* Open(uint64_t first, uint64_t last, int bufsize);
+};
+
+
+// a header written in a subtree's stripe file that points at children,
+// and so needs patching once the stripe files are concatenated
+struct BlockFixup
+{
+    int file;
+    uint64_t offset;
+};
+
+/* A subtree built on its own: its root block (still pending, since the
+   parent writes it), and what's needed to splice its stripe files into
+   the final ones. */
+struct Subtree
+{
+    // octree coord prefix of the root, and its range of the input
+    uint64_t block;
+    uint64_t first;
+    uint64_t last;
+
+    VertexB* points;
+    int count;
+    uint64_t childLocation;
+    uint64_t childLength;
+    int16_t childFlags;
+    int16_t childFile;
+
+    vector<BlockFixup> fixups;
+    // bytes written to each stripe file
+    vector<uint64_t> fileSize;
+    // directory entries of the blocks written (locations in the part files)
+    vector<BlockDirEntry> dir;
+
+    int totalNodes;
+    int totalLeaves;
+    uint64_t distEvals;
+    uint64_t bruteEvals;
+    uint64_t nextEvals;
+    uint64_t nextMatches;
+    double nextDistSum;
+    uint64_t rawBytes;
+    uint64_t packedBytes;
+};
+
+
+/* Everything needed to build the blocks of one snapshot, which used to
+   be file-scope globals, so that several snapshots can be built at once.
+   The member functions live in CreateBlocks.cpp, MergeBlock.cpp and
+   WriteBlock.cpp, as before. */
+class BlockBuilder
+{
+private:
 
+    // ***************************************************************
+    // The most important single variable
+    // ***************************************************************
+    int MAX_COUNT;
 
-void MergeBlock(int depth, int blocknum, int shift);
-void MergeCurrentTime(int shift, int count, VertexB* PtsOut);
-void MergeNextTime(int count, VertexB* PtsOut);
+    // ***************************************************************
+    // these point to processed blocks that we need to use for
+    // merging in any sort of depth-first traversal
+    // ***************************************************************
 
-uint64_t WritePendingBlock(uint64_t block, int shift, int depth);
+    // points to previously completed blocks
+    VertexB* PendingBlocks[MAX_DEPTH][8];
+    // and their counts
+    int PendingCount[MAX_DEPTH][8];
+    // and gives the file pointers to the first child (for depth->block)
+    uint64_t BlockChildLocation[MAX_DEPTH][8];
+    // and the length of children, in file
+    uint64_t BlockChildLength[MAX_DEPTH][8];
+    // which children exist
+    int16_t BlockChildFlags[MAX_DEPTH][8];
+    // and which file they're in
+    int16_t BlockChildFile[MAX_DEPTH][8];
+
+    // current read buffer, sized BUFFER_FAC*MAX_COUNT
+    int CurrentCount;
+    VertexB* CurrentBlock;
+
+    // where the points come from
+    BlockSource *reader;
+
+    // one writer for each file
+    LargeWriter **writers;
+    // and the current writer
+    LargeWriter *writer;
+    // and the index of the current writer
+    int curWriterIndex;
+    // total number of writers
+    int numWriters;
+
+    int totalNodes;
+    int totalLeaves;
+
+    // also current block info, for merging
+    BlockFile *curBlockFile;
+
+    // input array into which we copy all pending blocks
+    VertexB* PtsIn;
+    // output array for writeblocks
+    OutVertex* OutPoints;
+    // for repeating procedure, just with the next position
+    NextPt* PtsNext;
+    // for finding nearest kept points when merging
+    PointGrid* MergeGrid;
+    // and how many distances brute force would have taken
+    uint64_t bruteEvals;
+
+    // same for next timestep, with the match found for each of PtsIn
+    // (which also holds flags while recomputing coords)
+    PointGrid* NextGrid;
+    int* NextIndex;
+    double* NextDist;
+    // threads used to find matches
+    int mergeThreads;
+    // distances computed, and how good the matches were
+    uint64_t nextEvals;
+    uint64_t nextMatches;
+    double nextDistSum;
+
+    // random state, reseeded for every merged block, so that the output
+    // doesn't depend on the order blocks are built in
+    uint64_t rngState;
+
+    // for a subtree: note where headers with children went
+    bool recordFixups;
+    vector<BlockFixup> fixups;
+
+    // an entry for every block written, in the order written
+    vector<BlockDirEntry> dirEntries;
+
+    // with CompressBlocks, a group of children is put together here, and
+    // then written packed; and how much that saved
+    bool grouping;
+    vector<char> groupBuf;
+    vector<char> packBuf;
+    uint64_t rawBytes;
+    uint64_t packedBytes;
+
+    // for the top of a split tree: the input, the boundaries of the
+    // subtrees in it, the finished subtrees, and where their stripe
+    // files start in the final ones (subBases[block*numWriters + file])
+    BlockInput *topInput;
+    int splitDepth;
+    uint64_t *splitBounds;
+    Subtree **subtrees;
+    uint64_t *subBases;
+
+
+    int GetMatchingCount(uint64_t block, int shift);
+    void CreateBlocks(uint64_t block, int shift, int depth);
+    void CreateTop(uint64_t block, int shift, int depth);
+    void FinishNode(uint64_t block, int shift, int depth);
+    void CreateLeaf(int depth, int blocknum, int count);
+    void ReadNextBlock();
+    void NextWriter();
+
+    void SeedRandom(uint64_t block, int depth);
+    int Random();
+
+    void MergeBlock(uint64_t block, int depth, int shift);
+    void MergeCurrentTime(int shift, int count, VertexB* PtsOut);
+    void MergeNextTime(int count, VertexB* PtsOut);
+    void FindNextMatches(int count);
+    void PrintMergeStats();
+
+    uint64_t WritePendingBlock(uint64_t block, int shift, int depth);
+    uint64_t WriteGroup(int depth, int blocknum, unsigned int firstFixup, unsigned int firstEntry);
+
+    void SetupBlocks();
+    void CleanupBlocks();
+
+    // mark as private, no copying allowed
+    BlockBuilder(const BlockBuilder& other);
+
+    // same here
+    BlockBuilder& operator=(const BlockBuilder& old);
+
+public:
+
+    BlockBuilder(int maxcnt, BlockFile& bf);
+
+    // sets how many threads to use for matching points when merging
+    void SetMergeThreads(int n);
+
+    // reads the coord-sorted input, and writes the tree to outfile.i
+    void Build(BlockInput& input, string outfile, int numfiles);
+
+    // builds just the subtree over sub's range of input, at given depth,
+    // to outfile.i, leaving its root block in sub
+    void BuildSubtree(BlockInput& input, string outfile, int numfiles, Subtree& sub, int depth);
+
+    // builds the levels above the subtrees, whose stripe files have
+    // already been copied into writers, and writes the root
+    void BuildTop(BlockInput& input, LargeWriter **outwriters, int numfiles, int depth,
+		  uint64_t *bounds, Subtree **subs, uint64_t *bases);
+
+    // the blocks written so far, for the directory
+    vector<BlockDirEntry>& Directory() { return dirEntries; }
+};
+
+
+// ***************************************************************
+// Function prototypes
+// ***************************************************************
 void deinterleave(uint64_t block, uint16_t pos[3]);
 void mergecur(VertexB *a, VertexB *b);
 
-void SetupBlocks();
-void CleanupBlocks();
-
 #endif
@@ -2,7 +2,9 @@
 #define _FORMATS_H_
 
 #include "xstdint.h"
+#include <string.h>
 #include <string>
+#include <vector>
 #include <sstream>
 
 using namespace std;
@@ -183,6 +185,115 @@ struct VertexB
     }
 };
 
+
+/* Compact forms of VertexA and VertexB, for intermediate files written
+   with CompactRecords set: pids as offsets from the file's smallest pid,
+   positions as 32-bit fixed point within the file's bounds, and floats
+   for the rest. See RecordFrame below and Packing in PartFiles.h. */
+// 40 bytes
+struct PackedVertexA
+{
+    uint32_t pid;
+    uint32_t pos[3];
+    float vel[3];
+    float hsml;
+    float densq;
+    float vdisp;
+};
+
+// 72 bytes
+struct PackedVertexB
+{
+    uint64_t coord;
+    uint32_t pid;
+    uint32_t pos[3];
+    float vel[3];
+    float acc[3];
+    float hsml;
+    float densq;
+    float vdisp;
+    float nhsml;
+    float ndensq;
+    float nvdisp;
+};
+
+#define FRAME_MAGIC "GTPACKED"
+
+/* Starts each subfile of packed records, and holds what's needed to unpack
+   them. Files of full records have no header at all. */
+struct RecordFrame
+{
+    char magic[8];
+    uint64_t pidBase; // smallest and largest pid in the file
+    uint64_t pidMax;
+    double lo[3]; // bounds of positions in the file
+    double hi[3];
+
+    // empty, ready for Add
+    void Begin()
+    {
+	memcpy(magic, FRAME_MAGIC, 8);
+	pidBase = ~(uint64_t)0;
+	pidMax = 0;
+	for (int j=0; j<3; j++)
+	{
+	    lo[j] = 1e300;
+	    hi[j] = -1e300;
+	}
+    }
+
+    void Add(uint64_t pid, const double pos[3])
+    {
+	if (pid < pidBase) pidBase = pid;
+	if (pid > pidMax) pidMax = pid;
+	for (int j=0; j<3; j++)
+	{
+	    if (pos[j] < lo[j]) lo[j] = pos[j];
+	    if (pos[j] > hi[j]) hi[j] = pos[j];
+	}
+    }
+
+    // widens this frame to cover another one too
+    void Add(const RecordFrame& f)
+    {
+	if (f.pidBase < pidBase) pidBase = f.pidBase;
+	if (f.pidMax > pidMax) pidMax = f.pidMax;
+	for (int j=0; j<3; j++)
+	{
+	    if (f.lo[j] < lo[j]) lo[j] = f.lo[j];
+	    if (f.hi[j] > hi[j]) hi[j] = f.hi[j];
+	}
+    }
+
+    bool IsValid() const
+    {
+	return memcmp(magic, FRAME_MAGIC, 8) == 0;
+    }
+
+    // can every pid be stored as a 32-bit offset (positions always fit)?
+    bool Fits() const
+    {
+	return pidMax >= pidBase && pidMax - pidBase <= 0xffffffffULL;
+    }
+
+    // position as fixed point, clamped to the frame (and NaN to lo)
+    uint32_t PackPos(double x, int j) const
+    {
+	double s = (x - lo[j]) / (hi[j] - lo[j]) * 4294967296.0;
+	if (!(s >= 0))
+	    return 0;
+	if (s >= 4294967295.0)
+	    return 0xffffffff;
+	return (uint32_t)s;
+    }
+
+    // and back, to the middle of its step
+    double UnpackPos(uint32_t q, int j) const
+    {
+	return lo[j] + (q + 0.5) * ((hi[j] - lo[j]) / 4294967296.0);
+    }
+};
+
 // compressed output vertex format
 // 32 bytes
 struct __attribute__ ((__packed__)) OutVertex
@@ -204,12 +315,38 @@ struct __attribute__ ((__packed__)) OutVertex
     uint16_t nvdisp;
 };
 
+// coarse output vertex format, for blocks above CoarseDepth, which are
+// only ever drawn a few pixels a point: no accelerations or next-step
+// values (so these points just move with their velocities), and 8 bits
+// for the rest past the positions
+// 16 bytes
+struct __attribute__ ((__packed__)) CoarseVertex
+{
+    uint32_t pid;
+    uint16_t pos[3];
+    uint8_t vel[3];
+    uint8_t hsml;
+    uint8_t densq;
+    uint8_t vdisp;
+};
+
+// vertex codecs, as in OutBlock::codec
+#define VERTEX_FULL 0 // OutVertex
+#define VERTEX_COARSE 1 // CoarseVertex
+
+// bytes per point of a codec
+inline int VertexSize(int codec)
+{
+    return codec == VERTEX_COARSE ? sizeof(CoarseVertex) : sizeof(OutVertex);
+}
+
 
 // output block header format
 struct __attribute__ ((__packed__)) OutBlock
 {
     uint16_t pos[3];
-    uint16_t depth; // size is TreeSize/(1<<depth)
+    uint8_t depth; // size is TreeSize/(1<<depth)
+    uint8_t codec; // layout of the points (VERTEX_FULL or VERTEX_COARSE)
     uint32_t count;
     uint64_t childLocation; // location in file of first child
     uint64_t childLength; // length in file of all children (bytes)
@@ -243,6 +380,52 @@ struct __attribute__ ((__packed__)) BlockFile
 };
 
 
+/* A compressed child group (see Compress.h), flagged in the parent's
+   childFlags: this header, the blocks' headers as they are, and then
+   their points, packed. childLength is the frame's length on disk. */
+#define COMPRESSED_CHILDREN (1<<8)
+#define GROUP_FRAME_MAGIC 0x50524743 // "CGRP"
+
+struct __attribute__ ((__packed__)) GroupFrame
+{
+    uint32_t magic;
+    uint32_t rawLength; // the blocks back to back, once unpacked
+    uint32_t packedLength; // this frame, header included
+    uint16_t numBlocks;
+    uint8_t vertexSize; // bytes per point
+    uint8_t filter; // how points were transformed before packing
+};
+
+
+/* The directory of a set of block files, blocks_N_dir: this header, and
+   then an entry for every block, depth first (each block, then its
+   children in octant order, and so on down). A block's children are the
+   entries right after it, and its next sibling is subtreeSize entries
+   on, so the whole tree can be walked without reading the blocks. */
+#define BLOCK_DIR_MAGIC 0x52494442 // "BDIR"
+#define BLOCK_DIR_VERSION 2
+
+struct __attribute__ ((__packed__)) BlockDirHeader
+{
+    uint32_t magic;
+    int32_t version;
+    uint64_t count; // entries following
+};
+
+struct __attribute__ ((__packed__)) BlockDirEntry
+{
+    uint64_t key; // octree index, 3 bits per level (0 for the root)
+    uint16_t depth;
+    int16_t file; // subfile containing the block
+    uint32_t count; // points in it
+    uint64_t location; // file location of the block (see WriteGroup for packed ones)
+    uint32_t length; // its length (header and points)
+    int16_t childFlags; // which children exist, as in the header
+    uint64_t childLength; // length of all its children, as in the header
+    uint32_t subtreeSize; // entries in its subtree, itself included
+};
+
+
 /* Self-descriptive. Used for sorting points by pid. */
 struct GroupVertex
 {
@@ -282,6 +465,45 @@ struct GroupVertexB
 };
 
 
+/* Index of a snapshot's group catalog, saved as catalog_N next to the
+   subid files: this header, then a CatalogFile for each subhalo_tab
+   subfile, so the subhalo stages know where each file's subhalos start
+   without opening every header again. Each subfile's size and mtime say
+   whether the index still goes with it. */
+#define CATALOG_MAGIC 0x58444943 // "CIDX"
+#define CATALOG_VERSION 2
+
+struct __attribute__ ((__packed__)) CatalogHeader
+{
+    uint32_t magic;
+    int32_t version;
+    int32_t snap;
+    uint32_t numFiles;
+    uint32_t totalGroups;
+    uint32_t totalSubhalos;
+    uint64_t totalIDs;
+};
+
+struct __attribute__ ((__packed__)) CatalogFile
+{
+    uint32_t numGroups;
+    uint32_t numSubhalos;
+    // of its first group and subhalo, in the whole snapshot
+    uint32_t groupOffset;
+    uint32_t subhaloOffset;
+    // of the subfile when it was indexed
+    uint64_t size;
+    int64_t mtime;
+};
+
+// and the two together, in memory
+struct CatalogIndex
+{
+    CatalogHeader head;
+    vector<CatalogFile> files;
+};
+
+
 /* Each snapshot's halo list is just a file with a list of these arrays.
    (and a header with the total number of subhalos) */
 struct __attribute__ ((__packed__)) OutHalo
@@ -0,0 +1,994 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <vector>
+
+#include "Formats.h"
+#include "Gadget.h"
+#include "Loaders.h"
+#include "Threads.h"
+
+/* Writes a synthetic simulation in the formats createblocks reads, so
+   it can be benchmarked and regression tested without a real one. For
+   each snapshot there are snapshot, hsml, subhalo_tab and subhalo_ids
+   files, named the way PathInfo expects and in the byte order the
+   loaders expect (see Gadget.h). There is also one merger tree file for
+   them all, and a param file to run createblocks or pipelinebench on
+   the lot.
+
+   A fraction of the particles sit in halos, with sizes falling off as
+   a power law. Each halo is a group with one main subhalo, a few
+   satellites in the bigger ones, and some unbound fuzz. The rest of the
+   particles are spread evenly. Halos drift through the box from one
+   snapshot to the next, and their particles orbit in them. Everything
+   about a particle comes from a hash of its index, so files can be
+   written in any order, on any number of threads, in memory that only
+   depends on the file size.
+
+   usage: gensnaps <dir> [options]
+     -n count        particles (default 1000000, at most 2^32-1)
+     -s first last   snapshots to write (default 0 1)
+     -i step         snapshot interval (default 1)
+     -f files        snapshot and hsml files per snapshot
+                     (default one per 4M particles)
+     -g files        subhalo_tab and subhalo_ids files per snapshot (default 2)
+     -c fraction     of particles in halos (default 0.5)
+     -h count        halos (default one per 1000 particles in halos)
+     -a slope        of the halo sizes, as in N(>size) ~ size^-slope (default 1)
+     -z redshift     of the first snapshot, the last being at 0 (default 3)
+     -b size         box size (default 100)
+     -r seed         (default 1)
+     -t threads      (default 1)
+     -name name      snapshot name (default synth)  */
+
+int NumThreads = 1;
+
+#define PI 3.14159265358979
+// smallest halo, in particles
+#define MIN_HALO 20
+// particles per snapshot file, unless told otherwise
+#define FILE_PARTS 4000000
+// neighbours that hsml and density are taken over
+#define NUM_NGB 32
+// typical velocity of halos and field particles
+#define BULK_VEL 300.0
+// how fast particles orbit in their halos, in radians per unit of log(a)
+#define ORBIT_FREQ 4.0
+
+
+// ***************************************************************
+// Random numbers
+// ***************************************************************
+
+// splitmix64's finalizer, which scrambles every bit into every other
+static inline uint64_t mix64(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// streams of numbers drawn for each particle or halo
+enum { S_BASE = 0, S_PHASE = 3, S_HSML = 6, S_SAT = 7, S_VEL = 20, S_AMP = 23 };
+
+/* Random numbers that only depend on a seed, an index (of a particle,
+   say) and a stream, so nothing needs to be kept around. */
+struct Hash
+{
+    uint64_t seed;
+
+    // uniform in [0, 1)
+    double Uniform(uint64_t i, int stream) const
+    {
+	return (mix64(mix64(seed + stream) ^ i) >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    // standard normal, by Box-Muller
+    double Gauss(uint64_t i, int stream) const
+    {
+	double u = Uniform(i, 1000 + 2*stream);
+	double v = Uniform(i, 1001 + 2*stream);
+	return sqrt(-2*log(1 - u)) * cos(2*PI*v);
+    }
+};
+
+/* A random permutation of [0, n), from a small Feistel network over the
+   next power of 4 up, walking each cycle back into range. */
+class Permutation
+{
+private:
+    uint64_t count;
+    int half;
+    uint64_t mask;
+    uint64_t key;
+
+    uint64_t encrypt(uint64_t x) const
+    {
+	uint64_t l = x >> half;
+	uint64_t r = x & mask;
+	for (int i=0; i<4; i++)
+	{
+	    uint64_t t = l ^ (mix64(r ^ key ^ ((uint64_t)i << 56)) & mask);
+	    l = r;
+	    r = t;
+	}
+	return (l << half) | r;
+    }
+
+public:
+    Permutation(uint64_t n, uint64_t k)
+    {
+	count = n;
+	half = 1;
+	while (((uint64_t)1 << (2*half)) < n)
+	    half++;
+	mask = ((uint64_t)1 << half) - 1;
+	key = mix64(k);
+    }
+
+    uint64_t operator()(uint64_t i) const
+    {
+	uint64_t x = encrypt(i);
+	while (x >= count)
+	    x = encrypt(x);
+	return x;
+    }
+};
+
+
+// ***************************************************************
+// The simulation
+// ***************************************************************
+
+/* A halo takes a range of particle indices: its main subhalo first,
+   then its satellites, then the fuzz that's in no subhalo. Its particles
+   come in that order in the subhalo_ids files too. */
+struct Halo
+{
+    uint64_t start;
+    uint32_t count;
+    uint32_t mainCount;
+    uint32_t satCount; // each
+    int numSats;
+    int firstSub; // overall index of main subhalo
+    double radius;
+};
+
+// one snapshot's time
+struct Epoch
+{
+    int snap;
+    double a;
+    // log(a) since the first snapshot
+    double loga;
+    // factor from velocity to dx/dloga, as in Interleave
+    double vfac;
+    // displacement per unit of velocity since the first snapshot
+    double drift;
+};
+
+class Synth
+{
+public:
+    uint64_t numParts;
+    uint64_t numClustered;
+    double box;
+    double mass;
+    double omega0;
+    double omegaLambda;
+    Hash hash;
+    Permutation labels;
+
+    vector<Halo> halos;
+    int numSubs;
+
+    // group files, and the first halo and subhalo in each
+    int numGroupFiles;
+    vector<int> fileHalo;
+    vector<int> fileSub;
+
+    Synth(uint64_t n, double frac, int nhalos, double slope, double bx, uint64_t seed, int gfiles)
+	: labels(n, seed)
+    {
+	numParts = n;
+	box = bx;
+	omega0 = 0.25;
+	omegaLambda = 0.75;
+	hash.seed = seed;
+	// in 1e10 Msun/h, with the box in Mpc/h
+	mass = 27.7536627 * omega0 * box*box*box / n;
+
+	// halo sizes go as rank^(-1/slope), down to the smallest we allow
+	uint64_t target = (uint64_t)(frac * n);
+	if (nhalos <= 0)
+	    nhalos = (int)(target / 1000) > 0 ? (int)(target / 1000) : 1;
+	double total = 0;
+	for (int h=0; h<nhalos; h++)
+	    total += pow(h+1.0, -1/slope);
+
+	numClustered = 0;
+	numSubs = 0;
+	for (int h=0; h<nhalos && target > 0; h++)
+	{
+	    uint64_t c = (uint64_t)(target * pow(h+1.0, -1/slope) / total);
+	    if (c < MIN_HALO)
+		break;
+	    Halo halo;
+	    halo.start = numClustered;
+	    halo.count = (uint32_t)c;
+	    halo.numSats = (c >= 2000) ? (int)log2(c / 1000.0) + 1 : 0;
+	    if (halo.numSats > 8)
+		halo.numSats = 8;
+	    halo.satCount = halo.numSats > 0 ? c / 5 / halo.numSats : 0;
+	    halo.mainCount = c - c/10 - halo.numSats*halo.satCount;
+	    halo.firstSub = numSubs;
+	    // where it's 200 times the mean density
+	    halo.radius = box * cbrt(3.0 * c / (4*PI * 200 * n));
+	    halos.push_back(halo);
+	    numClustered += c;
+	    numSubs += 1 + halo.numSats;
+	}
+
+	numGroupFiles = gfiles;
+	int nh = halos.size();
+	for (int f=0; f<=numGroupFiles; f++)
+	{
+	    int h = (int)((uint64_t)nh * f / numGroupFiles);
+	    fileHalo.push_back(h);
+	    fileSub.push_back(h < nh ? halos[h].firstSub : numSubs);
+	}
+    }
+
+    Epoch MakeEpoch(int snap, double a, double a0)
+    {
+	Epoch e;
+	e.snap = snap;
+	e.a = a;
+	e.loga = log(a / a0);
+	e.vfac = vfac(a);
+	// integrate vfac over log(a)
+	e.drift = 0;
+	const int steps = 100;
+	for (int i=0; i<steps; i++)
+	    e.drift += vfac(a0 * exp(e.loga * (i+0.5) / steps)) * e.loga / steps;
+	return e;
+    }
+
+    // the particle id of an index, which are 1...n in a random order
+    uint64_t Label(uint64_t i) const
+    {
+	return 1 + labels(i);
+    }
+
+    // halo of a particle index, or -1 for the field
+    int HaloOf(uint64_t i) const
+    {
+	if (i >= numClustered)
+	    return -1;
+	int lo = 0;
+	int hi = halos.size()-1;
+	while (lo < hi)
+	{
+	    int mid = (lo + hi + 1) / 2;
+	    if (halos[mid].start <= i)
+		lo = mid;
+	    else
+		hi = mid-1;
+	}
+	return lo;
+    }
+
+    // subhalo of a particle within its halo (0 for main), or -1 for fuzz
+    int SubOf(const Halo& h, uint64_t i) const
+    {
+	uint64_t k = i - h.start;
+	if (k < h.mainCount)
+	    return 0;
+	k -= h.mainCount;
+	if (k < (uint64_t)h.numSats*h.satCount)
+	    return 1 + (int)(k / h.satCount);
+	return -1;
+    }
+
+    uint32_t SubCount(const Halo& h, int k) const
+    {
+	return k == 0 ? h.mainCount : h.satCount;
+    }
+
+    // offset of a subhalo's first particle within its halo
+    uint32_t SubOffset(const Halo& h, int k) const
+    {
+	return k == 0 ? 0 : h.mainCount + (k-1)*h.satCount;
+    }
+
+    double SubRadius(const Halo& h, int k) const
+    {
+	return 0.5 * h.radius * cbrt(SubCount(h, k) / (double)h.count);
+    }
+
+    // velocity of a halo (and all of its subhalos)
+    void HaloVel(int h, double vel[3]) const
+    {
+	for (int j=0; j<3; j++)
+	    vel[j] = BULK_VEL * hash.Gauss(h, S_VEL+j);
+    }
+
+    // center of subhalo k of halo h (-1 for the halo itself)
+    void SubPos(int h, int k, const Epoch& e, double pos[3]) const
+    {
+	double vel[3];
+	HaloVel(h, vel);
+	for (int j=0; j<3; j++)
+	{
+	    pos[j] = box * hash.Uniform(h, S_BASE+j) + vel[j] * e.drift;
+	    // satellites sit around the main subhalo
+	    if (k > 0)
+		pos[j] += 0.5 * halos[h].radius * hash.Gauss((uint64_t)h*16 + k, S_SAT+j);
+	}
+	wrap(pos);
+    }
+
+    // velocity dispersion in a subhalo, from its orbits
+    double SubDisp(int h, int k, const Epoch& e) const
+    {
+	double r = (k < 0) ? halos[h].radius : SubRadius(halos[h], k);
+	return r * ORBIT_FREQ / e.vfac / sqrt(2.0);
+    }
+
+    void Particle(uint64_t i, const Epoch& e, double *pos, double *vel,
+		  float& hsml, float& density, float& vdisp) const
+    {
+	int h = HaloOf(i);
+	if (h < 0)
+	{
+	    // drifting along on its own
+	    for (int j=0; j<3; j++)
+	    {
+		vel[j] = BULK_VEL * hash.Gauss(i, S_VEL+j);
+		pos[j] = box * hash.Uniform(i, S_BASE+j) + vel[j] * e.drift;
+	    }
+	    wrap(pos);
+	    double r = cbrt(3.0 * NUM_NGB / (4*PI * numParts)) * box;
+	    setSmoothing(i, r, BULK_VEL, hsml, density, vdisp);
+	    return;
+	}
+
+	const Halo& halo = halos[h];
+	int k = SubOf(halo, i);
+	SubPos(h, k < 0 ? 0 : k, e, pos);
+	HaloVel(h, vel);
+
+	// orbiting the center, along each axis
+	double r = (k < 0) ? halo.radius : SubRadius(halo, k);
+	for (int j=0; j<3; j++)
+	{
+	    double amp = r * hash.Gauss(i, S_AMP+j);
+	    double phase = ORBIT_FREQ * e.loga + 2*PI * hash.Uniform(i, S_PHASE+j);
+	    pos[j] += amp * cos(phase);
+	    vel[j] -= amp * ORBIT_FREQ * sin(phase) / e.vfac;
+	}
+	wrap(pos);
+
+	uint32_t n = (k < 0) ? halo.count : SubCount(halo, k);
+	setSmoothing(i, r * cbrt((double)NUM_NGB / n), SubDisp(h, k, e), hsml, density, vdisp);
+    }
+
+private:
+    static double vfac(double a)
+    {
+	return 1.0 / (HUBBLE * sqrt(0.25 / (a*a*a) + 0.75) * sqrt(a));
+    }
+
+    void wrap(double pos[3]) const
+    {
+	for (int j=0; j<3; j++)
+	{
+	    pos[j] = fmod(pos[j], box);
+	    if (pos[j] < 0)
+		pos[j] += box;
+	}
+    }
+
+    // hsml of about r, and the density and dispersion to go with it
+    void setSmoothing(uint64_t i, double r, double disp, float& hsml, float& density, float& vdisp) const
+    {
+	double hs = r * (0.8 + 0.4 * hash.Uniform(i, S_HSML));
+	hsml = (float)hs;
+	density = (float)(NUM_NGB * mass / (4.0/3*PI * hs*hs*hs));
+	vdisp = (float)disp;
+    }
+};
+
+
+// ***************************************************************
+// Writing files
+// ***************************************************************
+
+// writes count words of the given size, byte swapping them in place
+// first if the files need it
+static void putWords(FILE *file, void *data, int size, uint64_t count)
+{
+    if (size == 4)
+	SwapCopy32(data, data, count);
+    else if (size == 8)
+	SwapCopy64(data, data, count);
+    fwrite(data, size, count, file);
+}
+
+// same, as a fortran-style record with its length before and after
+static bool putRecord(FILE *file, void *data, int size, uint64_t count)
+{
+    uint64_t len = (uint64_t)size * count;
+    if (len > 0xffffffffULL)
+    {
+	fprintf(stderr,"Record of %lu bytes is too big, use more files!\n",(long unsigned int)len);
+	return false;
+    }
+    uint32_t n = (uint32_t)len;
+    SwapCopy32(&n, &n, 1);
+    fwrite(&n, 4, 1, file);
+    putWords(file, data, size, count);
+    fwrite(&n, 4, 1, file);
+    return true;
+}
+
+static inline void put32(FILE *file, uint32_t x)
+{
+    putWords(file, &x, 4, 1);
+}
+
+static inline void put64(FILE *file, uint64_t x)
+{
+    putWords(file, &x, 8, 1);
+}
+
+// swaps every field of a snapshot header
+static void swapHeader(VertexData& h)
+{
+    SwapCopy32(h.numParts, h.numParts, 6);
+    SwapCopy64(h.massParts, h.massParts, 6);
+    SwapCopy64(&h.time, &h.time, 2);
+    SwapCopy32(&h.flag_sfr, &h.flag_sfr, 10);
+    SwapCopy64(&h.boxSize, &h.boxSize, 4);
+    SwapCopy32(&h.flag_age, &h.flag_age, 9);
+}
+
+static FILE* openFile(string name)
+{
+    FILE *file = fopen(name.c_str(), "wb");
+    if (file == NULL)
+	fprintf(stderr,"Error creating %s!\n",name.c_str());
+    return file;
+}
+
+
+/* One file of snapshot particles, and the hsml file that goes with it.
+   Particles come in a different random order in each snapshot. */
+bool WriteSnapFile(Synth& sy, PathInfo& ps, const Epoch& e, int fn, int numFiles)
+{
+    uint64_t first = sy.numParts * fn / numFiles;
+    uint32_t n = (uint32_t)(sy.numParts * (fn+1) / numFiles - first);
+
+    double *pos = new double[(uint64_t)3*n];
+    double *vel = new double[(uint64_t)3*n];
+    partid_t *ids = new partid_t[n];
+    float *hsml = new float[n];
+    float *density = new float[n];
+    float *vdisp = new float[n];
+
+    Permutation order(sy.numParts, sy.hash.seed ^ mix64(e.snap + 1));
+    for (uint32_t k=0; k<n; k++)
+    {
+	uint64_t i = order(first + k);
+	ids[k] = sy.Label(i);
+	sy.Particle(i, e, pos + 3*(uint64_t)k, vel + 3*(uint64_t)k, hsml[k], density[k], vdisp[k]);
+    }
+
+    bool ok = false;
+    FILE *file = openFile(ps.GetSnap(e.snap, fn));
+    if (file != NULL)
+    {
+	VertexData head;
+	memset(&head, 0, sizeof(VertexData));
+	head.numParts[1] = n;
+	head.numTotals[1] = (uint32_t)sy.numParts;
+	head.massParts[1] = sy.mass;
+	head.time = e.a;
+	head.redshift = 1/e.a - 1;
+	head.numSubfiles = numFiles;
+	head.boxSize = sy.box;
+	head.omega0 = sy.omega0;
+	head.omegaLambda = sy.omegaLambda;
+	head.hubbleParam = 0.73;
+	swapHeader(head);
+
+	char block[256];
+	memset(block, 0, 256);
+	memcpy(block, &head, offsetof(VertexData, pos));
+
+	ok = putRecord(file, block, 1, 256)
+	    && putRecord(file, pos, 8, (uint64_t)3*n)
+	    && putRecord(file, vel, 8, (uint64_t)3*n)
+	    && putRecord(file, ids, sizeof(partid_t), n);
+	fclose(file);
+    }
+
+    file = openFile(ps.GetHsml(e.snap, fn));
+    if (file != NULL)
+    {
+	put32(file, n);
+	put32(file, (uint32_t)first);
+	put64(file, sy.numParts);
+	put32(file, numFiles);
+	putWords(file, hsml, 4, n);
+	putWords(file, density, 4, n);
+	putWords(file, vdisp, 4, n);
+	fclose(file);
+    }
+    else
+	ok = false;
+
+    delete[] pos;
+    delete[] vel;
+    delete[] ids;
+    delete[] hsml;
+    delete[] density;
+    delete[] vdisp;
+
+    return ok;
+}
+
+/* One subhalo_tab file, with the groups given to it and their subhalos,
+   and one subhalo_ids file, with its share of the ids (which don't line
+   up with the groups). Only the fields the loaders use mean much. */
+bool WriteGroupFile(Synth& sy, PathInfo& ps, const Epoch& e, int fn)
+{
+    int h0 = sy.fileHalo[fn];
+    int h1 = sy.fileHalo[fn+1];
+    int ng = h1 - h0;
+    int s0 = sy.fileSub[fn];
+    int ns = sy.fileSub[fn+1] - s0;
+    uint64_t i0 = sy.numClustered * fn / sy.numGroupFiles;
+    uint64_t i1 = sy.numClustered * (fn+1) / sy.numGroupFiles;
+
+    FILE *file = openFile(ps.GetSubTab(e.snap, fn));
+    if (file == NULL)
+	return false;
+
+    put32(file, ng);
+    put32(file, sy.halos.size());
+    put32(file, (uint32_t)(i1 - i0));
+    put64(file, sy.numClustered);
+    put32(file, sy.numGroupFiles);
+    put32(file, ns);
+    put32(file, sy.numSubs);
+
+    // group fields, one after the other
+    vector<uint32_t> words(ng > 0 ? ng : 1);
+    vector<float> floats(3*(ng > ns ? ng : ns) + 1);
+
+    for (int g=0; g<ng; g++) words[g] = sy.halos[h0+g].count;
+    putWords(file, &words[0], 4, ng);
+    for (int g=0; g<ng; g++) words[g] = (uint32_t)sy.halos[h0+g].start;
+    putWords(file, &words[0], 4, ng);
+    for (int g=0; g<ng; g++) floats[g] = (float)(sy.halos[h0+g].count * sy.mass);
+    putWords(file, &floats[0], 4, ng);
+    for (int g=0; g<ng; g++)
+    {
+	double pos[3];
+	sy.SubPos(h0+g, 0, e, pos);
+	for (int j=0; j<3; j++)
+	    floats[3*g+j] = (float)pos[j];
+    }
+    putWords(file, &floats[0], 4, 3*ng);
+    // masses and radii within 200 times mean, critical and tophat
+    for (int m=0; m<3; m++)
+    {
+	for (int g=0; g<ng; g++) floats[g] = (float)(sy.halos[h0+g].count * sy.mass);
+	putWords(file, &floats[0], 4, ng);
+	for (int g=0; g<ng; g++) floats[g] = (float)sy.halos[h0+g].radius;
+	putWords(file, &floats[0], 4, ng);
+    }
+    // no contamination
+    for (int g=0; g<ng; g++) words[g] = 0;
+    putWords(file, &words[0], 4, ng);
+    for (int g=0; g<ng; g++) floats[g] = 0;
+    putWords(file, &floats[0], 4, ng);
+    for (int g=0; g<ng; g++) words[g] = 1 + sy.halos[h0+g].numSats;
+    putWords(file, &words[0], 4, ng);
+    for (int g=0; g<ng; g++) words[g] = sy.halos[h0+g].firstSub;
+    putWords(file, &words[0], 4, ng);
+
+    // and subhalo fields, in the order of GroupData
+    vector<int> subHalo(ns > 0 ? ns : 1);
+    vector<int> subIndex(ns > 0 ? ns : 1);
+    for (int h=h0; h<h1; h++)
+    {
+	for (int k=0; k<=sy.halos[h].numSats; k++)
+	{
+	    subHalo[sy.halos[h].firstSub + k - s0] = h;
+	    subIndex[sy.halos[h].firstSub + k - s0] = k;
+	}
+    }
+    words.resize(ns > 0 ? ns : 1);
+
+    for (int s=0; s<ns; s++) words[s] = sy.SubCount(sy.halos[subHalo[s]], subIndex[s]);
+    putWords(file, &words[0], 4, ns);
+    for (int s=0; s<ns; s++)
+    {
+	const Halo& h = sy.halos[subHalo[s]];
+	words[s] = (uint32_t)(h.start + sy.SubOffset(h, subIndex[s]));
+    }
+    putWords(file, &words[0], 4, ns);
+    for (int s=0; s<ns; s++) floats[s] = (float)(sy.SubCount(sy.halos[subHalo[s]], subIndex[s]) * sy.mass);
+    putWords(file, &floats[0], 4, ns);
+    // position, velocity and center of mass
+    for (int s=0; s<ns; s++)
+    {
+	double pos[3];
+	sy.SubPos(subHalo[s], subIndex[s], e, pos);
+	for (int j=0; j<3; j++)
+	    floats[3*s+j] = (float)pos[j];
+    }
+    putWords(file, &floats[0], 4, 3*ns);
+    for (int s=0; s<ns; s++)
+    {
+	double vel[3];
+	sy.HaloVel(subHalo[s], vel);
+	for (int j=0; j<3; j++)
+	    floats[3*s+j] = (float)vel[j];
+    }
+    putWords(file, &floats[0], 4, 3*ns);
+    for (int s=0; s<ns; s++)
+    {
+	double pos[3];
+	sy.SubPos(subHalo[s], subIndex[s], e, pos);
+	for (int j=0; j<3; j++)
+	    floats[3*s+j] = (float)pos[j];
+    }
+    putWords(file, &floats[0], 4, 3*ns);
+    // no spin
+    for (int s=0; s<3*ns; s++) floats[s] = 0;
+    putWords(file, &floats[0], 4, 3*ns);
+    // dispersion, max circular velocity and its radius, half mass radius
+    for (int s=0; s<ns; s++) floats[s] = (float)sy.SubDisp(subHalo[s], subIndex[s], e);
+    putWords(file, &floats[0], 4, ns);
+    for (int s=0; s<ns; s++) floats[s] = (float)(1.5 * sy.SubDisp(subHalo[s], subIndex[s], e));
+    putWords(file, &floats[0], 4, ns);
+    for (int s=0; s<ns; s++) floats[s] = (float)sy.SubRadius(sy.halos[subHalo[s]], subIndex[s]);
+    putWords(file, &floats[0], 4, ns);
+    putWords(file, &floats[0], 4, ns);
+    // most bound particle, and group
+    vector<partid_t> ids(ns > 0 ? ns : 1);
+    for (int s=0; s<ns; s++)
+    {
+	const Halo& h = sy.halos[subHalo[s]];
+	ids[s] = sy.Label(h.start + sy.SubOffset(h, subIndex[s]));
+    }
+    putWords(file, &ids[0], sizeof(partid_t), ns);
+    for (int s=0; s<ns; s++) words[s] = subHalo[s];
+    putWords(file, &words[0], 4, ns);
+
+    fclose(file);
+
+    file = openFile(ps.GetSubId(e.snap, fn));
+    if (file == NULL)
+	return false;
+
+    put32(file, ng);
+    put32(file, sy.halos.size());
+    put32(file, (uint32_t)(i1 - i0));
+    put64(file, sy.numClustered);
+    put32(file, sy.numGroupFiles);
+    put32(file, (uint32_t)i0);
+
+    ids.resize(i1 > i0 ? i1 - i0 : 1);
+    for (uint64_t i=i0; i<i1; i++)
+	ids[i-i0] = sy.Label(i);
+    putWords(file, &ids[0], sizeof(partid_t), i1 - i0);
+
+    fclose(file);
+    return true;
+}
+
+/* The merger tree file: a tree for each halo, holding each of its
+   subhalos in every snapshot, each descending into itself in the next
+   one. Written as it is in memory, unlike the others. */
+bool WriteTreeFile(Synth& sy, string filename, vector<Epoch>& epochs)
+{
+    FILE *file = openFile(filename);
+    if (file == NULL)
+	return false;
+
+    int numSnaps = epochs.size();
+    int32_t numTrees = sy.halos.size();
+    uint64_t total = (uint64_t)sy.numSubs * numSnaps;
+    if (total > 0x7fffffff)
+    {
+	fprintf(stderr,"Too many halos for a tree file!\n");
+	fclose(file);
+	return false;
+    }
+    int32_t totalHalos = (int32_t)total;
+    fwrite(&numTrees, 4, 1, file);
+    fwrite(&totalHalos, 4, 1, file);
+    for (int h=0; h<numTrees; h++)
+    {
+	int32_t n = (1 + sy.halos[h].numSats) * numSnaps;
+	fwrite(&n, 4, 1, file);
+    }
+
+    vector<TreeHalo> tree;
+    for (int h=0; h<numTrees; h++)
+    {
+	const Halo& halo = sy.halos[h];
+	int nsub = 1 + halo.numSats;
+	tree.resize(nsub * numSnaps);
+
+	// the last snapshot's halos first, as the roots
+	for (int k=0; k<nsub; k++)
+	{
+	    for (int q=0; q<numSnaps; q++)
+	    {
+		const Epoch& e = epochs[q];
+		int idx = k*numSnaps + (numSnaps-1-q);
+		TreeHalo& t = tree[idx];
+		memset(&t, 0, sizeof(TreeHalo));
+
+		t.Descendant = (q+1 < numSnaps) ? idx-1 : -1;
+		t.FirstProgenitor = (q > 0) ? idx+1 : -1;
+		t.NextProgenitor = -1;
+		t.FirstHaloInFOFgroup = numSnaps-1-q;
+		t.NextHaloInFOFgroup = (k+1 < nsub) ? idx + numSnaps : -1;
+		t.Length = sy.SubCount(halo, k);
+		t.M_Mean200 = t.M_Crit200 = t.M_TopHat = (float)(halo.count * sy.mass);
+
+		double pos[3], vel[3];
+		sy.SubPos(h, k, e, pos);
+		sy.HaloVel(h, vel);
+		for (int j=0; j<3; j++)
+		{
+		    t.Pos[j] = (float)pos[j];
+		    t.Vel[j] = (float)vel[j];
+		}
+		t.VelDisp = (float)sy.SubDisp(h, k, e);
+		t.Vmax = 1.5f * t.VelDisp;
+		t.MostBoundID = sy.Label(halo.start + sy.SubOffset(halo, k));
+		t.SnapNum = e.snap;
+
+		// which group file it's in, and where
+		int f = 0;
+		while (sy.fileHalo[f+1] <= h)
+		    f++;
+		t.FileNum = f;
+		t.SubhaloIndex = halo.firstSub + k - sy.fileSub[f];
+		t.SubHalfMass = (float)sy.SubRadius(halo, k);
+	    }
+	}
+	fwrite(&tree[0], sizeof(TreeHalo), tree.size(), file);
+    }
+
+    fclose(file);
+    return true;
+}
+
+
+// ***************************************************************
+// Main
+// ***************************************************************
+
+// one file to write: kind 0 is snapshot and hsml, 1 is groups, 2 the tree
+struct Task
+{
+    int kind;
+    int epoch;
+    int file;
+};
+
+/* Takes tasks off the shared list until there are none left. */
+struct GenJob
+{
+    Synth *sy;
+    PathInfo *ps;
+    vector<Epoch> *epochs;
+    vector<Task> *tasks;
+    int *next;
+    int numFiles;
+    string treeFile;
+    bool ok;
+
+    void Run()
+    {
+	ok = true;
+	int t;
+	while ((t = __sync_fetch_and_add(next, 1)) < (int)tasks->size())
+	{
+	    Task& task = (*tasks)[t];
+	    const Epoch& e = (*epochs)[task.epoch];
+	    bool done;
+	    if (task.kind == 0)
+		done = WriteSnapFile(*sy, *ps, e, task.file, numFiles);
+	    else if (task.kind == 1)
+		done = WriteGroupFile(*sy, *ps, e, task.file);
+	    else
+		done = WriteTreeFile(*sy, treeFile, *epochs);
+	    ok = ok && done;
+
+	    if (task.kind == 2)
+		printf("Wrote merger tree.\n");
+	    else
+		printf("Wrote %s file %d of snap %d.\n", task.kind == 0 ? "snapshot" : "group", task.file, e.snap);
+	    fflush(stdout);
+	}
+    }
+};
+
+int main(int argc, char * argv[])
+{
+    if (argc < 2)
+    {
+	printf("\nusage: gensnaps <dir> [-n count] [-s first last] [-i step] [-f files] [-g files]\n"
+	       "         [-c fraction] [-h halos] [-a slope] [-z redshift] [-b box] [-r seed]\n"
+	       "         [-t threads] [-name name]\n\n");
+	exit(1);
+    }
+
+    string dir = argv[1];
+    double count = 1000000;
+    int first = 0;
+    int last = 1;
+    int step = 1;
+    int numFiles = 0;
+    int numGroupFiles = 2;
+    double frac = 0.5;
+    int numHalos = 0;
+    double slope = 1;
+    double zstart = 3;
+    double box = 100;
+    uint64_t seed = 1;
+    string name = "synth";
+
+    for (int i=2; i<argc; i++)
+    {
+	bool more = i+1 < argc;
+	if (strcmp(argv[i], "-n") == 0 && more)
+	    count = atof(argv[++i]);
+	else if (strcmp(argv[i], "-s") == 0 && i+2 < argc)
+	{
+	    first = atoi(argv[++i]);
+	    last = atoi(argv[++i]);
+	}
+	else if (strcmp(argv[i], "-i") == 0 && more)
+	    step = atoi(argv[++i]);
+	else if (strcmp(argv[i], "-f") == 0 && more)
+	    numFiles = atoi(argv[++i]);
+	else if (strcmp(argv[i], "-g") == 0 && more)
+	    numGroupFiles = atoi(argv[++i]);
+	else if (strcmp(argv[i], "-c") == 0 && more)
+	    frac = atof(argv[++i]);
+	else if (strcmp(argv[i], "-h") == 0 && more)
+	    numHalos = atoi(argv[++i]);
+	else if (strcmp(argv[i], "-a") == 0 && more)
+	    slope = atof(argv[++i]);
+	else if (strcmp(argv[i], "-z") == 0 && more)
+	    zstart = atof(argv[++i]);
+	else if (strcmp(argv[i], "-b") == 0 && more)
+	    box = atof(argv[++i]);
+	else if (strcmp(argv[i], "-r") == 0 && more)
+	    seed = strtoull(argv[++i], NULL, 10);
+	else if (strcmp(argv[i], "-t") == 0 && more)
+	    NumThreads = atoi(argv[++i]);
+	else if (strcmp(argv[i], "-name") == 0 && more)
+	    name = argv[++i];
+	else
+	{
+	    fprintf(stderr,"Unknown option %s!\n",argv[i]);
+	    exit(1);
+	}
+    }
+
+    uint64_t n = (uint64_t)count;
+    if (n == 0 || n > 0xffffffffULL || step < 1 || last < first || numGroupFiles < 1
+	|| frac < 0 || frac > 1 || slope <= 0 || box <= 0)
+    {
+	fprintf(stderr,"Bad options!\n");
+	exit(1);
+    }
+    if (numFiles <= 0)
+	numFiles = (int)((n + FILE_PARTS - 1) / FILE_PARTS);
+    if (NumThreads < 1)
+	NumThreads = 1;
+
+    Synth sy(n, frac, numHalos, slope, box, seed, numGroupFiles);
+    if (sy.halos.empty())
+    {
+	fprintf(stderr,"No halos of at least %d particles, cluster more!\n",MIN_HALO);
+	exit(1);
+    }
+    printf("Writing %lu particles, %lu of them in %d halos with %d subhalos.\n",
+	   (long unsigned int)n, (long unsigned int)sy.numClustered, (int)sy.halos.size(), sy.numSubs);
+
+    PathInfo ps(dir + "/", name);
+
+    // evenly spaced in log(a), up to a=1
+    vector<Epoch> epochs;
+    int numSnaps = (last - first) / step + 1;
+    double a0 = 1 / (1 + zstart);
+    for (int q=0; q<numSnaps; q++)
+    {
+	double u = (numSnaps > 1) ? q / (numSnaps - 1.0) : 1;
+	epochs.push_back(sy.MakeEpoch(first + q*step, a0 * pow(1/a0, u), a0));
+    }
+
+    mkdir(dir.c_str(), 0755);
+    mkdir((dir + "/treedata").c_str(), 0755);
+    vector<Task> tasks;
+    for (int q=0; q<numSnaps; q++)
+    {
+	string id = ps.FormatId(epochs[q].snap);
+	mkdir((dir + "/snapdir_" + id).c_str(), 0755);
+	mkdir((dir + "/hsmldir_" + id).c_str(), 0755);
+	mkdir((dir + "/groups_" + id).c_str(), 0755);
+
+	Task t;
+	t.epoch = q;
+	t.kind = 0;
+	for (t.file = 0; t.file < numFiles; t.file++)
+	    tasks.push_back(t);
+	t.kind = 1;
+	for (t.file = 0; t.file < numGroupFiles; t.file++)
+	    tasks.push_back(t);
+    }
+    Task t;
+    t.kind = 2;
+    t.epoch = 0;
+    t.file = 0;
+    tasks.push_back(t);
+
+    int next = 0;
+    GenJob *jobs = new GenJob[NumThreads];
+    for (int i=0; i<NumThreads; i++)
+    {
+	jobs[i].sy = &sy;
+	jobs[i].ps = &ps;
+	jobs[i].epochs = &epochs;
+	jobs[i].tasks = &tasks;
+	jobs[i].next = &next;
+	jobs[i].numFiles = numFiles;
+	jobs[i].treeFile = ps.GetTree(last, step);
+    }
+    RunThreads(jobs, NumThreads);
+
+    bool ok = true;
+    for (int i=0; i<NumThreads; i++)
+	ok = ok && jobs[i].ok;
+    delete[] jobs;
+
+    // and something to run on it
+    mkdir((dir + "/out1").c_str(), 0755);
+    mkdir((dir + "/out2").c_str(), 0755);
+    FILE *file = fopen((dir + "/params").c_str(), "w");
+    if (file != NULL)
+    {
+	fprintf(file, "FirstSnap=%d\nLastSnap=%d\nSnapInterval=%d\n", first, first + (numSnaps-1)*step, step);
+	fprintf(file, "MaxCount=4000\nNumStripes=2\nNumThreads=%d\n", NumThreads);
+	fprintf(file, "Out1=%s/out1\nOut2=%s/out2\n", dir.c_str(), dir.c_str());
+	fprintf(file, "SrcPath=%s/\nSrcName=%s\n", dir.c_str(), name.c_str());
+	fclose(file);
+    }
+    else
+	ok = false;
+
+    if (!ok)
+    {
+	fprintf(stderr,"Some files could not be written!\n");
+	return 1;
+    }
+    printf("Done, see %s/params.\n", dir.c_str());
+    return 0;
+}
@@ -1,12 +1,16 @@
 #include <cmath>
+#include <map>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "PartFiles.h"
 #include "Formats.h"
 #include "Loaders.h"
 #include "Process.h"
+#include "Threads.h"
 
 
-int* LoadFileOffsets(PathInfo& ps, int snap);
+int* LoadFileOffsets(PathInfo& ps, int snap, string dir);
 
 /* This function loads in group catalogue files and particle subid files
    and outputs all of the points sorted by pid (pre-mergesort). */
@@ -72,6 +76,7 @@ void PrepareSubIds(PathInfo& ps, int snap, string filename)
 
     BufferedWriter<GroupVertex> writer(filename);
     writer.SetSort(true);
+    writer.SetBuffers(WriteBuffers);
 
     GroupVertex tmp;
 
@@ -147,6 +152,7 @@ void BuildSubOrder(PathInfo& ps, int snap, string filename)
 {
     BufferedWriter<uint64_t> writer(filename);
     writer.SetSort(true);
+    writer.SetBuffers(WriteBuffers);
 
     printf("Loading ids from snapshot %d...\n",snap);
 
@@ -202,9 +208,10 @@ void SequenceSubIds(PathPair paths, string suborder, string filename)
     BufferedReader<uint64_t> pidreader(suborder);
 
     writer.SetSort(true);
-    reader.SetDelete(true);
+    writer.SetBuffers(WriteBuffers);
+    reader.SetPrefetch(ReadAhead);
+    pidreader.SetPrefetch(ReadAhead);
 
-    GroupVertex gin;
     GroupVertexB gout;
 
     // index of point
@@ -212,7 +219,7 @@ void SequenceSubIds(PathPair paths, string suborder, string filename)
 
     while (reader.CanRead())
     {
-	gin = reader.Read();
+	const GroupVertex& gin = reader.Read();
 	// set these two
 	gout.subid = gin.subid;
 	gout.fofid = gin.fofid;
@@ -242,148 +249,290 @@ void SequenceSubIds(PathPair paths, string suborder, string filename)
 }
 
 
-/* Now this is the main function, it outputs the halo file using merger tree and everything. */
-void BuildHaloTable(PathInfo& ps, string treefile, PathPair paths, int snap, int step, string filename)
+/* Where the merger tree's halos go, for one snapshot's table. */
+struct TreeTable
 {
-    // load file offsets for next, current, and previous snaps
-    int *curFileOffset = LoadFileOffsets(ps, snap);
-    int *prevFileOffset = LoadFileOffsets(ps, snap-step);
-    int *nextFileOffset = LoadFileOffsets(ps, snap+step);
+    int snap;
+    int numSubhalos;
+    // subhalo index offsets of the group files of this and the next and
+    // previous snapshots (NULL if there's no such snapshot)
+    int *curFileOffset;
+    int *prevFileOffset;
+    int *nextFileOffset;
+    double vfac;
+    double dloga;
+    OutHalo *halos;
+    string filename;
+};
+
+/* Returns the bytes of a snapshot's halo table (indexing its catalog in
+   dir, if that hasn't been done yet). */
+uint64_t HaloTableSize(PathInfo& ps, int snap, string dir)
+{
+    CatalogIndex index;
+    if (!LoadCatalogIndex(ps, snap, dir, index))
+	return 0;
+    return (uint64_t)sizeof(OutHalo)*index.head.totalSubhalos;
+}
 
-    // load only the header for info
-    GroupData gdata = LoadGroupHeader(ps, snap, 0, false);
+// fills in halo's entry in its snapshot's table, if it has one in tables
+// (by snapshot number), where its links are indices into tree
+static void placeHalo(TreeHalo *tree, TreeHalo *halo, int step, vector<TreeTable*>& tables)
+{
+    if (halo->SnapNum < 0 || halo->SnapNum >= (int)tables.size() || tables[halo->SnapNum] == NULL)
+	return;
+    TreeTable& t = *tables[halo->SnapNum];
+    int snap = t.snap;
+
+    int outIndex = t.curFileOffset[halo->FileNum] + halo->SubhaloIndex;
+    OutHalo& out = t.halos[outIndex];
+    // set current snapshot properties
+    for (int j=0; j<3; j++)
+    {
+	out.pos[j] = halo->Pos[j];
+	out.vel[j] = halo->Vel[j]*t.vfac;
+	out.acc[j] = 0;
+    }
+    out.radius = halo->SubHalfMass;
 
-    int numGroupFiles = gdata.numFiles;
-    int numSubhalos = gdata.totalSubhalos;
+    out.mainDescendant = -1;
+    out.mainProgenitor = -1;
 
+    // check next properties
+    if (halo->Descendant != -1 && t.nextFileOffset != NULL)
+    {
+	TreeHalo* nhalo = tree + halo->Descendant;
+	if (nhalo->SnapNum == snap+step)
+	{
+	    // first, set our actual file index
+	    out.mainDescendant = nhalo->SubhaloIndex + t.nextFileOffset[nhalo->FileNum];
+	    // then, our position interpolation info
+	    for (int j=0; j<3; j++)
+	    {
+		out.acc[j] = (nhalo->Pos[j]-halo->Pos[j])/(t.dloga*t.dloga)
+		    - halo->Vel[j]*t.vfac/t.dloga;
+		out.acc[j] *= 2;
+	    }
+	}
+    }
 
-    // alright, so far so good. now we need to make our array of output subs
-    OutHalo* outHalos = new OutHalo[numSubhalos];
+    // or prev properties
+    if (halo->FirstProgenitor != -1 && t.prevFileOffset != NULL)
+    {
+	TreeHalo* phalo = tree + halo->FirstProgenitor;
+	if (phalo->SnapNum == snap-step)
+	{
+	    // just set file index
+	    out.mainProgenitor = phalo->SubhaloIndex + t.prevFileOffset[phalo->FileNum];
+	}
+    }
+}
 
-    // set the default values for stuff, just in case
-    for (int i=0; i<numSubhalos; i++)
+/* Builds the merger tree part of the halo tables of snaps (positions,
+   velocities, accelerations, radii, and main progenitors and descendants)
+   and saves each to its file in filenames, as a count and then the
+   OutHalo array, with no points yet. The tree is streamed a tree at a
+   time, and every table filled in the same pass, unless they don't all
+   fit in memLimit bytes (0 for no limit), in which case it takes a pass
+   for each batch of snapshots that does. The catalog indices are in dir. */
+void BuildHaloTrees(PathInfo& ps, string treefile, string dir, const vector<int>& snaps, int step,
+		    const vector<string>& filenames, uint64_t memLimit)
+{
+    FILE *file = fopen(treefile.c_str(),"rb");
+    if (file == NULL)
     {
-	outHalos[i].pointIndex = -1;
-	outHalos[i].pointCount = -1;
+	fprintf(stderr,"Merger tree file %s not found!\n",treefile.c_str());
+	return;
     }
 
-    // and we want to populate the subid pointers, all the while writing the output points
-    BufferedReader<GroupVertexB> pidreader(paths.location + filename);
-    pidreader.SetDelete(true);
+    // the header, and the length of each tree
+    int32_t head[2];
+    fread(head, 4, 2, file);
+    int numTrees = head[0];
+    int totalHalos = head[1];
+    int32_t *numHalos = new int32_t[numTrees];
+    fread(numHalos, 4, numTrees, file);
+    off_t firstHalo = ftello(file);
+    int maxHalos = 0;
+    for (int t=0; t<numTrees; t++)
+	maxHalos = MAX(maxHalos, numHalos[t]);
+    printf("Merger tree contains %d trees, %d subs.\n",numTrees,totalHalos);
+
+    // every snapshot's offsets get loaded once, for all that need them
+    map<int, int*> offsets;
+    vector<TreeTable> tables(snaps.size());
+    int maxSnap = 0;
+    for (unsigned int i=0; i<snaps.size(); i++)
+    {
+	TreeTable& t = tables[i];
+	t.snap = snaps[i];
+	t.filename = filenames[i];
+	t.numSubhalos = (int)(HaloTableSize(ps, t.snap, dir) / sizeof(OutHalo));
+	t.halos = NULL;
+	int near[3] = { t.snap, t.snap-step, t.snap+step };
+	for (int k=0; k<3; k++)
+	    if (offsets.count(near[k]) == 0)
+		offsets[near[k]] = LoadFileOffsets(ps, near[k], dir);
+	t.curFileOffset = offsets[t.snap];
+	t.prevFileOffset = offsets[t.snap-step];
+	t.nextFileOffset = offsets[t.snap+step];
+
+	// get velocity scaling factor for snapshot
+	// to convert to dx/dloga
+	VertexData vdata1 = LoadSnapHeader(ps, t.snap, 0);
+	VertexData vdata2 = LoadSnapHeader(ps, t.snap+step, 0);
+
+	t.vfac = 1.0 / (HUBBLE * sqrt(vdata1.omega0 / pow(vdata1.time,3)
+				      + vdata1.omegaLambda) * sqrt(vdata1.time));
+	t.dloga = 1;
+	// does next snap exist?
+	if(vdata2.numSubfiles > 0)
+	    t.dloga = log(vdata2.time) - log(vdata1.time);
+	printf("Snap %d using dloga of %g.\n",t.snap,t.dloga);
+	maxSnap = MAX(maxSnap, t.snap);
+    }
 
-    FILE *pidfile = fopen((paths.temp + filename).c_str(),"wb");
+    TreeHalo *tree = new TreeHalo[MAX(maxHalos,1)];
+    countAlloc((int64_t)sizeof(TreeHalo)*maxHalos);
 
-    GroupVertexB tmp;
+    unsigned int next = 0;
+    int passes = 0;
+    while (next < tables.size())
+    {
+	// as many tables as fit (at least one)
+	vector<TreeTable*> bySnap(maxSnap+1, (TreeTable*)NULL);
+	uint64_t used = 0;
+	unsigned int first = next;
+	while (next < tables.size())
+	{
+	    uint64_t bytes = (uint64_t)sizeof(OutHalo)*tables[next].numSubhalos;
+	    if (next > first && memLimit > 0 && used + bytes > memLimit)
+		break;
+	    TreeTable& t = tables[next++];
+	    t.halos = new OutHalo[t.numSubhalos];
+	    countAlloc((int64_t)bytes);
+	    used += bytes;
+
+	    // set the default values for stuff, just in case
+	    memset(t.halos, 0, bytes);
+	    for (int i=0; i<t.numSubhalos; i++)
+	    {
+		t.halos[i].mainProgenitor = -1;
+		t.halos[i].mainDescendant = -1;
+		t.halos[i].pointIndex = -1;
+		t.halos[i].pointCount = -1;
+	    }
+	    bySnap[t.snap] = &t;
+	}
 
-    uint32_t curIndex = 0;
+	// then one pass over the halos of every tree
+	fseeko(file, firstHalo, SEEK_SET);
+	for (int t=0; t<numTrees; t++)
+	{
+	    if (fread(tree, sizeof(TreeHalo), numHalos[t], file) != (size_t)numHalos[t])
+	    {
+		fprintf(stderr,"Error! %s ends early\n",treefile.c_str());
+		break;
+	    }
+	    countRead((uint64_t)sizeof(TreeHalo)*numHalos[t], numHalos[t]);
 
-    while (pidreader.CanRead())
-    {
-	tmp = pidreader.Read();
-	pidreader.Next();
-	
-	// not part of a subhalo, ignore for now
-	if (tmp.subid == -1)
-	    continue;
+	    for (int i=0; i<numHalos[t]; i++)
+		placeHalo(tree, tree + i, step, bySnap);
+	}
+	passes++;
 
-	// write pid as an int32
-	uint32_t pid = (uint32_t)tmp.pid;
-	fwrite(&pid, 4, 1, pidfile);
+	// and out they go
+	for (unsigned int i=first; i<next; i++)
+	{
+	    TreeTable& t = tables[i];
+	    FILE *out = fopen(t.filename.c_str(),"wb");
+	    fwrite(&t.numSubhalos, 4, 1, out);
+	    fwrite(t.halos, sizeof(OutHalo), t.numSubhalos, out);
+	    fclose(out);
+	    countWrite(4 + (uint64_t)sizeof(OutHalo)*t.numSubhalos, t.numSubhalos);
+
+	    delete[] t.halos;
+	    countFree((int64_t)sizeof(OutHalo)*t.numSubhalos);
+	    t.halos = NULL;
+	}
+    }
+    printf("Halo tables of %d snaps built in %d pass%s over the merger tree.\n",
+	   (int)tables.size(), passes, passes == 1 ? "" : "es");
 
-	// now set substart?
-	if (outHalos[tmp.subid].pointIndex == -1)
-	    outHalos[tmp.subid].pointIndex = curIndex;
+    fclose(file);
+    delete[] tree;
+    countFree((int64_t)sizeof(TreeHalo)*maxHalos);
+    delete[] numHalos;
+    for (map<int, int*>::iterator it = offsets.begin(); it != offsets.end(); ++it)
+	if (it->second != NULL)
+	    delete[] it->second;
+}
 
-	// and always set count
-	outHalos[tmp.subid].pointCount = curIndex - outHalos[tmp.subid].pointIndex + 1;
-	// and fofgroup
-	outHalos[tmp.subid].fofGroup = tmp.fofid;
 
-	curIndex++;
+/* Now this is the main function, it outputs the halo file, from the
+   table BuildHaloTrees left in treetable and the sorted subids. */
+void BuildHaloTable(PathPair paths, int snap, string filename, string treetable)
+{
+    // the merger tree part is already done
+    FILE *tablefile = fopen(treetable.c_str(),"rb");
+    if (tablefile == NULL)
+    {
+	fprintf(stderr,"Halo table %s not found!\n",treetable.c_str());
+	return;
     }
+    int numSubhalos = 0;
+    fread(&numSubhalos, 4, 1, tablefile);
 
-    fclose(pidfile);
-    printf("%d subids written to file.\n", curIndex);
-
-    // get velocity scaling factor for snapshot
-    // to convert to dx/dloga
-    VertexData vdata1 = LoadSnapHeader(ps, snap, 0);
-    VertexData vdata2 = LoadSnapHeader(ps, snap+step, 0);
+    OutHalo* outHalos = new OutHalo[numSubhalos];
+    countAlloc((int64_t)sizeof(OutHalo)*numSubhalos);
+    fread(outHalos, sizeof(OutHalo), numSubhalos, tablefile);
+    fclose(tablefile);
+    countRead(4 + (uint64_t)sizeof(OutHalo)*numSubhalos, numSubhalos);
 
-    double vfac = 1.0 / (HUBBLE * sqrt(vdata1.omega0 / pow(vdata1.time,3)
-				+ vdata1.omegaLambda) * sqrt(vdata1.time));
+    // and we want to populate the subid pointers, all the while writing the output points
+    BufferedReader<GroupVertexB> pidreader(paths.location + filename);
+    pidreader.SetPrefetch(ReadAhead);
 
-    
-    double dloga = 1;
-    // does next snap exist?
-    if(vdata2.numSubfiles > 0)
-	dloga = log(vdata2.time) - log(vdata1.time);
-    printf("using dloga of %g.\n",dloga);
+    FILE *pidfile = fopen((paths.temp + filename).c_str(),"wb");
 
-    // alright, now that part is set correctly, we can move on to loading
-    // *** the merger tree ***
-    TreeData tdata = LoadTree(treefile);
-    printf("Merger tree contains %d trees, %d subs.\n",tdata.numTrees,tdata.totalHalos);
+    uint32_t curIndex = 0;
 
-    // i can just loop through every halo in each tree
-    for (int t=0; t<tdata.numTrees;t++)
+    // go through a whole read buffer at a time
+    while (pidreader.CanRead())
     {
-	// loop through the halos in each tree
-	for (int i=0; i<tdata.numHalos[t]; i++)
+	int n;
+	const GroupVertexB *span = pidreader.GetSpan(n);
+
+	for (int i=0; i<n; i++)
 	{
-	    TreeHalo* halo = tdata.roothalo[t] + i;
+	    const GroupVertexB& tmp = span[i];
 
-	    // check if it's the correct snapshot
-	    if (halo->SnapNum != snap)
+	    // not part of a subhalo, ignore for now
+	    if (tmp.subid == -1)
 		continue;
 
-	    int outIndex = curFileOffset[halo->FileNum] + halo->SubhaloIndex;
-	    // set current snapshot properties
-	    for (int j=0; j<3; j++)
-	    {
-		outHalos[outIndex].pos[j] = halo->Pos[j];
-		outHalos[outIndex].vel[j] = halo->Vel[j]*vfac;
-		outHalos[outIndex].acc[j] = 0;
-	    }
-	    outHalos[outIndex].radius = halo->SubHalfMass;
+	    // write pid as an int32
+	    uint32_t pid = (uint32_t)tmp.pid;
+	    fwrite(&pid, 4, 1, pidfile);
 
-	    outHalos[outIndex].mainDescendant = -1;
-	    outHalos[outIndex].mainProgenitor = -1;
+	    // now set substart?
+	    if (outHalos[tmp.subid].pointIndex == -1)
+		outHalos[tmp.subid].pointIndex = curIndex;
 
-	    // check next properties
-	    if (halo->Descendant != -1)
-	    {
-		TreeHalo* nhalo = tdata.roothalo[t] + halo->Descendant;
-		if (nhalo->SnapNum == snap+step)
-		{
-		    // first, set our actual file index
-		    outHalos[outIndex].mainDescendant = nhalo->SubhaloIndex
-			+ nextFileOffset[nhalo->FileNum];
-		    // then, our position interpolation info
-		    for (int j=0; j<3; j++)
-		    {
-			outHalos[outIndex].acc[j] = (nhalo->Pos[j]-halo->Pos[j])/(dloga*dloga)
-			    - halo->Vel[j]*vfac/dloga;
-			outHalos[outIndex].acc[j] *= 2;
-		    }
-		}
-	    }
+	    // and always set count
+	    outHalos[tmp.subid].pointCount = curIndex - outHalos[tmp.subid].pointIndex + 1;
+	    // and fofgroup
+	    outHalos[tmp.subid].fofGroup = tmp.fofid;
 
-	    // or prev properties
-	    if (halo->FirstProgenitor != -1)
-	    {
-		TreeHalo* phalo = tdata.roothalo[t] + halo->FirstProgenitor;
-		if (phalo->SnapNum == snap-step)
-		{
-		    // just set file index
-		    outHalos[outIndex].mainProgenitor = phalo->SubhaloIndex
-			+ prevFileOffset[phalo->FileNum];
-		}
-	    }
+	    curIndex++;
 	}
+
+	pidreader.Advance(n);
     }
 
-    printf("Done.\n");
+    fclose(pidfile);
+    countWrite((uint64_t)4*curIndex, curIndex);
+    printf("%d subids written to file.\n", curIndex);
 
     // now, save the actual halo data
     FILE *halofile = fopen((paths.temp + "/halos_" + toString<int>(snap)).c_str(),"wb");
@@ -391,42 +540,159 @@ void BuildHaloTable(PathInfo& ps, string treefile, PathPair paths, int snap, int
     fwrite(&numSubhalos, 4, 1, halofile);
     fwrite(outHalos, sizeof(OutHalo), numSubhalos, halofile);
     fclose(halofile);
+    countWrite(4 + (uint64_t)sizeof(OutHalo)*numSubhalos, numSubhalos);
 
-    FreeTree(tdata);
     delete[] outHalos;
-
-    delete[] curFileOffset;
-    if (nextFileOffset != NULL)
-	delete[] nextFileOffset;
-    if (prevFileOffset != NULL)
-	delete[] prevFileOffset;
+    countFree((int64_t)sizeof(OutHalo)*numSubhalos);
 }
 
 
-/* This helper just loads an array of offsets into a file for a given snap. */
-int* LoadFileOffsets(PathInfo& ps, int snap)
+/* Reads the headers of a share of a catalog's subfiles, taking the next
+   one still to do until there are none. */
+struct CatalogJob
 {
-    // load only the header for info
-    GroupData gdata = LoadGroupHeader(ps, snap, 0, false);
+    PathInfo *ps;
+    int snap;
+    CatalogIndex *index;
+    int *next;
+    bool ok;
 
-    // didn't find file
-    if (gdata.numFiles == -1)
-	return NULL;
+    void Run()
+    {
+	ok = true;
+	int f;
+	while ((f = __sync_fetch_and_add(next, 1)) < (int)index->files.size())
+	{
+	    // before the header, so a file changed in between looks stale
+	    struct stat st;
+	    if (stat(ps->GetSubTab(snap,f).c_str(), &st) == 0)
+	    {
+		index->files[f].size = st.st_size;
+		index->files[f].mtime = st.st_mtime;
+	    }
+	    GroupData gdata = LoadGroupHeader(*ps, snap, f, false);
+	    if (gdata.numFiles == (uint32_t)-1)
+	    {
+		ok = false;
+		continue;
+	    }
+	    index->files[f].numGroups = gdata.numGroups;
+	    index->files[f].numSubhalos = gdata.numSubhalos;
+	}
+    }
+};
 
-    int numGroupFiles = gdata.numFiles;
-    int numSubhalos = gdata.totalSubhalos;
+// the cached index, if it's there and every subfile is as it was indexed
+static bool readCatalogIndex(PathInfo& ps, int snap, string filename, CatalogIndex& index)
+{
+    FILE *file = fopen(filename.c_str(),"rb");
+    if (file == NULL)
+	return false;
+    bool ok = fread(&index.head, sizeof(CatalogHeader), 1, file) == 1
+	&& index.head.magic == CATALOG_MAGIC && index.head.version == CATALOG_VERSION
+	&& index.head.snap == snap && index.head.numFiles > 0;
+    if (ok)
+    {
+	index.files.resize(index.head.numFiles);
+	ok = fread(&index.files[0], sizeof(CatalogFile), index.head.numFiles, file) == index.head.numFiles;
+    }
+    fclose(file);
 
-    // this is the offset in subhalo index for the ith file,
-    // to convert from (file, index) to just an overall index
-    int *fileOffset = new int[numGroupFiles];
-    fileOffset[0] = 0;
-    fileOffset[1] = gdata.numSubhalos;
+    struct stat st;
+    for (unsigned int f=0; ok && f<index.files.size(); f++)
+	ok = stat(ps.GetSubTab(snap,f).c_str(), &st) == 0
+	    && (uint64_t)st.st_size == index.files[f].size
+	    && (int64_t)st.st_mtime == index.files[f].mtime;
+    return ok;
+}
 
-    for (int i=1; i<numGroupFiles-1; i++)
+/* Loads the index of a snapshot's group catalog from dir, or, if it isn't
+   there yet (or the catalog has changed since), reads every subfile
+   header, NumThreads at a time, and saves it there for the next stage to
+   use. Returns false if the catalog can't be read. */
+bool LoadCatalogIndex(PathInfo& ps, int snap, string dir, CatalogIndex& index)
+{
+    string filename = dir + "/catalog_" + toString<int>(snap);
+    if (readCatalogIndex(ps, snap, filename, index))
+	return true;
+
+    GroupData gdata = LoadGroupHeader(ps, snap, 0, false);
+    // didn't find file
+    if (gdata.numFiles == (uint32_t)-1)
+	return false;
+
+    index.head.magic = CATALOG_MAGIC;
+    index.head.version = CATALOG_VERSION;
+    index.head.snap = snap;
+    index.head.numFiles = gdata.numFiles;
+    index.head.totalGroups = gdata.totalGroups;
+    index.head.totalSubhalos = gdata.totalSubhalos;
+    index.head.totalIDs = gdata.totalIDs;
+    index.files.assign(gdata.numFiles, CatalogFile());
+
+    int nthreads = MIN(MAX(NumThreads, 1), (int)gdata.numFiles);
+    int next = 0;
+    CatalogJob *jobs = new CatalogJob[nthreads];
+    for (int i=0; i<nthreads; i++)
+    {
+	jobs[i].ps = &ps;
+	jobs[i].snap = snap;
+	jobs[i].index = &index;
+	jobs[i].next = &next;
+    }
+    RunThreads(jobs, nthreads);
+
+    bool ok = true;
+    for (int i=0; i<nthreads; i++)
+	ok = ok && jobs[i].ok;
+    delete[] jobs;
+    if (!ok)
+	return false;
+
+    // where each file starts
+    uint32_t groups = 0, subhalos = 0;
+    for (unsigned int f=0; f<index.files.size(); f++)
     {
-	gdata = LoadGroupHeader(ps, snap, i, false);
-	fileOffset[i+1] = fileOffset[i] + gdata.numSubhalos;
+	index.files[f].groupOffset = groups;
+	index.files[f].subhaloOffset = subhalos;
+	groups += index.files[f].numGroups;
+	subhalos += index.files[f].numSubhalos;
     }
+    if (subhalos != index.head.totalSubhalos)
+	fprintf(stderr,"Group files of snap %d have %u subhalos, not %u!\n",snap,subhalos,
+		index.head.totalSubhalos);
+    printf("Indexed %u group files of snap %d.\n", index.head.numFiles, snap);
+
+    // saved under another name first, in case a stage for another
+    // snapshot is after the same one (in this process or another)
+    static int saves = 0;
+    string tmpname = filename + ".tmp" + toString<int>((int)getpid())
+	+ "." + toString<int>(__sync_fetch_and_add(&saves, 1));
+    FILE *file = fopen(tmpname.c_str(),"wb");
+    if (file == NULL)
+	return true;
+    fwrite(&index.head, sizeof(CatalogHeader), 1, file);
+    fwrite(&index.files[0], sizeof(CatalogFile), index.files.size(), file);
+    fclose(file);
+    if (rename(tmpname.c_str(), filename.c_str()) != 0)
+	fprintf(stderr,"Error renaming catalog index %s!\n",tmpname.c_str());
+
+    return true;
+}
+
+/* This helper just loads an array of offsets into a file for a given snap
+   (NULL if there's no such snapshot), from its catalog index in dir. */
+int* LoadFileOffsets(PathInfo& ps, int snap, string dir)
+{
+    CatalogIndex index;
+    if (!LoadCatalogIndex(ps, snap, dir, index))
+	return NULL;
+
+    // this is the offset in subhalo index for the ith file,
+    // to convert from (file, index) to just an overall index
+    int *fileOffset = new int[index.files.size()];
+    for (unsigned int i=0; i<index.files.size(); i++)
+	fileOffset[i] = index.files[i].subhaloOffset;
 
     return fileOffset;
 }
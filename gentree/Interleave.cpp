@@ -3,63 +3,132 @@
 #include "Loaders.h"
 
 #include <stdlib.h>
+#include <string.h>
+#include <algorithm>
 #include <cmath>
 #include <cassert>
 
 
-/* Loads each file from a snapshot, creates an
-   interleaved format, does some basic processing on
-   the file (and sorts by pid), and then saves it. 
-   Returns a header containing info about the snapshot. */
-
-SnapHeader Interleave(PathInfo& ps, string filename, int snap)
+/* Checks whether the particle ids of a snapshot are exactly
+   minid...minid+numTotal-1, each appearing once, by reading just
+   the id blocks of all its files. */
+bool CheckDenseIds(PathInfo& ps, int snap, uint64_t numTotal, uint64_t& minid)
 {
-    printf("Loading snapshot %d...\n",snap);
+    uint64_t maxid = 0;
+    minid = (uint64_t)-1;
+
+    // first find the range
+    uint64_t count = 0;
+    for (int fn=0; count < numTotal; fn++)
+    {
+	uint32_t n;
+	partid_t *ids = LoadSnapIDs(ps, snap, fn, n);
+	if (ids == NULL)
+	    return false;
+	for (uint32_t i=0; i<n; i++)
+	{
+	    minid = std::min(minid, (uint64_t)ids[i]);
+	    maxid = std::max(maxid, (uint64_t)ids[i]);
+	}
+	count += n;
+	delete[] ids;
+    }
+
+    if (count != numTotal || maxid - minid + 1 != numTotal)
+	return false;
 
-    HsmlData hdata = LoadHsml(ps, snap, 0);
-    VertexData vdata = LoadSnap(ps, snap, 0);
+    // and make sure there are no duplicates (so no holes either)
+    uint64_t nwords = (numTotal + 63) / 64;
+    uint64_t *seen = new uint64_t[nwords];
+    memset(seen, 0, nwords*sizeof(uint64_t));
+    bool dense = true;
 
-    if (hdata.numTotal != vdata.numTotals[1])
+    count = 0;
+    for (int fn=0; dense && count < numTotal; fn++)
     {
-	fprintf(stderr,"Particle counts do not match!\n");
-	FreeHsml(hdata);
-	FreeSnap(vdata);
-	return SnapHeader();
+	uint32_t n;
+	partid_t *ids = LoadSnapIDs(ps, snap, fn, n);
+	if (ids == NULL)
+	{
+	    dense = false;
+	    break;
+	}
+	for (uint32_t i=0; i<n; i++)
+	{
+	    uint64_t k = ids[i] - minid;
+	    uint64_t bit = ((uint64_t)1) << (k % 64);
+	    if (seen[k/64] & bit)
+	    {
+		dense = false;
+		break;
+	    }
+	    seen[k/64] |= bit;
+	}
+	count += n;
+	delete[] ids;
     }
 
-    uint64_t numTotal = hdata.numTotal;
+    delete[] seen;
+    return dense;
+}
 
-    printf("Processing %lu particles...", (long unsigned int)numTotal);
 
-    // make a header for each interleaved file
-    SnapHeader head;
-    head.numTotal = numTotal;
-    head.mass = vdata.massParts[1];
-    head.time = vdata.time;
-    head.redshift = vdata.redshift;
-    head.boxSize = vdata.boxSize;
-    head.omega0 = vdata.omega0;
-    head.omegaLambda = vdata.omegaLambda;
-    head.hubbleParam = vdata.hubbleParam;
-    head.snap = snap;
+/* Where interleaved points go: into sorted runs, or straight to
+   their slot by pid. */
+template<typename W>
+struct RunOutput
+{
+    W* writer;
 
-    head.SetFilename(filename);
+    void Put(const VertexA& v)
+    {
+	writer->Write(v);
+    }
+};
 
-    for (int i=0; i<3; i++)
+template<typename W>
+struct PlacedOutput
+{
+    W* writer;
+    uint64_t minid;
+    // which slots got a particle
+    vector<bool>* seen;
+
+    void Put(const VertexA& v)
     {
-	head.minpos[i] = 1e300;
-	head.maxpos[i] = -1e300;
+	writer->Write(v.pid - minid, v);
+	(*seen)[v.pid - minid] = true;
     }
+};
+
+// closes up the slots of any particles that didn't turn up, so nothing
+// downstream takes them for real ones, and returns how many are left
+template<typename W>
+uint64_t closeGaps(W& writer, const vector<bool>& seen)
+{
+    uint64_t count = 0;
+    for (uint64_t i=0; i<seen.size(); i++)
+	if (seen[i])
+	    count++;
+    if (count < seen.size())
+	writer.Compact(seen);
+    return count;
+}
 
+
+/* Pairs up the particles of the snapshot and hsml files (which are in
+   the same order) starting from the given first subfiles, hands each
+   one to out, and finds the bounds. Returns how many it found. */
+template<typename O>
+uint64_t interleavePoints(SubfileLoader<HsmlData>& hsmlLoader, SubfileLoader<VertexData>& snapLoader,
+			  HsmlData *hdata, VertexData *vdata, SnapHeader& head, O& out)
+{
     // ******* Velocity scaling info *******
     // factor to convert velocity to dx/dloga:
     double vfac = 1.0 / (HUBBLE * sqrt(head.omega0 / pow(head.time,3)
 				+ head.omegaLambda) * sqrt(head.time));
 
-    BufferedWriter<VertexA> writer(filename);
-    writer.SetSort(true);
-
-    uint32_t totalIndex = 0; // overall index
+    uint64_t totalIndex = 0; // overall index
 
     uint32_t vIndex = 0; // index into snap file
     uint32_t hIndex = 0; // index into hsml file
@@ -69,66 +138,186 @@ SnapHeader Interleave(PathInfo& ps, string filename, int snap)
 
     VertexA tmp;
 
-    while (totalIndex <  numTotal)
+    while (totalIndex < head.numTotal)
     {
-	if (vIndex == vdata.numParts[1]) // load next input file
+	if (vIndex == vdata->numParts[1]) // load next input file
 	{
 	    vFileId++;
-	    FreeSnap(vdata);
-	    vdata = LoadSnap(ps, snap, vFileId);
+	    vdata = snapLoader.Get(vFileId);
 	    vIndex = 0;
+	    if (vdata == NULL)
+		break;
 	    printf("Loaded snap part %d; ",vFileId);
 	    fflush(stdout);
+	    continue;
 	}
-	if (hIndex == hdata.numFile) // load next input file
+	if (hIndex == hdata->numFile) // load next input file
 	{
 	    hFileId++;
-	    FreeHsml(hdata);
-	    hdata = LoadHsml(ps, snap, hFileId);
+	    hdata = hsmlLoader.Get(hFileId);
 	    hIndex = 0;
+	    if (hdata == NULL)
+		break;
 	    printf("Loaded hsml part %d; ",hFileId);
 	    fflush(stdout);
+	    continue;
 	}
 
 	// and write vertex data (| is for > 32-bit particle count)
-	tmp.pid = vdata.id[vIndex] | (((uint64_t)vdata.nLargeSims[1])<<32);
-	assert(tmp.pid == vdata.id[vIndex]);
+	tmp.pid = vdata->id[vIndex] | (((uint64_t)vdata->nLargeSims[1])<<32);
+	assert(tmp.pid == vdata->id[vIndex]);
 	for (int i=0;i<3;i++)
 	{
-	    tmp.pos[i] = vdata.pos[vIndex*3 + i];
+	    tmp.pos[i] = vdata->pos[vIndex*3 + i];
 	    // check  bounds
 	    if (tmp.pos[i] > head.maxpos[i])
 		head.maxpos[i] = tmp.pos[i];
 	    if (tmp.pos[i] < head.minpos[i])
 		head.minpos[i] = tmp.pos[i];
 	    // convert velocity
-	    tmp.vel[i] = vdata.vel[vIndex*3 + i] * vfac;
+	    tmp.vel[i] = vdata->vel[vIndex*3 + i] * vfac;
 	}
-	tmp.hsml = hdata.hsml[hIndex];
-	tmp.densq = hdata.density[hIndex]*hdata.density[hIndex];
+	tmp.hsml = hdata->hsml[hIndex];
+	tmp.densq = hdata->density[hIndex]*hdata->density[hIndex];
 	// weight velocity dispersion by squared density, since
 	// that is what we compute the sum of
-	tmp.vdisp = hdata.velDisp[hIndex]*tmp.densq;
+	tmp.vdisp = hdata->velDisp[hIndex]*tmp.densq;
 
-	writer.Write(tmp);
+	out.Put(tmp);
 
 	totalIndex++;
 	vIndex++;
 	hIndex++;
     }
 
-    int numFiles = writer.Close();
+    return totalIndex;
+}
+
+
+/* Loads each file from a snapshot, creates an
+   interleaved format, does some basic processing on
+   the file (and sorts by pid), and then saves it. 
+   If direct is set and the ids are dense, each particle is
+   written straight to slot pid-minid instead, and placed is
+   set, meaning that the output needs no merging.
+   If points is given, they go into a new array there instead,
+   sorted by pid either way, and no files get written.
+   Returns a header containing info about the snapshot. */
+
+SnapHeader Interleave(PathInfo& ps, string filename, int snap, bool direct, bool& placed, VertexA **points)
+{
+    printf("Loading snapshot %d...\n",snap);
+
+    // these keep the next few subfiles loading while we use one
+    SubfileLoader<HsmlData> hsmlLoader(ps, snap, &PathInfo::GetHsml, LoadAhead);
+    SubfileLoader<VertexData> snapLoader(ps, snap, &PathInfo::GetSnap, LoadAhead);
+
+    HsmlData *hdata = hsmlLoader.Get(0);
+    VertexData *vdata = snapLoader.Get(0);
+
+    if (hdata == NULL || vdata == NULL)
+	return SnapHeader();
+
+    if (hdata->numTotal != vdata->numTotals[1])
+    {
+	fprintf(stderr,"Particle counts do not match!\n");
+	return SnapHeader();
+    }
+
+    uint64_t numTotal = hdata->numTotal;
 
-    // save # of files, for mergesort
-    FILE *file = fopen(filename.c_str(),"wb");
-    fwrite(&numFiles, sizeof(int), 1, file);
-    fclose(file);
+    printf("Processing %lu particles...", (long unsigned int)numTotal);
+
+    // make a header for each interleaved file
+    SnapHeader head;
+    head.numTotal = numTotal;
+    head.mass = vdata->massParts[1];
+    head.time = vdata->time;
+    head.redshift = vdata->redshift;
+    head.boxSize = vdata->boxSize;
+    head.omega0 = vdata->omega0;
+    head.omegaLambda = vdata->omegaLambda;
+    head.hubbleParam = vdata->hubbleParam;
+    head.snap = snap;
+
+    head.SetFilename(filename);
+
+    for (int i=0; i<3; i++)
+    {
+	head.minpos[i] = 1e300;
+	head.maxpos[i] = -1e300;
+    }
+
+    // see if we can skip the sort, otherwise fall back to it
+    uint64_t minid = 0;
+    placed = false;
+    if (direct)
+    {
+	placed = CheckDenseIds(ps, snap, numTotal, minid);
+	if (!placed)
+	    printf("ids not dense, sorting instead...");
+    }
+
+    uint64_t found = 0;
+    if (points != NULL)
+    {
+	ArrayWriter<VertexA> writer(numTotal);
+	if (placed)
+	{
+	    vector<bool> seen(numTotal, false);
+	    PlacedOutput<ArrayWriter<VertexA> > out = { &writer, minid, &seen };
+	    found = interleavePoints(hsmlLoader, snapLoader, hdata, vdata, head, out);
+	    head.numTotal = closeGaps(writer, seen);
+	}
+	else
+	{
+	    RunOutput<ArrayWriter<VertexA> > out = { &writer };
+	    found = interleavePoints(hsmlLoader, snapLoader, hdata, vdata, head, out);
+	    writer.SetSort(true);
+	    // (so whatever did get found is still in order)
+	    head.numTotal = found;
+	}
+	writer.Close();
+	*points = writer.Release();
+    }
+    else if (placed)
+    {
+	DirectWriter<VertexA> writer(filename, numTotal);
+	if (!writer.IsOpen())
+	{
+	    placed = false;
+	    return SnapHeader();
+	}
+	vector<bool> seen(numTotal, false);
+	PlacedOutput<DirectWriter<VertexA> > out = { &writer, minid, &seen };
+	found = interleavePoints(hsmlLoader, snapLoader, hdata, vdata, head, out);
+	head.numTotal = closeGaps(writer, seen);
+
+	// already in order, so no merge and no file count
+	writer.Close();
+    }
+    else
+    {
+	BufferedWriter<VertexA> writer(filename);
+	writer.SetSort(true);
+	writer.SetBuffers(WriteBuffers);
+	RunOutput<BufferedWriter<VertexA> > out = { &writer };
+	found = interleavePoints(hsmlLoader, snapLoader, hdata, vdata, head, out);
+
+	int numFiles = writer.Close();
+
+	// save # of files, for mergesort
+	FILE *file = fopen(filename.c_str(),"wb");
+	fwrite(&numFiles, sizeof(int), 1, file);
+	fclose(file);
+    }
+
+    if (found < numTotal)
+	fprintf(stderr,"Only found %lu of %lu particles!\n",
+		(long unsigned int)found, (long unsigned int)numTotal);
 
     printf("\nInterleaved snap %d\n",snap);
     fflush(stdout);
 
-    FreeHsml(hdata);
-    FreeSnap(vdata);
-
     return head;
 }
@@ -1,89 +1,288 @@
 #include <stdio.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "Loaders.h"
 
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-HsmlData LoadHsml(PathInfo& ps, int id, int fn)
+
+// ***************************************************************
+// Bulk byte swapping
+// ***************************************************************
+
+void SwapCopy32(void *dst, const void *src, uint64_t count)
 {
-    FILE *file = fopen(ps.GetHsml(id,fn).c_str(),"rb");
-    if (file == NULL)
+#ifdef _READ_SWAP_BYTES
+    const uint32_t *in = (const uint32_t*)src;
+    uint32_t *out = (uint32_t*)dst;
+    uint64_t i = 0;
+
+#if defined(__SSSE3__)
+    const __m128i mask = _mm_setr_epi8(3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12);
+    for (; i+4 <= count; i+=4)
     {
-	fprintf(stderr,"Hsml file %s not found!\n",ps.GetHsml(id,fn).c_str());
-	return HsmlData();
+	__m128i v = _mm_loadu_si128((const __m128i*)(in+i));
+	_mm_storeu_si128((__m128i*)(out+i), _mm_shuffle_epi8(v, mask));
+    }
+#elif defined(__SSE2__)
+    for (; i+4 <= count; i+=4)
+    {
+	__m128i v = _mm_loadu_si128((const __m128i*)(in+i));
+	// swap bytes in each 16-bit word, then the words
+	v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+	v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2,3,0,1));
+	v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2,3,0,1));
+	_mm_storeu_si128((__m128i*)(out+i), v);
     }
+#endif
 
-    HsmlData data;
+    for (; i<count; i++)
+	out[i] = bswap_32(in[i]);
+#else
+    if (dst != src)
+	memcpy(dst, src, count*4);
+#endif
+}
 
-    // read header
-    fread(&data, 4, 5, file);
+void SwapCopy64(void *dst, const void *src, uint64_t count)
+{
+#ifdef _READ_SWAP_BYTES
+    const uint64_t *in = (const uint64_t*)src;
+    uint64_t *out = (uint64_t*)dst;
+    uint64_t i = 0;
 
-    bswap32(data.numFile);
-    bswap32(data.numPrevious);
-    bswap64(data.numTotal);
-    bswap32(data.numFiles);
+#if defined(__SSSE3__)
+    const __m128i mask = _mm_setr_epi8(7,6,5,4,3,2,1,0, 15,14,13,12,11,10,9,8);
+    for (; i+2 <= count; i+=2)
+    {
+	__m128i v = _mm_loadu_si128((const __m128i*)(in+i));
+	_mm_storeu_si128((__m128i*)(out+i), _mm_shuffle_epi8(v, mask));
+    }
+#elif defined(__SSE2__)
+    for (; i+2 <= count; i+=2)
+    {
+	__m128i v = _mm_loadu_si128((const __m128i*)(in+i));
+	v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+	v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0,1,2,3));
+	v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0,1,2,3));
+	_mm_storeu_si128((__m128i*)(out+i), v);
+    }
+#endif
 
-    // allocate arrays
-    data.hsml = new float[data.numFile];
-    data.density = new float[data.numFile];
-    data.velDisp = new float[data.numFile];
+    for (; i<count; i++)
+	out[i] = bswap_64(in[i]);
+#else
+    if (dst != src)
+	memcpy(dst, src, count*8);
+#endif
+}
 
-    // and read them
-    fread(data.hsml, 4, data.numFile, file);
-    fread(data.density, 4, data.numFile, file);
-    fread(data.velDisp, 4, data.numFile, file);
+// ids are whichever size partid_t is
+inline void swapCopyIDs(partid_t *dst, const void *src, uint64_t count)
+{
+    if (sizeof(partid_t) == 4)
+	SwapCopy32(dst, src, count);
+    else
+	SwapCopy64(dst, src, count);
+}
 
-    fclose(file);
 
-    // swap bytes if necessary
-#ifdef _READ_SWAP_BYTES
-    uint32_t* hsml = (uint32_t*)data.hsml;
-    uint32_t* dens = (uint32_t*)data.density;
-    uint32_t* vdisp = (uint32_t*)data.velDisp;
-    for (int i=0; i<data.numFile; i++)
+// ***************************************************************
+// Mapped files
+// ***************************************************************
+
+MappedFile::MappedFile(string filename)
+{
+    data = NULL;
+    size = 0;
+    mapped = false;
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+	return;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
     {
-	bswap32(hsml[i]);
-	bswap32(dens[i]);
-	bswap32(vdisp[i]);
+	close(fd);
+	return;
     }
-#endif
+    size = st.st_size;
 
-    return data;
+    void *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p != MAP_FAILED)
+    {
+	// we go through it once, front to back
+	madvise(p, size, MADV_SEQUENTIAL);
+	madvise(p, size, MADV_WILLNEED);
+	data = (char*)p;
+	mapped = true;
+    }
+    else
+    {
+	// fall back on reading the whole thing
+	data = (char*)malloc(size);
+	uint64_t done = 0;
+	while (data != NULL && done < size)
+	{
+	    ssize_t n = read(fd, data+done, size-done);
+	    if (n <= 0)
+	    {
+		free(data);
+		data = NULL;
+	    }
+	    else
+		done += n;
+	}
+    }
+
+    close(fd);
 }
 
-void FreeHsml(HsmlData& data)
+MappedFile::~MappedFile()
 {
-    delete[] data.hsml;
-    delete[] data.density;
-    delete[] data.velDisp;
+    if (data == NULL)
+	return;
+    if (mapped)
+	munmap(data, size);
+    else
+	free(data);
 }
 
-VertexData LoadSnap(PathInfo& ps, int id, int fn)
+
+/* Steps through the fortran-style records of a snapshot file, each
+   of which has its length in bytes before and after it. */
+class RecordReader
 {
-    FILE *file = fopen(ps.GetSnap(id, fn).c_str(), "rb");
+    const MappedFile& file;
+    uint64_t pos;
+    string filename;
 
-    if (file == NULL)
+public:
+    RecordReader(const MappedFile& f, string fname)
+	: file(f)
     {
-	fprintf(stderr,"Vertex file %s not found!\n",ps.GetSnap(id, fn).c_str());
-	return VertexData();
+	pos = 0;
+	filename = fname;
     }
 
-    VertexData data;
+    // returns the start of the next record and its length, or NULL
+    // if the file ends first
+    const char* Next(uint32_t& nbytes)
+    {
+	if (pos + 4 > file.Size())
+	{
+	    fprintf(stderr,"Error! %s ends early\n",filename.c_str());
+	    return NULL;
+	}
+	memcpy(&nbytes, file.Data()+pos, 4);
+	bswap32(nbytes);
+	pos += 4;
+
+	if (pos + nbytes + 4 > file.Size())
+	{
+	    fprintf(stderr,"Error! %s ends early\n",filename.c_str());
+	    return NULL;
+	}
+	const char *rec = file.Data()+pos;
+	pos += nbytes;
+
+	// check to make sure head size and tail size are equal
+	uint32_t tmp;
+	memcpy(&tmp, file.Data()+pos, 4);
+	bswap32(tmp);
+	if (tmp != nbytes)
+	    fprintf(stderr,"Error! Head size = %d, tail size = %d\n",nbytes,tmp);
+	pos += 4;
+
+	return rec;
+    }
+};
 
-    // needed for reading dumb format
-    uint32_t nbytes;
-    uint32_t tmp;
-    // position of read
-    uint64_t fPos;
 
-    fread(&nbytes, 4, 1, file);
-    bswap32(nbytes);
+// ***************************************************************
+// Hsml and snapshot files
+// ***************************************************************
 
-    fPos = 4;
+bool ReadHsml(string filename, HsmlData& data, uint32_t& capacity)
+{
+    MappedFile file(filename);
+    if (!file.IsOpen())
+    {
+	fprintf(stderr,"Hsml file %s not found!\n",filename.c_str());
+	return false;
+    }
 
     // read header
-    // er, this is wrong, but i don't really feel like changing it right now
-    fread(&data, sizeof(data), 1, file);
+    if (file.Size() < 20)
+    {
+	fprintf(stderr,"Error! %s ends early\n",filename.c_str());
+	return false;
+    }
+    memcpy(&data, file.Data(), 20);
 
-    // swap header bytes
+    bswap32(data.numFile);
+    bswap32(data.numPrevious);
+    bswap64(data.numTotal);
+    bswap32(data.numFiles);
+
+    uint32_t n = data.numFile;
+    if (file.Size() < 20 + (uint64_t)12*n)
+    {
+	fprintf(stderr,"Error! %s ends early\n",filename.c_str());
+	return false;
+    }
+
+    // allocate arrays, unless we have them already
+    if (n > capacity || data.hsml == NULL)
+    {
+	FreeHsml(data);
+	data.hsml = new float[n];
+	data.density = new float[n];
+	data.velDisp = new float[n];
+	capacity = n;
+    }
+
+    // and read them, swapping bytes if necessary
+    const char *p = file.Data() + 20;
+    SwapCopy32(data.hsml, p, n);
+    SwapCopy32(data.density, p + (uint64_t)4*n, n);
+    SwapCopy32(data.velDisp, p + (uint64_t)8*n, n);
+
+    countRead(file.Size(), 0);
+    return true;
+}
+
+HsmlData LoadHsml(PathInfo& ps, int id, int fn)
+{
+    HsmlData data;
+    data.hsml = data.density = data.velDisp = NULL;
+    uint32_t capacity = 0;
+    if (!ReadHsml(ps.GetHsml(id,fn), data, capacity))
+    {
+	FreeHsml(data);
+	return HsmlData();
+    }
+    return data;
+}
+
+void FreeHsml(HsmlData& data)
+{
+    delete[] data.hsml;
+    delete[] data.density;
+    delete[] data.velDisp;
+}
+
+// swaps the bytes of the header fields we use
+void swapSnapHeader(VertexData& data)
+{
     for (int i=0; i<6; i++)
     {
 	bswap32(data.numParts[i]);
@@ -99,85 +298,69 @@ VertexData LoadSnap(PathInfo& ps, int id, int fn)
     bswap64(data.hubbleParam);
 
     bswap32(data.numSubfiles);
+}
 
-    // allocate arrays
-    data.pos = new double[data.numParts[1]*3];
-    data.vel = new double[data.numParts[1]*3];
-    data.id = new partid_t[data.numParts[1]];
-
-    // go to next data loc.
-    fPos += nbytes;
-    fseek(file, fPos, SEEK_SET);
-    fread(&tmp, 4, 1, file);
-    bswap32(tmp);
-
-    // check to make sure head size and tail size are equal
-    if (tmp != nbytes)
-	fprintf(stderr,"Error! Head size = %d, tail size = %d\n",nbytes,tmp);
-    fread(&nbytes, 4, 1, file);
-    bswap32(nbytes);
-
-    fPos += 8;
-
-
-    // and read them
-    fread(data.pos, 24, data.numParts[1], file);
-
-    // go to next data loc.
-    fPos += nbytes;
-    fseek(file, fPos, SEEK_SET);
-    fread(&tmp, 4, 1, file);
-    bswap32(tmp);
-
-    // check to make sure head size and tail size are equal
-    if (tmp != nbytes)
-	fprintf(stderr,"Error! Head size = %d, tail size = %d\n",nbytes,tmp);
-    fread(&nbytes, 4, 1, file);
-    bswap32(nbytes);
-
-    fPos += 8;
+bool ReadSnap(string filename, VertexData& data, uint32_t& capacity)
+{
+    MappedFile file(filename);
+    if (!file.IsOpen())
+    {
+	fprintf(stderr,"Vertex file %s not found!\n",filename.c_str());
+	return false;
+    }
+    RecordReader records(file, filename);
 
-    // read next array
-    fread(data.vel, 24, data.numParts[1], file);
+    // read header, which has the same layout as the start of VertexData
+    uint32_t nbytes;
+    const char *rec = records.Next(nbytes);
+    if (rec == NULL)
+	return false;
+    memcpy(&data, rec, nbytes < offsetof(VertexData, pos) ? nbytes : offsetof(VertexData, pos));
+    swapSnapHeader(data);
 
-    // go to next data loc.
-    fPos += nbytes;
-    fseek(file, fPos, SEEK_SET);
-    fread(&tmp, 4, 1, file);
-    bswap32(tmp);
+    uint32_t n = data.numParts[1];
 
-    // check to make sure head size and tail size are equal
-    if (tmp != nbytes)
-	fprintf(stderr,"Error! Head size = %d, tail size = %d\n",nbytes,tmp);
-    fread(&nbytes, 4, 1, file);
-    bswap32(nbytes);
+    // allocate arrays, unless we have them already
+    if (n > capacity || data.pos == NULL)
+    {
+	FreeSnap(data);
+	data.pos = new double[(uint64_t)n*3];
+	data.vel = new double[(uint64_t)n*3];
+	data.id = new partid_t[n];
+	capacity = n;
+    }
 
-    fPos += 8;
+    // and read them, swapping bytes if necessary
+    const char *pos = records.Next(nbytes);
+    if (pos == NULL || nbytes < (uint64_t)24*n)
+	return false;
+    SwapCopy64(data.pos, pos, (uint64_t)3*n);
 
-    // and read last array
-    fread(data.id, sizeof(partid_t), data.numParts[1], file);
+    const char *vel = records.Next(nbytes);
+    if (vel == NULL || nbytes < (uint64_t)24*n)
+	return false;
+    SwapCopy64(data.vel, vel, (uint64_t)3*n);
 
-    fclose(file);
+    const char *ids = records.Next(nbytes);
+    if (ids == NULL || nbytes < (uint64_t)sizeof(partid_t)*n)
+	return false;
+    swapCopyIDs(data.id, ids, n);
 
+    countRead(file.Size(), n);
+    return true;
+}
 
-#ifdef _READ_SWAP_BYTES
-    uint64_t* pos = (uint64_t*)data.pos;
-    uint64_t* vel = (uint64_t*)data.vel;
-    // swap bytes if necessary
-    for (int i=0; i<3*data.numParts[1]; i++)
+VertexData LoadSnap(PathInfo& ps, int id, int fn)
+{
+    VertexData data;
+    data.pos = data.vel = NULL;
+    data.id = NULL;
+    uint32_t capacity = 0;
+    if (!ReadSnap(ps.GetSnap(id, fn), data, capacity))
     {
-	bswap64(pos[i]);
-	bswap64(vel[i]);
+	FreeSnap(data);
+	return VertexData();
     }
-
-    if (sizeof(partid_t) == 4)
-	for (int i=0; i<data.numParts[1]; i++)
-	    bswap32(data.id[i]);
-    else
-	for (int i=0; i<data.numParts[1]; i++)
-	    bswap64(data.id[i]);
-#endif
-
     return data;
 }
 
@@ -202,6 +385,48 @@ void FreeSnap(VertexData& data)
     delete[] data.id;
 }
 
+/* Loads only the particle ids from a snapshot file, skipping the
+   position and velocity blocks. Returns NULL if there's no file,
+   otherwise an array of count ids (to be delete[]'d). */
+partid_t* LoadSnapIDs(PathInfo& ps, int id, int fn, uint32_t& count)
+{
+    count = 0;
+    string filename = ps.GetSnap(id, fn);
+    MappedFile file(filename);
+
+    if (!file.IsOpen())
+    {
+	fprintf(stderr,"Vertex file %s not found!\n",filename.c_str());
+	return NULL;
+    }
+    RecordReader records(file, filename);
+
+    // just need the particle count out of the header
+    uint32_t nbytes;
+    const char *rec = records.Next(nbytes);
+    if (rec == NULL || nbytes < 8)
+	return NULL;
+    memcpy(&count, rec + 4, 4);
+    bswap32(count);
+
+    // skip positions and velocities
+    const char *ids = NULL;
+    for (int i=0; i<3 && rec != NULL; i++)
+	ids = rec = records.Next(nbytes);
+    if (ids == NULL || nbytes < (uint64_t)sizeof(partid_t)*count)
+    {
+	count = 0;
+	return NULL;
+    }
+
+    partid_t *out = new partid_t[count];
+    swapCopyIDs(out, ids, count);
+
+    // (only the ids get read from disk)
+    countRead((uint64_t)sizeof(partid_t)*count, count);
+    return out;
+}
+
 VertexData LoadSnapHeader(PathInfo& ps, int id, int fn)
 {
     FILE *file = fopen(ps.GetSnap(id, fn).c_str(), "rb");
@@ -218,45 +443,63 @@ VertexData LoadSnapHeader(PathInfo& ps, int id, int fn)
 
     // needed for reading dumb format
     uint32_t nbytes;
-    uint32_t tmp;
-    // position of read
-    uint64_t fPos;
 
     fread(&nbytes, 4, 1, file);
-    fPos = 4;
 
-    // read header
-    // er, this is wrong, but i don't really feel like changing it right now
-    fread(&data, sizeof(data), 1, file);
+    // read header, which has the same layout as the start of VertexData
+    fread(&data, offsetof(VertexData, pos), 1, file);
 
     fclose(file);
 
     // swap header bytes
-    for (int i=0; i<6; i++)
-    {
-	bswap32(data.numParts[i]);
-	bswap32(data.numTotals[i]);
-	bswap64(data.massParts[i]);
-	bswap32(data.nLargeSims[i]);
-    }
-    bswap64(data.time);
-    bswap64(data.redshift);
-    bswap64(data.boxSize);
-    bswap64(data.omega0);
-    bswap64(data.omegaLambda);
-    bswap64(data.hubbleParam);
+    swapSnapHeader(data);
 
-    bswap32(data.numSubfiles);
+    return data;
+}
 
 
-    return data;
+// the group and id file headers are packed, unlike GroupData and IDData
+// (where totalIDs lands on an 8 byte boundary), so go field by field
+static void readGroupHeader(GroupData& data, const char *p)
+{
+    memcpy(&data.numGroups, p, 4);
+    memcpy(&data.totalGroups, p+4, 4);
+    memcpy(&data.numIDs, p+8, 4);
+    memcpy(&data.totalIDs, p+12, 8);
+    memcpy(&data.numFiles, p+20, 4);
+    memcpy(&data.numSubhalos, p+24, 4);
+    memcpy(&data.totalSubhalos, p+28, 4);
+
+    bswap32(data.numGroups);
+    bswap32(data.totalGroups);
+    bswap32(data.numIDs);
+    bswap64(data.totalIDs);
+    bswap32(data.numFiles);
+    bswap32(data.numSubhalos);
+    bswap32(data.totalSubhalos);
 }
 
+static void readIDHeader(IDData& data, const char *p)
+{
+    memcpy(&data.numGroups, p, 4);
+    memcpy(&data.totalGroups, p+4, 4);
+    memcpy(&data.numIDs, p+8, 4);
+    memcpy(&data.totalIDs, p+12, 8);
+    memcpy(&data.numFiles, p+20, 4);
+    memcpy(&data.offset, p+24, 4);
+
+    bswap32(data.numGroups);
+    bswap32(data.totalGroups);
+    bswap32(data.numIDs);
+    bswap64(data.totalIDs);
+    bswap32(data.numFiles);
+    bswap32(data.offset);
+}
 
 GroupData LoadGroup(PathInfo& ps, int id, int fn, bool vel)
 {
-    FILE *file = fopen(ps.GetSubTab(id,fn).c_str(),"rb");
-    if (file == NULL)
+    MappedFile file(ps.GetSubTab(id,fn));
+    if (!file.IsOpen() || file.Size() < 32)
     {
 	fprintf(stderr,"Group file %s not found!\n",ps.GetSubTab(id,fn).c_str());
 	return GroupData();
@@ -265,15 +508,16 @@ GroupData LoadGroup(PathInfo& ps, int id, int fn, bool vel)
     GroupData data;
 
     // read header
-    fread(&data, 4, 8, file);
+    readGroupHeader(data, file.Data());
 
-    bswap32(data.numGroups);
-    bswap32(data.totalGroups);
-    bswap32(data.numIDs);
-    bswap64(data.totalIDs);
-    bswap32(data.numFiles);
-    bswap32(data.numSubhalos);
-    bswap32(data.totalSubhalos);
+    // skipping over useless stuff we don't need between them
+    uint64_t gStart = 32;
+    uint64_t sStart = gStart + (uint64_t)data.numGroups*4*16;
+    if (file.Size() < sStart + (uint64_t)data.numSubhalos*4*2)
+    {
+	fprintf(stderr,"Error! %s ends early\n",ps.GetSubTab(id,fn).c_str());
+	return GroupData();
+    }
 
     // allocate arrays
     data.sLength = new uint32_t[data.numSubhalos];
@@ -282,30 +526,14 @@ GroupData LoadGroup(PathInfo& ps, int id, int fn, bool vel)
     data.gLength = new uint32_t[data.numGroups];
     data.gOffset = new uint32_t[data.numGroups];
 
-    fread(data.gLength, 4, data.numGroups, file);
-    fread(data.gOffset, 4, data.numGroups, file);
-
-    // skip over useless stuff we don't need
-    fseek(file, data.numGroups*4*14, SEEK_CUR);
-    // and read good fields
-    fread(data.sLength, 4, data.numSubhalos, file);
-    fread(data.sOffset, 4, data.numSubhalos, file);
-
-    fclose(file);
-
-#ifdef _READ_SWAP_BYTES
-    for (int i=0; i<data.numGroups; i++)
-    {
-	bswap32(data.gLength[i]);
-	bswap32(data.gOffset[i]);
-    }
-    for (int i=0; i<data.numSubhalos; i++)
-    {
-	bswap32(data.sLength[i]);
-	bswap32(data.sOffset[i]);
-    }
-#endif
+    // and read good fields, swapping bytes if necessary
+    const char *p = file.Data();
+    SwapCopy32(data.gLength, p + gStart, data.numGroups);
+    SwapCopy32(data.gOffset, p + gStart + (uint64_t)4*data.numGroups, data.numGroups);
+    SwapCopy32(data.sLength, p + sStart, data.numSubhalos);
+    SwapCopy32(data.sOffset, p + sStart + (uint64_t)4*data.numSubhalos, data.numSubhalos);
 
+    countRead(file.Size(), data.numSubhalos);
     return data;
 }
 
@@ -332,25 +560,23 @@ GroupData LoadGroupHeader(PathInfo& ps, int id, int fn, bool vel)
     }
 
     // read header
-    fread(&data, 4, 8, file);
+    char head[32];
+    bool ok = fread(head, 32, 1, file) == 1;
 
     fclose(file);
 
-    data.numGroups = bswap32(data.numGroups);
-    data.totalGroups = bswap32(data.totalGroups);
-    data.numIDs = bswap32(data.numIDs);
-    data.totalIDs = bswap64(data.totalIDs);
-    data.numFiles = bswap32(data.numFiles);
-    data.numSubhalos = bswap32(data.numSubhalos);
-    data.totalSubhalos = bswap32(data.totalSubhalos);
+    if (ok)
+	readGroupHeader(data, head);
+    else
+	fprintf(stderr,"Error! %s ends early\n",ps.GetSubTab(id,fn).c_str());
 
     return data;
 }
 
 IDData LoadIDs(PathInfo& ps, int id, int fn)
 {
-    FILE *file = fopen(ps.GetSubId(id,fn).c_str(),"rb");
-    if (file == NULL)
+    MappedFile file(ps.GetSubId(id,fn));
+    if (!file.IsOpen() || file.Size() < 28)
     {
 	fprintf(stderr,"SubID file %s not found!\n",ps.GetSubId(id,fn).c_str());
 	return IDData();
@@ -359,35 +585,21 @@ IDData LoadIDs(PathInfo& ps, int id, int fn)
     IDData data;
 
     // read header
-    fread(&data, 4, 7, file);
+    readIDHeader(data, file.Data());
 
-    data.numGroups = bswap32(data.numGroups);
-    data.totalGroups = bswap32(data.totalGroups);
-    data.numIDs = bswap32(data.numIDs);
-    data.totalIDs = bswap64(data.totalIDs);
-    data.numFiles = bswap32(data.numFiles);
-    data.offset = bswap32(data.offset);
+    if (file.Size() < 28 + (uint64_t)sizeof(partid_t)*data.numIDs)
+    {
+	fprintf(stderr,"Error! %s ends early\n",ps.GetSubId(id,fn).c_str());
+	return IDData();
+    }
 
     // allocate arrays
     data.IDs = new partid_t[data.numIDs];
 
-    // and read good fields
-    fread(data.IDs, sizeof(partid_t), data.numIDs, file);
-
-    fclose(file);
-
-#ifdef _READ_SWAP_BYTES
-
-    // swap bytes if necessary
-    if (sizeof(partid_t) == 4)
-	for (int i=0; i<data.numIDs; i++)
-	    bswap32(data.IDs[i]);
-    else
-	for (int i=0; i<data.numIDs; i++)
-	    bswap64(data.IDs[i]);
-
-#endif    
+    // and read good fields, swapping bytes if necessary
+    swapCopyIDs(data.IDs, file.Data() + 28, data.numIDs);
 
+    countRead(file.Size(), data.numIDs);
     return data;
 }
 
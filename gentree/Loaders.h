@@ -2,8 +2,83 @@
 #define _LOADERS_H_
 
 #include <stdio.h>
+#include <pthread.h>
+#include <string.h>
 #include "Formats.h"
 #include "Gadget.h"
+#include "Telemetry.h"
+
+
+// subfiles to load ahead of the one being used, in the background
+extern int LoadAhead;
+
+// copies count 4 or 8 byte words from src to dst (which can be the
+// same), swapping their bytes if files need it
+void SwapCopy32(void *dst, const void *src, uint64_t count);
+void SwapCopy64(void *dst, const void *src, uint64_t count);
+
+
+/* A whole file mapped into memory, read only (or just read in, if
+   it can't be mapped). */
+class MappedFile
+{
+private:
+    char *data;
+    uint64_t size;
+    bool mapped;
+
+    // mark as private, no copying allowed
+    MappedFile(const MappedFile& other);
+
+    // same here
+    MappedFile& operator=(const MappedFile& old);
+
+public:
+    MappedFile(string filename);
+    ~MappedFile();
+
+    bool IsOpen() const
+    {
+	return data != NULL;
+    }
+
+    const char* Data() const
+    {
+	return data;
+    }
+
+    uint64_t Size() const
+    {
+	return size;
+    }
+};
+
+
+// load one subfile into data, reusing its arrays if they hold at least
+// capacity entries (else replacing them, and updating capacity)
+bool ReadHsml(string filename, HsmlData& data, uint32_t& capacity);
+bool ReadSnap(string filename, VertexData& data, uint32_t& capacity);
+
+// so the loader below can do either
+inline bool ReadSubfile(string filename, HsmlData& data, uint32_t& capacity)
+{
+    return ReadHsml(filename, data, capacity);
+}
+
+inline bool ReadSubfile(string filename, VertexData& data, uint32_t& capacity)
+{
+    return ReadSnap(filename, data, capacity);
+}
+
+inline int SubfileCount(const HsmlData& data)
+{
+    return data.numFiles;
+}
+
+inline int SubfileCount(const VertexData& data)
+{
+    return data.numSubfiles;
+}
 
 
 HsmlData LoadHsml(PathInfo& ps, int id, int file);
@@ -13,6 +88,7 @@ VertexData LoadSnap(PathInfo& ps, int id, int file);
 void FreeSnap(VertexData& data);
 
 VertexData LoadSnapHeader(PathInfo& ps, int id, int file);
+partid_t* LoadSnapIDs(PathInfo& ps, int id, int file, uint32_t& count);
 
 GroupData LoadGroup(PathInfo& ps, int id, int file, bool vel);
 void FreeGroup(GroupData& data);
@@ -25,4 +101,139 @@ void FreeIDs(IDData& data);
 TreeData LoadTree(string filename);
 void FreeTree(TreeData& data);
 
+
+/* Loads the hsml or snap subfiles of a snapshot in order, with up to
+   ahead of the following ones loading on their own threads while the
+   current one is used. The arrays of each slot get reused, so whatever
+   Get returns is only good until the next call. */
+template<typename D>
+class SubfileLoader
+{
+private:
+    struct Slot
+    {
+	D data;
+	uint32_t capacity;
+	string filename;
+	bool ok;
+	bool loading;
+	pthread_t thread;
+    };
+
+    PathInfo& ps;
+    int snap;
+    string (PathInfo::*getName)(int, int);
+
+    Slot *slots;
+    int numSlots;
+
+    // known once the first one is loaded
+    int numFiles;
+    // next subfile to start loading
+    int nextFile;
+
+    static void* loadThread(void *ptr)
+    {
+	Slot *s = (Slot*)ptr;
+	s->ok = ReadSubfile(s->filename, s->data, s->capacity);
+	return NULL;
+    }
+
+    void start(int fn)
+    {
+	Slot& s = slots[fn % numSlots];
+	s.filename = (ps.*getName)(snap, fn);
+	// no point in a thread if we'd wait for it straight away
+	if (numSlots == 1)
+	{
+	    s.ok = ReadSubfile(s.filename, s.data, s.capacity);
+	    return;
+	}
+	s.loading = true;
+	startThread(&s.thread, &loadThread, &s);
+    }
+
+    void wait(Slot& s)
+    {
+	if (s.loading)
+	{
+	    pthread_join(s.thread, NULL);
+	    s.loading = false;
+	}
+    }
+
+    // mark as private, no copying allowed
+    SubfileLoader(const SubfileLoader& other);
+
+    // same here
+    SubfileLoader& operator=(const SubfileLoader& old);
+
+public:
+    SubfileLoader(PathInfo& p, int sn, string (PathInfo::*name)(int, int), int ahead)
+	: ps(p)
+    {
+	snap = sn;
+	getName = name;
+	numSlots = (ahead > 0 ? ahead : 0) + 1;
+	slots = new Slot[numSlots];
+	for (int i=0; i<numSlots; i++)
+	{
+	    memset(&slots[i].data, 0, sizeof(D));
+	    slots[i].capacity = 0;
+	    slots[i].ok = false;
+	    slots[i].loading = false;
+	}
+	numFiles = -1;
+	nextFile = 0;
+    }
+
+    ~SubfileLoader()
+    {
+	for (int i=0; i<numSlots; i++)
+	{
+	    wait(slots[i]);
+	    Free(slots[i].data);
+	}
+	delete[] slots;
+    }
+
+    // returns subfile fn (asked for in order), or NULL if it failed
+    D* Get(int fn)
+    {
+	if (fn >= nextFile)
+	{
+	    start(fn);
+	    nextFile = fn+1;
+	}
+
+	Slot& s = slots[fn % numSlots];
+	wait(s);
+	if (!s.ok)
+	    return NULL;
+
+	// the first one says how many there are
+	if (numFiles < 0)
+	    numFiles = SubfileCount(s.data);
+
+	// and keep the following ones coming, in the other slots
+	while (nextFile < numFiles && nextFile < fn + numSlots)
+	{
+	    start(nextFile);
+	    nextFile++;
+	}
+
+	return &s.data;
+    }
+
+    static void Free(HsmlData& data)
+    {
+	FreeHsml(data);
+    }
+
+    static void Free(VertexData& data)
+    {
+	FreeSnap(data);
+    }
+};
+
 #endif
@@ -0,0 +1,276 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "Manifest.h"
+#include "Formats.h"
+
+
+void listSubfiles(string filename, vector<string>& files)
+{
+    struct stat st;
+    for (int i=0; ; i++)
+    {
+	string sub = filename + "." + toString<int>(i);
+	if (stat(sub.c_str(), &st) != 0)
+	    break;
+	files.push_back(sub);
+    }
+}
+
+void removeSubfiles(string filename)
+{
+    for (int i=0; ; i++)
+    {
+	if (remove((filename + "." + toString<int>(i)).c_str()) != 0)
+	    break;
+    }
+    remove(filename.c_str());
+}
+
+
+// the struct bytes as hex, and back
+static string toHex(const void *data, int size)
+{
+    static const char digits[] = "0123456789abcdef";
+    const unsigned char *p = (const unsigned char*)data;
+    string s(2*size, '0');
+    for (int i=0; i<size; i++)
+    {
+	s[2*i] = digits[p[i] >> 4];
+	s[2*i+1] = digits[p[i] & 15];
+    }
+    return s;
+}
+
+static int fromHexDigit(char c)
+{
+    if (c >= '0' && c <= '9')
+	return c - '0';
+    if (c >= 'a' && c <= 'f')
+	return c - 'a' + 10;
+    return -1;
+}
+
+static bool fromHex(string s, void *data, int size)
+{
+    if ((int)s.size() != 2*size)
+	return false;
+    unsigned char *p = (unsigned char*)data;
+    for (int i=0; i<size; i++)
+    {
+	int hi = fromHexDigit(s[2*i]);
+	int lo = fromHexDigit(s[2*i+1]);
+	if (hi < 0 || lo < 0)
+	    return false;
+	p[i] = (unsigned char)(hi*16 + lo);
+    }
+    return true;
+}
+
+
+Manifest::Manifest(string fname)
+{
+    filename = fname;
+    load();
+}
+
+/* The file has one line per record:
+     stage <name>            a finished stage, in order
+     file <size> <path>      a file left by the stage above
+     value <key> <hex>       saved state
+   and anything it doesn't understand (like a half-written line) ends it. */
+void Manifest::load()
+{
+    FILE *file = fopen(filename.c_str(), "r");
+    if (file == NULL)
+	return;
+
+    char line[4096];
+    while (fgets(line, 4096, file) != NULL)
+    {
+	int len = strcspn(line, "\n\r");
+	// no newline, so it got cut off
+	if (line[len] == 0)
+	    break;
+	line[len] = 0;
+
+	if (strncmp(line, "stage ", 6) == 0)
+	{
+	    Entry e;
+	    e.stage = string(line+6);
+	    done.push_back(e);
+	}
+	else if (strncmp(line, "file ", 5) == 0 && !done.empty())
+	{
+	    char *end;
+	    uint64_t size = strtoull(line+5, &end, 10);
+	    if (*end != ' ')
+		break;
+	    done.back().files.push_back(string(end+1));
+	    done.back().sizes.push_back(size);
+	}
+	else if (strncmp(line, "value ", 6) == 0)
+	{
+	    char *sp = strchr(line+6, ' ');
+	    if (sp == NULL)
+		break;
+	    keys.push_back(string(line+6, sp-(line+6)));
+	    values.push_back(string(sp+1));
+	}
+	else
+	    break;
+    }
+    fclose(file);
+}
+
+void Manifest::save()
+{
+    string tmpname = filename + ".tmp";
+    FILE *file = fopen(tmpname.c_str(), "w");
+    if (file == NULL)
+    {
+	fprintf(stderr,"Error writing manifest %s!\n",tmpname.c_str());
+	return;
+    }
+
+    for (unsigned int i=0; i<done.size(); i++)
+    {
+	fprintf(file, "stage %s\n", done[i].stage.c_str());
+	for (unsigned int j=0; j<done[i].files.size(); j++)
+	    fprintf(file, "file %lu %s\n", (long unsigned int)done[i].sizes[j],
+		    done[i].files[j].c_str());
+    }
+    for (unsigned int i=0; i<keys.size(); i++)
+	fprintf(file, "value %s %s\n", keys[i].c_str(), values[i].c_str());
+
+    // make sure it's all on disk before it replaces the old one
+    fflush(file);
+    fsync(fileno(file));
+    fclose(file);
+
+    if (rename(tmpname.c_str(), filename.c_str()) != 0)
+	fprintf(stderr,"Error renaming manifest %s!\n",tmpname.c_str());
+}
+
+int Manifest::findStage(string stage)
+{
+    for (unsigned int i=0; i<done.size(); i++)
+	if (done[i].stage == stage)
+	    return i;
+    return -1;
+}
+
+bool Manifest::IsDone(string stage)
+{
+    return findStage(stage) >= 0;
+}
+
+bool Manifest::Check(string stage)
+{
+    int i = findStage(stage);
+    if (i < 0)
+	return false;
+
+    struct stat st;
+    for (unsigned int j=0; j<done[i].files.size(); j++)
+    {
+	if (stat(done[i].files[j].c_str(), &st) != 0 || (uint64_t)st.st_size != done[i].sizes[j])
+	{
+	    fprintf(stderr,"%s from stage %s is missing or changed!\n",
+		    done[i].files[j].c_str(), stage.c_str());
+	    return false;
+	}
+    }
+    return true;
+}
+
+int Manifest::Resume(const char **stages, int n)
+{
+    int k = 0;
+    while (k < n && IsDone(stages[k]))
+	k++;
+
+    // the files of earlier stages are used up by now, but the last
+    // one's are what the next stage needs
+    if (k > 0 && !Check(stages[k-1]))
+    {
+	fprintf(stderr,"Can't resume from %s, starting over.\n",filename.c_str());
+	Clear();
+	return 0;
+    }
+    return k;
+}
+
+void Manifest::Finish(string stage, const vector<string>& files)
+{
+    int i = findStage(stage);
+    if (i < 0)
+    {
+	Entry e;
+	e.stage = stage;
+	done.push_back(e);
+	i = done.size()-1;
+    }
+    done[i].files = files;
+    done[i].sizes.clear();
+
+    struct stat st;
+    for (unsigned int j=0; j<files.size(); j++)
+    {
+	if (stat(files[j].c_str(), &st) != 0)
+	    st.st_size = 0;
+	done[i].sizes.push_back(st.st_size);
+    }
+
+    save();
+}
+
+void Manifest::Clear()
+{
+    done.clear();
+    keys.clear();
+    values.clear();
+    save();
+}
+
+void Manifest::SetValue(string key, const void *data, int size)
+{
+    string hex = toHex(data, size);
+    for (unsigned int i=0; i<keys.size(); i++)
+    {
+	if (keys[i] == key)
+	{
+	    values[i] = hex;
+	    return;
+	}
+    }
+    keys.push_back(key);
+    values.push_back(hex);
+}
+
+bool Manifest::GetValue(string key, void *data, int size)
+{
+    for (unsigned int i=0; i<keys.size(); i++)
+	if (keys[i] == key)
+	    return fromHex(values[i], data, size);
+    return false;
+}
+
+void Manifest::SetString(string key, string s)
+{
+    SetValue(key, s.c_str(), s.size());
+}
+
+bool Manifest::GetString(string key, string& s)
+{
+    for (unsigned int i=0; i<keys.size(); i++)
+    {
+	if (keys[i] == key)
+	{
+	    s = string(values[i].size()/2, 0);
+	    return fromHex(values[i], &s[0], s.size());
+	}
+    }
+    return false;
+}
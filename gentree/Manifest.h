@@ -0,0 +1,77 @@
+#ifndef _MANIFEST_H_
+#define _MANIFEST_H_
+
+#include <string>
+#include <vector>
+#include "xstdint.h"
+
+using namespace std;
+
+
+// adds every existing subfile of filename (filename.0, .1, ...) to files
+void listSubfiles(string filename, vector<string>& files);
+// removes every subfile of filename, and filename itself
+void removeSubfiles(string filename);
+
+
+/* Records which stages of one chain (say, one snapshot's points) have
+   finished, so that a restarted run can skip them. Each finished stage
+   lists the files it left behind, with their sizes, and values hold the
+   state later stages need, as raw structs. Kept as a small text file,
+   rewritten through a temp file and a rename after every change, so a
+   crash leaves either the old or the new version. */
+class Manifest
+{
+private:
+    struct Entry
+    {
+	string stage;
+	vector<string> files;
+	vector<uint64_t> sizes;
+    };
+
+    string filename;
+    vector<Entry> done;
+    vector<string> keys;
+    vector<string> values;
+
+    void load();
+    void save();
+    int findStage(string stage);
+
+    // mark as private, no copying allowed
+    Manifest(const Manifest& other);
+
+    // same here
+    Manifest& operator=(const Manifest& old);
+
+public:
+
+    // loads the manifest, if there is one yet
+    Manifest(string fname);
+
+    bool IsDone(string stage);
+
+    // is every file the stage left still there, at the same size?
+    bool Check(string stage);
+
+    // returns how many of the given stages are done, in order; if the last
+    // of those no longer checks out, forgets everything and returns 0
+    int Resume(const char **stages, int n);
+
+    // records a stage as done, with the files it left behind
+    void Finish(string stage, const vector<string>& files);
+
+    // forgets everything, to start over
+    void Clear();
+
+    // values are saved along with the next Finish
+    void SetValue(string key, const void *data, int size);
+    // returns false if there is no such value, or it's the wrong size
+    bool GetValue(string key, void *data, int size);
+
+    void SetString(string key, string s);
+    bool GetString(string key, string& s);
+};
+
+#endif
@@ -8,50 +8,32 @@
 #include "CreateBlocks.h"
 #include "PartFiles.h"
 #include "Formats.h"
+#include "Sort.h"
 #include "TreeIndex.h"
 #include "Process.h"
+#include "Threads.h"
 
-extern LargeWriter *writer;
-extern VertexB* PendingBlocks[MAX_DEPTH][8];
-extern int PendingCount[MAX_DEPTH][8];
-extern uint64_t BlockChildLocation[MAX_DEPTH][8];
-extern uint64_t BlockChildLength[MAX_DEPTH][8];
-extern int16_t BlockChildFlags[MAX_DEPTH][8];
-extern int16_t BlockChildFile[MAX_DEPTH][8];
-extern int MAX_COUNT;
-extern BlockFile *curBlockFile;
+// fewest points worth giving a thread when matching to the next timestep
+#define MATCH_MIN_POINTS 4096
 
-
-// input array into which we copy all pending blocks
-VertexB* PtsIn;
-// output array for writeblocks
-OutVertex* OutPoints;
-
-
-// a struct to hold rearranged PtsOut, for merging next
-struct NextPt
+template<>
+struct SortKey<NextPt>
 {
-    uint64_t coord; // octtree coord in *next* timestep
-    double pos[3];
-    VertexB* orig;
-
-    bool operator< (const NextPt& b) const
-    {
-	return coord < b.coord;
-    }
+    static uint64_t Get(const NextPt& p) { return p.coord; }
 };
 
-// for repeating procedure, just with the next position
-NextPt* PtsNext;
-
 
 void mergenext(VertexB *a, NextPt *b);
 
 
 
 // Merges all of the children of specified block into one block
-void MergeBlock(int depth, int blocknum, int shift)
+void BlockBuilder::MergeBlock(uint64_t block, int depth, int shift)
 {
+    int blocknum = block&7;
+    // same random choices no matter what order blocks get built in
+    SeedRandom(block, depth);
+
     int count = 0;
     // first, copy input arrays to PtsIn
     for (int i=0; i<8; i++)
@@ -92,19 +74,7 @@ void MergeBlock(int depth, int blocknum, int shift)
 	}
     }
 
-    // and recompute bit indices, now that we have min/max of block
-    for (int i=0; i<count; i++)
-    {
-	// if this was flagged as selected, it is already included in PtsOut
-	if (PtsIn[i].coord == 0)
-	    continue;
-
-	PtsIn[i].coord = GetCoord( (PtsIn[i].pos[0]-minpos[0])/(maxpos[0]-minpos[0]),
-				   (PtsIn[i].pos[1]-minpos[1])/(maxpos[1]-minpos[1]),
-				   (PtsIn[i].pos[2]-minpos[2])/(maxpos[2]-minpos[2]));
-    }
-
-    // now do the same for PtsOut, but put reordered into PtsNext
+    // now do the same for PtsOut, but put into PtsNext
     for (int i=0; i<MAX_COUNT; i++)
     {
 	// set pointer to original point
@@ -112,15 +82,37 @@ void MergeBlock(int depth, int blocknum, int shift)
 	// and update position by time
 	for (int j=0; j<3; j++)
 	    PtsNext[i].pos[j] = PtsOut[i].pos[j] + PtsOut[i].vel[j] + 0.5*PtsOut[i].acc[j];
-	// and compute coord
-	PtsNext[i].coord = GetCoord( (PtsNext[i].pos[0]-minpos[0])/(maxpos[0]-minpos[0]),
-				     (PtsNext[i].pos[1]-minpos[1])/(maxpos[1]-minpos[1]),
-				     (PtsNext[i].pos[2]-minpos[2])/(maxpos[2]-minpos[2]));
     }
 
-    // alright, now we need to sort both arrays by coord
-    std::sort(PtsIn, PtsIn+count);
-    std::sort(PtsNext, PtsNext+MAX_COUNT);
+    // octree order is only needed for matching by window
+    if (NextMatch == NEXT_WINDOW)
+    {
+	double range[3];
+	for (int j=0; j<3; j++)
+	    range[j] = maxpos[j]-minpos[j];
+
+	// recompute bit indices, now that we have min/max of block, but
+	// remember which were flagged as selected, since those are already
+	// included in PtsOut
+	for (int i=0; i<count; i++)
+	    NextIndex[i] = (PtsIn[i].coord == 0);
+	MortonEncodeBatch(PtsIn[0].pos, sizeof(VertexB), count, minpos, range,
+			  &PtsIn[0].coord, sizeof(VertexB));
+	for (int i=0; i<count; i++)
+	{
+	    if (NextIndex[i])
+		PtsIn[i].coord = 0;
+	}
+
+	MortonEncodeBatch(PtsNext[0].pos, sizeof(NextPt), MAX_COUNT, minpos, range,
+			  &PtsNext[0].coord, sizeof(NextPt));
+
+	// alright, now we need to sort both arrays by coord
+	RadixSortMSD(PtsIn, count);
+	RadixSortMSD(PtsNext, MAX_COUNT);
+    }
+    else
+	NextGrid->Build(PtsNext[0].pos, sizeof(NextPt), MAX_COUNT);
 
     // now actually merge next timestep
     MergeNextTime(count, PtsOut);
@@ -131,7 +123,7 @@ void MergeBlock(int depth, int blocknum, int shift)
 
 // merges all properties at current timestep
 // reads from PtsIn, outputs to PtsOut
-void MergeCurrentTime(int shift, int count, VertexB* PtsOut)
+void BlockBuilder::MergeCurrentTime(int shift, int count, VertexB* PtsOut)
 {
     // number originally in bin
     int binold[BIN_COUNT];
@@ -199,7 +191,7 @@ void MergeCurrentTime(int shift, int count, VertexB* PtsOut)
     // if we have any left, randomly distribute
     while (total > 0)
     {
-	int ind = rand()%BIN_COUNT;
+	int ind = Random()%BIN_COUNT;
 	// make sure we are reducing
 	if (binnum[ind] < binold[ind])
 	{
@@ -210,7 +202,6 @@ void MergeCurrentTime(int shift, int count, VertexB* PtsOut)
 
     // index of output point
     int outIndex=0;
-    int cmp=0;
     for (int t=0;t<BIN_COUNT;t++)
     {
 	if (binnum[t] == 0) // empty bin
@@ -221,7 +212,7 @@ void MergeCurrentTime(int shift, int count, VertexB* PtsOut)
 	// copy points into output array
 	for (int i=0;i<binnum[t];i++)
 	{
-	    int rnd = rand() % cnt;
+	    int rnd = Random() % cnt;
 	    // put point into output
 	    PtsOut[outIndex+i] = PtsIn[binstart[t]+rnd];
 
@@ -236,87 +227,168 @@ void MergeCurrentTime(int shift, int count, VertexB* PtsOut)
 	    cnt--;
 	}
 
-	VertexB *a;
-	VertexB *b;
 	// and now take care of remaining points:
 	// merge each one with nearest point in output array
-	a = PtsIn + binstart[t];
-	for (int i=0;i<cnt;i++)
+	if (cnt > 0)
+	{
+	    MergeGrid->Build(PtsOut[outIndex].pos, sizeof(VertexB), binnum[t]);
+	    VertexB *a = PtsIn + binstart[t];
+	    for (int i=0;i<cnt;i++)
+	    {
+		double minDist;
+		int minIndex = MergeGrid->Nearest(a->pos, minDist);
+		mergecur(a, PtsOut+outIndex+minIndex);
+		a++;
+	    }
+	    // what checking every pair would have cost
+	    bruteEvals += (uint64_t)cnt*binnum[t];
+	}
+	// and step forward the out index
+	outIndex += binnum[t];
+    }
+}
+
+
+
+
+/* Finds the match in PtsNext for a range of PtsIn, either by looking
+   a few either side of its place in octree order (both sorted by coord),
+   or from the grid over PtsNext. */
+struct NextMatchJob
+{
+    VertexB *pts;
+    int first;
+    int last;
+    NextPt *next;
+    int numNext;
+    const PointGrid *grid;
+    int mode;
+
+    int *match;
+    double *dist;
+    uint64_t evals;
+
+    void Run()
+    {
+	evals = 0;
+
+	// index of output point, for the window
+	int outIndex = 0;
+	if (mode == NEXT_WINDOW && first < last)
 	{
-	    double minDist = 1000;
-	    int minIndex = -1;
-	    b = PtsOut + outIndex;
-	    for (int j=0;j<binnum[t];j++)
+	    NextPt key;
+	    key.coord = pts[first].coord;
+	    outIndex = std::lower_bound(next, next+numNext, key) - next;
+	    if (outIndex > numNext-1)
+		outIndex = numNext-1;
+	}
+
+	for (int i=first; i<last; i++)
+	{
+	    match[i] = -1;
+	    // skip over all the points that we have already put in PtsOut
+	    if (pts[i].coord == 0)
+		continue;
+
+	    if (mode != NEXT_WINDOW)
+	    {
+		match[i] = grid->Nearest(pts[i].pos, dist[i], evals, mode == NEXT_APPROX ? 1 : 0);
+		continue;
+	    }
+
+	    // advance outIndex to next point we want to merge with
+	    while (outIndex < numNext-1 && pts[i].coord > next[outIndex].coord)
+		outIndex++;
+
+	    // find spatially nearest point within a few
+	    int start = outIndex - 3;
+	    int end = outIndex + 3;
+	    if (start < 0) start = 0;
+	    if (end > numNext) end = numNext;
+
+	    double minDist = 1e300;
+	    for (int j=start; j< end; j++)
 	    {
-		double d = (a->pos[0]-b->pos[0])*(a->pos[0]-b->pos[0])
-		    + (a->pos[1]-b->pos[1])*(a->pos[1]-b->pos[1])
-		    + (a->pos[2]-b->pos[2])*(a->pos[2]-b->pos[2]);
+		double d = (pts[i].pos[0]-next[j].pos[0])*(pts[i].pos[0]-next[j].pos[0])
+		    + (pts[i].pos[1]-next[j].pos[1])*(pts[i].pos[1]-next[j].pos[1])
+		    + (pts[i].pos[2]-next[j].pos[2])*(pts[i].pos[2]-next[j].pos[2]);
 		if (d<minDist)
 		{
 		    minDist = d;
-		    minIndex = j;
+		    match[i] = j;
 		}
-		cmp++;
-		b++;
 	    }
-	    mergecur(a, PtsOut+outIndex+minIndex);
-	    a++;
-	} 
-	// and step forward the out index
-	outIndex += binnum[t];
+	    dist[i] = minDist;
+	    evals += end - start;
+	}
     }
-}
+};
 
 
+// finds the match of each point in PtsIn, on several threads if worth it
+void BlockBuilder::FindNextMatches(int count)
+{
+    int nthreads = MIN(mergeThreads, count / MATCH_MIN_POINTS);
+    if (nthreads < 1)
+	nthreads = 1;
+
+    NextMatchJob *jobs = new NextMatchJob[nthreads];
+    for (int t=0; t<nthreads; t++)
+    {
+	jobs[t].pts = PtsIn;
+	jobs[t].first = (int)((uint64_t)count*t / nthreads);
+	jobs[t].last = (int)((uint64_t)count*(t+1) / nthreads);
+	jobs[t].next = PtsNext;
+	jobs[t].numNext = MAX_COUNT;
+	jobs[t].grid = NextGrid;
+	jobs[t].mode = NextMatch;
+	jobs[t].match = NextIndex;
+	jobs[t].dist = NextDist;
+    }
+    RunThreads(jobs, nthreads);
+
+    for (int t=0; t<nthreads; t++)
+	nextEvals += jobs[t].evals;
+    delete[] jobs;
+}
 
 
 // merges all properties at next timestep
 // reads from updated PtsIn and uses PtsNext to update PtsOut
-void MergeNextTime(int count, VertexB* PtsOut)
+void BlockBuilder::MergeNextTime(int count, VertexB* PtsOut)
 {
     // we are going to merge each point in PtsIn with the point in
-    // PtsOut that has the closest octtree coordinate. that's all.
+    // PtsOut that is nearest in the next timestep. that's all.
     // our goal is to give away all of PtsIn's net next properties
     // to PtsNext->orig (in PtsOut).
 
-    // index of output point
-    int outIndex=0;
+    // finding the matches can be done in parallel...
+    FindNextMatches(count);
+
+    // ...but merging into them can't, and in order keeps it repeatable
     for (int i=0; i<count; i++)
     {
-	// skip over all the points that we have already put in PtsOut
-	if (PtsIn[i].coord == 0)
+	if (NextIndex[i] < 0)
 	    continue;
-
-	// advance outIndex to next point we want to merge with
-	while (outIndex < MAX_COUNT-1 && PtsIn[i].coord > PtsNext[outIndex].coord)
-	    outIndex++;
-
-	// find spatially nearest point within a few
-	int start = outIndex - 3;
-	int end = outIndex + 3;
-	if (start < 0) start = 0;
-	if (end > MAX_COUNT) end = MAX_COUNT;
-
-	int minIndex = -1;
-	double minDist = 1e300;
-
-	for (int j=start; j< end; j++)
-	{
-	    double d = (PtsIn[i].pos[0]-PtsNext[j].pos[0])*(PtsIn[i].pos[0]-PtsNext[j].pos[0])
-		+ (PtsIn[i].pos[1]-PtsNext[j].pos[1])*(PtsIn[i].pos[1]-PtsNext[j].pos[1])
-		+ (PtsIn[i].pos[2]-PtsNext[j].pos[2])*(PtsIn[i].pos[2]-PtsNext[j].pos[2]);
-	    if (d<minDist)
-	    {
-		minDist = d;
-		minIndex = j;
-	    }
-	}
-	if (minIndex >= 0)
-	    mergenext(PtsIn+i, PtsNext+minIndex);
+	mergenext(PtsIn+i, PtsNext+NextIndex[i]);
+	nextMatches++;
+	nextDistSum += sqrt(NextDist[i]);
     }
 }
 
 
+// prints how much work the merging took, and how good the matches were
+void BlockBuilder::PrintMergeStats()
+{
+    printf("%lu distance evaluations in merges (%lu brute force).\n",
+	   (long unsigned int)MergeGrid->evals, (long unsigned int)bruteEvals);
+    printf("%lu next timestep matches, mean distance %g, from %lu distance evaluations.\n",
+	   (long unsigned int)nextMatches, nextMatches > 0 ? nextDistSum/nextMatches : 0.0,
+	   (long unsigned int)nextEvals);
+    if (CompressBlocks)
+	printf("Child groups packed from %lu to %lu bytes (%.2f to 1).\n", (long unsigned int)rawBytes,
+	       (long unsigned int)packedBytes, packedBytes > 0 ? (double)rawBytes/packedBytes : 0.0);
+}
 
 
 
@@ -389,16 +461,39 @@ inline void mergenext(VertexB *a, NextPt *b)
 
 
 
-void SetupBlocks()
+// bytes in the arrays below, for the stage stats
+static int64_t setupBytes(int maxCount)
+{
+    return (int64_t)maxCount*(8*sizeof(VertexB) + sizeof(NextPt) + sizeof(OutVertex)
+			       + 8*sizeof(int) + 8*sizeof(double));
+}
+
+void BlockBuilder::SetupBlocks()
 {
     PtsIn = (VertexB*)malloc(8*MAX_COUNT*sizeof(VertexB));
     PtsNext = (NextPt*)malloc(MAX_COUNT*sizeof(NextPt));
     OutPoints = (OutVertex*)malloc(MAX_COUNT*sizeof(OutVertex));
+    MergeGrid = new PointGrid();
+    bruteEvals = 0;
+    NextGrid = new PointGrid();
+    NextIndex = (int*)malloc(8*MAX_COUNT*sizeof(int));
+    NextDist = (double*)malloc(8*MAX_COUNT*sizeof(double));
+    nextEvals = 0;
+    nextMatches = 0;
+    nextDistSum = 0;
+    rawBytes = 0;
+    packedBytes = 0;
+    countAlloc(setupBytes(MAX_COUNT));
 }
 
-void CleanupBlocks()
+void BlockBuilder::CleanupBlocks()
 {
     free(PtsIn);
     free(PtsNext);
     free(OutPoints);
+    delete MergeGrid;
+    delete NextGrid;
+    free(NextIndex);
+    free(NextDist);
+    countFree(setupBytes(MAX_COUNT));
 }
@@ -1,122 +1,349 @@
 #include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <vector>
 #include "PartFiles.h"
+#include "Threads.h"
 
 #ifndef _MERGEFILES_H_
 #define _MERGEFILES_H_
 
-template<typename T>
-void MergeFiles(string infile, string outfile, int start1, int end1, int start2, int end2);
-
+// total memory for read buffers during a merge, split among all runs
+#define MERGE_BUF_SIZE 800000000
+// smallest read buffer we will give a single run
+#define MERGE_MIN_BUF 1000000
+// number of samples taken from each run to pick key splitters
+#define MERGE_SAMPLES 64
 
-/* Merges a bunch of files sorted individually into a bunch of files
-   sorted together (but still in the same-sized files), using given comparison function.
-   Can use a second temporary location/file, and returns final path. */
 
+/* A tree of losers over k sorted runs. The root holds the index of the run
+   with the smallest current element; after that run is advanced, only the
+   path from its leaf to the root is replayed, so each element costs
+   log2(k) comparisons. Exhausted runs always lose, ties go to lower index. */
 template<typename T>
-PathPair MergeSorted(string filename, PathPair paths)
+class LoserTree
 {
-    int numFiles;
+private:
+    int k;
+    // tree[0] is the overall winner, tree[1..k-1] the losers at each node
+    int *tree;
+    RangeReader<T> **runs;
 
-    // get number of files
-    FILE *fhead = fopen((paths.location+filename).c_str(), "r");
-    fread(&numFiles, sizeof(int), 1, fhead);
-    fclose(fhead);
-    // and remove that temp file
-    remove((paths.location+filename).c_str());
+    // does run a come before run b?
+    bool beats(int a, int b)
+    {
+	if (!runs[a]->CanRead())
+	    return false;
+	if (!runs[b]->CanRead())
+	    return true;
+	if (runs[a]->Read() < runs[b]->Read())
+	    return true;
+	if (runs[b]->Read() < runs[a]->Read())
+	    return false;
+	return a < b;
+    }
 
-    // return if we don't need ta do nothin
-    if (numFiles == 1)
-	return paths;
+    // returns winner of subtree, storing losers on the way
+    int build(int node)
+    {
+	// leaves are at k...2k-1
+	if (node >= k)
+	    return node - k;
+	int l = build(2*node);
+	int r = build(2*node+1);
+	if (beats(l, r))
+	{
+	    tree[node] = r;
+	    return l;
+	}
+	tree[node] = l;
+	return r;
+    }
 
-    int numBlocks = numFiles; // number of sorted chunks
-    int blockLen = 1; // number of sorted files in each block
+    // mark as private, no copying allowed
+    LoserTree(const LoserTree& other);
 
-    printf("Blocks left: %d...",numBlocks);
-    fflush(stdout);
+    // same here
+    LoserTree& operator=(const LoserTree& old);
+
+public:
 
-    while (numBlocks > 1)
+    LoserTree(RangeReader<T> **r, int n)
     {
-	for (int start = 0; start < numFiles; start += 2*blockLen)
-	{	  
-	    if (numFiles - start <= blockLen)
-	    {
-		// we have reached the end, and only sorted files remain
-		// so we do a dummy write to copy data
-		MergeFiles<T>(paths.location + filename, paths.temp + filename, start, numFiles-1, numFiles, numFiles);
-	    }
-	    else if (numFiles - start < 2*blockLen)
-	    {
-		// we have reached the end, but don't have full set
-		MergeFiles<T>(paths.location + filename, paths.temp + filename, start, start+blockLen-1, start+blockLen, numFiles-1);
-		numBlocks--;
-	    }
-	    else
+	k = n;
+	runs = r;
+	tree = new int[k];
+	tree[0] = build(1);
+    }
+
+    ~LoserTree()
+    {
+	delete[] tree;
+    }
+
+    bool CanRead()
+    {
+	return runs[tree[0]]->CanRead();
+    }
+
+    const T& Read()
+    {
+	return runs[tree[0]]->Read();
+    }
+
+    // advances the winning run and replays its path
+    void Next()
+    {
+	int w = tree[0];
+	runs[w]->Next();
+	for (int node = (w+k)/2; node >= 1; node /= 2)
+	{
+	    if (beats(tree[node], w))
 	    {
-		// have full set
-		MergeFiles<T>(paths.location + filename, paths.temp + filename, start, start+blockLen-1, start+blockLen, start+2*blockLen-1);
-		numBlocks--;
+		int tmp = tree[node];
+		tree[node] = w;
+		w = tmp;
 	    }
-	    printf("%d blocks left...",numBlocks);
-	    fflush(stdout);
 	}
-	blockLen *= 2;
-	// swap source and destination reading
-	paths.swap();
+	tree[0] = w;
     }
-    printf("done.\n");
-    // this is our last written-to destination
-    return paths;
+};
+
+
+/* Merges part of every run (elements [first[i], last[i]) of run i, in global
+   element indices) into the output, starting at global index outStart. */
+template<typename T>
+struct MergeJob
+{
+    string infile;
+    string outfile;
+    int numRuns;
+    uint64_t *first;
+    uint64_t *last;
+    uint64_t outStart;
+    int bufSize;
+    // writing into preallocated files, shared with other jobs?
+    bool update;
+    // frame to pack the output in, or NULL for full records
+    const RecordFrame *frame;
+
+    void Run()
+    {
+	RangeReader<T> **runs = new RangeReader<T>*[numRuns];
+	for (int i=0; i<numRuns; i++)
+	    runs[i] = new RangeReader<T>(infile, first[i], last[i], bufSize);
+
+	RawWriter<T> writer(outfile, outStart, update, frame);
+	LoserTree<T> tree(runs, numRuns);
+
+	while (tree.CanRead())
+	{
+	    writer.Write(tree.Read());
+	    tree.Next();
+	}
+
+	writer.Close();
+
+	for (int i=0; i<numRuns; i++)
+	    delete runs[i];
+	delete[] runs;
+    }
+};
+
+
+// returns number of elements in a given subfile (packed or not)
+template<typename T>
+uint64_t getSubfileCount(string filename, int num)
+{
+    return SubfileInput<T>::Count(getSubfile(filename, num));
 }
 
+// reads a single element at a global index
+template<typename T>
+void readElement(string filename, uint64_t index, T& t)
+{
+    SubfileInput<T> input;
+    input.Open(getSubfile(filename, index/RangeReader<T>::FileMax));
+    input.Seek(index%RangeReader<T>::FileMax);
+    input.Read(&t, 1);
+}
+
+// finds first index in sorted [first, last) that is not less than t
+template<typename T>
+uint64_t lowerBound(string filename, uint64_t first, uint64_t last, const T& t)
+{
+    T cur;
+    while (first < last)
+    {
+	uint64_t mid = first + (last-first)/2;
+	readElement<T>(filename, mid, cur);
+	if (cur < t)
+	    first = mid + 1;
+	else
+	    last = mid;
+    }
+    return first;
+}
 
-/* Merges one pair/set of files. */
+
+/* Merges a bunch of files sorted individually into a bunch of files
+   sorted together (but still in the same-sized files), in a single pass.
+   Reads from the location path and writes to the temp path, and returns
+   the swapped paths, so that location points at the merged files.
+   The runs and their count file are left for the caller to remove, so
+   that an interrupted merge can be run again.
+   With several threads, the key range is split at sampled splitters and
+   each piece is merged into its own part of the output. */
 
 template<typename T>
-void MergeFiles(string infile, string outfile, int start1, int end1, int start2, int end2)
+PathPair MergeSorted(string filename, PathPair paths)
 {
-//    printf("Merging %s -> %s, (%d, %d) + (%d, %d)\n",infile.c_str(),outfile.c_str(), start1,end1,start2,end2);
+    int numFiles = 0;
 
-    BufferedReader<T> reader1(infile, start1, end1);
-    BufferedReader<T> reader2(infile, start2, end2);
+    // get number of files
+    FILE *fhead = fopen((paths.location+filename).c_str(), "r");
+    if (fhead == NULL || fread(&numFiles, sizeof(int), 1, fhead) != 1)
+    {
+	fprintf(stderr,"Can't read run count of %s, not merging!\n",(paths.location+filename).c_str());
+	numFiles = 0;
+    }
+    if (fhead != NULL)
+	fclose(fhead);
 
-    RawWriter<T> writer(outfile, start1);
+    // return if we don't need ta do nothin (no runs at all, for an
+    // empty snapshot, or just the one)
+    if (numFiles <= 1)
+	return paths;
+
+    string infile = paths.location + filename;
+    string outfile = paths.temp + filename;
 
-    // tells them to delete each file as it's read
-    reader1.SetDelete(true);
-    reader2.SetDelete(true);
+    const uint64_t fileMax = RangeReader<T>::FileMax;
 
-    while (reader1.CanRead() && reader2.CanRead())
+    // each run is one file, so its elements start at a multiple of fileMax
+    uint64_t total = 0;
+    uint64_t *runStart = new uint64_t[numFiles];
+    uint64_t *runEnd = new uint64_t[numFiles];
+    for (int i=0; i<numFiles; i++)
     {
-	// write smaller of the two, using built-in operator
-	if (reader1.Read() < reader2.Read())
+	runStart[i] = i*fileMax;
+	runEnd[i] = runStart[i] + getSubfileCount<T>(infile, i);
+	total += runEnd[i] - runStart[i];
+    }
+
+    // output is packed too if every run is, in a frame covering them all,
+    // unless the pids of all the runs together get too far apart
+    RecordFrame frame;
+    bool packed = Packing<T>::Exists;
+    frame.Begin();
+    for (int i=0; i<numFiles && packed; i++)
+    {
+	RecordFrame f;
+	packed = SubfileInput<T>::ReadFrame(getSubfile(infile, i), f);
+	frame.Add(f);
+    }
+    if (!frame.Fits())
+	packed = false;
+
+    int nthreads = NumThreads;
+    // not worth splitting tiny merges
+    if ((uint64_t)nthreads*MERGE_SAMPLES > total)
+	nthreads = 1;
+
+    int bufSize = MERGE_BUF_SIZE / (numFiles*nthreads);
+    if (bufSize < MERGE_MIN_BUF)
+	bufSize = MERGE_MIN_BUF;
+
+    printf("Merging %d runs with %d threads...", numFiles, nthreads);
+    fflush(stdout);
+
+    // bounds[j*numFiles + i] is start of piece j in run i
+    uint64_t *bounds = new uint64_t[(nthreads+1)*numFiles];
+    for (int i=0; i<numFiles; i++)
+    {
+	bounds[i] = runStart[i];
+	bounds[nthreads*numFiles + i] = runEnd[i];
+    }
+
+    if (nthreads > 1)
+    {
+	// sample each run evenly, and pick splitters from the sorted samples
+	std::vector<T> samples;
+	for (int i=0; i<numFiles; i++)
 	{
-	    writer.Write(reader1.Read());
-	    reader1.Next();
+	    uint64_t len = runEnd[i] - runStart[i];
+	    for (int s=0; s<MERGE_SAMPLES && (uint64_t)s<len; s++)
+	    {
+		T t;
+		readElement<T>(infile, runStart[i] + (len*s)/MERGE_SAMPLES, t);
+		samples.push_back(t);
+	    }
 	}
-	else
+	std::sort(samples.begin(), samples.end());
+
+	// and find where each splitter falls in each run
+	for (int j=1; j<nthreads; j++)
 	{
-	    writer.Write(reader2.Read());
-	    reader2.Next();
+	    const T& split = samples[(samples.size()*j)/nthreads];
+	    for (int i=0; i<numFiles; i++)
+		bounds[j*numFiles + i] = lowerBound<T>(infile, runStart[i], runEnd[i], split);
 	}
-    }
 
-    // write any leftovers
-    while (reader1.CanRead())
-    {
-	writer.Write(reader1.Read());
-	reader1.Next();
+	// preallocate output files, since pieces get written out of order
+	int numOut = (int)((total + fileMax - 1) / fileMax);
+	for (int f=0; f<numOut; f++)
+	{
+	    uint64_t len = fileMax;
+	    if (f == numOut-1)
+		len = total - f*fileMax;
+	    FILE *file = fopen(getSubfile(outfile, f).c_str(), "wb");
+	    if (packed)
+	    {
+		fwrite(&frame, sizeof(RecordFrame), 1, file);
+		fclose(file);
+		truncate(getSubfile(outfile, f).c_str(),
+			 sizeof(RecordFrame) + len*sizeof(typename Packing<T>::Packed));
+	    }
+	    else
+	    {
+		fclose(file);
+		truncate(getSubfile(outfile, f).c_str(), len*sizeof(T));
+	    }
+	}
     }
-    while (reader2.CanRead())
+
+    MergeJob<T> *jobs = new MergeJob<T>[nthreads];
+    uint64_t outStart = 0;
+    for (int j=0; j<nthreads; j++)
     {
-	writer.Write(reader2.Read());
-	reader2.Next();
+	jobs[j].infile = infile;
+	jobs[j].outfile = outfile;
+	jobs[j].numRuns = numFiles;
+	jobs[j].first = bounds + j*numFiles;
+	jobs[j].last = bounds + (j+1)*numFiles;
+	jobs[j].outStart = outStart;
+	jobs[j].bufSize = bufSize;
+	jobs[j].update = (nthreads > 1);
+	jobs[j].frame = packed ? &frame : NULL;
+
+	for (int i=0; i<numFiles; i++)
+	    outStart += jobs[j].last[i] - jobs[j].first[i];
     }
 
-    writer.Close();
+    RunThreads(jobs, nthreads);
 
-    // print starts of blocks and block size
-    printf("(%d,%d,%d)...", start1, start2, 1+(end1-start1));
+    printf("done.\n");
     fflush(stdout);
+
+    delete[] jobs;
+    delete[] bounds;
+    delete[] runStart;
+    delete[] runEnd;
+
+    // merged output is now at the other location
+    paths.swap();
+    return paths;
 }
 
 #endif
@@ -0,0 +1,163 @@
+#include "Morton.h"
+
+#ifdef __AVX2__
+#include <immintrin.h>
+
+// spreads the low 21 bits of each lane out to every third bit
+static inline __m256i spread4(__m256i v)
+{
+    v = _mm256_and_si256(v, _mm256_set1_epi64x(0x1fffff));
+    v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi64(v, 32)), _mm256_set1_epi64x(0x1f00000000ffffULL));
+    v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi64(v, 16)), _mm256_set1_epi64x(0x1f0000ff0000ffULL));
+    v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi64(v, 8)), _mm256_set1_epi64x(0x100f00f00f00f00fULL));
+    v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi64(v, 4)), _mm256_set1_epi64x(0x10c30c30c30c30c3ULL));
+    v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi64(v, 2)), _mm256_set1_epi64x(MORTON_MASK));
+    return v;
+}
+
+static inline __m256i compact4(__m256i v)
+{
+    v = _mm256_and_si256(v, _mm256_set1_epi64x(MORTON_MASK));
+    v = _mm256_and_si256(_mm256_xor_si256(v, _mm256_srli_epi64(v, 2)), _mm256_set1_epi64x(0x10c30c30c30c30c3ULL));
+    v = _mm256_and_si256(_mm256_xor_si256(v, _mm256_srli_epi64(v, 4)), _mm256_set1_epi64x(0x100f00f00f00f00fULL));
+    v = _mm256_and_si256(_mm256_xor_si256(v, _mm256_srli_epi64(v, 8)), _mm256_set1_epi64x(0x1f0000ff0000ffULL));
+    v = _mm256_and_si256(_mm256_xor_si256(v, _mm256_srli_epi64(v, 16)), _mm256_set1_epi64x(0x1f00000000ffffULL));
+    v = _mm256_and_si256(_mm256_xor_si256(v, _mm256_srli_epi64(v, 32)), _mm256_set1_epi64x(0x1fffff));
+    return v;
+}
+
+// same as MortonQuantize((x-lo)/range), for four at once
+static inline __m256i quantize4(__m256d x, __m256d lo, __m256d range)
+{
+    x = _mm256_div_pd(_mm256_sub_pd(x, lo), range);
+    x = _mm256_mul_pd(x, _mm256_set1_pd(MORTON_SIZE));
+    // NaNs come out of max as the second operand, 0
+    x = _mm256_max_pd(x, _mm256_setzero_pd());
+    x = _mm256_min_pd(x, _mm256_set1_pd(MORTON_SIZE-1));
+    return _mm256_cvtepu32_epi64(_mm256_cvttpd_epi32(x));
+}
+
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+
+// the same again, two at a time
+static inline __m128i spread2(__m128i v)
+{
+    v = _mm_and_si128(v, _mm_set1_epi64x(0x1fffff));
+    v = _mm_and_si128(_mm_or_si128(v, _mm_slli_epi64(v, 32)), _mm_set1_epi64x(0x1f00000000ffffULL));
+    v = _mm_and_si128(_mm_or_si128(v, _mm_slli_epi64(v, 16)), _mm_set1_epi64x(0x1f0000ff0000ffULL));
+    v = _mm_and_si128(_mm_or_si128(v, _mm_slli_epi64(v, 8)), _mm_set1_epi64x(0x100f00f00f00f00fULL));
+    v = _mm_and_si128(_mm_or_si128(v, _mm_slli_epi64(v, 4)), _mm_set1_epi64x(0x10c30c30c30c30c3ULL));
+    v = _mm_and_si128(_mm_or_si128(v, _mm_slli_epi64(v, 2)), _mm_set1_epi64x(MORTON_MASK));
+    return v;
+}
+
+static inline __m128i quantize2(__m128d x, __m128d lo, __m128d range)
+{
+    x = _mm_div_pd(_mm_sub_pd(x, lo), range);
+    x = _mm_mul_pd(x, _mm_set1_pd(MORTON_SIZE));
+    x = _mm_max_pd(x, _mm_setzero_pd());
+    x = _mm_min_pd(x, _mm_set1_pd(MORTON_SIZE-1));
+    return _mm_unpacklo_epi32(_mm_cvttpd_epi32(x), _mm_setzero_si128());
+}
+#endif
+
+
+void MortonEncodeBatch(const double *pos, size_t stride, int n,
+		       const double lo[3], const double range[3],
+		       uint64_t *coords, size_t coordStride)
+{
+    const char *p = (const char*)pos;
+    char *c = (char*)coords;
+    int i = 0;
+
+#ifdef __AVX2__
+    __m256d lo4[3], range4[3];
+    for (int j=0; j<3; j++)
+    {
+	lo4[j] = _mm256_set1_pd(lo[j]);
+	range4[j] = _mm256_set1_pd(range[j]);
+    }
+
+    for (; i+3 < n; i+=4)
+    {
+	const double *p0 = (const double*)(p + i*stride);
+	const double *p1 = (const double*)(p + (i+1)*stride);
+	const double *p2 = (const double*)(p + (i+2)*stride);
+	const double *p3 = (const double*)(p + (i+3)*stride);
+
+	__m256i coord = _mm256_setzero_si256();
+	for (int j=0; j<3; j++)
+	{
+	    __m256d x = _mm256_set_pd(p3[j], p2[j], p1[j], p0[j]);
+	    __m256i q = spread4(quantize4(x, lo4[j], range4[j]));
+	    coord = _mm256_or_si256(coord, _mm256_slli_epi64(q, j));
+	}
+
+	uint64_t out[4];
+	_mm256_storeu_si256((__m256i*)out, coord);
+	for (int k=0; k<4; k++)
+	    *(uint64_t*)(c + (i+k)*coordStride) = out[k];
+    }
+#elif defined(__SSE2__)
+    __m128d lo2[3], range2[3];
+    for (int j=0; j<3; j++)
+    {
+	lo2[j] = _mm_set1_pd(lo[j]);
+	range2[j] = _mm_set1_pd(range[j]);
+    }
+
+    for (; i+1 < n; i+=2)
+    {
+	const double *p0 = (const double*)(p + i*stride);
+	const double *p1 = (const double*)(p + (i+1)*stride);
+
+	__m128i coord = _mm_setzero_si128();
+	for (int j=0; j<3; j++)
+	{
+	    __m128i q = spread2(quantize2(_mm_set_pd(p1[j], p0[j]), lo2[j], range2[j]));
+	    coord = _mm_or_si128(coord, _mm_slli_epi64(q, j));
+	}
+
+	uint64_t out[2];
+	_mm_storeu_si128((__m128i*)out, coord);
+	*(uint64_t*)(c + i*coordStride) = out[0];
+	*(uint64_t*)(c + (i+1)*coordStride) = out[1];
+    }
+#endif
+
+    for (; i < n; i++)
+    {
+	const double *x = (const double*)(p + i*stride);
+	*(uint64_t*)(c + i*coordStride) =
+	    MortonEncode(MortonQuantize((x[0]-lo[0])/range[0]),
+			 MortonQuantize((x[1]-lo[1])/range[1]),
+			 MortonQuantize((x[2]-lo[2])/range[2]));
+    }
+}
+
+
+void MortonDecodeBatch(const uint64_t *coords, int n,
+		       uint32_t *x, uint32_t *y, uint32_t *z)
+{
+    int i = 0;
+
+#ifdef __AVX2__
+    // picks the low half of each lane, to pack four results
+    __m256i pack = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+    for (; i+3 < n; i+=4)
+    {
+	__m256i coord = _mm256_loadu_si256((const __m256i*)(coords+i));
+	uint32_t *out[3] = {x, y, z};
+	for (int j=0; j<3; j++)
+	{
+	    __m256i v = compact4(_mm256_srli_epi64(coord, j));
+	    v = _mm256_permutevar8x32_epi32(v, pack);
+	    _mm_storeu_si128((__m128i*)(out[j]+i), _mm256_castsi256_si128(v));
+	}
+    }
+#endif
+
+    for (; i < n; i++)
+	MortonDecode(coords[i], x[i], y[i], z[i]);
+}
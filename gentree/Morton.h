@@ -0,0 +1,93 @@
+/* Morton (octree) coordinates: the bits of x, y and z interleaved, with
+   x in bit 0, y in bit 1, z in bit 2, and so on up, MORTON_BITS per dim.
+   Uses BMI2 pdep/pext where the compiler has them (-mbmi2), and the
+   usual magic-number shifts otherwise; both give the same bits. */
+
+#ifndef _MORTON_H_
+#define _MORTON_H_
+
+#include "xstdint.h"
+#include <stddef.h>
+
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
+
+// bits per dimension, so coords are 60 bits
+#define MORTON_BITS 20
+#define MORTON_SIZE (1<<MORTON_BITS)
+
+// every third bit, starting at bit 0
+#define MORTON_MASK 0x1249249249249249ULL
+
+
+// spreads the low 21 bits of v out to every third bit
+inline uint64_t MortonSpread(uint64_t v)
+{
+#ifdef __BMI2__
+    return _pdep_u64(v, MORTON_MASK);
+#else
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffULL;
+    v = (v | v << 16) & 0x1f0000ff0000ffULL;
+    v = (v | v << 8) & 0x100f00f00f00f00fULL;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+    v = (v | v << 2) & MORTON_MASK;
+    return v;
+#endif
+}
+
+// and back again, gathering every third bit
+inline uint64_t MortonCompact(uint64_t v)
+{
+#ifdef __BMI2__
+    return _pext_u64(v, MORTON_MASK);
+#else
+    v &= MORTON_MASK;
+    v = (v ^ (v >> 2)) & 0x10c30c30c30c30c3ULL;
+    v = (v ^ (v >> 4)) & 0x100f00f00f00f00fULL;
+    v = (v ^ (v >> 8)) & 0x1f0000ff0000ffULL;
+    v = (v ^ (v >> 16)) & 0x1f00000000ffffULL;
+    v = (v ^ (v >> 32)) & 0x1fffff;
+    return v;
+#endif
+}
+
+inline uint64_t MortonEncode(uint32_t x, uint32_t y, uint32_t z)
+{
+    return MortonSpread(x) | (MortonSpread(y) << 1) | (MortonSpread(z) << 2);
+}
+
+inline void MortonDecode(uint64_t coord, uint32_t& x, uint32_t& y, uint32_t& z)
+{
+    x = (uint32_t)MortonCompact(coord);
+    y = (uint32_t)MortonCompact(coord >> 1);
+    z = (uint32_t)MortonCompact(coord >> 2);
+}
+
+// scales x in [0,1) to an integer cell, clamping anything outside
+// (and NaNs, to 0)
+inline uint32_t MortonQuantize(double x)
+{
+    x *= MORTON_SIZE;
+    if (!(x >= 0))
+	return 0;
+    if (x >= MORTON_SIZE)
+	return MORTON_SIZE-1;
+    return (uint32_t)x;
+}
+
+
+/* Encodes n positions, found every stride bytes from pos, as coords
+   of (pos-lo)/range, written every coordStride bytes from coords (so
+   they can go straight into an array of structs). Uses AVX2 or SSE2,
+   whichever the compiler has, and gives the same coords as GetCoord. */
+void MortonEncodeBatch(const double *pos, size_t stride, int n,
+		       const double lo[3], const double range[3],
+		       uint64_t *coords, size_t coordStride);
+
+// decodes n coords into cell positions, each dim to its own array
+void MortonDecodeBatch(const uint64_t *coords, int n,
+		       uint32_t *x, uint32_t *y, uint32_t *z);
+
+#endif
@@ -0,0 +1,257 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "CreateBlocks.h"
+#include "PartFiles.h"
+#include "MergeFiles.h"
+#include "Process.h"
+#include "Threads.h"
+
+// size of buffer for copying stripe files
+#define STITCH_BUF_SIZE 16000000
+
+
+uint64_t BlockInput::Total()
+{
+    if (points != NULL)
+	return count;
+
+    uint64_t total = 0;
+    int numIn = 0;
+    for (uint64_t n; (n = getSubfileCount<VertexB>(filename, numIn)) > 0; numIn++)
+	total += n;
+    return total;
+}
+
+uint64_t BlockInput::LowerBound(uint64_t first, uint64_t last, const VertexB& key)
+{
+    if (points != NULL)
+	return std::lower_bound(points + first, points + last, key) - points;
+    return lowerBound<VertexB>(filename, first, last, key);
+}
+
+BlockSource* BlockInput::Open()
+{
+    if (points != NULL)
+	return new ReaderSource<ArrayReader<VertexB> >(new ArrayReader<VertexB>(points, 0, count), true);
+
+    BufferedReader<VertexB> *reader = new BufferedReader<VertexB>(filename);
+    reader->SetPrefetch(ReadAhead);
+    return new ReaderSource<BufferedReader<VertexB> >(reader, true);
+}
+
+BlockSource* BlockInput::Open(uint64_t first, uint64_t last, int bufsize)
+{
+    if (points != NULL)
+	return new ReaderSource<ArrayReader<VertexB> >(new ArrayReader<VertexB>(points, first, last), true);
+    return new ReaderSource<RangeReader<VertexB> >(new RangeReader<VertexB>(filename, first, last, bufsize), true);
+}
+
+
+/* Builds subtrees taken off a shared list until there are none left,
+   each into its own set of stripe files. */
+struct SubtreeJob
+{
+    BlockInput *input;
+    string outfile;
+    int maxcnt;
+    int numfiles;
+    int depth;
+    int mergeThreads;
+    BlockFile *bf;
+
+    Subtree **subs;
+    int numSubs;
+    int *nextSub;
+
+    void Run()
+    {
+	int j;
+	while ((j = __sync_fetch_and_add(nextSub, 1)) < numSubs)
+	{
+	    BlockBuilder builder(maxcnt, *bf);
+	    builder.SetMergeThreads(mergeThreads);
+	    builder.BuildSubtree(*input, outfile + ".part" + toString<int>(j),
+				 numfiles, *subs[j], depth);
+	}
+    }
+};
+
+
+// copies n bytes from a file to a writer
+void copyBytes(FILE *in, LargeWriter *out, uint64_t n, char *buf)
+{
+    while (n > 0)
+    {
+	int len = (int)MIN(n, (uint64_t)STITCH_BUF_SIZE);
+	len = fread(buf, 1, len, in);
+	if (len <= 0)
+	    break;
+	countRead(len, 0);
+	out->Write(buf, len);
+	n -= len;
+    }
+}
+
+
+/* Splits the coord-sorted input at the octree nodes SplitDepth levels
+   down, builds each big enough one as its own subtree on the worker
+   threads, and then concatenates their stripe files (patching the child
+   locations in the headers as it goes) and builds the top levels over
+   them. Block contents don't depend on the number of threads. */
+void ProcessBlocksSplit(BlockInput input, string outfile, int maxcnt, int numfiles, BlockFile& bf)
+{
+    int depth = MIN(SplitDepth, MAX_DEPTH-1);
+    int numCells = 1 << (3*depth);
+    int shift = MAX_DEPTH*3 - 3*depth;
+
+    uint64_t total = input.Total();
+
+    printf("Splitting %lu points into %d cells at depth %d...", (long unsigned int)total, numCells, depth);
+    fflush(stdout);
+
+    // find where each cell starts in the input
+    uint64_t *bounds = new uint64_t[numCells+1];
+    bounds[numCells] = total;
+    for (int c=numCells-1; c>=0; c--)
+    {
+	VertexB key;
+	key.coord = ((uint64_t)c) << shift;
+	bounds[c] = input.LowerBound(0, bounds[c+1], key);
+    }
+
+    // anything that fits in a leaf gets made by the top, with the rest
+    Subtree **cells = new Subtree*[numCells];
+    vector<Subtree*> subs;
+    for (int c=0; c<numCells; c++)
+    {
+	cells[c] = NULL;
+	if (bounds[c+1] - bounds[c] <= (uint64_t)maxcnt)
+	    continue;
+	cells[c] = new Subtree();
+	cells[c]->block = c;
+	cells[c]->first = bounds[c];
+	cells[c]->last = bounds[c+1];
+	subs.push_back(cells[c]);
+    }
+
+    printf("building %d subtrees with %d threads.\n", (int)subs.size(), NumThreads);
+    fflush(stdout);
+
+    if (subs.size() > 0)
+    {
+	int nthreads = MIN(NumThreads, (int)subs.size());
+	if (nthreads < 1)
+	    nthreads = 1;
+	int nextSub = 0;
+	SubtreeJob *jobs = new SubtreeJob[nthreads];
+	for (int i=0; i<nthreads; i++)
+	{
+	    jobs[i].input = &input;
+	    jobs[i].outfile = outfile;
+	    jobs[i].maxcnt = maxcnt;
+	    jobs[i].numfiles = numfiles;
+	    jobs[i].depth = depth;
+	    // spare threads, if there are few subtrees, help with merging
+	    jobs[i].mergeThreads = MAX(NumThreads / nthreads, 1);
+	    jobs[i].bf = &bf;
+	    jobs[i].subs = &subs[0];
+	    jobs[i].numSubs = (int)subs.size();
+	    jobs[i].nextSub = &nextSub;
+	}
+	RunThreads(jobs, nthreads);
+	delete[] jobs;
+    }
+
+    // every subtree's stripe files go one after the other
+    uint64_t *bases = new uint64_t[(uint64_t)numCells*numfiles];
+    for (int i=0; i<numfiles; i++)
+    {
+	uint64_t base = 0;
+	for (int c=0; c<numCells; c++)
+	{
+	    bases[(uint64_t)c*numfiles + i] = base;
+	    if (cells[c] != NULL)
+		base += cells[c]->fileSize[i];
+	}
+    }
+
+    printf("Stitching subtrees...");
+    fflush(stdout);
+
+    LargeWriter **writers = new LargeWriter*[numfiles];
+    char *buf = new char[STITCH_BUF_SIZE];
+    countAlloc(STITCH_BUF_SIZE);
+    for (int i=0; i<numfiles; i++)
+    {
+	writers[i] = new LargeWriter(outfile + "." + toString<int>(i), BlockAlign);
+	for (unsigned int j=0; j<subs.size(); j++)
+	{
+	    Subtree *sub = subs[j];
+	    string part = outfile + ".part" + toString<int>(j) + "." + toString<int>(i);
+	    FILE *in = fopen(part.c_str(), "rb");
+	    if (in == NULL)
+	    {
+		fprintf(stderr,"Missing subtree file %s!\n",part.c_str());
+		continue;
+	    }
+
+	    // copy up to each header that needs patching, then patch it
+	    uint64_t pos = 0;
+	    for (unsigned int f=0; f<sub->fixups.size(); f++)
+	    {
+		if (sub->fixups[f].file != i)
+		    continue;
+		copyBytes(in, writers[i], sub->fixups[f].offset - pos, buf);
+		OutBlock head;
+		fread(&head, sizeof(OutBlock), 1, in);
+		head.childLocation += bases[sub->block*numfiles + head.childFile];
+		writers[i]->Write(&head, sizeof(OutBlock));
+		pos = sub->fixups[f].offset + sizeof(OutBlock);
+	    }
+	    copyBytes(in, writers[i], sub->fileSize[i] - pos, buf);
+
+	    fclose(in);
+	    remove(part.c_str());
+	}
+    }
+    delete[] buf;
+    countFree(STITCH_BUF_SIZE);
+
+    printf("done.\n");
+    fflush(stdout);
+
+    BlockBuilder builder(maxcnt, bf);
+    builder.BuildTop(input, writers, numfiles, depth, bounds, cells, bases);
+
+    // the directory: the top's blocks, and every subtree's, moved to
+    // where its stripe files went
+    vector<BlockDirEntry>& dir = builder.Directory();
+    for (unsigned int j=0; j<subs.size(); j++)
+    {
+	Subtree *sub = subs[j];
+	for (unsigned int e=0; e<sub->dir.size(); e++)
+	{
+	    sub->dir[e].location += bases[sub->block*numfiles + sub->dir[e].file];
+	    dir.push_back(sub->dir[e]);
+	}
+	vector<BlockDirEntry>().swap(sub->dir);
+    }
+    SaveBlockDir(outfile + "_dir", dir);
+
+    for (int i=0; i<numfiles; i++)
+    {
+	writers[i]->Close();
+	delete writers[i];
+    }
+    delete[] writers;
+
+    for (unsigned int j=0; j<subs.size(); j++)
+    {
+	free(subs[j]->points);
+	delete subs[j];
+    }
+    delete[] cells;
+    delete[] bases;
+    delete[] bounds;
+}
@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "Params.h"
+
+// worker threads for merging etc.
+int NumThreads = 1;
+// buffers per sorting writer, >1 sorts and writes in the background
+int WriteBuffers = 1;
+// load next read buffer in the background?
+int ReadAhead = 0;
+// snapshot subfiles to load in the background while interleaving
+int LoadAhead = 0;
+// write particles straight to their pid slot when ids are dense?
+int DirectPlace = 0;
+// pack intermediate records (see Formats.h), trading precision for disk
+int CompactRecords = 0;
+// build subtrees this many levels down separately (and in parallel);
+// costs a copy of every subtree, so only worth it with threads to spare
+int SplitDepth = 0;
+// how to match points to the next timestep when merging (see CreateBlocks.h)
+int NextMatch = 0;
+// how many pipeline stages can run at once, and how many of those disk-bound
+int MaxStages = 1;
+int MaxDiskStages = 1;
+// memory budget for running stages, in MB (0 for none)
+int MaxMemory = 0;
+// memory budget for doing snapshots without intermediate files, in MB
+// (0 never does, -1 uses up to half of physical memory)
+int InMemory = 0;
+// memory for the halo tables built in each pass over the merger tree, in
+// MB (0 does them all in one pass, however big)
+int HaloMemory = 0;
+// quantize blocks with approximate logs and no exactness checks (see Quantize.h)
+int FastQuantize = 0;
+// blocks shallower than this get CoarseVertex points (see Formats.h)
+int CoarseDepth = 0;
+// alignment of child groups in the block files, in bytes (0 for none)
+int BlockAlign = 0;
+// write child groups compressed, where that makes them smaller (see Compress.h)
+int CompressBlocks = 0;
+
+
+PathInfo ReadParams(string filename, PathPair& paths, int& first, int& last, int& step, int& maxcount, int& nstripes)
+{
+    FILE *file = fopen(filename.c_str(), "r");
+
+    // can use defaults for system config
+    if (file == NULL)
+    {
+	fprintf(stderr,"Error opening param file %s!\n",filename.c_str());
+	return PathInfo("","");
+    }
+
+    char line[1024];
+
+    string srcpath;
+    string srcname;
+
+    while (fgets(line, 1024, file)!= NULL)
+    {
+	// find pos of first actual character
+	int s = strspn(line, " \t\n\v");
+	// skip comment lines
+	if (strlen(line) == 0)
+	    continue;
+	if (line[s] == '#')
+	    continue;
+	// and find position of the value
+	int v = strcspn(line, "=")+1;
+
+	// otherwise (also know line is null-term.)
+	// check for each different param
+	if (strncmp(line+s, "FirstSnap", 9) == 0)
+	    first = atoi(line+v);
+	else if (strncmp(line+s, "LastSnap", 8) == 0)
+	    last = atoi(line+v);
+	else if (strncmp(line+s, "SnapInterval", 12) == 0)
+	    step = atoi(line+v);
+	else if (strncmp(line+s, "MaxCount", 8) == 0)
+	    maxcount = atoi(line+v);
+	else if (strncmp(line+s, "NumStripes", 10) == 0)
+	    nstripes = atoi(line+v);
+	else if (strncmp(line+s, "NumThreads", 10) == 0)
+	    NumThreads = atoi(line+v);
+	else if (strncmp(line+s, "WriteBuffers", 12) == 0)
+	    WriteBuffers = atoi(line+v);
+	else if (strncmp(line+s, "ReadAhead", 9) == 0)
+	    ReadAhead = atoi(line+v);
+	else if (strncmp(line+s, "LoadAhead", 9) == 0)
+	    LoadAhead = atoi(line+v);
+	else if (strncmp(line+s, "DirectPlace", 11) == 0)
+	    DirectPlace = atoi(line+v);
+	else if (strncmp(line+s, "CompactRecords", 14) == 0)
+	    CompactRecords = atoi(line+v);
+	else if (strncmp(line+s, "SplitDepth", 10) == 0)
+	    SplitDepth = atoi(line+v);
+	else if (strncmp(line+s, "NextMatch", 9) == 0)
+	    NextMatch = atoi(line+v);
+	else if (strncmp(line+s, "MaxStages", 9) == 0)
+	    MaxStages = atoi(line+v);
+	else if (strncmp(line+s, "MaxDiskStages", 13) == 0)
+	    MaxDiskStages = atoi(line+v);
+	else if (strncmp(line+s, "MaxMemory", 9) == 0)
+	    MaxMemory = atoi(line+v);
+	else if (strncmp(line+s, "InMemory", 8) == 0)
+	    InMemory = atoi(line+v);
+	else if (strncmp(line+s, "HaloMemory", 10) == 0)
+	    HaloMemory = atoi(line+v);
+	else if (strncmp(line+s, "FastQuantize", 12) == 0)
+	    FastQuantize = atoi(line+v);
+	else if (strncmp(line+s, "CoarseDepth", 11) == 0)
+	    CoarseDepth = atoi(line+v);
+	else if (strncmp(line+s, "BlockAlign", 10) == 0)
+	    BlockAlign = atoi(line+v);
+	else if (strncmp(line+s, "CompressBlocks", 14) == 0)
+	    CompressBlocks = atoi(line+v);
+	else if (strncmp(line+s, "Out1", 4) == 0)
+	    paths.location = string(line+v, strcspn(line+v,"\n\r"));
+	else if (strncmp(line+s, "Out2", 4) == 0)
+	    paths.temp = string(line+v, strcspn(line+v,"\n\r"));
+	else if (strncmp(line+s, "SrcPath", 7) == 0)
+	    srcpath = string(line+v, strcspn(line+v,"\n\r"));
+	else if (strncmp(line+s, "SrcName", 7) == 0)
+	    srcname = string(line+v, strcspn(line+v,"\n\r"));
+    }
+
+    fclose(file);
+
+    // direct I/O wants a power of two, and pages at that
+    if (BlockAlign > 0)
+    {
+	int align = 4096;
+	while (align < BlockAlign)
+	    align *= 2;
+	if (align != BlockAlign)
+	    fprintf(stderr,"BlockAlign must be a power of two, at least 4096; using %d.\n",align);
+	BlockAlign = align;
+    }
+
+    return PathInfo(srcpath,srcname);
+}
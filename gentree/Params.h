@@ -0,0 +1,12 @@
+#ifndef _PARAMS_H_
+#define _PARAMS_H_
+
+#include "Formats.h"
+
+/* Reads a createblocks param file: the snapshot range, block sizes and
+   paths go in the arguments, and the tuning options (NumThreads etc.)
+   into their globals, which are defined in Params.cpp. Returns the
+   source paths. */
+PathInfo ReadParams(string filename, PathPair& paths, int& first, int& last, int& step, int& maxcount, int& nstripes);
+
+#endif
@@ -4,7 +4,15 @@
 #define _PARTFILES_H_
 
 #include <stdio.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <algorithm>
+#include "Sort.h"
+#include "Telemetry.h"
 
 // helper function
 inline string getSubfile(string filename, int num)
@@ -19,6 +27,271 @@ inline string getSubfile(string filename, int num)
 //#define MAX_FILE_SIZE 30000000
 // and this one is only for the reader
 #define READ_BUF_SIZE 400000000
+// buffer for writers that write aligned (rounded up to the alignment)
+#define DIRECT_BUF_SIZE (1<<22)
+
+// number of buffers for writers that sort and write in the background
+extern int WriteBuffers;
+// do readers load their next buffer in the background?
+extern int ReadAhead;
+// do writers pack the records that have a compact form?
+extern int CompactRecords;
+
+
+/* How a type is packed for the intermediate files, if it has a compact
+   form at all. Extend builds the frame a set of elements is packed in. */
+template<typename T>
+struct Packing
+{
+    static const bool Exists = false;
+    typedef T Packed;
+
+    static void Extend(RecordFrame&, const T&)
+    {
+    }
+
+    static void Pack(const T& t, Packed& p, const RecordFrame&)
+    {
+	p = t;
+    }
+
+    static void Unpack(const Packed& p, T& t, const RecordFrame&)
+    {
+	t = p;
+    }
+};
+
+template<>
+struct Packing<VertexA>
+{
+    static const bool Exists = true;
+    typedef PackedVertexA Packed;
+
+    static void Extend(RecordFrame& f, const VertexA& t)
+    {
+	f.Add(t.pid, t.pos);
+    }
+
+    static void Pack(const VertexA& t, Packed& p, const RecordFrame& f)
+    {
+	p.pid = (uint32_t)(t.pid - f.pidBase);
+	for (int j=0; j<3; j++)
+	{
+	    p.pos[j] = f.PackPos(t.pos[j], j);
+	    p.vel[j] = (float)t.vel[j];
+	}
+	p.hsml = t.hsml;
+	p.densq = t.densq;
+	p.vdisp = t.vdisp;
+    }
+
+    static void Unpack(const Packed& p, VertexA& t, const RecordFrame& f)
+    {
+	t.pid = f.pidBase + p.pid;
+	for (int j=0; j<3; j++)
+	{
+	    t.pos[j] = f.UnpackPos(p.pos[j], j);
+	    t.vel[j] = p.vel[j];
+	}
+	t.hsml = p.hsml;
+	t.densq = p.densq;
+	t.vdisp = p.vdisp;
+    }
+};
+
+template<>
+struct Packing<VertexB>
+{
+    static const bool Exists = true;
+    typedef PackedVertexB Packed;
+
+    static void Extend(RecordFrame& f, const VertexB& t)
+    {
+	f.Add(t.pid, t.pos);
+    }
+
+    static void Pack(const VertexB& t, Packed& p, const RecordFrame& f)
+    {
+	p.coord = t.coord;
+	p.pid = (uint32_t)(t.pid - f.pidBase);
+	for (int j=0; j<3; j++)
+	{
+	    p.pos[j] = f.PackPos(t.pos[j], j);
+	    p.vel[j] = (float)t.vel[j];
+	    p.acc[j] = (float)t.acc[j];
+	}
+	p.hsml = t.hsml;
+	p.densq = t.densq;
+	p.vdisp = t.vdisp;
+	p.nhsml = t.nhsml;
+	p.ndensq = t.ndensq;
+	p.nvdisp = t.nvdisp;
+    }
+
+    static void Unpack(const Packed& p, VertexB& t, const RecordFrame& f)
+    {
+	t.coord = p.coord;
+	t.pid = f.pidBase + p.pid;
+	for (int j=0; j<3; j++)
+	{
+	    t.pos[j] = f.UnpackPos(p.pos[j], j);
+	    t.vel[j] = p.vel[j];
+	    t.acc[j] = p.acc[j];
+	}
+	t.hsml = p.hsml;
+	t.densq = p.densq;
+	t.vdisp = p.vdisp;
+	t.nhsml = p.nhsml;
+	t.ndensq = p.ndensq;
+	t.nvdisp = p.nvdisp;
+    }
+};
+
+// elements packed or unpacked at a time, through a scratch buffer
+#define PACK_CHUNK 65536
+
+// writes n elements to file, packed in the given frame, after it
+template<typename T>
+void writePacked(FILE *file, const T* buf, int n, const RecordFrame& frame)
+{
+    typedef typename Packing<T>::Packed P;
+    fwrite(&frame, sizeof(RecordFrame), 1, file);
+
+    P *scratch = new P[n < PACK_CHUNK ? n : PACK_CHUNK];
+    for (int i=0; i<n; i+=PACK_CHUNK)
+    {
+	int len = (n-i < PACK_CHUNK) ? n-i : PACK_CHUNK;
+	for (int k=0; k<len; k++)
+	    Packing<T>::Pack(buf[i+k], scratch[k], frame);
+	fwrite(scratch, sizeof(P), len, file);
+    }
+    delete[] scratch;
+}
+
+
+/* One subfile being read, in whichever form it was written: plain T's,
+   or packed ones after a RecordFrame. */
+template<typename T>
+class SubfileInput
+{
+private:
+    typedef typename Packing<T>::Packed P;
+
+    FILE *file;
+    bool packed;
+    RecordFrame frame;
+    P* scratch;
+
+    // mark as private, no copying allowed
+    SubfileInput(const SubfileInput& other);
+
+    // same here
+    SubfileInput& operator=(const SubfileInput& old);
+
+public:
+
+    SubfileInput()
+    {
+	file = NULL;
+	packed = false;
+	scratch = NULL;
+    }
+
+    ~SubfileInput()
+    {
+	Close();
+	delete[] scratch;
+    }
+
+    // opens a file and checks its form, returns false if it isn't there
+    bool Open(string name)
+    {
+	Close();
+	file = fopen(name.c_str(), "rb");
+	if (file == NULL)
+	    return false;
+	packed = Packing<T>::Exists &&
+	    fread(&frame, sizeof(RecordFrame), 1, file) == 1 && frame.IsValid();
+	if (!packed)
+	    fseeko(file, 0, SEEK_SET);
+	else if (scratch == NULL)
+	    scratch = new P[PACK_CHUNK];
+	return true;
+    }
+
+    void Close()
+    {
+	if (file != NULL)
+	{
+	    fclose(file);
+	    file = NULL;
+	}
+    }
+
+    bool IsOpen()
+    {
+	return file != NULL;
+    }
+
+    // moves to the element at index in this file
+    void Seek(uint64_t index)
+    {
+	if (packed)
+	    fseeko(file, sizeof(RecordFrame) + index*sizeof(P), SEEK_SET);
+	else
+	    fseeko(file, index*sizeof(T), SEEK_SET);
+    }
+
+    // reads up to n elements, returning the count
+    int Read(T* buf, int n)
+    {
+	if (!packed)
+	{
+	    int len = fread(buf, sizeof(T), n, file);
+	    countRead((uint64_t)len*sizeof(T), len);
+	    return len;
+	}
+
+	int total = 0;
+	while (total < n)
+	{
+	    int len = (n-total < PACK_CHUNK) ? n-total : PACK_CHUNK;
+	    len = fread(scratch, sizeof(P), len, file);
+	    for (int k=0; k<len; k++)
+		Packing<T>::Unpack(scratch[k], buf[total+k], frame);
+	    total += len;
+	    if (len == 0)
+		break;
+	}
+	countRead((uint64_t)total*sizeof(P), total);
+	return total;
+    }
+
+    // reads the frame of a file, returning false if it isn't packed
+    static bool ReadFrame(string name, RecordFrame& f)
+    {
+	if (!Packing<T>::Exists)
+	    return false;
+	FILE *file = fopen(name.c_str(), "rb");
+	if (file == NULL)
+	    return false;
+	bool ok = fread(&f, sizeof(RecordFrame), 1, file) == 1 && f.IsValid();
+	fclose(file);
+	return ok;
+    }
+
+    // returns the number of elements in a file, 0 if it isn't there
+    static uint64_t Count(string name)
+    {
+	struct stat st;
+	if (stat(name.c_str(), &st) != 0)
+	    return 0;
+	RecordFrame f;
+	if (ReadFrame(name, f))
+	    return (st.st_size - sizeof(RecordFrame)) / sizeof(P);
+	return st.st_size / sizeof(T);
+    }
+};
 
 template<typename T>
 class BufferedReader
@@ -27,7 +300,7 @@ private:
     string filename;
 
     // internal file
-    FILE *inFile;
+    SubfileInput<T> input;
 
     // objects, and # of objects
     T* buffer;
@@ -45,11 +318,24 @@ private:
     // delete files after reading?
     bool delFiles;
 
+    // read-ahead: once started, the io thread owns the file state above
+    // and fills backBuffer while we are reading from buffer
+    bool prefetch;
+    T* backBuffer;
+    int backLength;
+    bool backReady;
+    bool quit;
+
+    pthread_t ioThread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
 
 
     void init()
     {
 	buffer = new T[BufMax];
+	countAlloc((int64_t)BufMax*sizeof(T));
 	bufLength = 0;
 	curFile = 0;
 	curIndex = 0;
@@ -58,68 +344,125 @@ private:
 	filename = "";
 	canRead = true;
 	delFiles = false;
-	inFile = NULL;
+	prefetch = false;
+	backBuffer = NULL;
     }
 
 
     void cleanup()
     {
-	// close + free
-	if (inFile != NULL)
-	{	    
-	    fclose(inFile);
-	    inFile = NULL;
+	// stop read-ahead thread first, since it may be using the file
+	if (prefetch)
+	{
+	    pthread_mutex_lock(&mutex);
+	    quit = true;
+	    pthread_cond_broadcast(&cond);
+	    pthread_mutex_unlock(&mutex);
+	    pthread_join(ioThread, NULL);
+
+	    pthread_mutex_destroy(&mutex);
+	    pthread_cond_destroy(&cond);
+	    delete[] backBuffer;
+	    countFree((int64_t)BufMax*sizeof(T));
+	    prefetch = false;
 	}
+
+	// close + free
+	input.Close();
 	delete[] buffer;
+	countFree((int64_t)BufMax*sizeof(T));
     }
     
     void readFile()
     {
         // close current file
-	if (inFile != NULL)
+	if (input.IsOpen())
 	{
-	    fclose(inFile);
+	    input.Close();
 	    if (delFiles)
 		remove(getSubfile(filename, curFile-1).c_str());
 	}
 	// trying to read past max file?
 	if (maxFile != -1 && curFile > maxFile)
-	{
-	    canRead = false;
-	    inFile = NULL;
 	    return;
-	}
-	inFile = fopen(getSubfile(filename,curFile).c_str(),"rb");
-	// next file does not exist
-	if (inFile == NULL)
+	// (stays closed if next file does not exist)
+	input.Open(getSubfile(filename,curFile));
+    }
+
+    // reads as much as we can into buf, advancing the file if we
+    // read nothing, and returns the count (0 once we're out of files)
+    int fillBuffer(T* buf)
+    {
+	int n = 0;
+	while (input.IsOpen())
 	{
-	    canRead = false;
-	    return;
+	    n = input.Read(buf, BufMax);
+	    if (n > 0)
+		break;
+	    curFile++;
+	    readFile();
 	}
+	return n;
     }
 
     void readBuffer()
     {
-	if (inFile == NULL)
-	    return;
-	
 	// only load if we can
 	if (!canRead)
 	    return;
-	
-	// read as much as we can
-	bufLength = fread(buffer, sizeof(T), BufMax, inFile);
-	// advance the file, if we read nothing
-	if (bufLength == 0)
+
+	if (prefetch)
 	{
-	    curFile++;
-	    readFile();
-	    // and only if the next file exists
-	    if (canRead)
-		bufLength = fread(buffer, sizeof(T), BufMax, inFile);
+	    // wait for the back buffer, swap, and have the next one loaded
+	    pthread_mutex_lock(&mutex);
+	    while (!backReady)
+		pthread_cond_wait(&cond, &mutex);
+	    T* tmp = buffer;
+	    buffer = backBuffer;
+	    backBuffer = tmp;
+	    bufLength = backLength;
+	    backReady = false;
+	    pthread_cond_broadcast(&cond);
+	    pthread_mutex_unlock(&mutex);
 	}
+	else
+	    bufLength = fillBuffer(buffer);
 
 	curIndex = 0;
+	if (bufLength == 0)
+	    canRead = false;
+    }
+
+    // io thread loop, keeps the back buffer full
+    void ioLoop()
+    {
+	pthread_mutex_lock(&mutex);
+	while (!quit)
+	{
+	    if (backReady)
+	    {
+		pthread_cond_wait(&cond, &mutex);
+		continue;
+	    }
+	    pthread_mutex_unlock(&mutex);
+
+	    int n = fillBuffer(backBuffer);
+
+	    pthread_mutex_lock(&mutex);
+	    backLength = n;
+	    backReady = true;
+	    pthread_cond_broadcast(&cond);
+	    // nothing left to read
+	    if (n == 0)
+		break;
+	}
+	pthread_mutex_unlock(&mutex);
+    }
+
+    static void* ioStart(void *ptr)
+    {
+	((BufferedReader<T>*)ptr)->ioLoop();
+	return NULL;
     }
 
     // mark as private, no copying allowed
@@ -164,36 +507,287 @@ public:
     {
 	cleanup();
     }
-    
-    T Read()
+    
+    const T& Read()
+    {
+	return buffer[curIndex];	
+    }
+
+    T* GetPointer()
+    {
+	return buffer + curIndex;
+    }
+
+    bool Next()
+    {
+	totalCount++;
+	curIndex++;
+	// end of this buffer/file?
+	if (curIndex >= bufLength)
+	    readBuffer();
+
+	return canRead;
+    }
+
+    // returns the elements left in the current buffer, which can be
+    // used in place and then skipped over with Advance()
+    const T* GetSpan(int& count)
+    {
+	count = bufLength - curIndex;
+	return buffer + curIndex;
+    }
+
+    // skips over n elements, at most the count given by GetSpan()
+    bool Advance(int n)
+    {
+	totalCount += n;
+	curIndex += n;
+	if (curIndex >= bufLength)
+	    readBuffer();
+
+	return canRead;
+    }
+
+    // starts loading the next buffer in the background,
+    // so that it's ready when we finish the current one
+    void SetPrefetch(bool val)
+    {
+	if (!val || prefetch || !canRead)
+	    return;
+
+	prefetch = true;
+	backBuffer = new T[BufMax];
+	countAlloc((int64_t)BufMax*sizeof(T));
+	backLength = 0;
+	backReady = false;
+	quit = false;
+
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&cond, NULL);
+	startThread(&ioThread, &ioStart, this);
+    }
+
+    void SetDelete(bool val)
+    {
+	delFiles = val;
+    }
+
+    bool CanRead()
+    {
+	return canRead;
+    }
+};
+
+
+/* Reads the elements [first, last) out of a set of subfiles, where
+   element i lives in subfile i/FileMax, as written by the writers below.
+   Used for merging runs, where we only want part of each file. */
+template<typename T>
+class RangeReader
+{
+private:
+    string filename;
+
+    // internal file
+    SubfileInput<T> input;
+
+    // objects, and # of objects
+    T* buffer;
+    int bufMax;
+    int bufLength;
+    int curIndex;
+
+    // global index of first element in buffer, and end of range
+    uint64_t bufStart;
+    uint64_t last;
+
+    int curFile;
+
+    bool canRead;
+
+    // delete files after reading?
+    bool delFiles;
+
+
+    void readBuffer()
+    {
+	bufStart += bufLength;
+	bufLength = 0;
+	curIndex = 0;
+
+	if (bufStart >= last)
+	{
+	    canRead = false;
+	    if (input.IsOpen())
+	    {
+		input.Close();
+		if (delFiles)
+		    remove(getSubfile(filename, curFile).c_str());
+	    }
+	    return;
+	}
+
+	int file = (int)(bufStart / FileMax);
+	uint64_t offset = bufStart % FileMax;
+
+	// moved on to next file?
+	if (file != curFile || !input.IsOpen())
+	{
+	    if (input.IsOpen())
+	    {
+		input.Close();
+		if (delFiles)
+		    remove(getSubfile(filename, curFile).c_str());
+	    }
+	    curFile = file;
+	    if (!input.Open(getSubfile(filename, curFile)))
+	    {
+		canRead = false;
+		return;
+	    }
+	    input.Seek(offset);
+	}
+
+	// read up to end of buffer, range, or file
+	uint64_t n = bufMax;
+	if (n > last - bufStart)
+	    n = last - bufStart;
+	if (n > FileMax - offset)
+	    n = FileMax - offset;
+
+	bufLength = input.Read(buffer, (int)n);
+	if (bufLength == 0)
+	    canRead = false;
+    }
+
+    // mark as private, no copying allowed
+    RangeReader(const RangeReader& other);
+
+    // same here
+    RangeReader& operator=(const RangeReader& old);
+
+public:
+
+    static const int FileMax = MAX_FILE_SIZE/sizeof(T);
+
+    RangeReader(string fname, uint64_t first, uint64_t end, int bufsize)
+    {
+	filename = fname;
+	bufMax = bufsize/sizeof(T);
+	if (bufMax < 1)
+	    bufMax = 1;
+	buffer = new T[bufMax];
+	countAlloc((int64_t)bufMax*sizeof(T));
+	bufLength = 0;
+	curIndex = 0;
+	bufStart = first;
+	last = end;
+	curFile = -1;
+	canRead = true;
+	delFiles = false;
+
+	readBuffer();
+    }
+
+    ~RangeReader()
+    {
+	delete[] buffer;
+	countFree((int64_t)bufMax*sizeof(T));
+    }
+
+    const T& Read()
+    {
+	return buffer[curIndex];
+    }
+
+    bool Next()
+    {
+	curIndex++;
+	if (curIndex >= bufLength)
+	    readBuffer();
+
+	return canRead;
+    }
+
+    // returns the rest of the current buffer, to process in one go
+    const T* GetSpan(int& count)
+    {
+	count = bufLength - curIndex;
+	return buffer + curIndex;
+    }
+
+    // skips n elements, which must be at most the span count
+    bool Advance(int n)
+    {
+	curIndex += n;
+	if (curIndex >= bufLength)
+	    readBuffer();
+
+	return canRead;
+    }
+
+    // deletes each subfile once we are done with it
+    void SetDelete(bool val)
+    {
+	delFiles = val;
+    }
+
+    bool CanRead()
+    {
+	return canRead;
+    }
+};
+
+
+/* Reads the elements [first, last) of an array already in memory, the
+   same way the readers above read files, for snapshots small enough
+   to skip them. The array still belongs to the caller. */
+template<typename T>
+class ArrayReader
+{
+private:
+    const T* data;
+    uint64_t cur;
+    uint64_t last;
+
+    // spans are at most this long, since counts are ints
+    static const int SpanMax = 1<<30;
+
+public:
+
+    ArrayReader(const T* d, uint64_t first, uint64_t end)
     {
-	return buffer[curIndex];	
+	data = d;
+	cur = first;
+	last = end;
     }
 
-    T* GetPointer()
+    const T& Read()
     {
-	return buffer + curIndex;
+	return data[cur];
     }
 
     bool Next()
     {
-	totalCount++;
-	curIndex++;
-	// end of this buffer/file?
-	if (curIndex >= bufLength)
-	    readBuffer();
+	cur++;
+	return cur < last;
+    }
 
-	return canRead;
+    const T* GetSpan(int& count)
+    {
+	count = (int)std::min(last - cur, (uint64_t)SpanMax);
+	return data + cur;
     }
 
-    void SetDelete(bool val)
+    bool Advance(int n)
     {
-	delFiles = val;
+	cur += n;
+	return cur < last;
     }
 
     bool CanRead()
     {
-	return canRead;
+	return cur < last;
     }
 };
 
@@ -202,6 +796,8 @@ template<typename T>
 class RawWriter
 {
 private:
+    typedef typename Packing<T>::Packed P;
+
     string filename;
 
     // internal file
@@ -211,6 +807,16 @@ private:
     int curFile;
     int curCount;
 
+    // writing into already existing files?
+    bool update;
+
+    // packing into this frame? (each file starts with it)
+    bool packed;
+    RecordFrame frame;
+
+    // written since the stats were last told
+    uint64_t uncounted;
+
 
     void init()
     {
@@ -218,11 +824,20 @@ private:
 	curCount = 0;
 	filename = "";
 	outFile = NULL;
+	update = false;
+	packed = false;
+	uncounted = 0;
     }
 
+    void countWritten()
+    {
+	countWrite(uncounted * (packed ? sizeof(P) : sizeof(T)), uncounted);
+	uncounted = 0;
+    }
 
     void cleanup()
     {
+	countWritten();
 	// close
 	if (outFile != NULL)
 	{
@@ -233,10 +848,24 @@ private:
     
     void nextFile()
     {
+	countWritten();
         // close current file
 	if (outFile != NULL)
 	    fclose(outFile);
-	outFile = fopen(getSubfile(filename,curFile).c_str(),"wb");
+	// don't truncate files that others are writing into
+	if (update)
+	{
+	    outFile = fopen(getSubfile(filename,curFile).c_str(),"r+b");
+	    // (whose frame is already there)
+	    if (packed && outFile != NULL)
+		fseeko(outFile, sizeof(RecordFrame), SEEK_SET);
+	}
+	else
+	{
+	    outFile = fopen(getSubfile(filename,curFile).c_str(),"wb");
+	    if (packed && outFile != NULL)
+		fwrite(&frame, sizeof(RecordFrame), 1, outFile);
+	}
 	curCount = 0;
 	curFile++;
     }
@@ -269,6 +898,33 @@ public:
 	nextFile();
     }
 
+    // writes into preallocated files, starting at global element index
+    // start, so that several writers can fill disjoint parts of one set;
+    // with a frame, elements are packed in it (and preallocated files
+    // must already start with it)
+    RawWriter(string fname, uint64_t start, bool upd, const RecordFrame *f = NULL)
+    {
+	init();
+	filename = fname;
+	update = upd;
+	if (f != NULL && Packing<T>::Exists)
+	{
+	    packed = true;
+	    frame = *f;
+	}
+	curFile = (int)(start / BufMax);
+	nextFile();
+	curCount = (int)(start % BufMax);
+	// (an empty piece at the very end may have no file to seek in)
+	if (outFile != NULL)
+	{
+	    if (packed)
+		fseeko(outFile, sizeof(RecordFrame) + (uint64_t)curCount*sizeof(P), SEEK_SET);
+	    else
+		fseeko(outFile, (uint64_t)curCount*sizeof(T), SEEK_SET);
+	}
+    }
+
     ~RawWriter()
     {
 	cleanup();
@@ -284,8 +940,266 @@ public:
 	// filled up file?
 	if (curCount >=  BufMax)
 	    nextFile();
-	fwrite(&t, sizeof(T), 1, outFile);
+	if (packed)
+	{
+	    P p;
+	    Packing<T>::Pack(t, p, frame);
+	    fwrite(&p, sizeof(P), 1, outFile);
+	}
+	else
+	    fwrite(&t, sizeof(T), 1, outFile);
 	curCount++;
+	uncounted++;
+    }
+};
+
+/* Writes elements straight to their final global index, in files that
+   are preallocated and mapped into memory, so that nothing needs to be
+   sorted afterwards. Element i goes to subfile i/BufMax, same as with
+   the writers above and below. */
+template<typename T>
+class DirectWriter
+{
+private:
+    string filename;
+
+    int numFiles;
+    // mapped subfiles
+    T** maps;
+    uint64_t* lengths;
+
+    bool isOpen;
+
+
+    void cleanup()
+    {
+	if (maps == NULL)
+	    return;
+	for (int i=0; i<numFiles; i++)
+	{
+	    if (maps[i] != NULL)
+	    {
+		munmap(maps[i], lengths[i]*sizeof(T));
+		countWrite(lengths[i]*sizeof(T), lengths[i]);
+	    }
+	}
+	delete[] maps;
+	delete[] lengths;
+	maps = NULL;
+	lengths = NULL;
+    }
+
+    // mark as private, no copying allowed
+    DirectWriter(const DirectWriter& other);
+
+    // same here
+    DirectWriter& operator=(const DirectWriter& old);
+
+
+public:
+
+    static const int BufMax = MAX_FILE_SIZE/sizeof(T);
+
+    DirectWriter(string fname, uint64_t count)
+    {
+	filename = fname;
+	isOpen = true;
+	numFiles = (int)((count + BufMax - 1) / BufMax);
+	if (numFiles == 0)
+	    numFiles = 1;
+
+	maps = new T*[numFiles];
+	lengths = new uint64_t[numFiles];
+	for (int i=0; i<numFiles; i++)
+	{
+	    maps[i] = NULL;
+	    lengths[i] = std::min((uint64_t)BufMax, count - (uint64_t)i*BufMax);
+	}
+
+	for (int i=0; i<numFiles; i++)
+	{
+	    string sub = getSubfile(filename, i);
+	    int fd = open(sub.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	    if (fd < 0)
+	    {
+		fprintf(stderr,"Error creating file %s!\n",sub.c_str());
+		isOpen = false;
+		return;
+	    }
+	    // nothing to map for an empty file
+	    if (lengths[i] == 0)
+	    {
+		close(fd);
+		continue;
+	    }
+	    void *ptr = MAP_FAILED;
+	    if (ftruncate(fd, lengths[i]*sizeof(T)) == 0)
+		ptr = mmap(NULL, lengths[i]*sizeof(T), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	    close(fd);
+	    if (ptr == MAP_FAILED)
+	    {
+		fprintf(stderr,"Error mapping file %s!\n",sub.c_str());
+		isOpen = false;
+		return;
+	    }
+	    maps[i] = (T*)ptr;
+	}
+    }
+
+    ~DirectWriter()
+    {
+	cleanup();
+    }
+
+    bool IsOpen()
+    {
+	return isOpen;
+    }
+
+    // returns number of files written
+    int Close()
+    {
+	cleanup();
+	return numFiles;
+    }
+
+    void Write(uint64_t index, const T& t)
+    {
+	maps[index / BufMax][index % BufMax] = t;
+    }
+
+    // drops the elements not in keep, moving the rest down, and shrinks
+    // the files to match (removing any left empty, past the first)
+    void Compact(const vector<bool>& keep)
+    {
+	uint64_t n = 0;
+	for (uint64_t i=0; i<keep.size(); i++)
+	{
+	    if (!keep[i])
+		continue;
+	    if (n != i)
+		maps[n / BufMax][n % BufMax] = maps[i / BufMax][i % BufMax];
+	    n++;
+	}
+
+	for (int i=numFiles-1; i>=0; i--)
+	{
+	    uint64_t start = (uint64_t)i*BufMax;
+	    uint64_t length = n > start ? std::min((uint64_t)BufMax, n - start) : 0;
+	    if (length == lengths[i] || maps[i] == NULL)
+		continue;
+	    munmap(maps[i], lengths[i]*sizeof(T));
+	    countWrite(length*sizeof(T), length);
+	    maps[i] = NULL;
+	    lengths[i] = length;
+
+	    string sub = getSubfile(filename, i);
+	    if (length == 0 && i > 0)
+	    {
+		remove(sub.c_str());
+		numFiles = i;
+	    }
+	    else if (truncate(sub.c_str(), length*sizeof(T)) != 0)
+		fprintf(stderr,"Error truncating file %s!\n",sub.c_str());
+	}
+    }
+};
+
+/* Collects elements in an array in memory, in place of a BufferedWriter
+   (with Write(t), sorting them all at Close if asked) or a DirectWriter
+   (with Write(index, t)), for snapshots small enough to skip the files.
+   Release hands the array over to the caller. */
+template<typename T>
+class ArrayWriter
+{
+private:
+    T* data;
+    uint64_t capacity;
+    uint64_t count;
+
+    bool doSort;
+
+    void cleanup()
+    {
+	if (data != NULL)
+	{
+	    delete[] data;
+	    countFree((int64_t)capacity*sizeof(T));
+	    data = NULL;
+	}
+    }
+
+    // mark as private, no copying allowed
+    ArrayWriter(const ArrayWriter& other);
+
+    // same here
+    ArrayWriter& operator=(const ArrayWriter& old);
+
+public:
+
+    ArrayWriter(uint64_t cap)
+    {
+	capacity = cap;
+	data = new T[capacity];
+	countAlloc((int64_t)capacity*sizeof(T));
+	count = 0;
+	doSort = false;
+    }
+
+    ~ArrayWriter()
+    {
+	cleanup();
+    }
+
+    void SetSort(bool val)
+    {
+	doSort = val;
+    }
+
+    void Write(const T& t)
+    {
+	data[count++] = t;
+    }
+
+    void Write(uint64_t index, const T& t)
+    {
+	data[index] = t;
+	count++;
+    }
+
+    // drops the elements not in keep (as written by Write(index, t)),
+    // moving the rest down
+    void Compact(const vector<bool>& keep)
+    {
+	uint64_t n = 0;
+	for (uint64_t i=0; i<keep.size(); i++)
+	    if (keep[i])
+		data[n++] = data[i];
+	count = n;
+    }
+
+    // sorts (?) what was written by Write(t), and returns how many
+    uint64_t Close()
+    {
+	if (doSort)
+	    ParallelRadixSort(data, (int)count, NumThreads);
+	countWrite(0, count);
+	return count;
+    }
+
+    T* Data()
+    {
+	return data;
+    }
+
+    // the array is the caller's to delete[] from now on
+    T* Release()
+    {
+	T* d = data;
+	if (data != NULL)
+	    countFree((int64_t)capacity*sizeof(T));
+	data = NULL;
+	return d;
     }
 };
 
@@ -304,44 +1218,166 @@ private:
 
     // do we sort?
     bool doSort;
-    
+
+    // pack each buffer, in a frame of its own?
+    bool compact;
+
+    // background mode: numBuffers buffers are used in turn, and full
+    // ones are sorted and written out by ioThread while we fill the next
+    int numBuffers;
+    T** buffers;
+    // count and subfile index of each full buffer, -1 count if free
+    int* fullCount;
+    int* fullFile;
+    int curBuffer;
+    bool quit;
+
+    pthread_t ioThread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
     void init()
     {
 	buffer = new T[BufMax];
+	countAlloc((int64_t)BufMax*sizeof(T));
 	curFile = 0;
 	curCount = 0;
 	filename = "";
 	doSort = false;
+	compact = Packing<T>::Exists && CompactRecords != 0;
+	numBuffers = 1;
+	buffers = NULL;
+	fullCount = NULL;
+	fullFile = NULL;
+	curBuffer = 0;
+	quit = false;
     }
 
 
     void cleanup()
     {
+	// stop the background writer first
+	if (numBuffers > 1)
+	{
+	    pthread_mutex_lock(&mutex);
+	    quit = true;
+	    pthread_cond_broadcast(&cond);
+	    pthread_mutex_unlock(&mutex);
+	    pthread_join(ioThread, NULL);
+
+	    pthread_mutex_destroy(&mutex);
+	    pthread_cond_destroy(&cond);
+
+	    for (int i=0; i<numBuffers; i++)
+		delete[] buffers[i];
+	    countFree((int64_t)numBuffers*BufMax*sizeof(T));
+	    delete[] buffers;
+	    delete[] fullCount;
+	    delete[] fullFile;
+	    numBuffers = 1;
+	    buffer = NULL;
+	}
+
 	// free data
 	if (buffer != NULL)
 	{
 	    delete[] buffer;
+	    countFree((int64_t)BufMax*sizeof(T));
 	    buffer = NULL;
 	}
     }
-    
-    void writeBuffer()
-    {	
-	if (curCount == 0)
-	    return;
-        // sort (?) and write buffer
+
+    // sorts (?) and writes a single buffer to a subfile
+    void saveBuffer(T* buf, int count, int file)
+    {
 	if (doSort)
-	    std::sort(buffer, buffer+curCount);
+	    ParallelRadixSort(buf, count, NumThreads);
 
 	// open file for writing
-	FILE *outFile = fopen(getSubfile(filename,curFile).c_str(),"wb");
+	FILE *outFile = fopen(getSubfile(filename,file).c_str(),"wb");
+
+	// packed if we can, but a spread of pids too wide for
+	// offsets just gets written in full
+	RecordFrame frame;
+	if (compact)
+	{
+	    frame.Begin();
+	    for (int i=0; i<count; i++)
+		Packing<T>::Extend(frame, buf[i]);
+	}
+
 	// write
-	fwrite(buffer, sizeof(T), curCount, outFile);
-	curCount = 0;
+	if (compact && frame.Fits())
+	{
+	    writePacked(outFile, buf, count, frame);
+	    countWrite(sizeof(RecordFrame) + (uint64_t)count*sizeof(typename Packing<T>::Packed), count);
+	}
+	else
+	{
+	    fwrite(buf, sizeof(T), count, outFile);
+	    countWrite((uint64_t)count*sizeof(T), count);
+	}
 	// and close
 	fclose(outFile);
-	// next file
+    }
+    
+    void writeBuffer()
+    {	
+	if (curCount == 0)
+	    return;
+
+	if (numBuffers == 1)
+	{
+	    saveBuffer(buffer, curCount, curFile);
+	    curCount = 0;
+	    // next file
+	    curFile++;
+	    return;
+	}
+
+	// hand current buffer to io thread, and wait for the next to be free
+	pthread_mutex_lock(&mutex);
+	fullCount[curBuffer] = curCount;
+	fullFile[curBuffer] = curFile;
+	pthread_cond_broadcast(&cond);
+
 	curFile++;
+	curCount = 0;
+	curBuffer = (curBuffer+1) % numBuffers;
+	while (fullCount[curBuffer] >= 0)
+	    pthread_cond_wait(&cond, &mutex);
+	buffer = buffers[curBuffer];
+	pthread_mutex_unlock(&mutex);
+    }
+
+    // io thread loop, takes full buffers in order
+    void ioLoop()
+    {
+	int cur = 0;
+	pthread_mutex_lock(&mutex);
+	while (true)
+	{
+	    while (fullCount[cur] < 0 && !quit)
+		pthread_cond_wait(&cond, &mutex);
+	    // all buffers are handed over before quitting
+	    if (fullCount[cur] < 0)
+		break;
+	    pthread_mutex_unlock(&mutex);
+
+	    saveBuffer(buffers[cur], fullCount[cur], fullFile[cur]);
+
+	    pthread_mutex_lock(&mutex);
+	    fullCount[cur] = -1;
+	    pthread_cond_broadcast(&cond);
+	    cur = (cur+1) % numBuffers;
+	}
+	pthread_mutex_unlock(&mutex);
+    }
+
+    static void* ioStart(void *ptr)
+    {
+	((BufferedWriter<T>*)ptr)->ioLoop();
+	return NULL;
     }
 
     // mark as private, no copying allowed
@@ -370,7 +1406,8 @@ public:
 
     ~BufferedWriter()
     {
-	writeBuffer();
+	if (buffer != NULL)
+	    writeBuffer();
 	cleanup();
     }
     
@@ -390,17 +1427,48 @@ public:
 	doSort = val;
     }
 
+    // uses n buffers, with sorting and writing done in the background
+    // (call before writing anything; each buffer is MAX_FILE_SIZE bytes)
+    void SetBuffers(int n)
+    {
+	if (n <= 1 || numBuffers > 1 || curCount > 0)
+	    return;
+
+	numBuffers = n;
+	buffers = new T*[n];
+	fullCount = new int[n];
+	fullFile = new int[n];
+	buffers[0] = buffer;
+	fullCount[0] = -1;
+	for (int i=1; i<n; i++)
+	{
+	    buffers[i] = new T[BufMax];
+	    countAlloc((int64_t)BufMax*sizeof(T));
+	    fullCount[i] = -1;
+	}
+	curBuffer = 0;
+	quit = false;
+
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&cond, NULL);
+	startThread(&ioThread, &ioStart, this);
+    }
+
     int Close()
     {	
-        // save before closing
-	writeBuffer();
+        // save before closing (and wait for background writes)
+	if (buffer != NULL)
+	    writeBuffer();
 	cleanup();
 	return curFile;
     }
 };
 
 // This is a class for a cross-platform file writer
-// capable of writing large files
+// capable of writing large files. Given an alignment, it can also pad
+// out to a multiple of it, and writes whole aligned chunks of a buffer
+// with O_DIRECT where the system (and file system) allows, so the
+// blocks don't fill up the page cache on the way out
 class LargeWriter
 {
 private:
@@ -408,10 +1476,25 @@ private:
     uint64_t writeLocation;
     FILE *file;
 
+    // for aligned writing: the file, and what's not written yet
+    string filename;
+    int fd;
+    int align;
+    bool direct;
+    char *buffer;
+    int bufSize;
+    int bufCount;
+
     void init()
     {
 	file = NULL;
 	writeLocation = 0;
+	fd = -1;
+	align = 0;
+	direct = false;
+	buffer = NULL;
+	bufSize = 0;
+	bufCount = 0;
     }
 
     // mark as private, no copying allowed
@@ -420,13 +1503,96 @@ private:
     // same here
     LargeWriter& operator=(const LargeWriter& old);
 
+    void openAligned()
+    {
+	bufSize = (DIRECT_BUF_SIZE + align - 1) / align * align;
+	void *mem;
+	// no buffer, no alignment: fall back to writing through stdio
+	if (posix_memalign(&mem, align, bufSize) != 0)
+	{
+	    fprintf(stderr,"Error allocating write buffer for %s, writing unaligned!\n",filename.c_str());
+	    align = 0;
+	    bufSize = 0;
+	    file = fopen(filename.c_str(), "wb");
+	    return;
+	}
+	buffer = (char*)mem;
+	countAlloc(bufSize);
+
+#ifdef O_DIRECT
+	fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+	direct = fd >= 0;
+#endif
+	// tmpfs and the like say no to O_DIRECT, so just write buffered
+	if (fd < 0)
+	    fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+	    fprintf(stderr,"Error opening %s for writing!\n",filename.c_str());
+    }
+
+    // turns O_DIRECT off for the rest of the file
+    void stopDirect()
+    {
+#ifdef O_DIRECT
+	if (direct)
+	    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+#endif
+	direct = false;
+    }
+
+    void writeOut(const char *data, int size)
+    {
+	while (size > 0)
+	{
+	    ssize_t n = write(fd, data, size);
+	    if (n < 0 && errno == EINTR)
+		continue;
+	    // the file system wants a bigger alignment, or none of this
+	    if (n < 0 && errno == EINVAL && direct)
+	    {
+		fprintf(stderr,"No direct I/O for %s, writing it buffered.\n",filename.c_str());
+		stopDirect();
+		continue;
+	    }
+	    if (n <= 0)
+	    {
+		fprintf(stderr,"Error writing %s!\n",filename.c_str());
+		return;
+	    }
+	    data += n;
+	    size -= n;
+	}
+    }
+
+    // writes out the whole aligned part of the buffer, and on closing,
+    // the rest of it too (without O_DIRECT, since it's a partial block)
+    void flush(bool last)
+    {
+	int n = bufCount / align * align;
+	writeOut(buffer, n);
+	memmove(buffer, buffer+n, bufCount-n);
+	bufCount -= n;
+	if (last && bufCount > 0)
+	{
+	    stopDirect();
+	    writeOut(buffer, bufCount);
+	    bufCount = 0;
+	}
+    }
+
 
 public:
 
-    LargeWriter(string filename)
+    // alignment 0 writes through stdio, as always, and never pads
+    LargeWriter(string fname, int alignment = 0)
     {
 	init();
-	file = fopen(filename.c_str(), "wb");
+	filename = fname;
+	align = alignment;
+	if (align > 0)
+	    openAligned();
+	else
+	    file = fopen(filename.c_str(), "wb");
     }
 
     ~LargeWriter()
@@ -436,8 +1602,42 @@ public:
 
     void Write(void * data, int size)
     {
-	fwrite(data, size, 1, file);
 	writeLocation += size;
+	countWrite(size, 0);
+	if (align <= 0)
+	{
+	    fwrite(data, size, 1, file);
+	    return;
+	}
+
+	const char *p = (const char*)data;
+	while (size > 0)
+	{
+	    int n = min(size, bufSize - bufCount);
+	    memcpy(buffer + bufCount, p, n);
+	    bufCount += n;
+	    p += n;
+	    size -= n;
+	    if (bufCount == bufSize)
+		flush(false);
+	}
+    }
+
+    // pads with zeros up to the next multiple of the alignment, and
+    // returns how many bytes that took (none without an alignment)
+    uint64_t Pad()
+    {
+	if (align <= 0)
+	    return 0;
+	int pad = (int)((align - writeLocation % align) % align);
+	writeLocation += pad;
+	countWrite(pad, 0);
+	// the buffer is a multiple of align, so this never wraps
+	memset(buffer + bufCount, 0, pad);
+	bufCount += pad;
+	if (bufCount == bufSize)
+	    flush(false);
+	return pad;
     }
 
     uint64_t GetLocation()
@@ -452,6 +1652,18 @@ public:
 	    fclose(file);
 	    file = NULL;
 	}
+	if (fd >= 0)
+	{
+	    flush(true);
+	    close(fd);
+	    fd = -1;
+	}
+	if (buffer != NULL)
+	{
+	    free(buffer);
+	    buffer = NULL;
+	    countFree(bufSize);
+	}
     }
 };
 
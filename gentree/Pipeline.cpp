@@ -0,0 +1,821 @@
+#include "Formats.h"
+#include "PartFiles.h"
+#include "Process.h"
+#include "MergeFiles.h"
+#include "Pipeline.h"
+#include "Loaders.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+
+extern int DirectPlace;
+extern int InMemory;
+extern int HaloMemory;
+
+
+// rough memory used by readers and writers, for the scheduler
+uint64_t readerMemory()
+{
+    return (uint64_t)READ_BUF_SIZE * (ReadAhead ? 2 : 1);
+}
+
+uint64_t writerMemory()
+{
+    return (uint64_t)MAX_FILE_SIZE * (WriteBuffers > 1 ? WriteBuffers : 1);
+}
+
+
+// the stages of each chain, in order, as they are named in the manifests
+enum { INTERLEAVE, PID_MERGE, INDEX, COORD_MERGE, BLOCKS, NUM_POINT_STAGES };
+static const char *PointStages[] = { "interleave", "pid merge", "index", "coord merge", "blocks" };
+
+enum { SUBIDS, SUBID_MERGE, SEQUENCE, SUBID_RESORT, HALOS, NUM_SUB_STAGES };
+static const char *SubStages[] = { "subids", "subid merge", "sequence", "subid resort", "halos" };
+
+enum { SUBORDER, SUBORDER_MERGE, NUM_ORDER_STAGES };
+static const char *OrderStages[] = { "suborder", "suborder merge" };
+
+
+// a set of subfiles, and the count file next to it
+static vector<string> runFiles(string filename)
+{
+    vector<string> files;
+    listSubfiles(filename, files);
+    files.push_back(filename);
+    return files;
+}
+
+static vector<string> subFiles(string filename)
+{
+    vector<string> files;
+    listSubfiles(filename, files);
+    return files;
+}
+
+// saves where a chain's files are, for the stages after this one
+static void savePaths(Manifest *m, const PathPair& paths)
+{
+    m->SetString("location", paths.location);
+    m->SetString("temp", paths.temp);
+}
+
+static bool loadPaths(Manifest *m, PathPair& paths)
+{
+    return m->GetString("location", paths.location) && m->GetString("temp", paths.temp);
+}
+
+// and the rest of what a snapshot's later stages need
+static void saveState(SnapState *s)
+{
+    savePaths(s->manifest, s->paths);
+    s->manifest->SetValue("head", &s->head, sizeof(SnapHeader));
+    s->manifest->SetValue("bf", &s->bf, sizeof(BlockFile));
+    int placed = s->placed;
+    s->manifest->SetValue("placed", &placed, sizeof(int));
+}
+
+static bool loadState(SnapState *s)
+{
+    int placed = 0;
+    bool ok = loadPaths(s->manifest, s->paths)
+	&& s->manifest->GetValue("head", &s->head, sizeof(SnapHeader))
+	&& s->manifest->GetValue("bf", &s->bf, sizeof(BlockFile))
+	&& s->manifest->GetValue("placed", &placed, sizeof(int));
+    s->placed = (placed != 0);
+    return ok;
+}
+
+// is a snapshot's pid-sorted file still there, for the index of the one before?
+static bool hasPidFile(SnapState *s)
+{
+    // (never, if it was done in memory)
+    int memory = 0;
+    if (s->manifest->GetValue("memory", &memory, sizeof(int)) && memory)
+	return false;
+    if (s->manifest->IsDone(PointStages[PID_MERGE]))
+	return s->manifest->Check(PointStages[PID_MERGE]);
+    // (resumed from an old _info file, without a manifest)
+    struct stat st;
+    return stat(getSubfile(s->head.filename, 0).c_str(), &st) == 0;
+}
+
+
+// ***************************************************************
+// Stages for the points
+// ***************************************************************
+
+/* Merges the sorted runs of one file, unless told to skip it, and then
+   records that in the manifest. Only then are the runs removed, so that
+   an interrupted merge can be run again. */
+template<typename T>
+class MergeStage : public Stage
+{
+    PathPair *paths;
+    string filename;
+    Manifest *manifest;
+    string stage;
+    bool *skip;
+
+public:
+    MergeStage(string n, PathPair *p, string fname, Manifest *m, string stg, bool *skp = NULL)
+	: Stage(n, true, MERGE_BUF_SIZE)
+    {
+	paths = p;
+	filename = fname;
+	manifest = m;
+	stage = stg;
+	skip = skp;
+    }
+
+    void Run()
+    {
+	PathPair old = *paths;
+	if (skip == NULL || !*skip)
+	    *paths = MergeSorted<T>(filename, *paths);
+
+	savePaths(manifest, *paths);
+	manifest->Finish(stage, subFiles(paths->location + filename));
+
+	// a single run is already merged, and only its count file goes
+	if (paths->location != old.location)
+	    removeSubfiles(old.location + filename);
+	else
+	    remove((old.location + filename).c_str());
+    }
+};
+
+class InterleaveStage : public Stage
+{
+    PathInfo *ps;
+    SnapState *s;
+
+public:
+    InterleaveStage(PathInfo *p, SnapState *st)
+	: Stage("interleave " + toString<int>(st->snap), true, writerMemory() + READ_BUF_SIZE)
+    {
+	ps = p;
+	s = st;
+    }
+
+    void Run()
+    {
+	// interleave and sort by pid (unless already placed by pid)
+	s->head = Interleave(*ps, s->paths.location + s->snapName, s->snap, DirectPlace != 0, s->placed);
+
+	saveState(s);
+	if (s->placed)
+	    s->manifest->Finish(PointStages[INTERLEAVE], subFiles(s->paths.location + s->snapName));
+	else
+	    s->manifest->Finish(PointStages[INTERLEAVE], runFiles(s->paths.location + s->snapName));
+    }
+};
+
+class IndexStage : public Stage
+{
+    SnapState *s;
+
+public:
+    IndexStage(SnapState *st)
+	: Stage("index " + toString<int>(st->snap), true, 2*readerMemory() + writerMemory())
+    {
+	s = st;
+    }
+
+    void Run()
+    {
+	s->head.SetFilename(s->paths.location + s->snapName);
+
+	// build index and sort by index
+	// do we have a next snap?
+	if (s->next != NULL)
+	    s->bf = BuildIndex(&s->head, &s->next->head, s->paths.temp + s->indName);
+	else
+	    s->bf = BuildIndex(&s->head, NULL, s->paths.temp + s->indName);
+
+	s->paths.swap();
+
+	saveState(s);
+	s->manifest->Finish(PointStages[INDEX], runFiles(s->paths.location + s->indName));
+
+	// and we won't be needing the next snap's points anymore
+	if (s->next != NULL)
+	    removeSubfiles(s->next->head.filename);
+    }
+};
+
+class BlocksStage : public Stage
+{
+    SnapState *s;
+    int maxcnt;
+    int numsubs;
+
+public:
+    BlocksStage(SnapState *st, int maxc, int nsubs)
+	: Stage("blocks " + toString<int>(st->snap), false, readerMemory())
+    {
+	s = st;
+	maxcnt = maxc;
+	numsubs = nsubs;
+    }
+
+    void Run()
+    {
+	// and create all the block files
+	ProcessBlocks(s->paths.location + s->indName, s->paths.temp + s->blocksName, maxcnt, numsubs, s->bf);
+	s->bf.Save(s->paths.temp + s->blocksName + "_info");
+
+	// also save snap info
+	s->head.Save();
+
+	vector<string> files = subFiles(s->paths.temp + s->blocksName);
+	files.push_back(s->paths.temp + s->blocksName + "_info");
+	files.push_back(s->paths.temp + s->blocksName + "_dir");
+	files.push_back(string(s->head.filename) + "_info");
+	s->manifest->Finish(PointStages[BLOCKS], files);
+
+	// done with the coord-sorted points
+	removeSubfiles(s->paths.location + s->indName);
+    }
+};
+
+
+// ***************************************************************
+// Stages for the points, in memory
+// ***************************************************************
+
+class MemInterleaveStage : public Stage
+{
+    PathInfo *ps;
+    SnapState *s;
+
+public:
+    MemInterleaveStage(PathInfo *p, SnapState *st, uint64_t count)
+	: Stage("interleave " + toString<int>(st->snap), true, count*sizeof(VertexA))
+    {
+	ps = p;
+	s = st;
+    }
+
+    void Run()
+    {
+	// (the filename only names the snap info)
+	s->head = Interleave(*ps, s->paths.location + s->snapName, s->snap, DirectPlace != 0, s->placed,
+			     &s->pidPoints);
+    }
+};
+
+class MemIndexStage : public Stage
+{
+    SnapState *s;
+
+public:
+    MemIndexStage(SnapState *st, uint64_t count)
+	: Stage("index " + toString<int>(st->snap), false, count*(sizeof(VertexA) + sizeof(VertexB)))
+    {
+	s = st;
+    }
+
+    void Run()
+    {
+	SnapState *n = s->next;
+	s->bf = BuildIndex(&s->head, s->pidPoints, n ? &n->head : NULL, n ? n->pidPoints : NULL,
+			   &s->coordPoints);
+
+	// done with the next snap's points, wherever they were
+	if (n != NULL)
+	{
+	    if (n->pidPoints != NULL)
+	    {
+		delete[] n->pidPoints;
+		n->pidPoints = NULL;
+	    }
+	    else
+		removeSubfiles(n->head.filename);
+	}
+	if (!s->pointsNeeded)
+	{
+	    delete[] s->pidPoints;
+	    s->pidPoints = NULL;
+	}
+    }
+};
+
+class MemBlocksStage : public Stage
+{
+    SnapState *s;
+    int maxcnt;
+    int numsubs;
+
+public:
+    MemBlocksStage(SnapState *st, int maxc, int nsubs, uint64_t count)
+	: Stage("blocks " + toString<int>(st->snap), false, count*sizeof(VertexB))
+    {
+	s = st;
+	maxcnt = maxc;
+	numsubs = nsubs;
+    }
+
+    void Run()
+    {
+	ProcessBlocks(BlockInput(s->coordPoints, s->head.numTotal), s->paths.location + s->blocksName,
+		      maxcnt, numsubs, s->bf);
+	s->bf.Save(s->paths.location + s->blocksName + "_info");
+	s->head.Save();
+
+	delete[] s->coordPoints;
+	s->coordPoints = NULL;
+
+	// every stage is done at once, with only the blocks to show for it
+	int memory = 1;
+	s->manifest->SetValue("memory", &memory, sizeof(int));
+	saveState(s);
+	for (int i=0; i<BLOCKS; i++)
+	    s->manifest->Finish(PointStages[i], vector<string>());
+
+	vector<string> files = subFiles(s->paths.location + s->blocksName);
+	files.push_back(s->paths.location + s->blocksName + "_info");
+	files.push_back(s->paths.location + s->blocksName + "_dir");
+	files.push_back(string(s->head.filename) + "_info");
+	s->manifest->Finish(PointStages[BLOCKS], files);
+    }
+};
+
+
+// ***************************************************************
+// Stages for the subhalos
+// ***************************************************************
+
+class SubOrderStage : public Stage
+{
+    PathInfo *ps;
+    int snap;
+    string filename;
+    Manifest *manifest;
+
+public:
+    SubOrderStage(PathInfo *p, int sn, string fname, Manifest *m)
+	: Stage("suborder", true, writerMemory())
+    {
+	ps = p;
+	snap = sn;
+	filename = fname;
+	manifest = m;
+    }
+
+    void Run()
+    {
+	BuildSubOrder(*ps, snap, filename);
+	manifest->Finish(OrderStages[SUBORDER], runFiles(filename));
+    }
+};
+
+class PrepareStage : public Stage
+{
+    PathInfo *ps;
+    SubState *s;
+
+public:
+    PrepareStage(PathInfo *p, SubState *st)
+	: Stage("subids " + toString<int>(st->snap), true, writerMemory())
+    {
+	ps = p;
+	s = st;
+    }
+
+    void Run()
+    {
+	printf("Doing snap %d...\n", s->snap);
+	// first, rearrange subids
+	PrepareSubIds(*ps, s->snap, s->paths.location + s->subName);
+
+	savePaths(s->manifest, s->paths);
+	s->manifest->Finish(SubStages[SUBIDS], runFiles(s->paths.location + s->subName));
+    }
+};
+
+class SequenceStage : public Stage
+{
+    SubState *s;
+    PathPair *orderPaths;
+    string orderFile;
+
+public:
+    SequenceStage(SubState *st, PathPair *op, string ofile)
+	: Stage("sequence " + toString<int>(st->snap), true, 2*readerMemory() + writerMemory())
+    {
+	s = st;
+	orderPaths = op;
+	orderFile = ofile;
+    }
+
+    void Run()
+    {
+	// now fix the pids to go from 0....n-1
+	SequenceSubIds(s->paths, orderPaths->location + orderFile, s->subName);
+	s->paths.swap();
+
+	savePaths(s->manifest, s->paths);
+	s->manifest->Finish(SubStages[SEQUENCE], runFiles(s->paths.location + s->subName));
+
+	// the input was on the other side
+	removeSubfiles(s->paths.temp + s->subName);
+    }
+};
+
+/* Reads the merger tree once for the halo tables of every snapshot still
+   to do, and leaves each in its own file for its HaloStage. */
+class HaloTreeStage : public Stage
+{
+    PathInfo *ps;
+    string treefile;
+    string dir;
+    int step;
+    vector<int> snaps;
+    vector<string> tables;
+
+public:
+    HaloTreeStage(PathInfo *p, string tfile, string d, int stp, const vector<int>& sn,
+		  const vector<string>& tbl, uint64_t mem)
+	: Stage("halo trees", true, mem)
+    {
+	ps = p;
+	treefile = tfile;
+	dir = d;
+	step = stp;
+	snaps = sn;
+	tables = tbl;
+    }
+
+    void Run()
+    {
+	BuildHaloTrees(*ps, treefile, dir, snaps, step, tables, (uint64_t)HaloMemory*1000000);
+    }
+};
+
+class HaloStage : public Stage
+{
+    SubState *s;
+    string table;
+
+public:
+    HaloStage(SubState *st, string tbl, uint64_t tableSize)
+	: Stage("halos " + toString<int>(st->snap), false, readerMemory() + tableSize)
+    {
+	s = st;
+	table = tbl;
+    }
+
+    void Run()
+    {
+	// now build the table omgzzz
+	BuildHaloTable(s->paths, s->snap, s->subName, table);
+
+	vector<string> files;
+	files.push_back(s->paths.temp + s->subName);
+	files.push_back(s->paths.temp + "/halos_" + toString<int>(s->snap));
+	s->manifest->Finish(SubStages[HALOS], files);
+
+	removeSubfiles(s->paths.location + s->subName);
+	remove(table.c_str());
+    }
+};
+
+
+// ***************************************************************
+// The pipeline itself
+// ***************************************************************
+
+/* Returns the particle count of the largest snapshot, if they all fit in
+   the InMemory budget (when it's -1, half of physical memory), else 0.
+   At most two snapshots are kept at once, with their points in both
+   sorted orders, while one gets indexed and the other made into blocks. */
+static uint64_t memoryCount(PathInfo& ps, int firstSnap, int lastSnap, int step)
+{
+    if (InMemory == 0)
+	return 0;
+
+    uint64_t budget = (uint64_t)InMemory*1000000;
+    if (InMemory < 0)
+	budget = (uint64_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) / 2;
+
+    uint64_t maxCount = 0;
+    for (int snap = lastSnap; snap>=firstSnap; snap -= step)
+    {
+	VertexData head = LoadSnapHeader(ps, snap, 0);
+	if (head.numSubfiles == 0)
+	    return 0;
+	uint64_t n = head.numTotals[1] | (((uint64_t)head.nLargeSims[1])<<32);
+	maxCount = MAX(maxCount, n);
+    }
+
+    uint64_t need = maxCount * 2*(sizeof(VertexA) + sizeof(VertexB));
+    // (the in-memory sorts count with ints)
+    if (need > budget || maxCount >= 0x7fffffff)
+    {
+	printf("Snapshots of %lu particles need %s, more than %s, so using files.\n",
+	       (long unsigned int)maxCount, formatBytes(need).c_str(), formatBytes(budget).c_str());
+	return 0;
+    }
+
+    printf("Snapshots of %lu particles fit in %s, so doing them in memory.\n",
+	   (long unsigned int)maxCount, formatBytes(budget).c_str());
+    return maxCount;
+}
+
+Pipeline::Pipeline(PathInfo& info)
+    : ps(info), sched(MaxStages, MaxDiskStages, (uint64_t)MaxMemory*1000000)
+{
+    orderManifest = NULL;
+}
+
+Pipeline::~Pipeline()
+{
+    for (unsigned int i=0; i<snaps.size(); i++)
+    {
+	delete snaps[i]->manifest;
+	delete[] snaps[i]->pidPoints;
+	delete[] snaps[i]->coordPoints;
+	delete snaps[i];
+    }
+    for (unsigned int i=0; i<subs.size(); i++)
+    {
+	delete subs[i]->manifest;
+	delete subs[i];
+    }
+    delete orderManifest;
+}
+
+void Pipeline::AddProcessing(PathPair paths, int firstSnap, int lastSnap, int step, int maxcnt, int numsubs)
+{
+    // can we skip the intermediate files?
+    uint64_t memCount = memoryCount(ps, firstSnap, lastSnap, step);
+    bool memory = (memCount > 0);
+
+    // first find how far each snapshot got, counting backwards from lastSnap
+    vector<SnapState*> added;
+    vector<int> done;
+    SnapState *next = NULL;
+    for (int snap = lastSnap; snap>=firstSnap; snap -= step)
+    {
+	SnapState *s = new SnapState();
+	snaps.push_back(s);
+	added.push_back(s);
+	s->snap = snap;
+	s->paths = paths;
+	s->placed = false;
+	s->next = next;
+	s->inMemory = memory;
+	s->pidPoints = NULL;
+	s->coordPoints = NULL;
+	s->pointsNeeded = false;
+	s->snapName = "/snap_" + toString<int>(snap);
+	s->indName = "/ind_" + toString<int>(snap);
+	s->blocksName = "/blocks_" + toString<int>(snap);
+	// (always on the first path, since the others move around)
+	s->manifest = new Manifest(paths.location + s->snapName + "_manifest");
+
+	int d = s->manifest->Resume(PointStages, NUM_POINT_STAGES);
+	if (d > 0 && !loadState(s))
+	{
+	    fprintf(stderr,"Bad manifest for snap %d, starting over.\n",snap);
+	    s->manifest->Clear();
+	    s->paths = paths;
+	    d = 0;
+	}
+	// in memory, a snapshot is either done or not
+	if (memory && d > 0 && d < NUM_POINT_STAGES)
+	{
+	    printf("Redoing snap %d in memory.\n",snap);
+	    s->manifest->Clear();
+	    s->paths = paths;
+	    d = 0;
+	}
+
+	// no manifest, but an old finished run might have left its info
+	if (d == 0 && next == NULL)
+	{
+	    string where[2] = { paths.location, paths.temp };
+	    for (int i=0; i<2 && d == 0; i++)
+	    {
+		s->head = SnapHeader(where[i] + s->snapName+"_info");
+		if (s->head.snap >= 0)
+		{
+		    printf("Found snap %d at %s, resuming...",snap,s->head.filename);
+		    d = NUM_POINT_STAGES;
+		}
+	    }
+	    if (d == 0)
+		printf("Failed to locate previously generated block, starting from scratch.\n");
+	}
+	else if (d > 0)
+	    printf("Resuming snap %d after %s.\n",snap,PointStages[d-1]);
+
+	done.push_back(d);
+	next = s;
+    }
+
+    // a snapshot still to be indexed needs the pid-sorted points of the
+    // next one, so redo that one if they've gone missing
+    for (bool changed = true; changed; )
+    {
+	changed = false;
+	for (unsigned int i=1; i<added.size(); i++)
+	{
+	    SnapState *n = added[i-1];
+	    if (done[i] <= INDEX && done[i-1] > PID_MERGE && !hasPidFile(n))
+	    {
+		fprintf(stderr,"Points of snap %d are gone, redoing it.\n",n->snap);
+		n->manifest->Clear();
+		n->paths = paths;
+		n->placed = false;
+		done[i-1] = 0;
+		changed = true;
+	    }
+	}
+    }
+
+    // index stage of the next snap, which has to finish reading its
+    // pid-sorted file before we can use (and delete) it
+    Stage *nextIndex = NULL;
+
+    // now add whatever processing each one still needs
+    for (unsigned int i=0; i<added.size(); i++)
+    {
+	SnapState *s = added[i];
+	string sn = toString<int>(s->snap);
+	// (next to the manifest)
+	string report = paths.location + s->snapName + "_stats.json";
+	Stage *prev = NULL;
+	Stage *index = NULL;
+
+	if (memory)
+	{
+	    if (done[i] == NUM_POINT_STAGES)
+	    {
+		nextIndex = NULL;
+		continue;
+	    }
+	    s->pointsNeeded = (i+1 < added.size() && done[i+1] < NUM_POINT_STAGES);
+
+	    // not loaded until the next snap is indexed, which frees the one after
+	    Stage *load = sched.Add(new MemInterleaveStage(&ps, s, memCount), report);
+	    load->After(nextIndex);
+	    index = sched.Add(new MemIndexStage(s, memCount), report);
+	    index->After(load);
+	    index->After(nextIndex);
+	    Stage *blocks = sched.Add(new MemBlocksStage(s, maxcnt, numsubs, memCount), report);
+	    blocks->After(index);
+
+	    nextIndex = index;
+	    continue;
+	}
+
+	if (done[i] <= INTERLEAVE)
+	    prev = sched.Add(new InterleaveStage(&ps, s), report);
+	if (done[i] <= PID_MERGE)
+	{
+	    Stage *mergeA = sched.Add(new MergeStage<VertexA>("pid merge " + sn, &s->paths, s->snapName,
+							      s->manifest, PointStages[PID_MERGE], &s->placed), report);
+	    mergeA->After(prev);
+	    prev = mergeA;
+	}
+	if (done[i] <= INDEX)
+	{
+	    index = sched.Add(new IndexStage(s), report);
+	    index->After(prev);
+	    index->After(nextIndex);
+	    prev = index;
+	}
+	if (done[i] <= COORD_MERGE)
+	{
+	    Stage *mergeB = sched.Add(new MergeStage<VertexB>("coord merge " + sn, &s->paths, s->indName,
+							      s->manifest, PointStages[COORD_MERGE]), report);
+	    mergeB->After(prev);
+	    prev = mergeB;
+	}
+	if (done[i] <= BLOCKS)
+	{
+	    Stage *blocks = sched.Add(new BlocksStage(s, maxcnt, numsubs), report);
+	    blocks->After(prev);
+	}
+
+	nextIndex = index;
+    }
+}
+
+void Pipeline::AddSubhalos(PathPair paths, int firstSnap, int lastSnap, int step)
+{
+    printf("Building subhalo table for %d...%d, every %d.\n",firstSnap,lastSnap,step);
+
+    orderPaths = paths;
+    orderFile = "/suborder";
+    orderManifest = new Manifest(paths.location + orderFile + "_manifest");
+    int orderDone = orderManifest->Resume(OrderStages, NUM_ORDER_STAGES);
+    if (orderDone > 0 && !loadPaths(orderManifest, orderPaths))
+    {
+	orderManifest->Clear();
+	orderPaths = paths;
+	orderDone = 0;
+    }
+
+    string orderReport = paths.location + orderFile + "_stats.json";
+
+    // first, we need to make the subid lookup table
+    Stage *order = NULL;
+    if (orderDone <= SUBORDER)
+	order = sched.Add(new SubOrderStage(&ps, firstSnap, paths.location + orderFile, orderManifest),
+			  orderReport);
+    // and merge them
+    Stage *orderMerge = NULL;
+    if (orderDone <= SUBORDER_MERGE)
+    {
+	orderMerge = sched.Add(new MergeStage<uint64_t>("suborder merge", &orderPaths, orderFile,
+							orderManifest, OrderStages[SUBORDER_MERGE]), orderReport);
+	orderMerge->After(order);
+    }
+
+    // and get a treefile
+    treeFile = ps.GetTree(lastSnap,step);
+
+    // the snapshots whose tables are still to do, for one pass over it
+    vector<Stage*> haloStages;
+    vector<int> haloSnaps;
+    vector<string> haloTables;
+    uint64_t tablesSize = 0;
+
+    for (int snap=firstSnap; snap<= lastSnap; snap+=step)
+    {
+	SubState *s = new SubState();
+	subs.push_back(s);
+	s->snap = snap;
+	s->paths = paths;
+	s->subName = "/subid_" + toString<int>(snap);
+	s->manifest = new Manifest(paths.location + s->subName + "_manifest");
+
+	int done = s->manifest->Resume(SubStages, NUM_SUB_STAGES);
+	if (done > 0 && !loadPaths(s->manifest, s->paths))
+	{
+	    s->manifest->Clear();
+	    s->paths = paths;
+	    done = 0;
+	}
+	if (done > 0)
+	    printf("Resuming subhalos of snap %d after %s.\n",snap,SubStages[done-1]);
+
+	string sn = toString<int>(snap);
+	string report = paths.location + s->subName + "_stats.json";
+	Stage *prev = NULL;
+	if (done <= SUBIDS)
+	    prev = sched.Add(new PrepareStage(&ps, s), report);
+	// and mergesort (probably not neccessary)
+	if (done <= SUBID_MERGE)
+	{
+	    Stage *merge1 = sched.Add(new MergeStage<GroupVertex>("subid merge " + sn, &s->paths, s->subName,
+								  s->manifest, SubStages[SUBID_MERGE]), report);
+	    merge1->After(prev);
+	    prev = merge1;
+	}
+	if (done <= SEQUENCE)
+	{
+	    Stage *seq = sched.Add(new SequenceStage(s, &orderPaths, orderFile), report);
+	    seq->After(prev);
+	    seq->After(orderMerge);
+	    prev = seq;
+	}
+	// and resort
+	if (done <= SUBID_RESORT)
+	{
+	    Stage *merge2 = sched.Add(new MergeStage<GroupVertexB>("subid resort " + sn, &s->paths, s->subName,
+								   s->manifest, SubStages[SUBID_RESORT]), report);
+	    merge2->After(prev);
+	    prev = merge2;
+	}
+	if (done <= HALOS)
+	{
+	    string table = paths.location + "/halotree_" + sn;
+	    uint64_t size = HaloTableSize(ps, snap, paths.location);
+	    Stage *halos = sched.Add(new HaloStage(s, table, size), report);
+	    halos->After(prev);
+	    haloStages.push_back(halos);
+	    haloSnaps.push_back(snap);
+	    haloTables.push_back(table);
+	    tablesSize += size;
+	}
+    }
+
+    if (haloStages.empty())
+	return;
+    // it holds as many tables at once as HaloMemory allows
+    if (HaloMemory > 0)
+	tablesSize = MIN(tablesSize, (uint64_t)HaloMemory*1000000);
+    Stage *trees = sched.Add(new HaloTreeStage(&ps, treeFile, paths.location, step, haloSnaps, haloTables,
+					       tablesSize), paths.location + "/halotree_stats.json");
+    for (unsigned int i=0; i<haloStages.size(); i++)
+	haloStages[i]->After(trees);
+}
+
+void Pipeline::Run()
+{
+    sched.Run();
+}
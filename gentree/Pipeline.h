@@ -0,0 +1,99 @@
+#ifndef _PIPELINE_H_
+#define _PIPELINE_H_
+
+#include <vector>
+#include "Formats.h"
+#include "Manifest.h"
+#include "Scheduler.h"
+
+
+/* Everything one snapshot needs on its way through the pipeline.
+   Each gets its own copy of the paths, since merges swap them. */
+struct SnapState
+{
+    int snap;
+    PathPair paths;
+    SnapHeader head;
+    BlockFile bf;
+    // was interleave output written straight in pid order?
+    bool placed;
+    // the snapshot after this one in time, or NULL for the last
+    SnapState *next;
+    // which of its stages are done, from this or an earlier run
+    Manifest *manifest;
+
+    // done without intermediate files? then its points are kept here
+    // between stages, sorted by pid and then by coord (NULL if not)
+    bool inMemory;
+    VertexA *pidPoints;
+    VertexB *coordPoints;
+    // will the snapshot before this one still need its pidPoints?
+    bool pointsNeeded;
+
+    string snapName;
+    string indName;
+    string blocksName;
+};
+
+/* Same thing, for the subhalo tables of one snapshot. */
+struct SubState
+{
+    int snap;
+    PathPair paths;
+    string subName;
+    Manifest *manifest;
+};
+
+
+/* Builds the whole stage graph for the points and subhalos, and runs it
+   under the scheduler limits from the param file. Snapshots still get
+   processed from last to first, but a snapshot's block build can overlap
+   with the next one's interleave and merges, and subhalos go alongside.
+   Stages already finished by an earlier run, as their manifests say,
+   are skipped.
+
+   If every snapshot fits in the InMemory budget, their points skip the
+   sorted runs and merges, and go from interleave to blocks in memory,
+   keeping at most two snapshots loaded at once. Those are redone whole
+   if interrupted, since there is nothing on disk to resume from. */
+class Pipeline
+{
+private:
+    PathInfo ps;
+    Scheduler sched;
+
+    vector<SnapState*> snaps;
+    vector<SubState*> subs;
+
+    // shared by all the subhalo stages
+    PathPair orderPaths;
+    string orderFile;
+    string treeFile;
+    Manifest *orderManifest;
+
+    // mark as private, no copying allowed
+    Pipeline(const Pipeline& other);
+
+    // same here
+    Pipeline& operator=(const Pipeline& old);
+
+public:
+
+    Pipeline(PathInfo& info);
+    ~Pipeline();
+
+    /* adds stages to create last and then all previous snapshot block files */
+    void AddProcessing(PathPair paths, int firstSnap, int lastSnap, int step, int maxcnt, int numsubs);
+    /* adds stages to create all specified subhalo files */
+    void AddSubhalos(PathPair paths, int firstSnap, int lastSnap, int step);
+
+    void Run();
+
+    // for looking at the stages once they've run
+    Scheduler& GetScheduler()
+    {
+	return sched;
+    }
+};
+
+#endif
@@ -0,0 +1,167 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+
+#include "Formats.h"
+#include "Pipeline.h"
+#include "Params.h"
+#include "Threads.h"
+
+/* Runs the whole pipeline from a param file (say, one written by
+   gensnaps), from scratch, and sums up what each kind of stage did:
+   how many ran, how long they took all told, and how fast they read,
+   wrote and went through records. Manifests and old snap info get
+   removed before each run, so nothing is skipped.
+
+   usage: pipelinebench <paramfile> [-p|-g] [-s] [-r runs]
+     -p, -g     only the points, or only the subhalos, as createblocks
+     -s         one stage at a time, to see each without the overlap
+     -r runs    times to run it all (default 1); the table is for the
+                last, and the total wall times for all of them  */
+
+// what each kind of stage added up to
+struct KindStats
+{
+    int count;
+    double wall;
+    StageStats stats;
+
+    KindStats()
+    {
+	count = 0;
+	wall = 0;
+    }
+};
+
+// removes whatever would let a run skip or resume a stage
+void clearRun(PathPair& paths, int first, int last, int step, bool points, bool groups)
+{
+    string where[2] = { paths.location, paths.temp };
+    for (int i=0; i<2; i++)
+    {
+	for (int snap = last; snap>=first; snap -= step)
+	{
+	    string n = toString<int>(snap);
+	    if (points)
+	    {
+		remove((where[i] + "/snap_" + n + "_manifest").c_str());
+		remove((where[i] + "/snap_" + n + "_info").c_str());
+	    }
+	    if (groups)
+		remove((where[i] + "/subid_" + n + "_manifest").c_str());
+	}
+	if (groups)
+	    remove((where[i] + "/suborder_manifest").c_str());
+    }
+}
+
+void printStats(map<string, KindStats>& kinds)
+{
+    printf("\n%-16s %5s %9s %9s %12s %12s %12s %10s\n",
+	   "stage", "count", "wall (s)", "cpu (s)", "read", "write", "records/s", "buffers");
+
+    map<string, KindStats>::iterator it;
+    for (it = kinds.begin(); it != kinds.end(); ++it)
+    {
+	KindStats& k = it->second;
+	const StageStats& st = k.stats;
+	uint64_t records = st.recordsWritten > st.recordsRead ? st.recordsWritten : st.recordsRead;
+	printf("%-16s %5d %9.2f %9.2f %12s %12s %12.3g %10s\n",
+	       it->first.c_str(), k.count, k.wall, 1e-9*st.cpuTime,
+	       formatRate(st.bytesRead, k.wall).c_str(), formatRate(st.bytesWritten, k.wall).c_str(),
+	       k.wall > 0 ? records/k.wall : 0.0, formatBytes(st.peakMemory).c_str());
+    }
+}
+
+int main(int argc, char * argv[])
+{
+    if (argc < 2)
+    {
+	printf("\nusage: pipelinebench <paramfile> [-p|-g] [-s] [-r runs]\n\n");
+	exit(1);
+    }
+
+    int findex = 0;
+    bool dogroups = true;
+    bool dopoints = true;
+    bool serial = false;
+    int runs = 1;
+    for (int i=1; i<argc; i++)
+    {
+	if (strcmp(argv[i], "-g") == 0)
+	    dopoints = false;
+	else if (strcmp(argv[i], "-p") == 0)
+	    dogroups = false;
+	else if (strcmp(argv[i], "-s") == 0)
+	    serial = true;
+	else if (strcmp(argv[i], "-r") == 0 && i+1 < argc)
+	    runs = atoi(argv[++i]);
+	else
+	    findex = i;
+    }
+    if (findex == 0 || runs < 1)
+    {
+	fprintf(stderr,"Bad options!\n");
+	exit(1);
+    }
+
+    int first, last, step;
+    int maxcount = 16000;
+    int nstripes = 2;
+
+    PathPair paths;
+    PathInfo ps = ReadParams(string(argv[findex]), paths, first, last, step, maxcount, nstripes);
+    if (serial)
+    {
+	MaxStages = 1;
+	MaxDiskStages = 1;
+    }
+
+    vector<double> times;
+    map<string, KindStats> kinds;
+    for (int r=0; r<runs; r++)
+    {
+	clearRun(paths, first, last, step, dopoints, dogroups);
+
+	Pipeline pipeline(ps);
+	if (dopoints)
+	    pipeline.AddProcessing(paths, first, last, step, maxcount, nstripes);
+	if (dogroups)
+	    pipeline.AddSubhalos(paths, first, last, step);
+
+	double start = getWallTime();
+	pipeline.Run();
+	times.push_back(getWallTime() - start);
+
+	// stats of the last run
+	kinds.clear();
+	Scheduler& sched = pipeline.GetScheduler();
+	for (int i=0; i<sched.NumStages(); i++)
+	{
+	    Stage *s = sched.GetStage(i);
+	    KindStats& k = kinds[stageKind(s->name)];
+	    k.count++;
+	    k.wall += s->WallTime();
+	    k.stats.bytesRead += s->stats.bytesRead;
+	    k.stats.bytesWritten += s->stats.bytesWritten;
+	    k.stats.recordsRead += s->stats.recordsRead;
+	    k.stats.recordsWritten += s->stats.recordsWritten;
+	    k.stats.cpuTime += s->stats.cpuTime;
+	    k.stats.peakMemory = max(k.stats.peakMemory, s->stats.peakMemory);
+	}
+    }
+
+    printf("\nSnaps %d to %d, every %d, with max count of %d, %d threads, up to %d stages at once.\n",
+	   first, last, step, maxcount, NumThreads, MaxStages);
+    printStats(kinds);
+
+    printf("\nTotal wall time:");
+    for (unsigned int i=0; i<times.size(); i++)
+	printf(" %.2f", times[i]);
+    sort(times.begin(), times.end());
+    printf(" s\nmin %.2f s, median %.2f s\n", times[0], times[times.size()/2]);
+
+    return 0;
+}
@@ -0,0 +1,257 @@
+#include <stdlib.h>
+#include <string.h>
+#include <cmath>
+#include "PointGrid.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+PointGrid::PointGrid()
+{
+    numPoints = 0;
+    xs = ys = zs = NULL;
+    ids = NULL;
+    capacity = 0;
+    cellStart = NULL;
+    cellCapacity = 0;
+    evals = 0;
+}
+
+PointGrid::~PointGrid()
+{
+    delete[] xs;
+    delete[] ys;
+    delete[] zs;
+    delete[] ids;
+    delete[] cellStart;
+}
+
+void PointGrid::reserve(int n, int ncells)
+{
+    if (n > capacity)
+    {
+	delete[] xs;
+	delete[] ys;
+	delete[] zs;
+	delete[] ids;
+	capacity = n;
+	xs = new double[capacity];
+	ys = new double[capacity];
+	zs = new double[capacity];
+	ids = new int[capacity];
+    }
+    if (ncells+1 > cellCapacity)
+    {
+	delete[] cellStart;
+	cellCapacity = ncells+1;
+	cellStart = new int[cellCapacity];
+    }
+}
+
+void PointGrid::Build(const double *pos, size_t stride, int n)
+{
+    numPoints = n;
+
+    double hi[3];
+    for (int j=0; j<3; j++)
+    {
+	lo[j] = 1e300;
+	hi[j] = -1e300;
+    }
+    for (int i=0; i<n; i++)
+    {
+	const double *p = (const double*)((const char*)pos + i*stride);
+	for (int j=0; j<3; j++)
+	{
+	    if (p[j] < lo[j]) lo[j] = p[j];
+	    if (p[j] > hi[j]) hi[j] = p[j];
+	}
+    }
+
+    // pick a cell size giving a few points per cell
+    dims[0] = dims[1] = dims[2] = 1;
+    if (n >= GRID_MIN_POINTS)
+    {
+	double vol = 1;
+	int ndims = 0;
+	for (int j=0; j<3; j++)
+	{
+	    if (hi[j] > lo[j])
+	    {
+		vol *= hi[j] - lo[j];
+		ndims++;
+	    }
+	}
+	if (ndims > 0)
+	{
+	    double size = pow(vol * GRID_CELL_POINTS / n, 1.0/ndims);
+	    for (int j=0; j<3; j++)
+	    {
+		if (hi[j] > lo[j])
+		{
+		    dims[j] = (int)((hi[j]-lo[j]) / size) + 1;
+		    // keep flat point sets from exploding the cell count
+		    if (dims[j] > n)
+			dims[j] = n;
+		}
+	    }
+	}
+    }
+
+    minSize = 1e300;
+    for (int j=0; j<3; j++)
+    {
+	double size = (hi[j] > lo[j]) ? (hi[j]-lo[j]) / dims[j] : 0;
+	invSize[j] = (size > 0) ? 1.0 / size : 0;
+	// a flat dim doesn't help bound distances
+	if (dims[j] > 1 && size < minSize)
+	    minSize = size;
+    }
+    if (minSize == 1e300)
+	minSize = 0;
+
+    int ncells = dims[0]*dims[1]*dims[2];
+    reserve(n, ncells);
+
+    // counting sort of the points by cell
+    memset(cellStart, 0, (ncells+1)*sizeof(int));
+    int *cellOf = new int[n];
+    for (int i=0; i<n; i++)
+    {
+	const double *p = (const double*)((const char*)pos + i*stride);
+	int c[3];
+	for (int j=0; j<3; j++)
+	{
+	    c[j] = (int)((p[j]-lo[j]) * invSize[j]);
+	    if (c[j] >= dims[j]) c[j] = dims[j]-1;
+	    if (c[j] < 0) c[j] = 0;
+	}
+	cellOf[i] = (c[2]*dims[1] + c[1])*dims[0] + c[0];
+	cellStart[cellOf[i]+1]++;
+    }
+    for (int c=0; c<ncells; c++)
+	cellStart[c+1] += cellStart[c];
+
+    int *next = new int[ncells];
+    memcpy(next, cellStart, ncells*sizeof(int));
+    for (int i=0; i<n; i++)
+    {
+	const double *p = (const double*)((const char*)pos + i*stride);
+	int k = next[cellOf[i]]++;
+	xs[k] = p[0];
+	ys[k] = p[1];
+	zs[k] = p[2];
+	ids[k] = i;
+    }
+    delete[] next;
+    delete[] cellOf;
+}
+
+// checks every point in a cell against the best so far
+inline void PointGrid::scanCell(int cell, const double q[3], double& best, int& bestIdx, uint64_t& count) const
+{
+    int i = cellStart[cell];
+    int end = cellStart[cell+1];
+    count += end - i;
+
+#ifdef __SSE2__
+    // two at a time, but the comparisons stay in order
+    __m128d qx = _mm_set1_pd(q[0]);
+    __m128d qy = _mm_set1_pd(q[1]);
+    __m128d qz = _mm_set1_pd(q[2]);
+    for (; i+1 < end; i+=2)
+    {
+	__m128d dx = _mm_sub_pd(qx, _mm_loadu_pd(xs+i));
+	__m128d dy = _mm_sub_pd(qy, _mm_loadu_pd(ys+i));
+	__m128d dz = _mm_sub_pd(qz, _mm_loadu_pd(zs+i));
+	__m128d d = _mm_add_pd(_mm_add_pd(_mm_mul_pd(dx,dx), _mm_mul_pd(dy,dy)),
+			       _mm_mul_pd(dz,dz));
+	double dd[2];
+	_mm_storeu_pd(dd, d);
+	for (int k=0; k<2; k++)
+	{
+	    if (dd[k] < best || (dd[k] == best && ids[i+k] < bestIdx))
+	    {
+		best = dd[k];
+		bestIdx = ids[i+k];
+	    }
+	}
+    }
+#endif
+
+    for (; i < end; i++)
+    {
+	double d = (q[0]-xs[i])*(q[0]-xs[i])
+	    + (q[1]-ys[i])*(q[1]-ys[i])
+	    + (q[2]-zs[i])*(q[2]-zs[i]);
+	if (d < best || (d == best && ids[i] < bestIdx))
+	{
+	    best = d;
+	    bestIdx = ids[i];
+	}
+    }
+}
+
+int PointGrid::Nearest(const double q[3], double& dist2)
+{
+    return Nearest(q, dist2, evals, 0);
+}
+
+int PointGrid::Nearest(const double q[3], double& dist2, uint64_t& count, int maxShells) const
+{
+    double best = 1e300;
+    int bestIdx = -1;
+
+    // cell containing q (or nearest one, if outside)
+    int c[3];
+    for (int j=0; j<3; j++)
+    {
+	double f = floor((q[j]-lo[j]) * invSize[j]);
+	if (f >= dims[j]) f = dims[j]-1;
+	if (f < 0) f = 0;
+	c[j] = (int)f;
+    }
+
+    int maxR = dims[0];
+    if (dims[1] > maxR) maxR = dims[1];
+    if (dims[2] > maxR) maxR = dims[2];
+
+    // search shells of cells outwards, until nothing further
+    // out could be closer (or as close, for lower indices)
+    for (int r=0; r<maxR; r++)
+    {
+	if (bestIdx >= 0 && r > 0)
+	{
+	    double bound = (r-1)*minSize;
+	    if (bound*bound > best)
+		break;
+	    if (maxShells > 0 && r >= maxShells)
+		break;
+	}
+
+	int z0 = c[2]-r, z1 = c[2]+r;
+	int y0 = c[1]-r, y1 = c[1]+r;
+	for (int z = (z0 < 0 ? 0 : z0); z <= z1 && z < dims[2]; z++)
+	{
+	    for (int y = (y0 < 0 ? 0 : y0); y <= y1 && y < dims[1]; y++)
+	    {
+		// inside the shell, only the two x ends are new
+		bool face = (z == z0 || z == z1 || y == y0 || y == y1);
+		int step = face ? 1 : 2*r;
+		if (step == 0)
+		    step = 1;
+		for (int x = c[0]-r; x <= c[0]+r; x += step)
+		{
+		    if (x < 0 || x >= dims[0])
+			continue;
+		    scanCell((z*dims[1] + y)*dims[0] + x, q, best, bestIdx, count);
+		}
+	    }
+	}
+    }
+
+    dist2 = best;
+    return bestIdx;
+}
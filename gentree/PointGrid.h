@@ -0,0 +1,69 @@
+#ifndef _POINTGRID_H_
+#define _POINTGRID_H_
+
+#include "xstdint.h"
+#include <stddef.h>
+
+// aim for about this many points per grid cell
+#define GRID_CELL_POINTS 2
+// don't bother with cells for fewer points than this, just scan them all
+#define GRID_MIN_POINTS 32
+
+
+/* A uniform grid over a set of points, for finding nearest neighbors.
+   Gives exactly the same answer as checking every point in order with
+   a strict <, that is, the nearest one with the lowest index on ties.
+   Memory is kept around between builds, since it gets rebuilt a lot. */
+class PointGrid
+{
+private:
+    // cells in each dim, and their size
+    int dims[3];
+    double lo[3];
+    double invSize[3];
+    double minSize;
+
+    // points sorted by cell, as separate coordinate arrays
+    int numPoints;
+    double *xs;
+    double *ys;
+    double *zs;
+    int *ids;
+    int capacity;
+
+    // first point of each cell, plus one at the end
+    int *cellStart;
+    int cellCapacity;
+
+    void reserve(int n, int ncells);
+    void scanCell(int cell, const double q[3], double& best, int& bestIdx, uint64_t& count) const;
+
+    // mark as private, no copying allowed
+    PointGrid(const PointGrid& other);
+
+    // same here
+    PointGrid& operator=(const PointGrid& old);
+
+public:
+
+    // number of point distances computed so far
+    uint64_t evals;
+
+    PointGrid();
+    ~PointGrid();
+
+    // sets up the grid for n points, whose positions (3 doubles) are
+    // found every stride bytes starting at pos
+    void Build(const double *pos, size_t stride, int n);
+
+    // returns index of nearest point to q, and sets its squared distance
+    int Nearest(const double q[3], double& dist2);
+
+    // same, but safe to call from several threads at once, adding to
+    // count instead of evals; with maxShells > 0, stops looking after
+    // that many shells of cells around q (1 being just q's own cell) once
+    // it has found anything, so the answer may not be the nearest
+    int Nearest(const double q[3], double& dist2, uint64_t& count, int maxShells) const;
+};
+
+#endif
@@ -5,13 +5,22 @@
 #ifndef _PROCESS_H_
 #define _PROCESS_H_
 
-SnapHeader Interleave(PathInfo& ps, string filename, int snap);
+SnapHeader Interleave(PathInfo& ps, string filename, int snap, bool direct, bool& placed, VertexA **points = NULL);
 BlockFile BuildIndex(SnapHeader *curSnap, SnapHeader *nextSnap, string filename);
-void ProcessBlocks(string infile, string outfile, int maxcnt, int numfiles, BlockFile& bf);
+BlockFile BuildIndex(SnapHeader *curSnap, const VertexA *curPoints, SnapHeader *nextSnap,
+		     const VertexA *nextPoints, VertexB **points);
+void ProcessBlocks(BlockInput input, string outfile, int maxcnt, int numfiles, BlockFile& bf);
+void ProcessBlocksSplit(BlockInput input, string outfile, int maxcnt, int numfiles, BlockFile& bf);
+void SortBlockDir(vector<BlockDirEntry>& dir);
+void SaveBlockDir(string filename, vector<BlockDirEntry>& dir);
 
 void BuildSubOrder(PathInfo& ps, int snap, string filename);
 void PrepareSubIds(PathInfo& ps, int snap, string filename);
 void SequenceSubIds(PathPair paths, string suborder, string filename);
-void BuildHaloTable(PathInfo& ps, string treefile, PathPair paths, int snap, int step, string filename);
+bool LoadCatalogIndex(PathInfo& ps, int snap, string dir, CatalogIndex& index);
+uint64_t HaloTableSize(PathInfo& ps, int snap, string dir);
+void BuildHaloTrees(PathInfo& ps, string treefile, string dir, const vector<int>& snaps, int step,
+		    const vector<string>& filenames, uint64_t memLimit);
+void BuildHaloTable(PathPair paths, int snap, string filename, string treetable);
 
 #endif
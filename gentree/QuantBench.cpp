@@ -0,0 +1,199 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+#include <vector>
+
+#include "Formats.h"
+#include "Quantize.h"
+
+/* Standalone timing of the block quantizing in Quantize.h: the plain
+   version and the fast one, on made-up blocks like the ones
+   WritePendingBlock gets (plus one with zero densities, equal values
+   and -0s in it). Checks that QuantizeBlock without fast gives the very
+   same bytes as the plain one, and how many steps off the fast one lands.
+
+   usage: quantbench [count] [blocks] [runs]  */
+
+double getTime()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + 1e-6*tv.tv_usec;
+}
+
+double frand()
+{
+    return rand() / (RAND_MAX + 1.0);
+}
+
+// roughly normal, from a sum of uniforms
+double nrand()
+{
+    return frand() + frand() + frand() + frand() - 2.0;
+}
+
+struct TestBlock
+{
+    double minpos[3];
+    double scale[3];
+};
+
+void fill(VertexB* data, int n, TestBlock& b, bool odd)
+{
+    memset(data, 0, n*sizeof(VertexB));
+    for (int j=0; j<3; j++)
+    {
+	b.scale[j] = 100.0 / (1 << (rand() % 8));
+	b.minpos[j] = frand()*100.0;
+    }
+    for (int i=0; i<n; i++)
+    {
+	VertexB& d = data[i];
+	d.pid = rand();
+	for (int j=0; j<3; j++)
+	{
+	    d.pos[j] = b.minpos[j] + frand()*b.scale[j];
+	    d.vel[j] = 300.0*nrand();
+	    d.acc[j] = 5000.0*nrand();
+	}
+	d.hsml = 0.01 + frand();
+	d.nhsml = d.hsml*(0.9 + 0.2*frand());
+	d.densq = exp(10.0*nrand());
+	d.vdisp = d.densq*exp(nrand());
+	d.ndensq = d.densq*(0.5 + frand());
+	d.nvdisp = d.vdisp*(0.5 + frand());
+
+	if (odd)
+	{
+	    if (i % 7 == 0)
+		d.vel[0] = -0.0;
+	    if (i % 5 == 0)
+		d.vel[1] = 0.0;
+	    d.acc[2] = 1.0;
+	    d.nhsml = d.hsml;
+	    if (i == n/2)
+		d.densq = 0;
+	    if (i == n/3)
+		d.nvdisp = 1e-40f;
+	}
+    }
+}
+
+// the quantized fields of a point, in a row
+void fields(const OutVertex& o, int f[15])
+{
+    for (int j=0; j<3; j++)
+    {
+	f[j] = o.pos[j];
+	f[j+3] = o.vel[j];
+	f[j+6] = o.acc[j];
+    }
+    f[9] = o.hsml;
+    f[10] = o.nhsml;
+    f[11] = o.densq;
+    f[12] = o.vdisp;
+    f[13] = o.ndensq;
+    f[14] = o.nvdisp;
+}
+
+// quantizes every block of a fresh copy, returns the best time of runs
+// (not counting the odd block)
+double timeVersion(int version, const vector<VertexB>& src, vector<VertexB>& work,
+		   const vector<TestBlock>& blocks, int count, int runs,
+		   vector<OutBlock>& heads, vector<OutVertex>& out)
+{
+    double best = 1e30;
+    for (int r=0; r<runs; r++)
+    {
+	work = src;
+	double t = 0;
+	for (unsigned int b=0; b<blocks.size(); b++)
+	{
+	    VertexB *data = &work[b*count];
+	    OutVertex *o = &out[b*count];
+	    double start = getTime();
+	    if (version == 0)
+		QuantizeBlockScalar(data, count, blocks[b].minpos, blocks[b].scale, heads[b], o);
+	    else
+		QuantizeBlock(data, count, blocks[b].minpos, blocks[b].scale, heads[b], o, version == 2);
+	    // the odd block is only there to check
+	    if (b > 0)
+		t += getTime() - start;
+	}
+	if (t < best)
+	    best = t;
+    }
+    return best;
+}
+
+int main(int argc, char * argv[])
+{
+    int count = argc > 1 ? atoi(argv[1]) : 16000;
+    int nblocks = argc > 2 ? atoi(argv[2]) : 100;
+    int runs = argc > 3 ? atoi(argv[3]) : 5;
+    if (count < 1 || nblocks < 1 || runs < 1)
+    {
+	printf("\nusage: quantbench [count] [blocks] [runs]\n\n");
+	exit(1);
+    }
+
+    // the odd block goes first, on top of the ones to time
+    srand(1234);
+    nblocks++;
+    vector<VertexB> src(count*nblocks);
+    vector<TestBlock> blocks(nblocks);
+    for (int b=0; b<nblocks; b++)
+	fill(&src[b*count], count, blocks[b], b == 0);
+
+    vector<VertexB> work;
+    vector<OutBlock> heads[3];
+    vector<OutVertex> out[3];
+    const char *names[3] = { "plain", "exact", "fast" };
+    double times[3];
+    for (int v=0; v<3; v++)
+    {
+	heads[v].resize(nblocks);
+	out[v].resize(count*nblocks);
+	times[v] = timeVersion(v, src, work, blocks, count, runs, heads[v], out[v]);
+    }
+
+    printf("\n%d blocks of %d points, best of %d:\n\n", nblocks-1, count, runs);
+    for (int v=0; v<3; v++)
+	printf("%-8s %8.2f ns/point %8.2fx\n", names[v], 1e9*times[v]/((double)count*(nblocks-1)),
+	       times[0]/times[v]);
+
+    // the exact one has to match to the byte
+    bool same = memcmp(&heads[0][0], &heads[1][0], nblocks*sizeof(OutBlock)) == 0
+	&& memcmp(&out[0][0], &out[1][0], (size_t)count*nblocks*sizeof(OutVertex)) == 0;
+    printf("\nexact output %s\n", same ? "identical" : "DIFFERENT!");
+
+    // and the fast one within a step, skipping the odd block, whose
+    // NaNs can land anywhere
+    int maxdiff[15];
+    uint64_t ndiff = 0;
+    memset(maxdiff, 0, sizeof(maxdiff));
+    for (size_t i=count; i<out[0].size(); i++)
+    {
+	int a[15], b[15];
+	fields(out[0][i], a);
+	fields(out[2][i], b);
+	for (int f=0; f<15; f++)
+	{
+	    int d = abs(a[f] - b[f]);
+	    if (d > 0)
+		ndiff++;
+	    if (d > maxdiff[f])
+		maxdiff[f] = d;
+	}
+    }
+    int worst = 0;
+    for (int f=0; f<15; f++)
+	worst = maxdiff[f] > worst ? maxdiff[f] : worst;
+    printf("fast output: %lu of %lu values differ, by at most %d step%s%s\n\n",
+	   (long unsigned int)ndiff, (long unsigned int)(15*(out[0].size()-count)),
+	   worst, worst == 1 ? "" : "s", worst > 1 ? " (TOO FAR!)" : "");
+
+    return (same && worst <= 1) ? 0 : 1;
+}
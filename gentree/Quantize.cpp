@@ -0,0 +1,346 @@
+#include <math.h>
+#include <float.h>
+#include <stddef.h>
+#include "Quantize.h"
+#include "CreateBlocks.h"
+
+// one point, as WritePendingBlock always did it (ranges already in head)
+static inline void quantizePoint(const VertexB& d, const double minpos[3], const double scale[3],
+				 const OutBlock& head, OutVertex& o)
+{
+    o.pid = (uint32_t)d.pid;
+
+    for (int j=0; j<3; j++)
+    {
+	o.pos[j] = (uint16_t)( 65535.99*(d.pos[j]-minpos[j])/scale[j]);
+	o.vel[j] = (uint16_t)( 65535.99*(d.vel[j]-head.mins[j]) / head.scales[j]);
+	o.acc[j] = (uint16_t)( 65535.99*(d.acc[j]-head.mins[j+3]) / head.scales[j+3]);
+    }
+    // these two are only 8-bit
+    o.hsml = (uint8_t)( 255.999*(d.hsml-head.mins[6]) / head.scales[6]);
+    o.nhsml = (uint8_t)( 255.999*(d.nhsml-head.mins[6]) / head.scales[6]);
+    // back to 16-bit
+    o.densq = (uint16_t)( 65535.99*(d.densq-head.mins[7]) / head.scales[7]);
+    o.vdisp = (uint16_t)( 65535.99*(d.vdisp-head.mins[8]) / head.scales[8]);
+    o.ndensq = (uint16_t)( 65535.99*(d.ndensq-head.mins[7]) / head.scales[7]);
+    o.nvdisp = (uint16_t)( 65535.99*(d.nvdisp-head.mins[8]) / head.scales[8]);
+}
+
+void QuantizeBlockScalar(VertexB *data, int count, const double minpos[3], const double scale[3],
+			 OutBlock& head, OutVertex *out)
+{
+    // ****** important ******
+    // now we want to do log compression of densities and (weighted) dispersions
+    for (int i=0; i < count; i++)
+    {
+	data[i].densq = logf(data[i].densq);
+	data[i].vdisp = logf(data[i].vdisp);
+	data[i].ndensq = logf(data[i].ndensq);
+	data[i].nvdisp = logf(data[i].nvdisp);
+    }
+
+    // initialize maxes and mins to outlandish values
+    for (int i=0; i<9; i++)
+    {
+	head.mins[i] = 1e30;
+	head.scales[i] = -1e30;
+    }
+
+    // now we need to set the mins / scales
+    for (int i=0; i < count; i++)
+    {
+	for (int j=0; j<3; j++)
+	{
+	    head.mins[j] = MIN(head.mins[j], (float)data[i].vel[j]);
+	    head.mins[j+3] = MIN(head.mins[j+3], (float)data[i].acc[j]);
+	    head.scales[j] = MAX(head.scales[j], (float)data[i].vel[j]);
+	    head.scales[j+3] = MAX(head.scales[j+3], (float)data[i].acc[j]);
+	}
+	head.mins[6] = MIN(head.mins[6], data[i].hsml);
+	head.mins[7] = MIN(head.mins[7], data[i].densq);
+	head.mins[8] = MIN(head.mins[8], data[i].vdisp);
+	// use same scale for current and next densq,vdisp,hsml
+	head.mins[6] = MIN(head.mins[6], data[i].nhsml);
+	head.mins[7] = MIN(head.mins[7], data[i].ndensq);
+	head.mins[8] = MIN(head.mins[8], data[i].nvdisp);
+
+	head.scales[6] = MAX(head.scales[6], data[i].hsml);
+	head.scales[7] = MAX(head.scales[7], data[i].densq);
+	head.scales[8] = MAX(head.scales[8], data[i].vdisp);
+	// ditto
+	head.scales[6] = MAX(head.scales[6], data[i].nhsml);
+	head.scales[7] = MAX(head.scales[7], data[i].ndensq);
+	head.scales[8] = MAX(head.scales[8], data[i].nvdisp);
+    }
+
+    // change from max to scale
+    for (int i=0; i<9; i++)
+	head.scales[i] -= head.mins[i];
+
+    for (int i=0; i < count; i++)
+	quantizePoint(data[i], minpos, scale, head, out[i]);
+}
+
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+/* The ranges of one point's fields, as floats, in three vectors:
+   [v0 v1 v2 a0], [a1 a2 hsml densq] then [a1 a2 nhsml ndensq], and
+   [vdisp] then [nvdisp]. Stored out, the lanes are mins[0..8] in order.
+   Each field sees its values in the same order as the plain loop, and
+   minps/maxps pick the same operand as MIN/MAX, so ties of 0 and -0 (and
+   NaNs) come out the same too. The logs come in as [densq vdisp ndensq
+   nvdisp], and go back to the point once it's done with. */
+static inline void rangePoint(VertexB& d, __m128 logs, __m128 mn[3], __m128 mx[3])
+{
+    __m128 va = _mm_movelh_ps(_mm_cvtpd_ps(_mm_loadu_pd(d.vel)),
+			      _mm_cvtpd_ps(_mm_set_pd(d.acc[0], d.vel[2])));
+    __m128 aa = _mm_cvtpd_ps(_mm_loadu_pd(d.acc+1));
+    // [hsml densq vdisp nhsml] and [ndensq nvdisp nhsml -]
+    __m128 u = _mm_unpacklo_ps(_mm_load_ss(&d.hsml), logs);
+    __m128 v = _mm_shuffle_ps(logs, _mm_load_ss(&d.nhsml), _MM_SHUFFLE(0,0,1,1));
+    __m128 hs = _mm_shuffle_ps(u, v, _MM_SHUFFLE(2,0,1,0));
+    __m128 nhs = _mm_shuffle_ps(logs, v, _MM_SHUFFLE(2,2,3,2));
+
+    __m128 cur = _mm_movelh_ps(aa, hs);
+    __m128 next = _mm_movelh_ps(aa, _mm_shuffle_ps(nhs, nhs, _MM_SHUFFLE(0,0,0,2)));
+    __m128 vd = _mm_shuffle_ps(logs, logs, _MM_SHUFFLE(1,1,1,1));
+    __m128 nvd = _mm_shuffle_ps(logs, logs, _MM_SHUFFLE(3,3,3,3));
+
+    mn[0] = _mm_min_ps(mn[0], va);
+    mx[0] = _mm_max_ps(mx[0], va);
+    mn[1] = _mm_min_ps(mn[1], cur);
+    mx[1] = _mm_max_ps(mx[1], cur);
+    mn[1] = _mm_min_ps(mn[1], next);
+    mx[1] = _mm_max_ps(mx[1], next);
+    mn[2] = _mm_min_ps(mn[2], vd);
+    mx[2] = _mm_max_ps(mx[2], vd);
+    mn[2] = _mm_min_ps(mn[2], nvd);
+    mx[2] = _mm_max_ps(mx[2], nvd);
+
+    _mm_storeu_ps(&d.hsml, hs);
+    _mm_storel_pi((__m64*)&d.ndensq, nhs);
+}
+
+/* Natural log of four floats, to a couple of ulps, with the Cephes
+   polynomial on the mantissa. Denormals work, log(0) is -inf, log(inf)
+   is inf, and anything negative (or NaN) gives NaN, as with logf. */
+static inline __m128 log4(__m128 x)
+{
+    const __m128 one = _mm_set1_ps(1.0f);
+
+    // scale denormals up by 2^23 first
+    __m128 tiny = _mm_cmplt_ps(x, _mm_set1_ps(FLT_MIN));
+    __m128 y = _mm_or_ps(_mm_and_ps(tiny, _mm_mul_ps(x, _mm_set1_ps(8388608.0f))),
+			 _mm_andnot_ps(tiny, x));
+
+    // split into exponent and a mantissa in [0.5,1)
+    __m128i bits = _mm_castps_si128(y);
+    __m128 e = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(126)));
+    e = _mm_sub_ps(e, _mm_and_ps(tiny, _mm_set1_ps(23.0f)));
+    __m128 m = _mm_or_ps(_mm_and_ps(y, _mm_castsi128_ps(_mm_set1_epi32(0x007fffff))),
+			 _mm_set1_ps(0.5f));
+
+    // and then around 1, in [sqrt(1/2),sqrt(2))
+    __m128 low = _mm_cmplt_ps(m, _mm_set1_ps(0.707106781186547524f));
+    e = _mm_sub_ps(e, _mm_and_ps(low, one));
+    m = _mm_add_ps(_mm_sub_ps(m, one), _mm_and_ps(low, m));
+
+    __m128 z = _mm_mul_ps(m, m);
+    __m128 p = _mm_set1_ps(7.0376836292E-2f);
+    p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(-1.1514610310E-1f));
+    p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(1.1676998740E-1f));
+    p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(-1.2420140846E-1f));
+    p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(1.4249322787E-1f));
+    p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(-1.6668057665E-1f));
+    p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(2.0000714765E-1f));
+    p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(-2.4999993993E-1f));
+    p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(3.3333331174E-1f));
+    p = _mm_mul_ps(_mm_mul_ps(p, m), z);
+    p = _mm_add_ps(p, _mm_mul_ps(e, _mm_set1_ps(-2.12194440e-4f)));
+    p = _mm_sub_ps(p, _mm_mul_ps(z, _mm_set1_ps(0.5f)));
+    __m128 r = _mm_add_ps(m, p);
+    r = _mm_add_ps(r, _mm_mul_ps(e, _mm_set1_ps(0.693359375f)));
+
+    // the special cases
+    __m128 zero = _mm_cmpeq_ps(x, _mm_setzero_ps());
+    r = _mm_or_ps(_mm_and_ps(zero, _mm_set1_ps(-HUGE_VALF)), _mm_andnot_ps(zero, r));
+    r = _mm_or_ps(r, _mm_cmpnge_ps(x, _mm_setzero_ps()));
+    __m128 inf = _mm_cmpeq_ps(x, _mm_set1_ps(HUGE_VALF));
+    r = _mm_or_ps(_mm_and_ps(inf, x), _mm_andnot_ps(inf, r));
+    return r;
+}
+
+// what's constant over a block, two lanes at a time: pos, vel and acc in
+// five pairs ([p0 p1] [p2 v0] [v1 v2] [a0 a1] [a2 -]), and the floats in
+// three ([hsml densq] [vdisp nhsml] [ndensq nvdisp])
+struct QuantConsts
+{
+    __m128d lo[5];
+    __m128d rcp[5];
+    __m128 flo[2];
+    __m128d fmul[3];
+    __m128d frcp[3];
+};
+
+static void setConsts(const double minpos[3], const double scale[3], const OutBlock& head,
+		      QuantConsts& c)
+{
+    double lo[10], rcp[10];
+    for (int j=0; j<3; j++)
+    {
+	lo[j] = minpos[j];
+	rcp[j] = 1.0/scale[j];
+    }
+    for (int j=0; j<6; j++)
+    {
+	lo[j+3] = head.mins[j];
+	rcp[j+3] = 1.0/(double)head.scales[j];
+    }
+    lo[9] = 0;
+    rcp[9] = 0;
+    for (int k=0; k<5; k++)
+    {
+	c.lo[k] = _mm_loadu_pd(lo + 2*k);
+	c.rcp[k] = _mm_loadu_pd(rcp + 2*k);
+    }
+
+    float m6 = head.mins[6], m7 = head.mins[7], m8 = head.mins[8];
+    double r6 = 1.0/(double)head.scales[6];
+    double r7 = 1.0/(double)head.scales[7];
+    double r8 = 1.0/(double)head.scales[8];
+    c.flo[0] = _mm_setr_ps(m6, m7, m8, m6);
+    c.flo[1] = _mm_setr_ps(m7, m8, 0, 0);
+    c.fmul[0] = _mm_setr_pd(255.999, 65535.99);
+    c.fmul[1] = _mm_setr_pd(65535.99, 255.999);
+    c.fmul[2] = _mm_set1_pd(65535.99);
+    c.frcp[0] = _mm_setr_pd(r6, r7);
+    c.frcp[1] = _mm_setr_pd(r8, r6);
+    c.frcp[2] = _mm_setr_pd(r7, r8);
+}
+
+// a*(1/s) for two lanes, truncated to ints in the low half
+static inline __m128i quantize2(__m128d a, __m128d rcp)
+{
+    return _mm_cvttpd_epi32(_mm_mul_pd(a, rcp));
+}
+
+// the low 16 bits of each int, sign extended, so packs keeps them as is
+static inline __m128i low16(__m128i v)
+{
+    return _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
+}
+
+static void quantizeBlockFast(VertexB *data, int n, const double minpos[3], const double scale[3],
+			  OutBlock& head, OutVertex *out)
+{
+    // first pass: logs and ranges
+    __m128 mn[3], mx[3];
+    for (int k=0; k<3; k++)
+    {
+	mn[k] = _mm_set1_ps(1e30f);
+	mx[k] = _mm_set1_ps(-1e30f);
+    }
+    for (int i=0; i<n; i++)
+    {
+	VertexB& d = data[i];
+	__m128 logs = log4(_mm_setr_ps(d.densq, d.vdisp, d.ndensq, d.nvdisp));
+	rangePoint(d, logs, mn, mx);
+    }
+
+    float lo[12], hi[12];
+    for (int k=0; k<3; k++)
+    {
+	_mm_storeu_ps(lo + 4*k, mn[k]);
+	_mm_storeu_ps(hi + 4*k, mx[k]);
+    }
+    for (int i=0; i<9; i++)
+    {
+	head.mins[i] = lo[i];
+	head.scales[i] = hi[i] - lo[i];
+    }
+
+    // second pass: everything quantized
+    QuantConsts c;
+    setConsts(minpos, scale, head, c);
+    const __m128d mul = _mm_set1_pd(65535.99);
+
+    for (int i=0; i<n; i++)
+    {
+	const VertexB& d = data[i];
+	OutVertex& o = out[i];
+
+	__m128d x[5];
+	x[0] = _mm_loadu_pd(d.pos);
+	x[1] = _mm_set_pd(d.vel[0], d.pos[2]);
+	x[2] = _mm_loadu_pd(d.vel+1);
+	x[3] = _mm_loadu_pd(d.acc);
+	x[4] = _mm_load_sd(d.acc+2);
+	__m128i t[5];
+	for (int k=0; k<5; k++)
+	    t[k] = quantize2(_mm_mul_pd(mul, _mm_sub_pd(x[k], c.lo[k])), c.rcp[k]);
+
+	// the floats are subtracted as floats, like the plain version
+	__m128 f0 = _mm_sub_ps(_mm_loadu_ps(&d.hsml), c.flo[0]);
+	__m128 f1 = _mm_sub_ps(_mm_loadl_pi(_mm_setzero_ps(), (const __m64*)&d.ndensq), c.flo[1]);
+	__m128i ft[3];
+	ft[0] = quantize2(_mm_mul_pd(c.fmul[0], _mm_cvtps_pd(f0)), c.frcp[0]);
+	ft[1] = quantize2(_mm_mul_pd(c.fmul[1], _mm_cvtps_pd(_mm_movehl_ps(f0, f0))), c.frcp[1]);
+	ft[2] = quantize2(_mm_mul_pd(c.fmul[2], _mm_cvtps_pd(f1)), c.frcp[2]);
+
+	o.pid = (uint32_t)d.pid;
+	// pos, vel and acc[0..1] in one store, then acc[2]
+	__m128i pva = _mm_packs_epi32(low16(_mm_unpacklo_epi64(t[0], t[1])),
+				      low16(_mm_unpacklo_epi64(t[2], t[3])));
+	_mm_storeu_si128((__m128i*)((char*)&o + offsetof(OutVertex, pos)), pva);
+	o.acc[2] = (uint16_t)_mm_cvtsi128_si32(t[4]);
+
+	__m128i f = _mm_unpacklo_epi64(ft[0], ft[1]);
+	o.hsml = (uint8_t)_mm_cvtsi128_si32(f);
+	o.densq = (uint16_t)_mm_extract_epi16(f, 2);
+	o.vdisp = (uint16_t)_mm_extract_epi16(f, 4);
+	o.nhsml = (uint8_t)_mm_extract_epi16(f, 6);
+	o.ndensq = (uint16_t)_mm_cvtsi128_si32(ft[2]);
+	o.nvdisp = (uint16_t)_mm_extract_epi16(ft[2], 2);
+    }
+}
+
+void QuantizeBlock(VertexB *data, int n, const double minpos[3], const double scale[3],
+		   OutBlock& head, OutVertex *out, bool fast)
+{
+    if (fast)
+	quantizeBlockFast(data, n, minpos, scale, head, out);
+    else
+	QuantizeBlockScalar(data, n, minpos, scale, head, out);
+}
+
+#else
+
+// no SSE2, so the plain version either way
+void QuantizeBlock(VertexB *data, int n, const double minpos[3], const double scale[3],
+		   OutBlock& head, OutVertex *out, bool fast)
+{
+    QuantizeBlockScalar(data, n, minpos, scale, head, out);
+}
+
+#endif
+
+void CoarsenBlock(OutVertex *out, int n)
+{
+    CoarseVertex *c = (CoarseVertex*)out;
+    for (int i=0; i<n; i++)
+    {
+	// the first one overlaps itself, so go through a copy
+	OutVertex o = out[i];
+	c[i].pid = o.pid;
+	for (int j=0; j<3; j++)
+	{
+	    c[i].pos[j] = o.pos[j];
+	    c[i].vel[j] = (uint8_t)(o.vel[j] >> 8);
+	}
+	c[i].hsml = o.hsml;
+	c[i].densq = (uint8_t)(o.densq >> 8);
+	c[i].vdisp = (uint8_t)(o.vdisp >> 8);
+    }
+}
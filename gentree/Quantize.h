@@ -0,0 +1,68 @@
+/* Packing a block's points into OutVertex: the log of the densities and
+   dispersions, the range of each field into the header's mins and
+   scales, and then every field quantized against its range.
+
+   The fast version (with SSE2) takes the logs four at a time, with a
+   polynomial, and multiplies by reciprocals instead of dividing, so a
+   value can land one step off (and the mins and scales differ in the
+   last bits). Otherwise it's the plain version, one field at a time. */
+
+#ifndef _QUANTIZE_H_
+#define _QUANTIZE_H_
+
+#include "Formats.h"
+
+// fills in the mins and scales of head from the n points at data, and
+// packs them into out, with positions in cells of size scale from minpos
+// (densq, vdisp, ndensq and nvdisp of data get replaced by their logs)
+void QuantizeBlock(VertexB *data, int n, const double minpos[3], const double scale[3],
+		   OutBlock& head, OutVertex *out, bool fast = false);
+
+// the plain version, for checking against
+void QuantizeBlockScalar(VertexB *data, int n, const double minpos[3], const double scale[3],
+			 OutBlock& head, OutVertex *out);
+
+// narrows n quantized points at out to CoarseVertex, in place
+void CoarsenBlock(OutVertex *out, int n);
+
+/* The vertex codecs, one for each layout of points, so a block gets
+   packed by the one for its depth without a test for every point. */
+template<int codec> struct VertexCodec;
+
+template<> struct VertexCodec<VERTEX_FULL>
+{
+    typedef OutVertex Vertex;
+
+    static void Pack(VertexB *data, int n, const double minpos[3], const double scale[3],
+		     OutBlock& head, Vertex *out, bool fast)
+    {
+	QuantizeBlock(data, n, minpos, scale, head, out, fast);
+    }
+};
+
+template<> struct VertexCodec<VERTEX_COARSE>
+{
+    typedef CoarseVertex Vertex;
+
+    // quantized in full, against the same ranges, then cut down
+    static void Pack(VertexB *data, int n, const double minpos[3], const double scale[3],
+		     OutBlock& head, Vertex *out, bool fast)
+    {
+	QuantizeBlock(data, n, minpos, scale, head, (OutVertex*)out, fast);
+	CoarsenBlock((OutVertex*)out, n);
+    }
+};
+
+// packs the n points at data with codec into out (which has room for n
+// OutVertex), setting head's codec and ranges, and returns their length
+template<int codec>
+uint64_t PackBlock(VertexB *data, int n, const double minpos[3], const double scale[3],
+		   OutBlock& head, void *out, bool fast)
+{
+    typedef typename VertexCodec<codec>::Vertex Vertex;
+    head.codec = codec;
+    VertexCodec<codec>::Pack(data, n, minpos, scale, head, (Vertex*)out, fast);
+    return (uint64_t)n*sizeof(Vertex);
+}
+
+#endif
@@ -0,0 +1,937 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+#include <map>
+
+#include "Formats.h"
+#include "PartFiles.h"
+#include "Process.h"
+#include "Telemetry.h"
+
+/* Rewrites the block files of snapshots with their child groups in a
+   different order, for fewer seeks when the viewer refines. Each group of
+   siblings stays in one piece (the viewer reads them that way); what
+   changes is where the groups go. Layouts are:
+
+     bfs        level by level, the root first
+     cluster    clusters of k levels of groups, each cluster one after the
+                other in the files, and the clusters below it after that,
+                depth first (k=1 is plain depth first)
+
+   Clusters (or, for bfs, single groups) are dealt out to the stripe files
+   in turn, the root's to file 0. Headers get their childFile,
+   childLocation and childLength rewritten, and the snapshot gets a new
+   _info and _dir to match; the blocks themselves don't change (and
+   compressed groups stay that way, their headers being whole in them).
+
+   With a time window of more than one snapshot, the snapshots are taken
+   that many at a time, and each window goes into one shared set of
+   chunk files, blocks_F-L.i (F and L its first and last snapshot): the
+   layout is made over all their trees at once, and each group is
+   followed by the ones at the same place in the later snapshots, so
+   that a region over the whole window is one mostly sequential read.
+   Each blocks_N.i is then a link to its chunk file, with the snapshot's
+   _info and _dir pointing into it, so nothing reading them changes.
+
+   Before and after, it counts the seeks a made-up viewer would make
+   reading the groups down random dives to a leaf, and over random
+   regions a few levels deep (or, with a window, down a dive in every
+   snapshot of it, a level at a time or a snapshot at a time), taking a
+   seek to be any read that doesn't start where the last one on that
+   stripe ended.
+
+   usage: repack [options] indir outdir snap [snap...]
+   (outdir can't be indir, as the files are read while they're written)
+     -l layout   bfs, cluster, or all to just compare them (default cluster)
+     -k levels   levels per cluster (default 3)
+     -s stripes  stripe files to write (default as many as there are)
+     -a align    pad groups to this, as BlockAlign (default 0)
+     -d dives    dives and regions to count seeks over (default 1000)
+     -t snaps    snapshots per shared chunk (default 1, none shared)
+     -n          only count seeks, don't write anything  */
+
+#define LAYOUT_BFS 1
+#define LAYOUT_CLUSTER 2
+
+// a group of siblings, written together
+struct Group
+{
+    vector<int> blocks; // their entries
+    int parent; // entry of the block they're children of (-1 for the root)
+    int depth;
+    int file;
+    uint64_t location;
+    uint64_t length; // without padding
+    bool packed; // a compressed frame (see Compress.h)
+    // and where it goes
+    int newFile;
+    uint64_t newLocation;
+    uint64_t newLength;
+};
+
+// where a group is in the tree: depth and key of its parent (-1 and 0
+// for the root's), the same in every snapshot
+typedef pair<int, uint64_t> GroupKey;
+
+// a snapshot's block tree, as found in its files
+struct SnapTree
+{
+    BlockFile info;
+    int numFiles;
+    vector<BlockDirEntry> entries; // depth first
+    vector<int> entryGroup; // group each entry is in
+    vector<int> childGroup; // group of each entry's children, or -1
+    vector<Group> groups; // the root's first
+    map<GroupKey, int> groupAt; // groups by key
+
+    // and for writing it: the files it comes from, and the new directory
+    vector<FILE*> in;
+    vector<BlockDirEntry> newDir;
+};
+
+// a run of groups to keep together
+typedef vector<int> Unit;
+
+
+// ***************************************************************
+// Reading the tree
+// ***************************************************************
+
+string stripeName(string dir, int snap, int i)
+{
+    return dir + "/blocks_" + toString<int>(snap) + "." + toString<int>(i);
+}
+
+// where the k'th header of a group is, from its start at offset (raw the
+// offset it would be at, not packed)
+uint64_t headerAt(bool packed, uint64_t start, int k, uint64_t offset)
+{
+    if (packed)
+	return start + sizeof(GroupFrame) + k*sizeof(OutBlock);
+    return start + offset;
+}
+
+// adds the entries of the subtree at file/location (with its header at
+// headLocation), by their headers; blocks in a packed group are at its
+// location plus their index, as WriteGroup has them
+void readEntries(FILE **files, int file, uint64_t location, uint64_t headLocation, uint64_t key,
+		 vector<BlockDirEntry>& out)
+{
+    OutBlock head;
+    fseeko(files[file], headLocation, SEEK_SET);
+    if (fread(&head, sizeof(OutBlock), 1, files[file]) != 1)
+    {
+	fprintf(stderr,"Short read at %lu in file %d!\n", (long unsigned int)location, file);
+	exit(1);
+    }
+
+    int index = (int)out.size();
+    BlockDirEntry e;
+    e.key = key;
+    e.depth = head.depth;
+    e.file = file;
+    e.count = head.count;
+    e.location = location;
+    e.length = sizeof(OutBlock) + VertexSize(head.codec)*head.count;
+    e.childFlags = head.childFlags;
+    e.childLength = head.childLength;
+    e.subtreeSize = 1;
+    out.push_back(e);
+
+    if (head.childLength == 0)
+	return;
+    bool packed = (head.childFlags & COMPRESSED_CHILDREN) != 0;
+    uint64_t offset = 0;
+    for (int i=0, k=0; i<8; i++)
+    {
+	if ((head.childFlags & (1<<i)) == 0)
+	    continue;
+	int child = (int)out.size();
+	readEntries(files, head.childFile, head.childLocation + (packed ? k : offset),
+		    headerAt(packed, head.childLocation, k, offset), (key<<3) + i, out);
+	offset += out[child].length;
+	k++;
+    }
+    out[index].subtreeSize = out.size() - index;
+}
+
+// where group g is
+GroupKey groupKey(SnapTree& tree, int g)
+{
+    int parent = tree.groups[g].parent;
+    if (parent < 0)
+	return GroupKey(-1, 0);
+    return GroupKey((int)tree.entries[parent].depth, (uint64_t)tree.entries[parent].key);
+}
+
+// sorts the entries into groups of siblings, the root on its own
+void buildGroups(SnapTree& tree)
+{
+    int n = (int)tree.entries.size();
+    tree.entryGroup.assign(n, -1);
+    tree.childGroup.assign(n, -1);
+    tree.groups.clear();
+
+    Group root;
+    root.blocks.push_back(0);
+    root.parent = -1;
+    root.depth = 0;
+    root.file = tree.info.firstFile;
+    root.location = tree.info.firstLocation;
+    root.length = tree.entries[0].length;
+    root.packed = false;
+    tree.groups.push_back(root);
+    tree.entryGroup[0] = 0;
+
+    for (int i=0; i<n; i++)
+    {
+	BlockDirEntry& e = tree.entries[i];
+	if (e.childLength == 0)
+	    continue;
+	Group g;
+	g.parent = i;
+	g.depth = e.depth + 1;
+	g.length = 0;
+	g.packed = (e.childFlags & COMPRESSED_CHILDREN) != 0;
+	int index = (int)tree.groups.size();
+	for (int c = i+1, k = 0; k<8; k++)
+	{
+	    if ((e.childFlags & (1<<k)) == 0)
+		continue;
+	    g.blocks.push_back(c);
+	    g.length += tree.entries[c].length;
+	    tree.entryGroup[c] = index;
+	    c += tree.entries[c].subtreeSize;
+	}
+	g.file = tree.entries[g.blocks[0]].file;
+	g.location = tree.entries[g.blocks[0]].location;
+	tree.childGroup[i] = index;
+	tree.groups.push_back(g);
+    }
+
+    tree.groupAt.clear();
+    for (unsigned int g=0; g<tree.groups.size(); g++)
+	tree.groupAt[groupKey(tree, g)] = g;
+}
+
+
+// the tree from the directory, if there's a good one, else from the headers
+bool loadTree(string dir, int snap, SnapTree& tree)
+{
+    string base = dir + "/blocks_" + toString<int>(snap);
+    FILE *file = fopen((base + "_info").c_str(), "rb");
+    if (file == NULL)
+    {
+	fprintf(stderr,"Couldn't open %s!\n", (base + "_info").c_str());
+	return false;
+    }
+    bool ok = fread(&tree.info, sizeof(BlockFile), 1, file) == 1;
+    fclose(file);
+    if (!ok)
+	return false;
+
+    tree.numFiles = 0;
+    struct stat st;
+    while (stat(stripeName(dir, snap, tree.numFiles).c_str(), &st) == 0)
+	tree.numFiles++;
+    if (tree.numFiles == 0)
+    {
+	fprintf(stderr,"No block files for snapshot %d in %s!\n", snap, dir.c_str());
+	return false;
+    }
+
+    tree.entries.clear();
+    file = fopen((base + "_dir").c_str(), "rb");
+    if (file != NULL)
+    {
+	BlockDirHeader head;
+	if (fread(&head, sizeof(BlockDirHeader), 1, file) == 1
+	    && head.magic == BLOCK_DIR_MAGIC && head.version == BLOCK_DIR_VERSION)
+	{
+	    tree.entries.resize(head.count);
+	    if (head.count > 0 && fread(&tree.entries[0], sizeof(BlockDirEntry), head.count, file) != head.count)
+		tree.entries.clear();
+	}
+	fclose(file);
+    }
+    if (tree.entries.empty())
+    {
+	printf("No block directory for snapshot %d, reading headers.\n", snap);
+	FILE **files = new FILE*[tree.numFiles];
+	for (int i=0; i<tree.numFiles; i++)
+	    files[i] = fopen(stripeName(dir, snap, i).c_str(), "rb");
+	readEntries(files, tree.info.firstFile, tree.info.firstLocation, tree.info.firstLocation,
+		    0, tree.entries);
+	for (int i=0; i<tree.numFiles; i++)
+	    fclose(files[i]);
+	delete[] files;
+    }
+
+    buildGroups(tree);
+
+    // packed groups are as long as their frames say
+    vector<FILE*> files(tree.numFiles, (FILE*)NULL);
+    for (unsigned int g=0; g<tree.groups.size(); g++)
+    {
+	Group& group = tree.groups[g];
+	if (!group.packed)
+	    continue;
+	if (files[group.file] == NULL)
+	    files[group.file] = fopen(stripeName(dir, snap, group.file).c_str(), "rb");
+	GroupFrame frame;
+	fseeko(files[group.file], group.location, SEEK_SET);
+	if (fread(&frame, sizeof(GroupFrame), 1, files[group.file]) != 1 || frame.magic != GROUP_FRAME_MAGIC)
+	{
+	    fprintf(stderr,"Bad compressed group at %lu in file %d!\n", (long unsigned int)group.location,
+		    group.file);
+	    return false;
+	}
+	group.length = frame.packedLength;
+    }
+    for (int i=0; i<tree.numFiles; i++)
+	if (files[i] != NULL)
+	    fclose(files[i]);
+    return true;
+}
+
+
+// ***************************************************************
+// Layouts
+// ***************************************************************
+
+// the groups below a group's blocks
+void childGroups(SnapTree& tree, int g, vector<int>& out)
+{
+    Group& group = tree.groups[g];
+    for (unsigned int b=0; b<group.blocks.size(); b++)
+	if (tree.childGroup[group.blocks[b]] >= 0)
+	    out.push_back(tree.childGroup[group.blocks[b]]);
+}
+
+// a cluster of levels below group g, then the ones under it
+void addCluster(SnapTree& tree, int g, int levels, vector<Unit>& units)
+{
+    Unit unit;
+    vector<int> level(1, g);
+    for (int l=0; l<levels && !level.empty(); l++)
+    {
+	vector<int> next;
+	for (unsigned int i=0; i<level.size(); i++)
+	{
+	    unit.push_back(level[i]);
+	    childGroups(tree, level[i], next);
+	}
+	level.swap(next);
+    }
+    units.push_back(unit);
+    for (unsigned int i=0; i<level.size(); i++)
+	addCluster(tree, level[i], levels, units);
+}
+
+// orders the groups into units, for a layout
+void layoutUnits(SnapTree& tree, int layout, int levels, vector<Unit>& units)
+{
+    units.clear();
+    if (layout == LAYOUT_CLUSTER)
+    {
+	addCluster(tree, 0, levels, units);
+	return;
+    }
+    // breadth first, one group at a time
+    vector<int> level(1, 0);
+    while (!level.empty())
+    {
+	vector<int> next;
+	for (unsigned int i=0; i<level.size(); i++)
+	{
+	    units.push_back(Unit(1, level[i]));
+	    childGroups(tree, level[i], next);
+	}
+	level.swap(next);
+    }
+}
+
+uint64_t padded(uint64_t length, int align)
+{
+    if (align <= 0)
+	return length;
+    return (length + align - 1) / align * align;
+}
+
+// places the units in turn on the stripes, the way LargeWriter would
+// write them (each group padded to align)
+void placeUnits(SnapTree& tree, vector<Unit>& units, int numFiles, int align)
+{
+    vector<uint64_t> pos(numFiles, 0);
+    for (unsigned int u=0; u<units.size(); u++)
+    {
+	int f = u % numFiles;
+	for (unsigned int i=0; i<units[u].size(); i++)
+	{
+	    Group& g = tree.groups[units[u][i]];
+	    g.newFile = f;
+	    g.newLocation = pos[f];
+	    g.newLength = padded(g.length, align);
+	    pos[f] += g.newLength;
+	}
+    }
+}
+
+/* Makes a tree with every block of the given ones (a block with children
+   in any of them has them here), to lay out a window of snapshots at
+   once. */
+void unionTree(vector<SnapTree>& trees, SnapTree& all)
+{
+    vector<BlockDirEntry> entries;
+    for (unsigned int t=0; t<trees.size(); t++)
+	entries.insert(entries.end(), trees[t].entries.begin(), trees[t].entries.end());
+    SortBlockDir(entries);
+
+    // the same block from different trees ends up side by side
+    all.entries.clear();
+    for (unsigned int i=0; i<entries.size(); i++)
+    {
+	BlockDirEntry& e = entries[i];
+	if (!all.entries.empty() && all.entries.back().key == e.key && all.entries.back().depth == e.depth)
+	{
+	    all.entries.back().childFlags |= e.childFlags;
+	    all.entries.back().childLength = max(all.entries.back().childLength, e.childLength);
+	    continue;
+	}
+	all.entries.push_back(e);
+    }
+    SortBlockDir(all.entries);
+
+    all.info = trees[0].info;
+    all.numFiles = trees[0].numFiles;
+    buildGroups(all);
+}
+
+/* Places the groups of a window of trees, unit by unit of the layout of
+   all of them together, each group of the layout with the same group of
+   every tree that has it one after the other. */
+void placeWindow(vector<SnapTree>& trees, SnapTree& all, vector<Unit>& units, int numFiles, int align)
+{
+    vector<uint64_t> pos(numFiles, 0);
+    for (unsigned int u=0; u<units.size(); u++)
+    {
+	int f = u % numFiles;
+	for (unsigned int i=0; i<units[u].size(); i++)
+	{
+	    GroupKey key = groupKey(all, units[u][i]);
+	    for (unsigned int t=0; t<trees.size(); t++)
+	    {
+		map<GroupKey, int>::iterator it = trees[t].groupAt.find(key);
+		if (it == trees[t].groupAt.end())
+		    continue;
+		Group& g = trees[t].groups[it->second];
+		g.newFile = f;
+		g.newLocation = pos[f];
+		g.newLength = padded(g.length, align);
+		pos[f] += g.newLength;
+	    }
+	}
+    }
+}
+
+// or keeps them where they are
+void placeOriginal(SnapTree& tree)
+{
+    for (unsigned int i=0; i<tree.groups.size(); i++)
+    {
+	Group& g = tree.groups[i];
+	g.newFile = g.file;
+	g.newLocation = g.location;
+	g.newLength = g.parent < 0 ? tree.info.firstLength : tree.entries[g.parent].childLength;
+    }
+}
+
+
+// ***************************************************************
+// Counting seeks
+// ***************************************************************
+
+struct SeekCount
+{
+    uint64_t reads;
+    uint64_t seeks;
+    uint64_t distance; // bytes skipped over, summed (within a file)
+    vector<uint64_t> head; // where each stripe's last read ended
+    vector<int> headSet; // and in which set of files
+
+    SeekCount(int numFiles)
+    {
+	reads = seeks = distance = 0;
+	head.assign(numFiles, 0);
+	headSet.assign(numFiles, -1);
+    }
+
+    // a read of group g, from set of files set (say, a snapshot's own)
+    void Read(const Group& g, int set = 0)
+    {
+	reads++;
+	uint64_t& h = head[g.newFile];
+	if (headSet[g.newFile] != set)
+	    seeks++;
+	else if (g.newLocation != h)
+	{
+	    seeks++;
+	    distance += g.newLocation > h ? g.newLocation - h : h - g.newLocation;
+	}
+	h = g.newLocation + g.newLength;
+	headSet[g.newFile] = set;
+    }
+};
+
+// a random leaf, more likely the more points it has
+int randomLeaf(vector<uint64_t>& leafPoints, vector<int>& leaves)
+{
+    uint64_t total = leafPoints.back();
+    uint64_t r = (((uint64_t)rand() << 31) ^ (uint64_t)rand()) % total;
+    return leaves[std::upper_bound(leafPoints.begin(), leafPoints.end(), r) - leafPoints.begin()];
+}
+
+/* Counts seeks over the same random dives and regions for any placement
+   of the groups (so call it with the same seed). A dive reads the groups
+   from the root down to a leaf; a region reads all groups down a few
+   levels from a group some way down a dive, a level at a time. */
+void countSeeks(SnapTree& tree, int dives, SeekCount& dive, SeekCount& region)
+{
+    vector<uint64_t> leafPoints;
+    vector<int> leaves;
+    uint64_t sum = 0;
+    for (unsigned int i=0; i<tree.entries.size(); i++)
+	if (tree.entries[i].childLength == 0 && tree.entries[i].count > 0)
+	{
+	    sum += tree.entries[i].count;
+	    leafPoints.push_back(sum);
+	    leaves.push_back(i);
+	}
+    if (leaves.empty())
+	return;
+
+    for (int d=0; d<dives; d++)
+    {
+	// groups on the way down, from the root
+	vector<int> path;
+	for (int g = tree.entryGroup[randomLeaf(leafPoints, leaves)]; g >= 0;
+	     g = tree.groups[g].parent < 0 ? -1 : tree.entryGroup[tree.groups[g].parent])
+	    path.push_back(g);
+	std::reverse(path.begin(), path.end());
+	for (unsigned int i=0; i<path.size(); i++)
+	    dive.Read(tree.groups[path[i]]);
+
+	// and a region, from partway down another one
+	path.clear();
+	for (int g = tree.entryGroup[randomLeaf(leafPoints, leaves)]; g >= 0;
+	     g = tree.groups[g].parent < 0 ? -1 : tree.entryGroup[tree.groups[g].parent])
+	    path.push_back(g);
+	vector<int> level(1, path[path.size()/2]);
+	for (int l=0; l<3 && !level.empty(); l++)
+	{
+	    vector<int> next;
+	    for (unsigned int i=0; i<level.size(); i++)
+	    {
+		region.Read(tree.groups[level[i]]);
+		childGroups(tree, level[i], next);
+	    }
+	    level.swap(next);
+	}
+    }
+}
+
+/* The same for a window of snapshots, with the camera still: a random
+   dive in the first one, and then the same groups in each of them, read
+   either a level at a time (the groups at one level in every snapshot,
+   then the next level down) or a snapshot at a time. Each tree's files
+   are their own set, unless they're shared. */
+void countWindowSeeks(vector<SnapTree>& trees, int dives, bool shared,
+		      SeekCount& level, SeekCount& playback)
+{
+    SnapTree& first = trees[0];
+    vector<uint64_t> leafPoints;
+    vector<int> leaves;
+    uint64_t sum = 0;
+    for (unsigned int i=0; i<first.entries.size(); i++)
+	if (first.entries[i].childLength == 0 && first.entries[i].count > 0)
+	{
+	    sum += first.entries[i].count;
+	    leafPoints.push_back(sum);
+	    leaves.push_back(i);
+	}
+    if (leaves.empty())
+	return;
+
+    for (int d=0; d<dives; d++)
+    {
+	vector<GroupKey> path;
+	for (int g = first.entryGroup[randomLeaf(leafPoints, leaves)]; g >= 0;
+	     g = first.groups[g].parent < 0 ? -1 : first.entryGroup[first.groups[g].parent])
+	    path.push_back(groupKey(first, g));
+	std::reverse(path.begin(), path.end());
+
+	for (unsigned int i=0; i<path.size(); i++)
+	    for (unsigned int t=0; t<trees.size(); t++)
+	    {
+		map<GroupKey, int>::iterator it = trees[t].groupAt.find(path[i]);
+		if (it != trees[t].groupAt.end())
+		    level.Read(trees[t].groups[it->second], shared ? 0 : t);
+	    }
+	for (unsigned int t=0; t<trees.size(); t++)
+	    for (unsigned int i=0; i<path.size(); i++)
+	    {
+		map<GroupKey, int>::iterator it = trees[t].groupAt.find(path[i]);
+		if (it != trees[t].groupAt.end())
+		    playback.Read(trees[t].groups[it->second], shared ? 0 : t);
+	    }
+    }
+}
+
+void printSeeks(const char *name, SeekCount& dive, SeekCount& region, int dives)
+{
+    printf("%-12s %10.2f %12s %12.2f %12s\n", name,
+	   (double)dive.seeks / dives,
+	   formatBytes(dive.seeks ? dive.distance / dive.seeks : 0).c_str(),
+	   (double)region.seeks / dives,
+	   formatBytes(region.seeks ? region.distance / region.seeks : 0).c_str());
+}
+
+
+// ***************************************************************
+// Writing
+// ***************************************************************
+
+// opens the files a tree comes from, and starts its new directory
+void openTree(SnapTree& tree, string indir, int snap)
+{
+    tree.in.resize(tree.numFiles);
+    for (int i=0; i<tree.numFiles; i++)
+	tree.in[i] = fopen(stripeName(indir, snap, i).c_str(), "rb");
+    tree.newDir = tree.entries;
+}
+
+// copies group g of a tree to its new place, with its headers pointed at
+// the children's new places
+bool writeGroup(SnapTree& tree, int index, LargeWriter **out, vector<char>& buf)
+{
+    Group& g = tree.groups[index];
+    buf.resize(g.length);
+    fseeko(tree.in[g.file], g.location, SEEK_SET);
+    if (fread(&buf[0], g.length, 1, tree.in[g.file]) != 1)
+    {
+	fprintf(stderr,"Short read of group at %lu in file %d!\n", (long unsigned int)g.location, g.file);
+	return false;
+    }
+    for (unsigned int b=0; b<g.blocks.size(); b++)
+    {
+	int e = g.blocks[b];
+	uint64_t offset = tree.entries[e].location - g.location;
+	OutBlock *head = (OutBlock*)&buf[headerAt(g.packed, 0, b, offset)];
+	int c = tree.childGroup[e];
+	if (c >= 0)
+	{
+	    head->childFile = tree.groups[c].newFile;
+	    head->childLocation = tree.groups[c].newLocation;
+	    head->childLength = tree.groups[c].newLength;
+	    tree.newDir[e].childLength = tree.groups[c].newLength;
+	}
+	tree.newDir[e].file = g.newFile;
+	tree.newDir[e].location = g.newLocation + offset;
+    }
+
+    LargeWriter *w = out[g.newFile];
+    if (w->GetLocation() != g.newLocation)
+    {
+	fprintf(stderr,"Group placed at %lu, but file %d is at %lu!\n", (long unsigned int)g.newLocation,
+		g.newFile, (long unsigned int)w->GetLocation());
+	return false;
+    }
+    w->Write(&buf[0], g.length);
+    w->Pad();
+    return true;
+}
+
+// closes a tree's files, and writes its new _info and _dir
+void finishTree(SnapTree& tree, string outdir, int snap)
+{
+    for (int i=0; i<tree.numFiles; i++)
+	fclose(tree.in[i]);
+    tree.in.clear();
+
+    BlockFile info = tree.info;
+    info.firstFile = tree.groups[0].newFile;
+    info.firstLocation = tree.groups[0].newLocation;
+    info.firstLength = tree.groups[0].newLength;
+    string base = outdir + "/blocks_" + toString<int>(snap);
+    info.Save(base + "_info");
+    SaveBlockDir(base + "_dir", tree.newDir);
+    vector<BlockDirEntry>().swap(tree.newDir);
+}
+
+LargeWriter** openWriters(string name, int numFiles, int align)
+{
+    LargeWriter **out = new LargeWriter*[numFiles];
+    for (int i=0; i<numFiles; i++)
+	out[i] = new LargeWriter(name + "." + toString<int>(i), align);
+    return out;
+}
+
+void closeWriters(LargeWriter **out, int numFiles)
+{
+    for (int i=0; i<numFiles; i++)
+    {
+	out[i]->Close();
+	delete out[i];
+    }
+    delete[] out;
+}
+
+// writes a snapshot's groups in the order of units, to its own files
+bool writeTree(SnapTree& tree, vector<Unit>& units, string indir, string outdir, int snap,
+	       int numFiles, int align)
+{
+    openTree(tree, indir, snap);
+    LargeWriter **out = openWriters(outdir + "/blocks_" + toString<int>(snap), numFiles, align);
+    vector<char> buf;
+    bool ok = true;
+    for (unsigned int u=0; u<units.size() && ok; u++)
+	for (unsigned int j=0; j<units[u].size() && ok; j++)
+	    ok = writeGroup(tree, units[u][j], out, buf);
+    closeWriters(out, numFiles);
+    finishTree(tree, outdir, snap);
+    return ok;
+}
+
+/* Writes a window of snapshots to shared chunk files, in the order
+   placeWindow gave them, and links each snapshot's names to those. */
+bool writeWindow(vector<SnapTree>& trees, SnapTree& all, vector<Unit>& units, string indir,
+		 string outdir, vector<int>& snaps, int numFiles, int align)
+{
+    for (unsigned int t=0; t<trees.size(); t++)
+	openTree(trees[t], indir, snaps[t]);
+    string chunk = "blocks_" + toString<int>(snaps.front()) + "-" + toString<int>(snaps.back());
+    LargeWriter **out = openWriters(outdir + "/" + chunk, numFiles, align);
+
+    vector<char> buf;
+    bool ok = true;
+    for (unsigned int u=0; u<units.size() && ok; u++)
+	for (unsigned int i=0; i<units[u].size() && ok; i++)
+	{
+	    GroupKey key = groupKey(all, units[u][i]);
+	    for (unsigned int t=0; t<trees.size() && ok; t++)
+	    {
+		map<GroupKey, int>::iterator it = trees[t].groupAt.find(key);
+		if (it != trees[t].groupAt.end())
+		    ok = writeGroup(trees[t], it->second, out, buf);
+	    }
+	}
+    closeWriters(out, numFiles);
+
+    for (unsigned int t=0; t<trees.size(); t++)
+    {
+	finishTree(trees[t], outdir, snaps[t]);
+	// (relative, so the directory can be moved as a whole)
+	for (int i=0; i<numFiles; i++)
+	{
+	    string link = stripeName(outdir, snaps[t], i);
+	    remove(link.c_str());
+	    if (symlink((chunk + "." + toString<int>(i)).c_str(), link.c_str()) != 0)
+	    {
+		fprintf(stderr,"Couldn't link %s to its chunk!\n", link.c_str());
+		ok = false;
+	    }
+	}
+    }
+    return ok;
+}
+
+
+/* Lays out, counts seeks for, and maybe writes a window of snapshots
+   (with layout -1, compares all the layouts). */
+void repackWindow(vector<int>& snaps, string indir, string outdir, int layout, int levels,
+		  int stripes, int align, int dives, bool write)
+{
+    vector<SnapTree> trees(snaps.size());
+    int oldFiles = 0;
+    for (unsigned int t=0; t<snaps.size(); t++)
+    {
+	if (!loadTree(indir, snaps[t], trees[t]))
+	    exit(1);
+	oldFiles = max(oldFiles, trees[t].numFiles);
+    }
+    SnapTree all;
+    unionTree(trees, all);
+    int numFiles = stripes > 0 ? stripes : trees[0].numFiles;
+    printf("\nSnapshots %d to %d: %d places for blocks, %d for groups, in %d files.\n",
+	   snaps.front(), snaps.back(), (int)all.entries.size(), (int)all.groups.size(), oldFiles);
+
+    // seeks per dive through the window, and how far each seek goes
+    printf("\n%-12s %12s %12s %14s %14s\n", "layout", "level seeks", "level dist", "snap seeks", "snap dist");
+    {
+	for (unsigned int t=0; t<trees.size(); t++)
+	    placeOriginal(trees[t]);
+	SeekCount level(oldFiles), playback(oldFiles);
+	srand(1);
+	countWindowSeeks(trees, dives, false, level, playback);
+	printf("%-12s %12.2f %12s %14.2f %14s\n", "separate", (double)level.seeks / dives,
+	       formatBytes(level.seeks ? level.distance / level.seeks : 0).c_str(),
+	       (double)playback.seeks / dives,
+	       formatBytes(playback.seeks ? playback.distance / playback.seeks : 0).c_str());
+    }
+
+    vector<Unit> units;
+    int tries = layout < 0 ? 5 : 1;
+    for (int t=0; t<tries; t++)
+    {
+	int l = layout < 0 ? (t == 0 ? LAYOUT_BFS : LAYOUT_CLUSTER) : layout;
+	int k = layout < 0 ? t : levels;
+	layoutUnits(all, l, k, units);
+	placeWindow(trees, all, units, numFiles, align);
+	SeekCount level(numFiles), playback(numFiles);
+	srand(1);
+	countWindowSeeks(trees, dives, true, level, playback);
+	string name = l == LAYOUT_BFS ? string("bfs") : "cluster k=" + toString<int>(k);
+	printf("%-12s %12.2f %12s %14.2f %14s\n", name.c_str(), (double)level.seeks / dives,
+	       formatBytes(level.seeks ? level.distance / level.seeks : 0).c_str(),
+	       (double)playback.seeks / dives,
+	       formatBytes(playback.seeks ? playback.distance / playback.seeks : 0).c_str());
+    }
+
+    if (!write || layout < 0)
+	return;
+    printf("\nWriting to %s...", outdir.c_str());
+    fflush(stdout);
+    if (!writeWindow(trees, all, units, indir, outdir, snaps, numFiles, align))
+	exit(1);
+    printf("done.\n");
+}
+
+
+int main(int argc, char * argv[])
+{
+    int layout = LAYOUT_CLUSTER;
+    bool compare = false;
+    int levels = 3;
+    int stripes = 0;
+    int align = 0;
+    int dives = 1000;
+    int window = 1;
+    bool write = true;
+    vector<string> args;
+    for (int i=1; i<argc; i++)
+    {
+	if (strcmp(argv[i], "-l") == 0 && i+1 < argc)
+	{
+	    i++;
+	    if (strcmp(argv[i], "bfs") == 0)
+		layout = LAYOUT_BFS;
+	    else if (strcmp(argv[i], "cluster") == 0)
+		layout = LAYOUT_CLUSTER;
+	    else if (strcmp(argv[i], "all") == 0)
+		compare = true;
+	    else
+	    {
+		fprintf(stderr,"Unknown layout %s!\n", argv[i]);
+		exit(1);
+	    }
+	}
+	else if (strcmp(argv[i], "-k") == 0 && i+1 < argc)
+	    levels = atoi(argv[++i]);
+	else if (strcmp(argv[i], "-s") == 0 && i+1 < argc)
+	    stripes = atoi(argv[++i]);
+	else if (strcmp(argv[i], "-a") == 0 && i+1 < argc)
+	    align = atoi(argv[++i]);
+	else if (strcmp(argv[i], "-d") == 0 && i+1 < argc)
+	    dives = atoi(argv[++i]);
+	else if (strcmp(argv[i], "-t") == 0 && i+1 < argc)
+	    window = atoi(argv[++i]);
+	else if (strcmp(argv[i], "-n") == 0)
+	    write = false;
+	else
+	    args.push_back(argv[i]);
+    }
+    if (compare)
+	write = false;
+    if (args.size() < 3 || levels < 1 || stripes < 0 || align < 0 || dives < 1 || window < 1
+	|| (align > 0 && (align & (align-1)) != 0))
+    {
+	printf("\nusage: repack [-l bfs|cluster|all] [-k levels] [-s stripes] [-a align] [-d dives]\n"
+	       "              [-t snaps] [-n] indir outdir snap [snap...]\n\n");
+	exit(1);
+    }
+    string indir = args[0];
+    string outdir = args[1];
+
+    // writing over the files being read would only truncate them
+    struct stat ist, ost;
+    if (write && stat(indir.c_str(), &ist) == 0 && stat(outdir.c_str(), &ost) == 0
+	&& ist.st_dev == ost.st_dev && ist.st_ino == ost.st_ino)
+    {
+	fprintf(stderr,"Output directory %s is the input directory, not repacking!\n",outdir.c_str());
+	exit(1);
+    }
+
+    if (window > 1)
+    {
+	for (unsigned int a=2; a<args.size(); a += window)
+	{
+	    vector<int> snaps;
+	    for (unsigned int j=a; j<args.size() && j<a+window; j++)
+		snaps.push_back(atoi(args[j].c_str()));
+	    repackWindow(snaps, indir, outdir, compare ? -1 : layout, levels, stripes, align, dives, write);
+	}
+	printf("\n");
+	return 0;
+    }
+
+    for (unsigned int a=2; a<args.size(); a++)
+    {
+	int snap = atoi(args[a].c_str());
+	SnapTree tree;
+	if (!loadTree(indir, snap, tree))
+	    exit(1);
+	int numFiles = stripes > 0 ? stripes : tree.numFiles;
+	printf("\nSnapshot %d: %d blocks in %d groups, %d files.\n", snap, (int)tree.entries.size(),
+	       (int)tree.groups.size(), tree.numFiles);
+
+	// seeks per dive and per region, and how far each seek goes
+	printf("\n%-12s %10s %12s %12s %12s\n", "layout", "dive seeks", "dive dist", "region seeks", "region dist");
+	{
+	    placeOriginal(tree);
+	    SeekCount dive(tree.numFiles), region(tree.numFiles);
+	    srand(1);
+	    countSeeks(tree, dives, dive, region);
+	    printSeeks("original", dive, region, dives);
+	}
+
+	vector<Unit> units;
+	int tries = compare ? 5 : 1;
+	for (int t=0; t<tries; t++)
+	{
+	    int l = compare ? (t == 0 ? LAYOUT_BFS : LAYOUT_CLUSTER) : layout;
+	    int k = compare ? t : levels;
+	    layoutUnits(tree, l, k, units);
+	    placeUnits(tree, units, numFiles, align);
+	    SeekCount dive(numFiles), region(numFiles);
+	    srand(1);
+	    countSeeks(tree, dives, dive, region);
+	    string name = l == LAYOUT_BFS ? string("bfs") : "cluster k=" + toString<int>(k);
+	    printSeeks(name.c_str(), dive, region, dives);
+	}
+
+	if (!write)
+	    continue;
+	printf("\nWriting to %s...", outdir.c_str());
+	fflush(stdout);
+	if (!writeTree(tree, units, indir, outdir, snap, numFiles, align))
+	    exit(1);
+	printf("done.\n");
+    }
+    printf("\n");
+
+    return 0;
+}
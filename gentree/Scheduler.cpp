@@ -0,0 +1,318 @@
+#include <stdio.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <map>
+#include "Scheduler.h"
+
+// seconds between progress reports while stages run
+#define PROGRESS_INTERVAL 60
+
+
+double getWallTime()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + 1e-6*tv.tv_usec;
+}
+
+
+Scheduler::Scheduler(int maxstages, int maxdisk, uint64_t maxmem)
+{
+    maxStages = maxstages < 1 ? 1 : maxstages;
+    maxDisk = maxdisk < 1 ? 1 : maxdisk;
+    maxMemory = maxmem;
+
+    running = 0;
+    diskRunning = 0;
+    memUsed = 0;
+
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&cond, NULL);
+}
+
+Scheduler::~Scheduler()
+{
+    for (unsigned int i=0; i<stages.size(); i++)
+	delete stages[i];
+
+    pthread_mutex_destroy(&mutex);
+    pthread_cond_destroy(&cond);
+}
+
+Stage* Scheduler::Add(Stage *s, string report)
+{
+    s->owner = this;
+    s->report = report;
+    stages.push_back(s);
+    return s;
+}
+
+// thread entry point, runs the stage and tells the scheduler
+void* Scheduler::runStage(void *ptr)
+{
+    Stage *s = (Stage*)ptr;
+    // whatever this thread (and those it starts) does counts for s
+    CurStats = &s->stats;
+    s->Run();
+    countThreadTime();
+
+    Scheduler *sched = s->owner;
+    pthread_mutex_lock(&sched->mutex);
+    s->state = Stage::DONE;
+    s->endTime = getWallTime();
+    pthread_cond_signal(&sched->cond);
+    pthread_mutex_unlock(&sched->mutex);
+
+    return NULL;
+}
+
+// is s ready, and is there room for it? (call with mutex held)
+bool Scheduler::canStart(Stage *s)
+{
+    if (s->state != Stage::WAITING)
+	return false;
+    for (unsigned int i=0; i<s->deps.size(); i++)
+	if (s->deps[i]->state != Stage::DONE)
+	    return false;
+
+    if (running >= maxStages)
+	return false;
+    if (s->usesDisk && diskRunning >= maxDisk)
+	return false;
+    // always let something run, even if it's over budget by itself
+    if (maxMemory > 0 && running > 0 && memUsed + s->memory > maxMemory)
+	return false;
+
+    return true;
+}
+
+void Scheduler::start(Stage *s)
+{
+    s->state = Stage::RUNNING;
+    s->startTime = getWallTime();
+    running++;
+    if (s->usesDisk)
+	diskRunning++;
+    memUsed += s->memory;
+
+    printf("[started %s]\n", s->name.c_str());
+    fflush(stdout);
+
+    pthread_create(&s->thread, NULL, &Scheduler::runStage, s);
+}
+
+string stageKind(string name)
+{
+    size_t sp = name.find_last_of(' ');
+    if (sp == string::npos || name.find_first_not_of("0123456789", sp+1) != string::npos)
+	return name;
+    return name.substr(0, sp);
+}
+
+void Scheduler::printFinished(Stage *s)
+{
+    const StageStats& st = s->stats;
+    double wall = s->endTime - s->startTime;
+    uint64_t records = st.recordsWritten > st.recordsRead ? st.recordsWritten : st.recordsRead;
+
+    printf("[finished %s in %.1f s: cpu %.1f s, read %s (%s), wrote %s (%s), %.3g records/s, buffers %s]\n",
+	   s->name.c_str(), wall, 1e-9*st.cpuTime,
+	   formatBytes(st.bytesRead).c_str(), formatRate(st.bytesRead, wall).c_str(),
+	   formatBytes(st.bytesWritten).c_str(), formatRate(st.bytesWritten, wall).c_str(),
+	   wall > 0 ? records/wall : 0.0, formatBytes(st.peakMemory).c_str());
+}
+
+void Scheduler::printProgress()
+{
+    double now = getWallTime();
+    for (unsigned int i=0; i<stages.size(); i++)
+    {
+	Stage *s = stages[i];
+	if (s->state != Stage::RUNNING)
+	    continue;
+	const StageStats& st = s->stats;
+	double wall = now - s->startTime;
+	printf("[running %s for %.0f s: read %s (%s), wrote %s (%s), buffers %s]\n",
+	       s->name.c_str(), wall,
+	       formatBytes(st.bytesRead).c_str(), formatRate(st.bytesRead, wall).c_str(),
+	       formatBytes(st.bytesWritten).c_str(), formatRate(st.bytesWritten, wall).c_str(),
+	       formatBytes(st.memory).c_str());
+    }
+}
+
+void Scheduler::printEta()
+{
+    double now = getWallTime();
+
+    // average time of each kind of stage so far, and the time stages
+    // have spent running (which is more than the time gone by, if
+    // they've been overlapping)
+    map<string, double> total;
+    map<string, int> count;
+    double busy = 0;
+    for (unsigned int i=0; i<stages.size(); i++)
+    {
+	Stage *s = stages[i];
+	if (s->state == Stage::DONE)
+	{
+	    string kind = stageKind(s->name);
+	    total[kind] += s->endTime - s->startTime;
+	    count[kind]++;
+	    busy += s->endTime - s->startTime;
+	}
+	else if (s->state == Stage::RUNNING)
+	    busy += now - s->startTime;
+    }
+
+    double left = 0;
+    int numLeft = 0;
+    int unknown = 0;
+    for (unsigned int i=0; i<stages.size(); i++)
+    {
+	Stage *s = stages[i];
+	if (s->state == Stage::DONE)
+	    continue;
+	numLeft++;
+	string kind = stageKind(s->name);
+	if (count[kind] == 0)
+	{
+	    unknown++;
+	    continue;
+	}
+	double t = total[kind] / count[kind];
+	if (s->state == Stage::RUNNING)
+	    t -= now - s->startTime;
+	if (t > 0)
+	    left += t;
+    }
+    if (numLeft == 0)
+	return;
+
+    double overlap = (now > runStart) ? busy / (now - runStart) : 1;
+    if (overlap < 1)
+	overlap = 1;
+    if (overlap > maxStages)
+	overlap = maxStages;
+
+    const char *plural = (numLeft == 1) ? "" : "s";
+    if (unknown < numLeft)
+	printf("[ETA %s for %d stage%s left", formatTime(left/overlap).c_str(), numLeft, plural);
+    else
+	printf("[no ETA yet for %d stage%s left", numLeft, plural);
+    if (unknown > 0 && unknown < numLeft)
+	printf(", %d of them of kinds not seen yet", unknown);
+    printf("]\n");
+}
+
+/* Rewrites the report with every finished stage that goes in it, as
+   {"stages": [{"name": ..., "wall": ..., ...}, ...]}, with times in
+   seconds and sizes in bytes. Only stages run by this process are in it,
+   not those a resumed run skipped. */
+void Scheduler::writeReport(string filename)
+{
+    string tmpname = filename + ".tmp";
+    FILE *file = fopen(tmpname.c_str(), "w");
+    if (file == NULL)
+    {
+	fprintf(stderr,"Error writing report %s!\n",tmpname.c_str());
+	return;
+    }
+
+    fprintf(file, "{\n  \"stages\": [");
+    bool first = true;
+    for (unsigned int i=0; i<stages.size(); i++)
+    {
+	Stage *s = stages[i];
+	if (s->state != Stage::DONE || s->report != filename)
+	    continue;
+	const StageStats& st = s->stats;
+	double wall = s->endTime - s->startTime;
+	double rate = wall > 0 ? 1/wall : 0;
+
+	fprintf(file, "%s\n    {\n", first ? "" : ",");
+	fprintf(file, "      \"name\": \"%s\",\n", s->name.c_str());
+	fprintf(file, "      \"start\": %.3f,\n", s->startTime - runStart);
+	fprintf(file, "      \"wall\": %.3f,\n", wall);
+	fprintf(file, "      \"cpu\": %.3f,\n", 1e-9*st.cpuTime);
+	fprintf(file, "      \"bytesRead\": %lu,\n", (long unsigned int)st.bytesRead);
+	fprintf(file, "      \"bytesWritten\": %lu,\n", (long unsigned int)st.bytesWritten);
+	fprintf(file, "      \"recordsRead\": %lu,\n", (long unsigned int)st.recordsRead);
+	fprintf(file, "      \"recordsWritten\": %lu,\n", (long unsigned int)st.recordsWritten);
+	fprintf(file, "      \"readBytesPerSec\": %.0f,\n", st.bytesRead*rate);
+	fprintf(file, "      \"writeBytesPerSec\": %.0f,\n", st.bytesWritten*rate);
+	fprintf(file, "      \"recordsReadPerSec\": %.0f,\n", st.recordsRead*rate);
+	fprintf(file, "      \"recordsWrittenPerSec\": %.0f,\n", st.recordsWritten*rate);
+	fprintf(file, "      \"peakBufferBytes\": %ld\n", (long int)st.peakMemory);
+	fprintf(file, "    }");
+	first = false;
+    }
+    fprintf(file, "\n  ]\n}\n");
+    fclose(file);
+
+    if (rename(tmpname.c_str(), filename.c_str()) != 0)
+	fprintf(stderr,"Error renaming report %s!\n",tmpname.c_str());
+}
+
+void Scheduler::Run()
+{
+    unsigned int numDone = 0;
+
+    pthread_mutex_lock(&mutex);
+    runStart = getWallTime();
+
+    while (numDone < stages.size())
+    {
+	// start whatever we can, in order
+	for (unsigned int i=0; i<stages.size(); i++)
+	{
+	    if (canStart(stages[i]))
+		start(stages[i]);
+	}
+
+	if (running == 0)
+	{
+	    // nothing running and nothing could start, so we're stuck
+	    fprintf(stderr,"Scheduler stuck with %d of %d stages left!\n",
+		    (int)(stages.size()-numDone), (int)stages.size());
+	    break;
+	}
+
+	// wake up now and then to report progress
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	struct timespec until;
+	until.tv_sec = tv.tv_sec + PROGRESS_INTERVAL;
+	until.tv_nsec = tv.tv_usec * 1000;
+	if (pthread_cond_timedwait(&cond, &mutex, &until) == ETIMEDOUT)
+	{
+	    printProgress();
+	    printEta();
+	    fflush(stdout);
+	}
+
+	// collect finished stages
+	for (unsigned int i=0; i<stages.size(); i++)
+	{
+	    Stage *s = stages[i];
+	    if (s->state != Stage::DONE || s->owner == NULL)
+		continue;
+
+	    pthread_join(s->thread, NULL);
+	    // mark as collected
+	    s->owner = NULL;
+	    running--;
+	    if (s->usesDisk)
+		diskRunning--;
+	    memUsed -= s->memory;
+	    numDone++;
+
+	    printFinished(s);
+	    if (!s->report.empty())
+		writeReport(s->report);
+	    printEta();
+	    fflush(stdout);
+	}
+    }
+
+    pthread_mutex_unlock(&mutex);
+}
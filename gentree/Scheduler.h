@@ -0,0 +1,160 @@
+#ifndef _SCHEDULER_H_
+#define _SCHEDULER_H_
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include "xstdint.h"
+#include "Telemetry.h"
+
+using namespace std;
+
+// max number of stages running at once (set from param file)
+extern int MaxStages;
+// max number of those that are disk-bound
+extern int MaxDiskStages;
+// memory budget for all running stages, in MB (0 for no limit)
+extern int MaxMemory;
+
+// current wall clock time, in seconds
+double getWallTime();
+
+// the kind of stage a name is for, which is the name without its
+// snapshot number ("merge 12" is a "merge")
+string stageKind(string name);
+
+
+class Scheduler;
+
+/* One step of the pipeline, like interleaving or merging a snapshot.
+   A stage can only start once every stage it runs after is done, and
+   when there is room for its memory and (if it uses the disk heavily)
+   for another disk-bound stage. */
+class Stage
+{
+    friend class Scheduler;
+
+private:
+    enum { WAITING, RUNNING, DONE } state;
+    vector<Stage*> deps;
+    pthread_t thread;
+    Scheduler *owner;
+    double startTime;
+    double endTime;
+
+public:
+    string name;
+    // mostly streaming to and from disk?
+    bool usesDisk;
+    // rough upper bound on memory used while running, in bytes
+    uint64_t memory;
+
+    // what it has done so far
+    StageStats stats;
+    // JSON file its stats are added to once it's done (none if empty)
+    string report;
+
+    Stage(string n, bool disk, uint64_t mem)
+    {
+	name = n;
+	usesDisk = disk;
+	memory = mem;
+	state = WAITING;
+	owner = NULL;
+	startTime = 0;
+	endTime = 0;
+    }
+
+    virtual ~Stage()
+    {
+    }
+
+    // don't start this one until s is done (s may be NULL)
+    void After(Stage *s)
+    {
+	if (s != NULL)
+	    deps.push_back(s);
+    }
+
+    // how long it ran for, once done
+    double WallTime() const
+    {
+	return endTime - startTime;
+    }
+
+    virtual void Run() = 0;
+};
+
+
+/* Runs a graph of stages, each on its own thread, as soon as their
+   dependencies and the limits allow. When several are ready, the one
+   added first goes first, so with MaxStages of 1 everything runs in
+   the order it was added.
+
+   As each stage finishes, its stats get printed and written to its
+   report, along with an estimate of the time left: each stage still to
+   go is expected to take as long as the finished ones of the same kind
+   (the same name, less the snapshot number) took on average, and they
+   overlap as much as they have so far. Every so often while stages are
+   running, their progress gets printed too. */
+class Scheduler
+{
+private:
+    vector<Stage*> stages;
+
+    int maxStages;
+    int maxDisk;
+    uint64_t maxMemory;
+
+    int running;
+    int diskRunning;
+    uint64_t memUsed;
+
+    // when Run started
+    double runStart;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    static void* runStage(void *ptr);
+
+    bool canStart(Stage *s);
+    void start(Stage *s);
+
+    // (these are called with the mutex held)
+    void printFinished(Stage *s);
+    void printProgress();
+    void printEta();
+    void writeReport(string filename);
+
+    // mark as private, no copying allowed
+    Scheduler(const Scheduler& other);
+
+    // same here
+    Scheduler& operator=(const Scheduler& old);
+
+public:
+
+    Scheduler(int maxstages, int maxdisk, uint64_t maxmem);
+    ~Scheduler();
+
+    // takes ownership of s, and returns it for convenience; its stats
+    // go to the given report once it's done
+    Stage* Add(Stage *s, string report = "");
+
+    // runs everything, and returns when it's all done
+    void Run();
+
+    // every stage added so far, in order
+    int NumStages() const
+    {
+	return stages.size();
+    }
+
+    Stage* GetStage(int i)
+    {
+	return stages[i];
+    }
+};
+
+#endif
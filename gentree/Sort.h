@@ -0,0 +1,317 @@
+#ifndef _SORT_H_
+#define _SORT_H_
+
+#include <algorithm>
+#include <string.h>
+#include "Formats.h"
+#include "Threads.h"
+
+// don't bother splitting up sorts smaller than this (per thread)
+#define PAR_SORT_MIN 100000
+
+// radix buckets this small are finished off with a comparison sort
+#define RADIX_SMALL 64
+
+
+/* Gives the integer key a record is sorted by, such that a < b
+   exactly when SortKey<T>::Get(a) < SortKey<T>::Get(b). Every type
+   that gets radix sorted needs one of these. */
+template<typename T>
+struct SortKey;
+
+template<>
+struct SortKey<uint64_t>
+{
+    static uint64_t Get(const uint64_t& t) { return t; }
+};
+
+template<>
+struct SortKey<VertexA>
+{
+    static uint64_t Get(const VertexA& v) { return v.pid; }
+};
+
+template<>
+struct SortKey<VertexB>
+{
+    static uint64_t Get(const VertexB& v) { return v.coord; }
+};
+
+template<>
+struct SortKey<GroupVertex>
+{
+    static uint64_t Get(const GroupVertex& v) { return v.pid; }
+};
+
+template<>
+struct SortKey<GroupVertexB>
+{
+    // subhalo points first by subid, then the rest by fofid
+    // (sign bit flipped, so that the ids order like signed ints)
+    static uint64_t Get(const GroupVertexB& v)
+    {
+	if (v.subid == -1)
+	    return (((uint64_t)1)<<32) | ((uint32_t)v.fofid ^ 0x80000000u);
+	return (uint32_t)v.subid ^ 0x80000000u;
+    }
+};
+
+// comparison by key, for finishing off small buckets
+template<typename T>
+struct KeyLess
+{
+    bool operator()(const T& a, const T& b) const
+    {
+	return SortKey<T>::Get(a) < SortKey<T>::Get(b);
+    }
+};
+
+
+// returns bits in which any key differs from the first one
+template<typename T>
+uint64_t radixDiffBits(const T* data, int n)
+{
+    uint64_t first = SortKey<T>::Get(data[0]);
+    uint64_t diff = 0;
+    for (int i=1; i<n; i++)
+	diff |= SortKey<T>::Get(data[i]) ^ first;
+    return diff;
+}
+
+// shift of the highest byte that has any differing bits, -1 if none
+inline int radixTopShift(uint64_t diff)
+{
+    if (diff == 0)
+	return -1;
+    int shift = 56;
+    while ((diff >> shift) == 0)
+	shift -= 8;
+    return shift;
+}
+
+// moves each record into its bucket in place, given bucket
+// starts in next (which end up at the bucket ends)
+template<typename T>
+void radixPermute(T* data, int* next, const int* end, int shift)
+{
+    for (int b=0; b<256; b++)
+    {
+	while (next[b] < end[b])
+	{
+	    // follow the cycle starting here until it comes back to b
+	    T tmp = data[next[b]];
+	    int d = (SortKey<T>::Get(tmp) >> shift) & 255;
+	    while (d != b)
+	    {
+		std::swap(tmp, data[next[d]++]);
+		d = (SortKey<T>::Get(tmp) >> shift) & 255;
+	    }
+	    data[next[b]++] = tmp;
+	}
+    }
+}
+
+
+/* In-place MSD radix sort on bytes of the key (American flag sort),
+   starting with the byte at given shift and recursing into buckets. */
+template<typename T>
+void RadixSortMSD(T* data, int n, int shift)
+{
+    if (n <= RADIX_SMALL)
+    {
+	std::sort(data, data+n, KeyLess<T>());
+	return;
+    }
+
+    int count[256];
+    memset(count, 0, sizeof(count));
+    for (int i=0; i<n; i++)
+	count[(SortKey<T>::Get(data[i]) >> shift) & 255]++;
+
+    int next[256], end[256];
+    int sum = 0;
+    bool single = false;
+    for (int b=0; b<256; b++)
+    {
+	if (count[b] == n)
+	    single = true;
+	next[b] = sum;
+	sum += count[b];
+	end[b] = sum;
+    }
+
+    // everything is in one bucket, so just go to next byte
+    if (single)
+    {
+	if (shift > 0)
+	    RadixSortMSD(data, n, shift-8);
+	return;
+    }
+
+    radixPermute(data, next, end, shift);
+
+    if (shift == 0)
+	return;
+
+    for (int b=0; b<256; b++)
+	if (count[b] > 1)
+	    RadixSortMSD(data + end[b]-count[b], count[b], shift-8);
+}
+
+template<typename T>
+void RadixSortMSD(T* data, int n)
+{
+    if (n < 2)
+	return;
+    int shift = radixTopShift(radixDiffBits(data, n));
+    if (shift >= 0)
+	RadixSortMSD(data, n, shift);
+}
+
+
+/* Parallel parts of the radix sort: either finds differing key bits
+   or the byte histogram of one chunk, or sorts buckets taken from a
+   shared list until there are none left. */
+template<typename T>
+struct RadixJob
+{
+    enum { DIFF, HIST, BUCKETS } mode;
+    T* data;
+    int n;
+    int shift;
+    uint64_t first;
+
+    // outputs of DIFF and HIST
+    uint64_t diff;
+    int count[256];
+
+    // for BUCKETS: bucket (start, count) pairs, and shared next index
+    int *buckets;
+    int numBuckets;
+    int *nextBucket;
+
+    void Run()
+    {
+	if (mode == DIFF)
+	{
+	    diff = 0;
+	    for (int i=0; i<n; i++)
+		diff |= SortKey<T>::Get(data[i]) ^ first;
+	}
+	else if (mode == HIST)
+	{
+	    memset(count, 0, sizeof(count));
+	    for (int i=0; i<n; i++)
+		count[(SortKey<T>::Get(data[i]) >> shift) & 255]++;
+	}
+	else
+	{
+	    int b;
+	    while ((b = __sync_fetch_and_add(nextBucket, 1)) < numBuckets)
+	    {
+		if (shift > 0)
+		    RadixSortMSD(data + buckets[2*b], buckets[2*b+1], shift-8);
+	    }
+	}
+    }
+};
+
+// for sorting buckets by size, largest first
+struct BucketSize
+{
+    const int *count;
+    bool operator()(int a, int b) const
+    {
+	return count[a] > count[b];
+    }
+};
+
+/* Radix sorts an array on several threads: the top byte is histogrammed
+   in parallel and partitioned in place, and then the buckets are handed
+   out to threads, largest first. */
+template<typename T>
+void ParallelRadixSort(T* data, int n, int nthreads)
+{
+    if (nthreads <= 1 || n < nthreads*PAR_SORT_MIN)
+    {
+	RadixSortMSD(data, n);
+	return;
+    }
+
+    RadixJob<T> *jobs = new RadixJob<T>[nthreads];
+    for (int i=0; i<nthreads; i++)
+    {
+	int start = (int)(((int64_t)n*i)/nthreads);
+	jobs[i].mode = RadixJob<T>::DIFF;
+	jobs[i].data = data + start;
+	jobs[i].n = (int)(((int64_t)n*(i+1))/nthreads) - start;
+	jobs[i].first = SortKey<T>::Get(data[0]);
+    }
+    RunThreads(jobs, nthreads);
+
+    uint64_t diff = 0;
+    for (int i=0; i<nthreads; i++)
+	diff |= jobs[i].diff;
+    int shift = radixTopShift(diff);
+    if (shift < 0)
+    {
+	delete[] jobs;
+	return;
+    }
+
+    for (int i=0; i<nthreads; i++)
+    {
+	jobs[i].mode = RadixJob<T>::HIST;
+	jobs[i].shift = shift;
+    }
+    RunThreads(jobs, nthreads);
+
+    int count[256], next[256], end[256];
+    int sum = 0;
+    for (int b=0; b<256; b++)
+    {
+	count[b] = 0;
+	for (int i=0; i<nthreads; i++)
+	    count[b] += jobs[i].count[b];
+	next[b] = sum;
+	sum += count[b];
+	end[b] = sum;
+    }
+
+    radixPermute(data, next, end, shift);
+
+    // now sort the buckets, biggest first for better balance
+    int order[256];
+    for (int b=0; b<256; b++)
+	order[b] = b;
+    BucketSize bs;
+    bs.count = count;
+    std::sort(order, order+256, bs);
+
+    int buckets[512];
+    int numBuckets = 0;
+    for (int i=0; i<256; i++)
+    {
+	int b = order[i];
+	if (count[b] < 2)
+	    break;
+	buckets[2*numBuckets] = end[b] - count[b];
+	buckets[2*numBuckets+1] = count[b];
+	numBuckets++;
+    }
+
+    int nextBucket = 0;
+    for (int i=0; i<nthreads; i++)
+    {
+	jobs[i].mode = RadixJob<T>::BUCKETS;
+	jobs[i].data = data;
+	jobs[i].buckets = buckets;
+	jobs[i].numBuckets = numBuckets;
+	jobs[i].nextBucket = &nextBucket;
+    }
+    RunThreads(jobs, nthreads);
+
+    delete[] jobs;
+}
+
+#endif
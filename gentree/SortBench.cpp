@@ -0,0 +1,102 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <algorithm>
+
+#include "Formats.h"
+#include "Sort.h"
+
+/* Standalone timing of the different sorts in Sort.h against plain
+   std::sort, on random VertexA (sorted by pid) and VertexB (sorted
+   by coord) arrays, like the ones that go through BufferedWriter.
+
+   usage: sortbench [count] [threads]  */
+
+int NumThreads = 1;
+
+double getTime()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + 1e-6*tv.tv_usec;
+}
+
+uint64_t randKey()
+{
+    return (((uint64_t)rand()) << 42) ^ (((uint64_t)rand()) << 21) ^ (uint64_t)rand();
+}
+
+void fill(VertexA* data, int n)
+{
+    srand(1234);
+    memset(data, 0, n*sizeof(VertexA));
+    for (int i=0; i<n; i++)
+    {
+	data[i].pid = randKey();
+	data[i].pos[0] = i;
+    }
+}
+
+void fill(VertexB* data, int n)
+{
+    srand(1234);
+    memset(data, 0, n*sizeof(VertexB));
+    for (int i=0; i<n; i++)
+    {
+	data[i].coord = randKey();
+	data[i].pos[0] = i;
+    }
+}
+
+template<typename T>
+bool isSorted(T* data, int n)
+{
+    for (int i=1; i<n; i++)
+	if (SortKey<T>::Get(data[i]) < SortKey<T>::Get(data[i-1]))
+	    return false;
+    return true;
+}
+
+// runs each of the sorts on the same input, and prints timings
+template<typename T>
+void bench(const char* name, int n)
+{
+    T* data = new T[n];
+    double t;
+
+    printf("%s (%d bytes), %d records:\n", name, (int)sizeof(T), n);
+
+    fill(data, n);
+    t = getTime();
+    std::sort(data, data+n);
+    printf("  std::sort          %8.3f s  %s\n", getTime()-t, isSorted(data,n) ? "ok" : "FAILED");
+
+    fill(data, n);
+    t = getTime();
+    RadixSortMSD(data, n);
+    printf("  RadixSortMSD       %8.3f s  %s\n", getTime()-t, isSorted(data,n) ? "ok" : "FAILED");
+
+    fill(data, n);
+    t = getTime();
+    ParallelRadixSort(data, n, NumThreads);
+    printf("  ParallelRadixSort  %8.3f s  %s\n", getTime()-t, isSorted(data,n) ? "ok" : "FAILED");
+
+    delete[] data;
+}
+
+int main(int argc, char * argv[])
+{
+    int count = 4000000;
+    if (argc > 1)
+	count = atoi(argv[1]);
+    if (argc > 2)
+	NumThreads = atoi(argv[2]);
+
+    printf("Using %d threads.\n", NumThreads);
+
+    bench<VertexA>("VertexA", count);
+    bench<VertexB>("VertexB", count);
+
+    return 0;
+}
@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <time.h>
+#include "Telemetry.h"
+
+
+__thread StageStats *CurStats = NULL;
+
+
+void countAlloc(int64_t bytes)
+{
+    StageStats *st = CurStats;
+    if (st == NULL)
+	return;
+    int64_t now = __sync_add_and_fetch(&st->memory, bytes);
+    // raise the peak, unless another thread just raised it further
+    int64_t peak = st->peakMemory;
+    while (now > peak)
+    {
+	int64_t old = __sync_val_compare_and_swap(&st->peakMemory, peak, now);
+	if (old == peak)
+	    break;
+	peak = old;
+    }
+}
+
+double getThreadTime()
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+	return 0;
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+void countThreadTime()
+{
+    if (CurStats != NULL)
+	__sync_fetch_and_add(&CurStats->cpuTime, (uint64_t)(getThreadTime()*1e9));
+}
+
+
+// what a thread started by startThread needs to know
+struct ThreadStart
+{
+    void* (*func)(void*);
+    void *arg;
+    StageStats *stats;
+};
+
+static void* threadEntry(void *ptr)
+{
+    ThreadStart ts = *(ThreadStart*)ptr;
+    delete (ThreadStart*)ptr;
+
+    CurStats = ts.stats;
+    void *ret = ts.func(ts.arg);
+    countThreadTime();
+    return ret;
+}
+
+int startThread(pthread_t *thread, void* (*func)(void*), void *arg)
+{
+    ThreadStart *ts = new ThreadStart();
+    ts->func = func;
+    ts->arg = arg;
+    ts->stats = CurStats;
+    int err = pthread_create(thread, NULL, &threadEntry, ts);
+    if (err != 0)
+	delete ts;
+    return err;
+}
+
+
+string formatBytes(double bytes)
+{
+    static const char *units[] = { "B", "kB", "MB", "GB", "TB" };
+    int u = 0;
+    while (bytes >= 1000 && u < 4)
+    {
+	bytes /= 1000;
+	u++;
+    }
+    char s[64];
+    sprintf(s, u == 0 ? "%.0f %s" : "%.1f %s", bytes, units[u]);
+    return s;
+}
+
+string formatRate(double bytes, double seconds)
+{
+    if (seconds <= 0)
+	return "-";
+    return formatBytes(bytes / seconds) + "/s";
+}
+
+string formatTime(double seconds)
+{
+    if (seconds < 0)
+	seconds = 0;
+    long t = (long)(seconds + 0.5);
+    char s[64];
+    sprintf(s, "%ld:%02ld:%02ld", t/3600, (t/60)%60, t%60);
+    return s;
+}
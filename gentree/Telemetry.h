@@ -0,0 +1,83 @@
+#ifndef _TELEMETRY_H_
+#define _TELEMETRY_H_
+
+#include <pthread.h>
+#include <string>
+#include "xstdint.h"
+
+using namespace std;
+
+
+/* What one stage of the pipeline has done so far. The readers and
+   writers (and the few places that do their own I/O) add to the stats
+   of whichever stage the calling thread works for, so these can be read
+   while it runs. Sizes are as on disk. */
+struct StageStats
+{
+    volatile uint64_t bytesRead;
+    volatile uint64_t bytesWritten;
+    volatile uint64_t recordsRead;
+    volatile uint64_t recordsWritten;
+    // CPU time of every thread that worked for the stage, in ns
+    // (only added once each thread is done)
+    volatile uint64_t cpuTime;
+    // big buffers allocated right now, and the most at any one time
+    volatile int64_t memory;
+    volatile int64_t peakMemory;
+
+    StageStats()
+    {
+	bytesRead = 0;
+	bytesWritten = 0;
+	recordsRead = 0;
+	recordsWritten = 0;
+	cpuTime = 0;
+	memory = 0;
+	peakMemory = 0;
+    }
+};
+
+// the stats of the stage the calling thread works for, NULL for none
+extern __thread StageStats *CurStats;
+
+inline void countRead(uint64_t bytes, uint64_t records)
+{
+    if (CurStats == NULL)
+	return;
+    __sync_fetch_and_add(&CurStats->bytesRead, bytes);
+    __sync_fetch_and_add(&CurStats->recordsRead, records);
+}
+
+inline void countWrite(uint64_t bytes, uint64_t records)
+{
+    if (CurStats == NULL)
+	return;
+    __sync_fetch_and_add(&CurStats->bytesWritten, bytes);
+    __sync_fetch_and_add(&CurStats->recordsWritten, records);
+}
+
+// a big buffer allocated (or freed, with negative bytes)
+void countAlloc(int64_t bytes);
+
+inline void countFree(int64_t bytes)
+{
+    countAlloc(-bytes);
+}
+
+// CPU time used by the calling thread so far, in seconds
+double getThreadTime();
+
+// adds all of the calling thread's CPU time to its stage, as it ends
+void countThreadTime();
+
+// starts a thread working for the same stage as the calling one, so
+// its I/O counts there, and its CPU time too once it ends
+int startThread(pthread_t *thread, void* (*func)(void*), void *arg);
+
+// sizes and rates for printing, like "1.2 GB" and "85.3 MB/s"
+string formatBytes(double bytes);
+string formatRate(double bytes, double seconds);
+// and times, as h:mm:ss
+string formatTime(double seconds);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef _THREADS_H_
+#define _THREADS_H_
+
+#include <pthread.h>
+#include "Telemetry.h"
+
+// number of worker threads to use for parallel stages (set from param file)
+extern int NumThreads;
+
+
+// thread entry point, just calls the job's Run()
+template<typename T>
+void* runThreadJob(void *ptr)
+{
+    ((T*)ptr)->Run();
+    return NULL;
+}
+
+/* Runs each of the n jobs on its own thread, and waits for all of them
+   to finish. A job is anything with a void Run() method. */
+template<typename T>
+void RunThreads(T* jobs, int n)
+{
+    // no point in spawning anything for a single job
+    if (n == 1)
+    {
+	jobs[0].Run();
+	return;
+    }
+
+    pthread_t *threads = new pthread_t[n];
+    for (int i=0; i<n; i++)
+	startThread(threads+i, &runThreadJob<T>, jobs+i);
+    for (int i=0; i<n; i++)
+	pthread_join(threads[i], NULL);
+
+    delete[] threads;
+}
+
+#endif
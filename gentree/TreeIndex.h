@@ -1,15 +1,18 @@
-/* This class contains a lookup table of uint64_t's, which are just
-   the bits spread out by threes, that is, 1101 -> 1001000001 */
+/* Octtree coordinates of scaled positions, as Morton codes (see
+   Morton.h), 20 bits per dim. */
 
 #ifndef _TREEINDEX_H_
 #define _TREEINDEX_H_
 
 #include "Formats.h"
+#include "Morton.h"
 
-#define NBITS 10
-#define NSIZE (1<<NBITS)
 
-void BuildTreeLookup();
-uint64_t GetCoord(double x, double y, double z);
+/* Returns the octtree coordinate, given x,y,z in (0,1)x(0,1)x(0,1) */
+
+inline uint64_t GetCoord(double x, double y, double z)
+{
+    return MortonEncode(MortonQuantize(x), MortonQuantize(y), MortonQuantize(z));
+}
 
 #endif
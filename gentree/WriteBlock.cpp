@@ -6,22 +6,13 @@
 #include "CreateBlocks.h"
 #include "PartFiles.h"
 #include "Formats.h"
-
-extern LargeWriter *writer;
-extern VertexB* PendingBlocks[MAX_DEPTH][8];
-extern int PendingCount[MAX_DEPTH][8];
-extern uint64_t BlockChildLocation[MAX_DEPTH][8];
-extern uint64_t BlockChildLength[MAX_DEPTH][8];
-extern int16_t BlockChildFlags[MAX_DEPTH][8];
-extern int16_t BlockChildFile[MAX_DEPTH][8];
-extern int MAX_COUNT;
-extern BlockFile *curBlockFile;
-
-extern OutVertex* OutPoints;
+#include "Morton.h"
+#include "Quantize.h"
+#include "Compress.h"
 
 // Outputs specified pending block to a file, and frees up associated memory
 // (returns # of bytes written)
-uint64_t WritePendingBlock(uint64_t block, int shift, int depth)
+uint64_t BlockBuilder::WritePendingBlock(uint64_t block, int shift, int depth)
 {
     OutBlock head;
     int blocknum = block&7;
@@ -48,54 +39,6 @@ uint64_t WritePendingBlock(uint64_t block, int shift, int depth)
     VertexB *data = PendingBlocks[depth][blocknum];
 
 
-    // ****** important ******
-    // now we want to do log compression of densities and (weighted) dispersions
-    for (int i=0; i < count; i++)
-    {
-	data[i].densq = log(data[i].densq);
-	data[i].vdisp = log(data[i].vdisp);
-	data[i].ndensq = log(data[i].ndensq);
-	data[i].nvdisp = log(data[i].nvdisp);
-    }
-
-    // initialize maxes and mins to outlandish values
-    for (int i=0; i<9; i++)
-    {
-	head.mins[i] = 1e30;
-	head.scales[i] = -1e30;
-    }
-
-    // now we need to set the mins / scales
-    for (int i=0; i < count; i++)
-    {
-	for (int j=0; j<3; j++)
-	{
-	    head.mins[j] = MIN(head.mins[j], (float)data[i].vel[j]);
-	    head.mins[j+3] = MIN(head.mins[j+3], (float)data[i].acc[j]);
-	    head.scales[j] = MAX(head.scales[j], (float)data[i].vel[j]);
-	    head.scales[j+3] = MAX(head.scales[j+3], (float)data[i].acc[j]);
-	}
-	head.mins[6] = MIN(head.mins[6], data[i].hsml);
-	head.mins[7] = MIN(head.mins[7], data[i].densq);
-	head.mins[8] = MIN(head.mins[8], data[i].vdisp);
-	// use same scale for current and next densq,vdisp,hsml
-	head.mins[6] = MIN(head.mins[6], data[i].nhsml);
-	head.mins[7] = MIN(head.mins[7], data[i].ndensq);
-	head.mins[8] = MIN(head.mins[8], data[i].nvdisp);	
-
-	head.scales[6] = MAX(head.scales[6], data[i].hsml);
-	head.scales[7] = MAX(head.scales[7], data[i].densq);
-	head.scales[8] = MAX(head.scales[8], data[i].vdisp);
-	// ditto
-	head.scales[6] = MAX(head.scales[6], data[i].nhsml);
-	head.scales[7] = MAX(head.scales[7], data[i].ndensq);
-	head.scales[8] = MAX(head.scales[8], data[i].nvdisp);
-    }
-
-    // change from max to scale
-    for (int i=0; i<9; i++)
-	head.scales[i] -= head.mins[i];
-
     double minpos[3];
     double scale[3];
     // set minpos and scale using bounds on current snapshot
@@ -106,50 +49,109 @@ uint64_t WritePendingBlock(uint64_t block, int shift, int depth)
 	    + curBlockFile->scale[j]*head.pos[j]/65536.0;
     }
 
-    for (int i=0; i < count; i++)
+    // log compression of densities and (weighted) dispersions, the
+    // mins / scales, and the points quantized against them (coarsely,
+    // near the root)
+    uint64_t bytes;
+    if (depth < CoarseDepth)
+	bytes = PackBlock<VERTEX_COARSE>(data, count, minpos, scale, head, OutPoints, FastQuantize != 0);
+    else
+	bytes = PackBlock<VERTEX_FULL>(data, count, minpos, scale, head, OutPoints, FastQuantize != 0);
+
+    // where it goes (if it's in a group to be packed, where it would
+    // have, had it not been; WriteGroup sorts out the ones that are)
+    uint64_t location = writer->GetLocation() + (grouping ? groupBuf.size() : 0);
+
+    // headers with children need patching when a subtree gets spliced in
+    if (recordFixups && head.childLength > 0)
     {
-	OutPoints[i].pid = (uint32_t)data[i].pid;
-
-	for (int j=0; j<3; j++)
-	{
-	    OutPoints[i].pos[j] = (uint16_t)( 65535.99*(data[i].pos[j]-minpos[j])/scale[j]);
-	    OutPoints[i].vel[j] = (uint16_t)( 65535.99*(data[i].vel[j]-head.mins[j]) / head.scales[j]);
-	    OutPoints[i].acc[j] = (uint16_t)( 65535.99*(data[i].acc[j]-head.mins[j+3]) / head.scales[j+3]);
-	}	
-	// these two are only 8-bit
-	OutPoints[i].hsml = (uint8_t)( 255.999*(data[i].hsml-head.mins[6]) / head.scales[6]);
-	OutPoints[i].nhsml = (uint8_t)( 255.999*(data[i].nhsml-head.mins[6]) / head.scales[6]);
-	// back to 16-bit
-	OutPoints[i].densq = (uint16_t)( 65535.99*(data[i].densq-head.mins[7]) / head.scales[7]);
-	OutPoints[i].vdisp = (uint16_t)( 65535.99*(data[i].vdisp-head.mins[8]) / head.scales[8]);
-	OutPoints[i].ndensq = (uint16_t)( 65535.99*(data[i].ndensq-head.mins[7]) / head.scales[7]);
-	OutPoints[i].nvdisp = (uint16_t)( 65535.99*(data[i].nvdisp-head.mins[8]) / head.scales[8]);
+	BlockFixup fix;
+	fix.file = curWriterIndex;
+	fix.offset = location;
+	fixups.push_back(fix);
     }
 
-    // write header
-    writer->Write(&head, sizeof(OutBlock));
-    // and write points
-    writer->Write(OutPoints, sizeof(OutVertex)*count);
+    // and where it all went, for the directory
+    BlockDirEntry entry;
+    entry.key = block;
+    entry.depth = depth;
+    entry.file = curWriterIndex;
+    entry.count = count;
+    entry.location = location;
+    entry.length = sizeof(OutBlock) + bytes;
+    entry.childFlags = head.childFlags;
+    entry.childLength = head.childLength;
+    entry.subtreeSize = 1;
+    dirEntries.push_back(entry);
+
+    if (grouping)
+    {
+	groupBuf.insert(groupBuf.end(), (char*)&head, (char*)&head + sizeof(OutBlock));
+	groupBuf.insert(groupBuf.end(), (char*)OutPoints, (char*)OutPoints + bytes);
+    }
+    else
+    {
+	// write header
+	writer->Write(&head, sizeof(OutBlock));
+	// and write points
+	writer->Write(OutPoints, bytes);
+    }
 
     // free the pending blocks
     free(data);
 
     // return bytes written
-    return sizeof(OutBlock) + sizeof(OutVertex)*count;
+    return sizeof(OutBlock) + bytes;
+}
+
+
+/* Writes the group of children put together by WritePendingBlock, packed
+   if that makes it any smaller (flagging that in the parent), and returns
+   its length. The headers in a packed one are whole, just further on, so
+   those to patch later are found there instead. Its blocks' directory
+   entries (from firstEntry on) get the frame's location plus their index
+   in it, since their offsets when decoded would run past the frame and
+   into whatever's next. */
+uint64_t BlockBuilder::WriteGroup(int depth, int blocknum, unsigned int firstFixup, unsigned int firstEntry)
+{
+    uint64_t length = groupBuf.size();
+    rawBytes += length;
+    // siblings are all at one depth, so share a codec
+    uint32_t packed = 0;
+    if (length > 0)
+	packed = CompressGroup(&groupBuf[0], length, VertexSize(((OutBlock*)&groupBuf[0])->codec), packBuf);
+    if (packed == 0)
+    {
+	if (length > 0)
+	    writer->Write(&groupBuf[0], length);
+	packedBytes += length;
+	return length;
+    }
+
+    uint64_t start = writer->GetLocation();
+    uint64_t offset = 0;
+    unsigned int f = firstFixup;
+    for (int k=0; offset < length; k++)
+    {
+	OutBlock *head = (OutBlock*)&groupBuf[offset];
+	if (f < fixups.size() && fixups[f].offset == start + offset)
+	    fixups[f++].offset = start + sizeof(GroupFrame) + k*sizeof(OutBlock);
+	dirEntries[firstEntry + k].location = start + k;
+	offset += sizeof(OutBlock) + VertexSize(head->codec)*head->count;
+    }
+
+    BlockChildFlags[depth][blocknum] |= COMPRESSED_CHILDREN;
+    writer->Write(&packBuf[0], packed);
+    packedBytes += packed;
+    return packed;
 }
 
 inline void deinterleave(uint64_t block, uint16_t pos[3])
 {
-    pos[0] = pos[1] = pos[2] = 0;
     // we need to get rid of a few bits (4*3, actually)
-    block >>= 12;
-    for (int i=0; i<16; i++)
-    {
-	pos[0] |= ((block&1) << i);
-	block >>= 1;
-	pos[1] |= ((block&1) << i);
-	block >>= 1;
-	pos[2] |= ((block&1) << i);
-	block >>= 1;	
-    }    
+    uint32_t x, y, z;
+    MortonDecode(block >> 12, x, y, z);
+    pos[0] = (uint16_t)x;
+    pos[1] = (uint16_t)y;
+    pos[2] = (uint16_t)z;
 }